@@ -546,8 +546,8 @@ void arch_set_speed(uint16_t us_per_sample) { // {{{
 	else {
 		uint32_t c = us_per_sample;
 		c *= F_CPU / 1000000;
-		timer1_top = c >> full_phase_bits;
-		//debug("%x us, top=%x:%x, fpb=%d", us_per_sample, int((c >> 16) & 0xffff), int(c & 0xffff), full_phase_bits);
+		timer1_top = c >> base_phase_bits;
+		//debug("%x us, top=%x:%x, fpb=%d", us_per_sample, int((c >> 16) & 0xffff), int(c & 0xffff), base_phase_bits);
 		// Set TOP.
 		ICR1H = (timer1_top >> 8) & 0xff;
 		ICR1L = timer1_top & 0xff;
@@ -1034,6 +1034,11 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 		"\t"	"brne 1b"			"\n"
 	"2:\t"		"ldd 16, y + %[len]"		"\n"
 		"\t"	"sts %[current_len], 16"	"\n"
+		/* Set number of phases per sample. */
+		"\t"	"ldd 16, y + %[phase_bits]"	"\n"
+		"\t"	"sts %[full_phase_bits], 16"	"\n"
+		"\t"	"ldd 16, y + %[phase]"		"\n"
+		"\t"	"sts %[full_phase], 16"		"\n"
 		"\t"	"rjmp isr_end"			"\n"
 		// Underrun.
 	"isr_underrun:\t"				"\n"
@@ -1070,6 +1075,7 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 		::
 			[current_buffer] "" (&current_buffer),
 			[full_phase] "" (&full_phase),
+			[full_phase_bits] "" (&full_phase_bits),
 			[move_phase] "" (&move_phase),
 			[step_state] "" (&step_state),
 			[active_motors] "" (&active_motors),
@@ -1089,6 +1095,8 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 			[motor_size] "" (sizeof(Motor)),
 			[settings_size] "I" (sizeof(Settings)),
 			[len] "I" (offsetof(Settings, len)),
+			[phase_bits] "I" (offsetof(Settings, phase_bits)),
+			[phase] "I" (offsetof(Settings, phase)),
 			[timsk] "M" (_SFR_MEM_ADDR(TIMSK1)),
 			[timskval] "M" (1 << OCIE1A),
 			[state_stop] "M" (STEP_STATE_STOP),
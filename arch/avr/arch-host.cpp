@@ -52,7 +52,7 @@ int hwpacketsize(int len, int *available) { // {{{
 
 #define CONTROL_SIZE 6
 void try_send_control() { // {{{
-	if (!connected || preparing || out_busy >= 3 || avr_control_queue_length == 0)
+	if (!connected || preparing || out_busy >= out_window || avr_control_queue_length == 0)
 		return;
 	avr_control_queue_length -= 1;
 	avr_buffer[0] = HWC_CONTROL;
@@ -78,12 +78,12 @@ void avr_send() { // {{{
 		debug("send called while not connected");
 		abort();
 	}
-	while (out_busy >= 3)
+	while (out_busy >= out_window)
 		serial_wait();
 	serial_cb[out_busy] = avr_cb;
 	avr_cb = NULL;
 	send_packet();
-	if (out_busy < 3)
+	if (out_busy < out_window)
 		try_send_control();
 } // }}}
 
@@ -160,7 +160,7 @@ void avr_get_current_pos(int offset, bool check) { // {{{
 	}
 } // }}}
 
-bool hwpacket(int len) { // {{{
+static bool avr_hwpacket(int len) { // {{{
 	(void)&len;
 	// Handle data in command.
 #if 0
@@ -218,11 +218,13 @@ bool hwpacket(int len) { // {{{
 		avr_running = false;
 		settings.queue_start = 0;
 		settings.queue_end = 0;
+		stream_clear();
 		stopping = 3;
 		computing_move = false;
 		current_fragment_pos = 0;
 		current_fragment = 0;
 		running_fragment = 0;
+		avr_queue_flush();
 		prepare_interrupt();
 		shmem->interrupt_ints[0] = s;
 		shmem->interrupt_ints[1] = m;
@@ -268,11 +270,13 @@ bool hwpacket(int len) { // {{{
 			abort();
 		}
 		avr_running = false;
-		if (computing_move) {
+		if (computing_move || avr_queued() > 0) {
 			debug("slowness underrun %d %d %d", sending_fragment, current_fragment, running_fragment);
+			shmem->underruns += 1;
 			//abort();
 			avr_write_ack("slowness underrun");
-			if (!sending_fragment && discarding == 0 && (current_fragment - (running_fragment + done_count + remaining_count) + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > 1)
+			sent_ack = true;
+			if (!sending_fragment && discarding == 0 && (avr_current_fragment() - (running_fragment + done_count + remaining_count) + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > 1)
 				arch_start_move(done_count);
 			// Buffer is too slow with refilling; this will fix itself.
 		}
@@ -311,9 +315,10 @@ bool hwpacket(int len) { // {{{
 				avr_write_ack("invalid done");
 			return false;
 		}
-		first_fragment = -1;
-		if ((current_fragment + discarding - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER + 1 < done_count + remaining_count) {
-			debug("Done count %d+%d higher than busy fragments %d+%d+1; clipping", done_count, remaining_count, (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER, discarding);
+		__atomic_store_n(&first_fragment, -1, __ATOMIC_RELAXED);
+		int current = avr_current_fragment();
+		if ((current + discarding - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER + 1 < done_count + remaining_count) {
+			debug("Done count %d+%d higher than busy fragments %d+%d+1; clipping", done_count, remaining_count, (current - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER, discarding);
 			if (!sent_ack)
 				avr_write_ack("invalid done");
 			abort();
@@ -321,13 +326,15 @@ bool hwpacket(int len) { // {{{
 		else if (!sent_ack)
 			avr_write_ack("done");
 		//debug("fragment done for gcode line %" LONGFMT, history[running_fragment].gcode_line);
-		running_fragment = (running_fragment + done_count) % FRAGMENTS_PER_BUFFER;
+		// The motion thread uses this to see how much room there is in the buffer.
+		__atomic_store_n(&running_fragment, (running_fragment + done_count) % FRAGMENTS_PER_BUFFER, __ATOMIC_RELEASE);
 		//debug("running -> %x", running_fragment);
-		if ((current_fragment + discarding + (transmitting_fragment ? 1 : 0)) % FRAGMENTS_PER_BUFFER == running_fragment && offset == 0) {
+		// A fragment that is being transmitted is already counted in current.
+		if ((current + discarding) % FRAGMENTS_PER_BUFFER == running_fragment && offset == 0) {
 			debug("Done received, but should be underrun (current: %d discarding: %d running: %d sending: %d transmitting %d)", current_fragment, discarding, running_fragment, sending_fragment, transmitting_fragment);
 			abort();
 		}
-		if (out_busy < 3)
+		if (out_busy < out_window)
 			buffer_refill();
 		//else
 		//	debug("no refill");
@@ -420,6 +427,17 @@ bool hwpacket(int len) { // {{{
 	} // }}}
 	}
 } // }}}
+
+bool hwpacket(int len) { // {{{
+	// Limits, underruns, homing and timeouts change the motion state, so the motion thread waits while they are handled.
+	bool hold = command[0] == HWC_LIMIT || command[0] == HWC_UNDERRUN || command[0] == HWC_HOMED || command[0] == HWC_TIMEOUT;
+	if (hold)
+		motion_hold();
+	bool ret = avr_hwpacket(len);
+	if (hold)
+		motion_unhold();
+	return ret;
+} // }}}
 // }}}
 
 // Hardware interface {{{
@@ -611,6 +629,11 @@ void arch_reset() { // {{{
 	avr_serial.write(CMD_ACK2);
 	avr_serial.write(CMD_ACK3);
 	avr_serial.write(CMD_STALLACK);
+	// The firmware answers every packet with a stall until it sees a stall ack.
+	// After a damaged byte it drops input until the line is quiet, so send it again after a pause.
+	avr_serial.flush();
+	usleep(20000);
+	avr_serial.write(CMD_STALLACK);
 	// Just in case the controller was reset: reclaim port by requesting ID.
 	avr_serial.write(CMD_ID);
 	avr_call1(HWC_PING, 0);
@@ -740,6 +763,27 @@ void arch_pattern_change() { // {{{
 	avr_send();
 } // }}}
 
+static int avr_setup_packet(char *packet) { // {{{
+	// Fill packet with HWC_SETUP for the current globals and return its length.
+	packet[0] = HWC_SETUP;
+	packet[1] = avr_active_motors;
+	for (int i = 0; i < 4; ++i)
+		packet[2 + i] = (base_hwtime_step >> (8 * i)) & 0xff;
+	// Compute the number of phases per sample the same way the firmware does.
+	avr_time_per_sample = base_hwtime_step;
+	avr_phase_bits = 0;
+	while (avr_phase_bits < 7 && TIME_PER_ISR > 0 && (avr_time_per_sample & 0xffff) / TIME_PER_ISR >= 2 << avr_phase_bits)
+		avr_phase_bits += 1;
+	packet[6] = led_pin.valid() ? led_pin.pin : ~0;
+	packet[7] = stop_pin.valid() ? stop_pin.pin : ~0;
+	packet[8] = probe_pin.valid() ? probe_pin.pin : ~0;
+	packet[9] = (led_pin.inverted() ? 1 : 0) | (probe_pin.inverted() ? 2 : 0) | (stop_pin.inverted() ? 4 : 0) | (spiss_pin.inverted() ? 8 : 0);
+	packet[10] = timeout & 0xff;
+	packet[11] = (timeout >> 8) & 0xff;
+	packet[12] = spiss_pin.valid() ? spiss_pin.pin : ~0;
+	return 13;
+} // }}}
+
 void arch_change(bool motors) { // {{{
 	int old_active_motors = avr_active_motors;
 	bool pattern_valid = false;
@@ -749,19 +793,10 @@ void arch_change(bool motors) { // {{{
 		for (uint8_t s = 0; s < NUM_SPACES; ++s) {
 			avr_active_motors += spaces[s].num_motors;
 		}
-		avr_buffer[0] = HWC_SETUP;
-		avr_buffer[1] = avr_active_motors;
-		for (int i = 0; i < 4; ++i)
-			avr_buffer[2 + i] = (settings.hwtime_step >> (8 * i)) & 0xff;
-		avr_buffer[6] = led_pin.valid() ? led_pin.pin : ~0;
-		avr_buffer[7] = stop_pin.valid() ? stop_pin.pin : ~0;
-		avr_buffer[8] = probe_pin.valid() ? probe_pin.pin : ~0;
-		avr_buffer[9] = (led_pin.inverted() ? 1 : 0) | (probe_pin.inverted() ? 2 : 0) | (stop_pin.inverted() ? 4 : 0) | (spiss_pin.inverted() ? 8 : 0);
-		avr_buffer[10] = timeout & 0xff;
-		avr_buffer[11] = (timeout >> 8) & 0xff;
-		avr_buffer[12] = spiss_pin.valid() ? spiss_pin.pin : ~0;
-		prepare_packet(avr_buffer, 13);
+		prepare_packet(avr_buffer, avr_setup_packet(avr_buffer));
 		avr_send();
+		if (avr_setup_queued)
+			avr_setup_len = avr_setup_packet(avr_setup_buffer);
 	}
 	if (motors) {
 		for (uint8_t s = 0; s < NUM_SPACES; ++s) {
@@ -790,7 +825,7 @@ void arch_change(bool motors) { // {{{
 } // }}}
 
 void arch_motors_change() { // {{{
-	if (preparing || out_busy >= 3) {
+	if (preparing || out_busy >= out_window) {
 		change_pending = true;
 		return;
 	}
@@ -799,6 +834,12 @@ void arch_motors_change() { // {{{
 } // }}}
 
 void arch_globals_change() { // {{{
+	if (connected && (motion_thread_self() || avr_queued() > 0)) {
+		// Send it with the next fragment, so the fragments before it still use the old setup.
+		avr_setup_len = avr_setup_packet(avr_setup_buffer);
+		avr_setup_queued = true;
+		return;
+	}
 	arch_change(false);
 } // }}}
 
@@ -813,6 +854,8 @@ void arch_setup_start() { // {{{
 	avr_limiter_space = -1;
 	avr_limiter_motor = 0;
 	avr_active_motors = 0;
+	avr_time_per_sample = 0;
+	avr_phase_bits = 0;
 	avr_uuid_dirty = false;
 	// Set up serial port.
 	connected = false;
@@ -847,8 +890,6 @@ void arch_send_pin_name(int pin) { // {{{
 } // }}}
 
 static void avr_connect4() { // {{{
-	while (out_busy >= 3)
-		serial_wait();
 	avr_pin_name_len[avr_next_pin_name] = command[1];
 	avr_pin_name[avr_next_pin_name] = new char[command[1] + 1];
 	memcpy(&avr_pin_name[avr_next_pin_name][1], &command[2], command[1]);
@@ -856,7 +897,10 @@ static void avr_connect4() { // {{{
 		avr_pin_name[avr_next_pin_name][0] = 7;
 	else
 		avr_pin_name[avr_next_pin_name][0] = 8;
+	// Ack before waiting: a resent reply would otherwise be handled as a new packet.
 	avr_write_ack("pin name");
+	while (out_busy >= out_window)
+		serial_wait();
 	arch_send_pin_name(avr_next_pin_name);
 	avr_next_pin_name += 1;
 	avr_connect3();
@@ -873,7 +917,17 @@ static void avr_connect3() { // {{{
 			}
 		}
 		delete[] pattern.avr_data.buffer;
-		pattern.avr_data.buffer = new AVR_BUFFER_DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(AVR_BUFFER_DATA_TYPE)];
+		pattern.avr_data.buffer = new AVR_BUFFER_DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(AVR_BUFFER_DATA_TYPE)]();
+		delete[] avr_queue_data;
+		delete[] avr_queue_len;
+		delete[] avr_queue_packets;
+		delete[] avr_queue_setup;
+		avr_queue_data = new char[FRAGMENTS_PER_BUFFER * AVR_QUEUE_PACKETS * AVR_QUEUE_PACKET];
+		avr_queue_len = new int[FRAGMENTS_PER_BUFFER * AVR_QUEUE_PACKETS];
+		avr_queue_packets = new int[FRAGMENTS_PER_BUFFER];
+		avr_queue_setup = new bool[FRAGMENTS_PER_BUFFER]();
+		avr_queue_flush();
+		avr_setup_queued = false;
 		connect_end();
 		arch_change(true);
 		return;
@@ -899,10 +953,18 @@ void avr_connect2() { // {{{
 	FRAGMENTS_PER_BUFFER = command[9];
 	BYTES_PER_FRAGMENT = command[10];
 	TIME_PER_ISR = uint8_t(command[11]) | uint8_t(command[12]) << 8;
+	int window = protocol_version >= 10 && command[1] >= 14 ? uint8_t(command[13]) : 0;
 	//id[0][:8] + '-' + id[0][8:12] + '-' + id[0][12:16] + '-' + id[0][16:20] + '-' + id[0][20:32]
 	for (int i = 0; i < UUID_SIZE; ++i)
 		shmem->uuid[i] = command[11 + i];
+	// Ack before waiting: a resent reply would otherwise be handled as a new packet.
 	avr_write_ack("setup");
+	// The firmware uses the window from the packet after CMD_BEGIN, which has been acked before this reply was sent.
+	if (window > 3) {
+		while (out_busy > 0)
+			serial_wait();
+		serial_window(window);
+	}
 	avr_control_queue = new uint8_t[NUM_DIGITAL_PINS * CONTROL_SIZE];
 	avr_in_control_queue = new bool[NUM_DIGITAL_PINS];
 	avr_control_queue_length = 0;
@@ -932,15 +994,19 @@ void arch_connect(char const *run_id, char const *port) { // {{{
 	avr_serial.begin(port);
 	if (!connected)
 		return;
+	// The firmware does not use a window until it is requested again.
+	serial_window(0);
 	arch_reset();
 	// Get constants.
 	avr_buffer[0] = HWC_BEGIN;
 	// Send packet size. Required by older protocols.
-	avr_buffer[1] = 10;
+	avr_buffer[1] = 11;
 	for (int i = 0; i < ID_SIZE; ++i)
 		avr_buffer[2 + i] = run_id[i];
+	// Request a window; older firmware ignores this byte.
+	avr_buffer[10] = MAX_WINDOW;
 	wait_for_reply[expected_replies++] = avr_connect2;
-	prepare_packet(avr_buffer, 10);
+	prepare_packet(avr_buffer, 11);
 	avr_send();
 } // }}}
 
@@ -970,7 +1036,7 @@ void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin, bo
 	}
 	// Make sure the controls for the heater and fan have been sent, otherwise they override this.
 	try_send_control();
-	while (out_busy >= 3 || avr_control_queue_length > 0) {
+	while (out_busy >= out_window || avr_control_queue_length > 0) {
 		serial_wait();
 		try_send_control();
 	}
@@ -1026,6 +1092,7 @@ void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin, bo
 
 void arch_disconnect() { // {{{
 	connected = false;
+	avr_queue_flush();
 	avr_serial.end();
 	if (requested_temp != uint8_t(~0)) {
 		shmem->floats[0] = NAN;
@@ -1112,7 +1179,7 @@ void arch_stop(bool fake) { // {{{
 	}
 	//debug("blocking host");
 	host_block = true;
-	if (preparing || out_busy >= 3) {
+	if (preparing || out_busy >= out_window) {
 		//debug("not yet stopping");
 		stop_pending = true;
 		return;
@@ -1141,6 +1208,7 @@ void avr_stop2() { // {{{
 	avr_get_current_pos(3, false);
 	current_fragment = running_fragment;
 	//debug("current_fragment = running_fragment; %d", current_fragment);
+	avr_queue_flush();
 	current_fragment_pos = 0;
 	num_active_motors = 0;
 	//debug("no longer blocking host 2");
@@ -1158,78 +1226,237 @@ static void avr_sent_fragment() { // {{{
 	sending_fragment -= 1;
 } // }}}
 
+static int avr_encode_fragment(int8_t const *data, int len, char *out) { // {{{
+	// Run length encode fragment data into out and return the encoded length.
+	// A header byte h is followed by (h & 0x7f) + 1 literal bytes, or, if bit 7 is set, by one byte that is repeated that many times.
+	int ret = 0;
+	int i = 0;
+	while (i < len) {
+		int run = 1;
+		while (i + run < len && run < 0x80 && data[i + run] == data[i])
+			run += 1;
+		if (run >= 3) {
+			out[ret++] = 0x80 | (run - 1);
+			out[ret++] = data[i];
+			i += run;
+			continue;
+		}
+		// Collect literal bytes until the next run that is worth encoding.
+		int start = i;
+		while (i < len && i - start < 0x80 && !(i + 2 < len && data[i] == data[i + 1] && data[i] == data[i + 2]))
+			i += 1;
+		out[ret++] = i - start - 1;
+		for (int b = start; b < i; ++b)
+			out[ret++] = data[b];
+	}
+	return ret;
+} // }}}
+
+static int avr_phase_period(int bits) { // {{{
+	// Sample period when the firmware uses 1 << bits ISR calls per sample, or -1 if the host cannot express it exactly.
+	if (avr_time_per_sample <= 0)
+		return -1;
+	if (bits >= avr_phase_bits)
+		return avr_time_per_sample << (bits - avr_phase_bits);
+	int shift = avr_phase_bits - bits;
+	if ((avr_time_per_sample >> shift) << shift != avr_time_per_sample)
+		return -1;
+	return avr_time_per_sample >> shift;
+} // }}}
+
+static uint8_t avr_fragment_phase_bits() { // {{{
+	// Phase bits for the fragment that is being sent; 0xff means the set up default.
+	for (int bits = 0; bits <= 7; ++bits) {
+		if (avr_phase_period(bits) == settings.hwtime_step)
+			return bits;
+	}
+	return 0xff;
+} // }}}
+
+int arch_sample_period(int max_step) { // {{{
+	// Return the longest sample period that is at most max_step, or the shortest available if they are all longer.
+	// The timer is shared with PWM, so it is not changed; only the number of ISR calls per sample can be set per fragment.
+	// At least 4 calls per sample are used, so steps are still spread out over the sample.
+	int ret = avr_phase_period(avr_phase_bits);
+	if (ret < 0)
+		return base_hwtime_step;
+	for (int bits = avr_phase_bits + 1; bits <= 7 && avr_phase_period(bits) <= max_step; ++bits)
+		ret = avr_phase_period(bits);
+	for (int bits = avr_phase_bits - 1; ret > max_step && bits >= 2 && avr_phase_period(bits) > 0; --bits)
+		ret = avr_phase_period(bits);
+	return ret;
+} // }}}
+
+static char *avr_queue_packet(int f, int p) { // {{{
+	return &avr_queue_data[(f * AVR_QUEUE_PACKETS + p) * AVR_QUEUE_PACKET];
+} // }}}
+
+void avr_queue_flush() { // {{{
+	// Forget the queued fragments, because the buffer was reset.  The motion thread must not be running.
+	for (int i = 0; i < avr_queued(); ++i) {
+		// Send their setup with the fragments that replace them.
+		if (avr_queue_setup[(avr_queue_current + i) % FRAGMENTS_PER_BUFFER])
+			avr_setup_queued = true;
+	}
+	__atomic_store_n(&avr_queue_tail, avr_queue_head, __ATOMIC_RELEASE);
+	avr_queue_current = current_fragment;
+	avr_queue_generation += 1;
+} // }}}
+
+int avr_queued() { // {{{
+	// Number of fragments that are computed, but not sent yet.
+	return __atomic_load_n(&avr_queue_head, __ATOMIC_ACQUIRE) - avr_queue_tail;
+} // }}}
+
+int avr_current_fragment() { // {{{
+	// The fragment that the firmware will receive next.
+	return avr_queue_current;
+} // }}}
+
+void arch_rewind() { // {{{
+	avr_queue_flush();
+} // }}}
+
 bool arch_send_fragment() { // {{{
-	if (!connected || host_block || stopping || discarding != 0 || stop_pending) {
+	// Encode the fragment into the queue; arch_send_queued() sends it from the main thread.
+	if (!connected || host_block || stopping || discarding != 0 || stop_pending || avr_queue_data == NULL) {
 		//debug("not sending arch frag block %d stop %d discard %d stop pending %d", host_block, stopping, discarding, stop_pending);
 		return false;
 	}
-	while (out_busy >= 3)
+	//debug("send fragment current-fragment-pos=%d current-fragment=%d active-moters=%d running=%d num-running=0x%x", current_fragment_pos, current_fragment, num_active_motors, running_fragment, (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER);
+	int f = current_fragment;
+	int *len = &avr_queue_len[f * AVR_QUEUE_PACKETS];
+	int p = 0;
+	avr_queue_setup[f] = avr_setup_queued;
+	if (avr_setup_queued) {
+		memcpy(avr_queue_packet(f, p), avr_setup_buffer, avr_setup_len);
+		len[p++] = avr_setup_len;
+		avr_setup_queued = false;
+	}
+	char *packet = avr_queue_packet(f, p);
+	packet[0] = probing ? HWC_START_PROBE : HWC_START_MOVE;
+	packet[1] = current_fragment_pos;
+	packet[2] = num_active_motors;
+	packet[3] = avr_fragment_phase_bits();
+	len[p++] = 4;
+	int mi = 0;
+	int cfp = current_fragment_pos;
+	for (int s = 0; s < NUM_SPACES; mi += spaces[s++].num_motors) {
+		for (uint8_t m = 0; m < spaces[s].num_motors && p < AVR_QUEUE_PACKETS; ++m) {
+			if (!spaces[s].motor[m]->active)
+				continue;
+			cpdebug(s, m, "sending %d %d", current_fragment, current_fragment_pos);
+			//debug("sending %d %d cf %d cp 0x%x", s, m, current_fragment, current_fragment_pos);
+			packet = avr_queue_packet(f, p);
+			packet[0] = single ? HWC_MOVE_SINGLE : HWC_MOVE;
+			packet[1] = mi + m;
+			packet[2] = avr_encode_fragment(spaces[s].motor[m]->avr_data.buffer, cfp, &packet[3]);
+			len[p++] = 3 + uint8_t(packet[2]);
+		}
+	}
+	if (pattern.active && p < AVR_QUEUE_PACKETS) {
+		packet = avr_queue_packet(f, p);
+		packet[0] = single ? HWC_MOVE_SINGLE : HWC_MOVE;
+		packet[1] = mi;
+		packet[2] = avr_encode_fragment(pattern.avr_data.buffer, cfp, &packet[3]);
+		len[p++] = 3 + uint8_t(packet[2]);
+	}
+	avr_queue_packets[f] = p;
+	// Hand the slot to the main thread.
+	__atomic_store_n(&avr_queue_head, avr_queue_head + 1, __ATOMIC_RELEASE);
+	return true;
+} // }}}
+
+static bool avr_send_copy(char const *packet, int len, int generation, void (*cb)()) { // {{{
+	// Send a copy of a queued packet; fail if sending was stopped while waiting for room.
+	while (out_busy >= out_window)
 		serial_wait();
-	if (!connected || host_block || stopping || discarding != 0 || stop_pending)
+	if (!connected || host_block || stopping || discarding != 0 || stop_pending || generation != avr_queue_generation)
 		return false;
-	avr_buffer[0] = probing ? HWC_START_PROBE : HWC_START_MOVE;
-	//debug("send fragment current-fragment-pos=%d current-fragment=%d active-moters=%d running=%d num-running=0x%x", current_fragment_pos, current_fragment, num_active_motors, running_fragment, (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER);
-	avr_buffer[1] = current_fragment_pos;
-	avr_buffer[2] = num_active_motors;
-	sending_fragment = num_active_motors + 1;
-	if (prepare_packet(avr_buffer, 3)) {
-		transmitting_fragment = true;
-		avr_cb = &avr_sent_fragment;
-		avr_send();
-		int mi = 0;
-		avr_filling = true;
-		int cfp = current_fragment_pos;
-		for (int s = 0; connected && !host_block && !stopping && discarding == 0 && !stop_pending && s < NUM_SPACES; mi += spaces[s++].num_motors) {
-			for (uint8_t m = 0; !host_block && !stopping && discarding == 0 && !stop_pending && m < spaces[s].num_motors; ++m) {
-				if (!spaces[s].motor[m]->active)
-					continue;
-				cpdebug(s, m, "sending %d %d", current_fragment, current_fragment_pos);
-				//debug("sending %d %d cf %d cp 0x%x", s, m, current_fragment, current_fragment_pos);
-				while (out_busy >= 3)
-					serial_wait();
-				if (stop_pending || discarding != 0)
-					break;
-				avr_buffer[0] = single ? HWC_MOVE_SINGLE : HWC_MOVE;
-				avr_buffer[1] = mi + m;
-				for (int i = 0; i < cfp; ++i) {
-					int value = spaces[s].motor[m]->avr_data.buffer[i];
-					avr_buffer[2 + i] = value;
-				}
-				if (prepare_packet(avr_buffer, 2 + cfp)) {
-					avr_cb = &avr_sent_fragment;
-					avr_send();
+	memcpy(avr_buffer, packet, len);
+	if (!prepare_packet(avr_buffer, len))
+		return false;
+	avr_cb = cb;
+	avr_send();
+	return true;
+} // }}}
+
+void arch_send_queued() { // {{{
+	// Send the fragments that were queued by arch_send_fragment(). This is done by the main thread only.
+	if (!connected || avr_queue_data == NULL || motion_thread_self() || preparing || avr_filling)
+		return;
+	while (!host_block && !stopping && discarding == 0 && !stop_pending) {
+		int generation = avr_queue_generation;
+		if (avr_queued() == 0) {
+			// A setup change without a fragment after it.  The motion thread owns it, so hold it while taking it.
+			if (__atomic_load_n(&avr_setup_queued, __ATOMIC_RELAXED)) {
+				char packet[sizeof(avr_setup_buffer)];
+				int len = 0;
+				motion_hold();
+				if (avr_setup_queued && avr_queued() == 0) {
+					len = avr_setup_len;
+					memcpy(packet, avr_setup_buffer, len);
+					avr_setup_queued = false;
 				}
-				else
-					break;
+				motion_unhold();
+				if (len > 0)
+					avr_send_copy(packet, len, generation, NULL);
 			}
+			break;
 		}
-		if (sending_fragment > 0 && !host_block && !stopping && discarding == 0 && !stop_pending && pattern.active) {
-			while (out_busy >= 3)
-				serial_wait();
-			if (!stop_pending && !stopping && discarding != 0) {
-				avr_buffer[0] = single ? HWC_MOVE_SINGLE : HWC_MOVE;
-				avr_buffer[1] = mi;
-				for (int i = 0; i < cfp; ++i)
-					avr_buffer[2 + i] = pattern.avr_data.buffer[i];
-				if (prepare_packet(avr_buffer, 2 + cfp)) {
-					avr_cb = &avr_sent_fragment;
-					avr_send();
-				}
+		int f = avr_queue_current;
+		int num = avr_queue_packets[f];
+		int *len = &avr_queue_len[f * AVR_QUEUE_PACKETS];
+		int p = 0;
+		avr_filling = true;
+		if (avr_queue_setup[f]) {
+			if (!avr_send_copy(avr_queue_packet(f, p), len[p], generation, NULL)) {
+				avr_filling = false;
+				break;
 			}
+			avr_queue_setup[f] = false;
+			p += 1;
+		}
+		sending_fragment = num - p;
+		transmitting_fragment = true;
+		bool started = avr_send_copy(avr_queue_packet(f, p), len[p], generation, &avr_sent_fragment);
+		if (started) {
+			// The firmware counts the fragment from its START_MOVE.
+			avr_queue_current = (f + 1) % FRAGMENTS_PER_BUFFER;
+			__atomic_store_n(&avr_queue_tail, avr_queue_tail + 1, __ATOMIC_RELEASE);
+			for (p += 1; p < num; ++p) {
+				if (!avr_send_copy(avr_queue_packet(f, p), len[p], generation, &avr_sent_fragment))
+					break;
+			}
+			while (sending_fragment > 0 && !host_block && !stopping && discarding == 0 && !stop_pending)
+				serial_wait();
 		}
-		while (sending_fragment > 0 && !host_block && !stopping && discarding == 0 && !stop_pending)
-			serial_wait();
 		transmitting_fragment = false;
+		sending_fragment = 0;
+		avr_filling = false;
+		if (!started)
+			break;
+		if (__atomic_load_n(&start_pending, __ATOMIC_ACQUIRE))
+			arch_start_move(0);
+	}
+	if (__atomic_load_n(&start_pending, __ATOMIC_ACQUIRE))
+		arch_start_move(0);
+	if (discard_pending) {
+		motion_hold();
+		arch_discard();
+		motion_unhold();
 	}
-	sending_fragment = 0;
-	avr_filling = false;
-	return !host_block && !stopping && discarding == 0 && !stop_pending;
 } // }}}
 
 void arch_start_move(int extra) { // {{{
 	if (host_block)
 		return;
-	if (!connected || preparing || sending_fragment || out_busy >= 3) {
+	if (motion_thread_self()) {
+		// The main thread starts it when it has sent the fragments.
+		__atomic_store_n(&start_pending, true, __ATOMIC_RELEASE);
+		return;
+	}
+	if (!connected || preparing || sending_fragment || out_busy >= out_window) {
 		//debug("no start yet");
 		start_pending = true;
 		return;
@@ -1238,12 +1465,18 @@ void arch_start_move(int extra) { // {{{
 		//debug("not startable");
 		return;
 	}
-	if ((running_fragment - current_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER <= extra + 2) {
+	int current = avr_current_fragment();
+	if ((running_fragment - current + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER <= extra + 2) {
 		//debug("no buffer no start");
 		return;
 	}
+	if (avr_queued() > 0 && (current - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER < MIN_BUFFER_FILL) {
+		// More fragments are coming; start when the firmware has enough of them.
+		start_pending = true;
+		return;
+	}
 	//debug("start move %d %d %d %d", current_fragment, running_fragment, sending_fragment, extra);
-	while (out_busy >= 3)
+	while (out_busy >= out_window)
 		serial_wait();
 	start_pending = false;
 	avr_running = true;
@@ -1253,14 +1486,14 @@ void arch_start_move(int extra) { // {{{
 } // }}}
 
 bool arch_running() { // {{{
-	return avr_running;
+	return avr_running || avr_queued() > 0;
 } // }}}
 
 void arch_home() { // {{{
 	if (!connected)
 		return;
 	avr_homing = true;
-	while (out_busy >= 3)
+	while (out_busy >= out_window)
 		serial_wait();
 	avr_buffer[0] = HWC_HOME;
 	int speed = 10000;	// μs/step.
@@ -1286,27 +1519,53 @@ static void avr_discard_done() { // {{{
 	//debug("discard done");
 } // }}}
 
+static int avr_queue_drop(int n) { // {{{
+	// Drop up to n of the newest queued fragments after a discard and return how many were dropped.
+	// current_fragment was already moved back over all n, so they start there.  The motion thread must not be running.
+	int dropped = min(n, avr_queued());
+	for (int i = n - dropped; i < n; ++i) {
+		int f = (current_fragment + i) % FRAGMENTS_PER_BUFFER;
+		if (avr_queue_setup[f]) {
+			// Send the setup with the fragments that replace these.
+			avr_queue_setup[f] = false;
+			avr_setup_queued = true;
+		}
+	}
+	__atomic_store_n(&avr_queue_head, avr_queue_head - dropped, __ATOMIC_RELEASE);
+	// If the firmware has some of the discarded fragments, it receives the replacements next.
+	avr_queue_current = (current_fragment - avr_queued() + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
+	return dropped;
+} // }}}
+
 void arch_discard() { // {{{
 	// Send a pending discard instruction to the firmware.
-	if (!connected || avr_filling) {
-		// Not now; it will be done later.
-		return;
-	}
-	discard_pending = false;
-	if (discarding == 0)
-		return;
-	while (out_busy >= 3)
-		serial_wait();
-	//debug("discard send");
-	avr_buffer[0] = HWC_DISCARD;
-	avr_buffer[1] = discarding;
-	if (prepare_packet(avr_buffer, 2)) {
-		avr_cb = &avr_discard_done;
-		avr_send();
+	// Fragments that are still queued never reach the firmware; only the rest is discarded there.
+	int dropped = avr_queue_drop(discarding);
+	discarding -= dropped;
+	if (discarding > 0) {
+		if (!connected || avr_filling) {
+			// Not now; it will be done later.
+			return;
+		}
+		discard_pending = false;
+		while (out_busy >= out_window)
+			serial_wait();
+		//debug("discard send");
+		avr_buffer[0] = HWC_DISCARD;
+		avr_buffer[1] = discarding;
+		if (prepare_packet(avr_buffer, 2)) {
+			avr_cb = &avr_discard_done;
+			avr_send();
+		}
+		else {
+			debug("prepare packet failed for discard");
+			discarding = 0;
+		}
 	}
 	else {
-		debug("prepare packet failed for discard");
-		discarding = 0;
+		discard_pending = false;
+		if (dropped == 0)
+			return;
 	}
 	double motors[spaces[0].num_motors];
 	double xyz[spaces[0].num_axes];
@@ -1323,7 +1582,7 @@ void arch_discard() { // {{{
 void arch_send_spi(int bits, const uint8_t *data) { // {{{
 	if (!connected)
 		return;
-	while (out_busy >= 3)
+	while (out_busy >= out_window)
 		serial_wait();
 	avr_buffer[0] = HWC_SPI;
 	avr_buffer[1] = bits;
@@ -1386,6 +1645,8 @@ void AVRSerial::begin(char const *port) { // {{{
 	pollfds[BASE_FDS].revents = 0;
 	start = 0;
 	end_ = 0;
+	tx_start = 0;
+	tx_end = 0;
 	fcntl(fd, F_SETFL, O_NONBLOCK);
 } // }}}
 
@@ -1397,16 +1658,52 @@ void AVRSerial::write(char c) { // {{{
 		debug("writing to serial while not connected");
 		abort();
 	}
-	while (true) {
-		errno = 0;
-		int ret = ::write(fd, &c, 1);
-		if (ret == 1)
+	while (tx_end == int(sizeof(tx_buffer))) {
+		// The buffer is full; move the unsent part to the front, or wait until the port accepts more.
+		if (tx_start > 0) {
+			memmove(tx_buffer, &tx_buffer[tx_start], tx_end - tx_start);
+			tx_end -= tx_start;
+			tx_start = 0;
 			break;
-		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		}
+		struct pollfd out = {fd, POLLOUT, 0};
+		int ret = poll(&out, 1, -1);
+		if (ret < 0 && errno != EINTR) {
+			disconnect(true, "poll for writing to avr failed: %s", strerror(errno));
+			return;
+		}
+		if (ret > 0 && (out.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+			// The port is gone; waiting for room would block forever.
+			disconnect(true, "serial port closed while writing; waiting for reconnect.");
+			return;
+		}
+		flush();
+		if (!connected)
+			return;	// This causes protocol errors during reconnect, but they will be handled.
+	}
+	tx_buffer[tx_end++] = c;
+} // }}}
+
+void AVRSerial::flush() { // {{{
+	// Write as much of the buffer as the port accepts.  If something is left, poll for POLLOUT so it is sent when there is room.
+	while (tx_start < tx_end) {
+		errno = 0;
+		int ret = ::write(fd, &tx_buffer[tx_start], tx_end - tx_start);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
 			disconnect(true, "write to avr failed: %d %s", ret, strerror(errno));
 			return;	// This causes protocol errors during reconnect, but they will be handled.
 		}
+		tx_start += ret;
+	}
+	if (tx_start == tx_end) {
+		tx_start = 0;
+		tx_end = 0;
+		pollfds[BASE_FDS].events = POLLIN | POLLPRI;
 	}
+	else
+		pollfds[BASE_FDS].events = POLLIN | POLLPRI | POLLOUT;
 } // }}}
 
 void AVRSerial::refill() { // {{{
@@ -1419,7 +1716,7 @@ void AVRSerial::refill() { // {{{
 			debug("read returned error: %s", strerror(errno));
 		end_ = 0;
 	}
-	if (end_ == 0 && pollfds[BASE_FDS].revents) {
+	if (end_ == 0 && (pollfds[BASE_FDS].revents & ~POLLOUT)) {
 		disconnect(true, "EOF detected on serial port; waiting for reconnect.");
 	}
 	pollfds[BASE_FDS].revents = 0;
@@ -50,23 +50,29 @@ struct avr_Data {
 #define ARCH_MOTOR avr_Data avr_data;
 #define ARCH_PATTERN avr_Data avr_data;
 #define ARCH_SPACE
-#define ARCH_NEW_MOTOR(s, m, base) base[m]->avr_data.buffer = new AVR_BUFFER_DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(AVR_BUFFER_DATA_TYPE)];
+#define ARCH_NEW_MOTOR(s, m, base) base[m]->avr_data.buffer = new AVR_BUFFER_DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(AVR_BUFFER_DATA_TYPE)]();
 #define DATA_DELETE(s, m) delete[] (spaces[s].motor[m]->avr_data.buffer)
+// Only active motors have data in their buffer; this must be called before they are deactivated.
 #define DATA_CLEAR() do { \
 		for (int s = 0; s < NUM_SPACES; ++s) \
 			for (int m = 0; m < spaces[s].num_motors; ++m) \
-				memset((spaces[s].motor[m]->avr_data.buffer), 0, BYTES_PER_FRAGMENT); \
-		memset(pattern.avr_data.buffer, 0, BYTES_PER_FRAGMENT); \
+				if (spaces[s].motor[m]->active) \
+					memset((spaces[s].motor[m]->avr_data.buffer), 0, BYTES_PER_FRAGMENT); \
+		if (pattern.active) \
+			memset(pattern.avr_data.buffer, 0, BYTES_PER_FRAGMENT); \
 	} while (0)
 #define DATA_SET(s, m, v) spaces[s].motor[m]->avr_data.buffer[current_fragment_pos] = v;
 #define PATTERN_SET(v) pattern.avr_data.buffer[current_fragment_pos] = v;
 #define SAMPLES_PER_FRAGMENT (BYTES_PER_FRAGMENT / sizeof(AVR_BUFFER_DATA_TYPE))
 #define ARCH_MAX_FDS 1	// Maximum number of fds for arch-specific purposes.
+#define AVR_QUEUE_PACKET 256	// Room for a packet in the fragment queue.
+#define AVR_QUEUE_PACKETS (NUM_MOTORS + 3)	// Packets per fragment: HWC_SETUP, START_MOVE, one per motor and one for the pattern.
 
 #endif
 
 // Not defines, because they can change value.
-EXTERN uint8_t NUM_PINS, NUM_DIGITAL_PINS, NUM_ANALOG_INPUTS, NUM_MOTORS, FRAGMENTS_PER_BUFFER, BYTES_PER_FRAGMENT, TIME_PER_ISR;
+EXTERN uint8_t NUM_PINS, NUM_DIGITAL_PINS, NUM_ANALOG_INPUTS, NUM_MOTORS, FRAGMENTS_PER_BUFFER, BYTES_PER_FRAGMENT;
+EXTERN uint16_t TIME_PER_ISR;
 // }}}
 
 enum Control { // {{{
@@ -88,7 +94,7 @@ enum HWCommands { // {{{
 	HWC_HOME,	// 07
 	HWC_START_MOVE,	// 08
 	HWC_START_PROBE,// 09
-	HWC_MOVE,	// 0a
+	HWC_MOVE,	// 0a; 1:which, 1:encoded length, *:run length encoded samples
 	HWC_MOVE_SINGLE,// 0b
 	HWC_PATTERN,	// 0c
 	HWC_START,	// 0d
@@ -159,7 +165,12 @@ void arch_change_steps_per_unit(int s, int m, double factor);
 void arch_invertpos(int s, int m);
 void arch_stop(bool fake);
 void avr_stop2();
+void avr_queue_flush();
+int avr_queued();
+int avr_current_fragment();
 bool arch_send_fragment();
+void arch_send_queued();
+int arch_sample_period(int max_step);
 void arch_start_move(int extra);
 bool arch_running();
 void arch_home();
@@ -173,8 +184,11 @@ void END_DEBUG();
 struct AVRSerial : public Serial_t { // {{{
 	char buffer[256];
 	int start, end_, fd;
+	// Bytes are collected in tx_buffer and written with one system call by flush().
+	char tx_buffer[1024];
+	int tx_start, tx_end;
 	void begin(char const *port);
-	void end() { close(fd); }
+	void end() { close(fd); tx_start = 0; tx_end = 0; }
 	void write(char c);
 	void refill();
 	int read();
@@ -183,7 +197,7 @@ struct AVRSerial : public Serial_t { // {{{
 			*target++ = read();
 		return len;
 	}
-	void flush() {}
+	void flush();
 	int available() {
 		if (start == end_)
 			refill();
@@ -208,6 +222,8 @@ EXTERN bool avr_running;
 EXTERN Avr_pin_t *avr_pins;
 EXTERN double *avr_pos_offset;	// pos + offset = hwpos
 EXTERN int avr_active_motors;
+EXTERN int avr_time_per_sample;	// Sample period that was sent in the last HWC_SETUP.
+EXTERN int avr_phase_bits;	// Number of ISR calls per sample at that period is 1 << avr_phase_bits.
 EXTERN int *avr_adc_id;
 EXTERN uint8_t *avr_control_queue;
 EXTERN bool *avr_in_control_queue;
@@ -221,6 +237,20 @@ EXTERN void (*avr_cb)();
 EXTERN int *avr_pin_name_len;
 EXTERN char **avr_pin_name;
 EXTERN bool avr_uuid_dirty;
+// Fragments that were computed, but not sent yet; see arch_send_queued().
+// The motion thread fills slots and moves the head; the main thread sends them and moves the tail.
+// Anything else is only done while the motion thread waits.
+EXTERN char *avr_queue_data;	// AVR_QUEUE_PACKETS packets for every fragment in the buffer.
+EXTERN int *avr_queue_len;	// Length of every packet in avr_queue_data.
+EXTERN int *avr_queue_packets;	// Number of packets for every fragment.
+EXTERN bool *avr_queue_setup;	// The first packet of the fragment is an HWC_SETUP.
+EXTERN unsigned avr_queue_head;	// Number of fragments that were queued; the last one is before current_fragment.
+EXTERN unsigned avr_queue_tail;	// Number of fragments that were sent.
+EXTERN int avr_queue_current;	// The fragment that the firmware receives next.
+EXTERN int avr_queue_generation;	// Changed when the queue is flushed, so a fragment that is being sent is not finished.
+EXTERN char avr_setup_buffer[16];	// HWC_SETUP packet for the next queued fragment.
+EXTERN int avr_setup_len;
+EXTERN bool avr_setup_queued;
 // }}}
 
 #define avr_write_ack(reason) do { \
@@ -0,0 +1,80 @@
+/* arch-firmware-defs.h - simulated firmware definitions for Franklin {{{
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+// The firmware built as a host program.  It talks to the host over stdin and stdout, so the avr host arch can run it as port "!program".
+// The environment can make the link lossy, for testing the recovery of the protocol:
+//	SIM_LOSS	Probability that a byte is dropped (default 0).
+//	SIM_CORRUPT	Probability that a bit in a byte is flipped (default 0).
+//	SIM_WINDOW	Largest window that is granted to the host (default SERIAL_WINDOW); 0 makes it use the flip-flop protocol.
+//	SIM_SEED	Seed for the random errors.
+//	SIM_SPEED	Factor by which moves are executed faster than real time (default 1), to test the throughput of the link.
+// Errors are injected in both directions.
+
+#ifndef _ARCH_SIM_DEFS_H
+#define _ARCH_SIM_DEFS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <cstdio>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#define NUM_DIGITAL_PINS 15
+#define NUM_ANALOG_INPUTS 7
+
+#define cli() do {} while(0)
+#define sei() do {} while(0)
+
+#ifdef F
+#undef F
+#endif
+#define F(x) (x)
+#define L "l"
+
+// There is no separate program memory.
+#define PROGMEM
+#define pgm_read_byte(p) (*(p))
+
+#define ARCH_PIN_DATA
+#define ARCH_MOTOR
+
+// Steps are done by SLOW_ISR() from the main loop.
+#define TIME_PER_ISR 20
+#ifdef FAST_ISR
+#undef FAST_ISR
+#endif
+
+extern uint8_t sim_window;
+#define SERIAL_WINDOW sim_window
+
+// These are used by SLOW_ISR(), which is defined before arch-firmware.h is included.
+extern volatile bool sim_isr_enabled;
+static inline void arch_disable_isr() {
+	sim_isr_enabled = false;
+}
+static inline void arch_enable_isr() {
+	sim_isr_enabled = true;
+}
+void arch_set_speed(uint16_t us_per_sample);
+
+#endif
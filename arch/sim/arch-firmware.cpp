@@ -0,0 +1,245 @@
+/* arch-firmware.cpp - simulated firmware for Franklin {{{
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+#include "firmware.h"
+#include <time.h>
+
+// Variables. {{{
+uint8_t sim_window;
+volatile bool sim_isr_enabled;
+static uint8_t sim_eeprom[UUID_SIZE];
+static int64_t sim_start_ns;
+static int64_t sim_isr_ns;	// Time between calls of SLOW_ISR; 0 if the timer is off.
+static int64_t sim_isr_next;
+static double sim_loss, sim_corrupt, sim_speed;
+static uint64_t sim_random_state;
+static uint8_t sim_tx[256];
+static int sim_tx_len;
+// }}}
+
+// Helpers. {{{
+static int64_t sim_now() { // {{{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * int64_t(1000000000) + ts.tv_nsec;
+} // }}}
+
+static double sim_random() { // {{{
+	// xorshift64*; this only needs to be reproducible, not good.
+	sim_random_state ^= sim_random_state >> 12;
+	sim_random_state ^= sim_random_state << 25;
+	sim_random_state ^= sim_random_state >> 27;
+	return (sim_random_state * 0x2545f4914f6cdd1dULL >> 11) * (1. / (uint64_t(1) << 53));
+} // }}}
+
+static double sim_env(char const *name, double def) { // {{{
+	char const *value = getenv(name);
+	return value ? atof(value) : def;
+} // }}}
+
+static bool sim_damage(uint8_t &c) { // {{{
+	// Apply the configured line errors to a byte.  Returns false if it is lost.
+	if (sim_loss > 0 && sim_random() < sim_loss)
+		return false;
+	if (sim_corrupt > 0 && sim_random() < sim_corrupt)
+		c ^= 1 << int(sim_random() * 8);
+	return true;
+} // }}}
+
+static void sim_flush() { // {{{
+	int pos = 0;
+	while (pos < sim_tx_len) {
+		int ret = ::write(1, &sim_tx[pos], sim_tx_len - pos);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				fprintf(stderr, "sim firmware: write failed: %s\n", strerror(errno));
+				exit(1);
+			}
+			struct pollfd out = {1, POLLOUT, 0};
+			poll(&out, 1, -1);
+			continue;
+		}
+		pos += ret;
+	}
+	sim_tx_len = 0;
+} // }}}
+// }}}
+
+// Debugging. {{{
+void debug_add(int i) { // {{{
+	(void)&i;
+} // }}}
+
+void debug_dump() { // {{{
+} // }}}
+
+void debug(char const *fmt, ...) { // {{{
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "sim firmware: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+} // }}}
+// }}}
+
+// Serial communication. {{{
+void arch_serial_write(uint8_t c) { // {{{
+	if (!sim_damage(c))
+		return;
+	if (sim_tx_len == int(sizeof(sim_tx)))
+		sim_flush();
+	sim_tx[sim_tx_len++] = c;
+} // }}}
+
+void arch_claim_serial() { // {{{
+} // }}}
+// }}}
+
+// Setup. {{{
+void arch_setup_start() { // {{{
+	fcntl(0, F_SETFL, O_NONBLOCK);
+	sim_start_ns = sim_now();
+	sim_isr_ns = 0;
+	sim_loss = sim_env("SIM_LOSS", 0);
+	sim_corrupt = sim_env("SIM_CORRUPT", 0);
+	sim_speed = sim_env("SIM_SPEED", 1);
+	sim_random_state = uint64_t(sim_env("SIM_SEED", 1)) * 2 + 1;
+	sim_window = min(int(sim_env("SIM_WINDOW", MAX_SERIAL_WINDOW)), MAX_SERIAL_WINDOW);
+	for (uint8_t i = 0; i < ID_SIZE; ++i)
+		machineid[1 + i] = 0;
+	for (uint8_t i = 0; i < UUID_SIZE; ++i)
+		machineid[1 + ID_SIZE + i] = EEPROM_read(i);
+} // }}}
+
+void arch_setup_end() { // {{{
+} // }}}
+
+void arch_msetup(uint8_t m) { // {{{
+	(void)&m;
+} // }}}
+
+void arch_set_speed(uint16_t us_per_sample) { // {{{
+	if (us_per_sample == 0) {
+		sim_isr_enabled = false;
+		sim_isr_ns = 0;
+		step_state = STEP_STATE_STOP;
+		return;
+	}
+	sim_isr_ns = max(int64_t(1), int64_t((us_per_sample * 1000. / sim_speed)) >> base_phase_bits);
+	sim_isr_next = sim_now() + sim_isr_ns;
+	sim_isr_enabled = true;
+} // }}}
+// }}}
+
+void arch_tick() { // {{{
+	// Send what the main loop has written.
+	sim_flush();
+	// Read input.
+	while (!serial_overflow) {
+		uint8_t data[64];
+		int room = (serial_buffer_tail - serial_buffer_head - 1) & SERIAL_MASK;
+		if (room == 0) {
+			serial_overflow = true;
+			break;
+		}
+		int len = ::read(0, data, min(room, int(sizeof(data))));
+		if (len < 0) {
+			if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+				break;
+			fprintf(stderr, "sim firmware: read failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (len == 0) {
+			// The host has closed the connection.
+			exit(0);
+		}
+		for (int i = 0; i < len; ++i) {
+			if (!sim_damage(data[i]))
+				continue;
+			*serial_buffer_head = data[i];
+			serial_buffer_head = (volatile uint8_t *)(((uintptr_t(serial_buffer_head) + 1) & SERIAL_MASK) | uintptr_t(serial_buffer));
+		}
+		if (len < int(sizeof(data)))
+			break;
+	}
+	// Do moves.
+	int64_t now = sim_now();
+	if (sim_isr_enabled && sim_isr_ns > 0 && now >= sim_isr_next) {
+		SLOW_ISR();
+		sim_isr_next += sim_isr_ns;
+		// Don't try to catch up after a long delay.
+		if (sim_isr_next < now - 16 * sim_isr_ns)
+			sim_isr_next = now;
+		return;
+	}
+	// Wait for input or for the next sample, but wake up often enough for the timers in the main loop.
+	int64_t wait = 1000000;
+	if (sim_isr_enabled && sim_isr_ns > 0)
+		wait = min(wait, sim_isr_next - now);
+	if (wait <= 0)
+		return;
+	struct pollfd in = {0, POLLIN | POLLPRI, 0};
+	struct timespec delay = {0, long(wait)};
+	ppoll(&in, 1, &delay, NULL);
+} // }}}
+
+void arch_outputs() { // {{{
+} // }}}
+
+// Timekeeping. {{{
+uint16_t millis() { // {{{
+	return (sim_now() - sim_start_ns) / 1000000;
+} // }}}
+
+uint16_t seconds() { // {{{
+	return (sim_now() - sim_start_ns) / 1000000000;
+} // }}}
+// }}}
+
+// EEPROM. {{{
+uint8_t EEPROM_read(uint16_t addr) { // {{{
+	return addr < sizeof(sim_eeprom) ? sim_eeprom[addr] : 0;
+} // }}}
+
+void EEPROM_write(uint16_t addr, uint8_t value) { // {{{
+	if (addr < sizeof(sim_eeprom))
+		sim_eeprom[addr] = value;
+} // }}}
+// }}}
+
+// SPI. {{{
+void arch_spi_start() { // {{{
+} // }}}
+
+void arch_spi_send(uint8_t data, uint8_t bits) { // {{{
+	(void)&data;
+	(void)&bits;
+} // }}}
+
+void arch_spi_stop() { // {{{
+} // }}}
+// }}}
+
+int8_t arch_pin_name(char *buffer_, bool digital, uint8_t pin_) { // {{{
+	if (digital)
+		return sprintf(buffer_, "D%d", pin_);
+	return sprintf(buffer_, "A%d", pin_);
+} // }}}
@@ -0,0 +1,119 @@
+/* arch-firmware.h - simulated firmware for Franklin {{{
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+#ifndef _ARCH_SIM_H
+#define _ARCH_SIM_H
+
+// Variables. {{{
+EXTERN int sim_temp;	// Fake heater on pin 0, adc 0.
+// }}}
+
+// Functions in arch-firmware.cpp. {{{
+void arch_serial_write(uint8_t c);
+void arch_claim_serial();
+void arch_setup_start();
+void arch_setup_end();
+void arch_tick();
+void arch_outputs();
+uint16_t millis();
+uint16_t seconds();
+uint8_t EEPROM_read(uint16_t addr);
+void EEPROM_write(uint16_t addr, uint8_t value);
+void arch_spi_start();
+void arch_spi_send(uint8_t data, uint8_t bits);
+void arch_spi_stop();
+int8_t arch_pin_name(char *buffer_, bool digital, uint8_t pin_);
+// }}}
+
+// ADC. {{{
+static inline void arch_adc_start(uint8_t adcpin) {
+	(void)&adcpin;
+}
+
+static inline bool adc_ready(uint8_t pin_) {
+	(void)&pin_;
+	return true;
+}
+
+static inline int16_t adc_get(uint8_t pin_) {
+	if (pin_ != 0)
+		return 0;
+	if (CONTROL_CURRENT(pin[0].state) == CTRL_RESET)
+		sim_temp = min(sim_temp + 1, (1 << 10) - 1);
+	else
+		sim_temp = max(sim_temp - 1, 0);
+	return sim_temp;
+}
+// }}}
+
+// Watchdog. {{{
+static inline void arch_watchdog_enable() {
+}
+
+static inline void arch_watchdog_reset() {
+}
+// }}}
+
+// Pin control. {{{
+inline void SET_OUTPUT(uint8_t pin_no) {
+	if (pin_no >= NUM_DIGITAL_PINS)
+		return;
+	if ((pin[pin_no].state & 0x3) == CTRL_SET || (pin[pin_no].state & 0x3) == CTRL_RESET)
+		return;
+	pin[pin_no].set_state((pin[pin_no].state & ~0x3) | CTRL_RESET);
+}
+
+inline void SET_INPUT(uint8_t pin_no) {
+	if (pin_no >= NUM_DIGITAL_PINS)
+		return;
+	pin[pin_no].set_state((pin[pin_no].state & ~0x3) | CTRL_INPUT);
+}
+
+inline void UNSET(uint8_t pin_no) {
+	if (pin_no >= NUM_DIGITAL_PINS)
+		return;
+	pin[pin_no].set_state((pin[pin_no].state & ~0x3) | CTRL_UNSET);
+}
+
+inline void SET(uint8_t pin_no) {
+	if (pin_no >= NUM_DIGITAL_PINS)
+		return;
+	if ((pin[pin_no].state & 0x3) == CTRL_SET)
+		return;
+	pin[pin_no].set_state((pin[pin_no].state & ~0x3) | CTRL_SET);
+}
+
+inline void RESET(uint8_t pin_no) {
+	if (pin_no >= NUM_DIGITAL_PINS)
+		return;
+	if ((pin[pin_no].state & 0x3) == CTRL_RESET)
+		return;
+	pin[pin_no].set_state((pin[pin_no].state & ~0x3) | CTRL_RESET);
+}
+
+// Limit switches on 1, 2, 3.
+inline bool GET(uint8_t pin_no) {
+	if (pin_no < 1 || pin_no > 3)
+		return false;
+	return motor[pin_no - 1].current_pos > 0;
+}
+// }}}
+
+#endif
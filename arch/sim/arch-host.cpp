@@ -0,0 +1,1095 @@
+/* arch-host.cpp - simulated machine for Franklin {{{
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016-2022 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+#include "cdriver.h"
+#include <sys/resource.h>
+#include <time.h>
+#include <random>
+#include <vector>
+
+// Size of the simulated buffer; these can be changed with command line options of sim_main().
+static int sim_config_fragments = 16;
+static int sim_config_bytes = 16;
+
+// Packets. {{{
+// There is no serial port, so there are never packets from the firmware.
+int hwpacketsize(int len, int *available) { // {{{
+	(void)&len;
+	(void)&available;
+	return 1;
+} // }}}
+
+bool hwpacket(int len) { // {{{
+	(void)&len;
+	return false;
+} // }}}
+
+void arch_had_ack() { // {{{
+} // }}}
+// }}}
+
+// Positions. {{{
+static int sim_motor_index(int s, int m) { // {{{
+	// Index of the motor in the firmware, or -1 if it does not exist.
+	if (s >= NUM_SPACES)
+		return -1;
+	int mi = 0;
+	for (int ts = 0; ts < s; ++ts)
+		mi += spaces[ts].num_motors;
+	if (mi + m >= NUM_MOTORS)
+		return -1;
+	return mi + m;
+} // }}}
+
+double arch_round_pos(int s, int m, double pos) { // {{{
+	int mi = sim_motor_index(s, m);
+	if (mi < 0)
+		return pos;
+	return round((pos + sim_pos_offset[mi]) * spaces[s].motor[m]->steps_per_unit) / spaces[s].motor[m]->steps_per_unit - sim_pos_offset[mi];
+} // }}}
+
+int arch_pos2hw(int s, int m, double pos) { // {{{
+	int mi = sim_motor_index(s, m);
+	return (pos + sim_pos_offset[mi]) * spaces[s].motor[m]->steps_per_unit;
+} // }}}
+
+double arch_hw2pos(int s, int m, int hw) { // {{{
+	int mi = sim_motor_index(s, m);
+	return hw / spaces[s].motor[m]->steps_per_unit - sim_pos_offset[mi];
+} // }}}
+
+static void sim_get_current_pos(bool check) { // {{{
+	// Set the host positions from the firmware step counters.
+	// If check is true, they are expected to be the same already; differences are reported.
+	int mi = 0;
+	for (int ts = 0; ts < NUM_SPACES; mi += spaces[ts++].num_motors) {
+		for (int tm = 0; tm < spaces[ts].num_motors && mi + tm < NUM_MOTORS; ++tm) {
+			Motor &mtr = *spaces[ts].motor[tm];
+			int p = sim_pos[mi + tm];
+			if (mtr.dir_pin.inverted())
+				p *= -1;
+			if (mtr.settings.hw_pos == p)
+				continue;
+			// followers are expected to go out of sync all the time.
+			if (check && ts != 2) {
+				debug("WARNING: position for %d %d out of sync!  old = %d, new = %d (difference = %d), offset = %f", ts, tm, mtr.settings.hw_pos, p, p - mtr.settings.hw_pos, sim_pos_offset[mi + tm]);
+				sim_desyncs += 1;
+			}
+			mtr.settings.current_pos = p / mtr.steps_per_unit - sim_pos_offset[mi + tm];
+			mtr.settings.hw_pos = p;
+		}
+	}
+} // }}}
+// }}}
+
+// Hardware interface {{{
+// Pins only keep their state; there is nothing connected to them.
+void SET_INPUT(Pin_t _pin) { // {{{
+	if (!_pin.valid())
+		return;
+	sim_pins[_pin.pin] = 2;
+} // }}}
+
+void SET_INPUT_NOPULLUP(Pin_t _pin) { // {{{
+	if (!_pin.valid())
+		return;
+	sim_pins[_pin.pin] = 3;
+} // }}}
+
+void RESET(Pin_t _pin) { // {{{
+	if (!_pin.valid())
+		return;
+	sim_pins[_pin.pin] = 0;
+} // }}}
+
+void SET(Pin_t _pin) { // {{{
+	if (!_pin.valid())
+		return;
+	sim_pins[_pin.pin] = 1;
+} // }}}
+
+void SET_OUTPUT(Pin_t _pin) { // {{{
+	if (!_pin.valid())
+		return;
+	if (sim_pins[_pin.pin] < 2)
+		return;
+	RESET(_pin);
+} // }}}
+
+void GET(Pin_t _pin, bool _default, void(*cb)(bool)) { // {{{
+	// Outputs read back their own state; inputs are not connected, so they read the default.
+	if (!connected || !_pin.valid() || sim_pins[_pin.pin] >= 2)
+		cb(_default);
+	else
+		cb(sim_pins[_pin.pin] == 1);
+} // }}}
+
+void arch_pin_set_reset(Pin_t _pin, char state) { // {{{
+	(void)&_pin;
+	(void)&state;
+} // }}}
+
+void arch_set_duty(Pin_t _pin, double duty) { // {{{
+	(void)&_pin;
+	(void)&duty;
+} // }}}
+
+void arch_set_pin_motor(Pin_t _pin, int s, int m, int ticks) { // {{{
+	(void)&_pin;
+	(void)&s;
+	(void)&m;
+	(void)&ticks;
+} // }}}
+// }}}
+
+// Setup hooks. {{{
+void arch_change(bool motors) { // {{{
+	// The simulated firmware has no settings; only the number of motors is needed.
+	(void)&motors;
+	if (!connected)
+		return;
+	sim_active_motors = 0;
+	for (int s = 0; s < NUM_SPACES; ++s)
+		sim_active_motors += spaces[s].num_motors;
+	if (sim_active_motors > NUM_MOTORS) {
+		debug("simulated machine has only %d motors; %d are configured", NUM_MOTORS, sim_active_motors);
+		sim_active_motors = NUM_MOTORS;
+	}
+} // }}}
+
+void arch_motors_change() { // {{{
+	change_pending = false;
+	arch_change(true);
+} // }}}
+
+void arch_globals_change() { // {{{
+	arch_change(false);
+} // }}}
+
+void arch_setup_start() { // {{{
+	// Set up arch variables.
+	sim_running = false;
+	NUM_PINS = 0;
+	NUM_DIGITAL_PINS = 0;
+	NUM_ANALOG_INPUTS = 0;
+	NUM_MOTORS = 0;
+	sim_pins = NULL;
+	sim_pos = NULL;
+	sim_pos_offset = NULL;
+	sim_fragment = NULL;
+	sim_buffer = NULL;
+	sim_record = NULL;
+	sim_active_motors = 0;
+	sim_fragments = 0;
+	sim_samples = 0;
+	sim_refills = 0;
+	sim_desyncs = 0;
+	sim_machine_time = 0;
+	sim_refill_max_us = 0;
+	sim_refill_total_us = 0;
+	pollfds[BASE_FDS].fd = -1;
+	connected = false;
+} // }}}
+
+void arch_setup_end() {
+	// Nothing to do.
+}
+
+void arch_set_uuid() { // {{{
+	// The uuid is only stored in shared memory.
+} // }}}
+
+void arch_connect(char const *run_id, char const *port) { // {{{
+	// Port is the name of the file to record the steps to, or empty for not recording them.
+	(void)&run_id;
+	connected = true;
+	NUM_DIGITAL_PINS = 64;
+	NUM_ANALOG_INPUTS = 16;
+	NUM_PINS = NUM_DIGITAL_PINS + NUM_ANALOG_INPUTS;
+	NUM_MOTORS = 32;
+	FRAGMENTS_PER_BUFFER = sim_config_fragments;
+	BYTES_PER_FRAGMENT = sim_config_bytes;
+	TIME_PER_ISR = 100;
+	if (port[0] != '\0') {
+		sim_record = fopen(port, "w");
+		if (!sim_record) {
+			disconnect(true, "failed to open step stream file %s: %s", port, strerror(errno));
+			return;
+		}
+	}
+	delete[] sim_pins;
+	sim_pins = new char[NUM_PINS];
+	for (int i = 0; i < NUM_PINS; ++i)
+		sim_pins[i] = 3;	// INPUT_NOPULLUP.
+	delete[] sim_pos;
+	sim_pos = new int32_t[NUM_MOTORS]();
+	delete[] sim_pos_offset;
+	sim_pos_offset = new double[NUM_MOTORS]();
+	delete[] sim_fragment;
+	sim_fragment = new Sim_Fragment[FRAGMENTS_PER_BUFFER]();
+	delete[] sim_buffer;
+	sim_buffer = new int8_t[FRAGMENTS_PER_BUFFER * (NUM_MOTORS + 1) * BYTES_PER_FRAGMENT]();
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		for (int m = 0; m < sp.num_motors; ++m) {
+			DATA_DELETE(s, m);
+			ARCH_NEW_MOTOR(s, m, sp.motor);
+		}
+	}
+	delete[] pattern.sim_data.buffer;
+	pattern.sim_data.buffer = new SIM_BUFFER_DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(SIM_BUFFER_DATA_TYPE)]();
+	for (int pin = 0; pin < NUM_PINS; ++pin) {
+		char *name = const_cast <char *>(shmem->interrupt_str);
+		bool digital = pin < NUM_DIGITAL_PINS;
+		name[0] = digital ? 7 : 8;
+		int len = sprintf(&name[1], digital ? "D%d" : "A%d", digital ? pin : pin - NUM_DIGITAL_PINS);
+		prepare_interrupt();
+		shmem->interrupt_ints[0] = pin;
+		shmem->interrupt_ints[1] = len;
+		send_to_parent(CMD_PINNAME);
+	}
+	connect_end();
+	arch_change(true);
+} // }}}
+
+void arch_request_temp(int which) { // {{{
+	// There are no thermistors.
+	(void)&which;
+	requested_temp = ~0;
+	shmem->floats[0] = NAN;
+	delayed_reply();
+} // }}}
+
+void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin, bool heater_invert, int heater_adctemp, int heater_limit_l, int heater_limit_h, int fan_pin, bool fan_invert, int fan_adctemp, int fan_limit_l, int fan_limit_h, double hold_time) { // {{{
+	(void)&id;
+	(void)&thermistor_pin;
+	(void)&active;
+	(void)&heater_pin;
+	(void)&heater_invert;
+	(void)&heater_adctemp;
+	(void)&heater_limit_l;
+	(void)&heater_limit_h;
+	(void)&fan_pin;
+	(void)&fan_invert;
+	(void)&fan_adctemp;
+	(void)&fan_limit_l;
+	(void)&fan_limit_h;
+	(void)&hold_time;
+} // }}}
+
+void arch_disconnect() { // {{{
+	connected = false;
+	sim_running = false;
+	if (sim_record) {
+		fclose(sim_record);
+		sim_record = NULL;
+	}
+} // }}}
+
+int arch_fds() { // {{{
+	return 0;
+} // }}}
+
+void arch_reconnect(const char *port) { // {{{
+	(void)&port;
+	connected = true;
+} // }}}
+// }}}
+
+// Running hooks. {{{
+static int sim_decode(int8_t value) { // {{{
+	// Inverse of the encoding in do_steps() in move.cpp: the ones after the sign bit are the high part of the number of steps, the bits after the first zero are the rest, with as many bits shifted out as there were ones.
+	int bits = value & 0x7f;
+	int count = 0;
+	while (count < 7 && bits & (0x40 >> count))
+		count += 1;
+	int steps = count == 7 ? 0x1c0 : count << 6 | (bits & ((1 << (6 - count)) - 1)) << count;
+	return value & 0x80 ? -steps : steps;
+} // }}}
+
+static void sim_execute(int f) { // {{{
+	// Run fragment f: count the steps and record them.
+	Sim_Fragment &frag = sim_fragment[f];
+	int8_t const *data = &sim_buffer[f * (NUM_MOTORS + 1) * BYTES_PER_FRAGMENT];
+	for (int i = 0; i < frag.num_samples; ++i) {
+		if (sim_record)
+			fprintf(sim_record, "%d", frag.hwtime_step);
+		for (int m = 0; m < sim_active_motors; ++m) {
+			int steps = sim_decode(data[m * BYTES_PER_FRAGMENT + i]);
+			sim_pos[m] += steps;
+			if (sim_record)
+				fprintf(sim_record, " %d", steps);
+		}
+		if (sim_record)
+			fprintf(sim_record, " %02x\n", frag.pattern ? data[NUM_MOTORS * BYTES_PER_FRAGMENT + i] & 0xff : 0);
+	}
+	sim_fragments += 1;
+	sim_samples += frag.num_samples;
+	sim_machine_time += frag.num_samples * (frag.hwtime_step / 1e6);
+	frag.num_samples = 0;
+} // }}}
+
+void sim_refill() { // {{{
+	// Refill the buffer and keep track of how long that takes.
+	int32_t start = utime();
+	buffer_refill();
+	// The simulated firmware runs on the main thread, so it needs the fragments now.
+	motion_wait();
+	int32_t t = utime() - start;
+	sim_refills += 1;
+	sim_refill_total_us += t;
+	if (t > sim_refill_max_us)
+		sim_refill_max_us = t;
+} // }}}
+
+void sim_run_fragment() { // {{{
+	// Run the oldest fragment in the buffer, and handle the underrun if that was the last one.
+	if (!sim_running)
+		return;
+	// The motion thread waits while the fragment runs, and must not be held while it refills the buffer.
+	motion_hold();
+	if (running_fragment != current_fragment) {
+		sim_execute(running_fragment);
+		first_fragment = -1;
+		__atomic_store_n(&running_fragment, (running_fragment + 1) % FRAGMENTS_PER_BUFFER, __ATOMIC_RELEASE);
+		motion_unhold();
+		sim_refill();
+		if (running_fragment != current_fragment)
+			return;
+		motion_hold();
+	}
+	sim_running = false;
+	if (computing_move) {
+		debug("slowness underrun %d %d %d", sending_fragment, current_fragment, running_fragment);
+		shmem->underruns += 1;
+		motion_unhold();
+		// The next refill restarts the move.
+		return;
+	}
+	cb_pending = true;
+	if (!sending_fragment && !transmitting_fragment && discarding == 0 && current_fragment_pos == 0) {
+		sim_get_current_pos(true);
+		// An expected underrun during a job is the end of a goto operation and the next command should be sent.
+		run_file_next_command(settings.hwtime);
+		motion_unhold();
+		sim_refill();
+		return;
+	}
+	motion_unhold();
+} // }}}
+
+int arch_tick() { // {{{
+	// Run one fragment per call, so requests are still handled while moving.
+	if (!connected || !sim_running)
+		return -1;
+	sim_run_fragment();
+	return sim_running ? 0 : -1;
+} // }}}
+
+void arch_addpos(int s, int m, double diff) { // {{{
+	int mi = sim_motor_index(s, m);
+	if (mi < 0)
+		return;
+	if (!std::isnan(diff))
+		sim_pos_offset[mi] -= diff;
+	else {
+		debug("Error: addpos called with NaN argument");
+		abort();
+	}
+} // }}}
+
+void arch_change_steps_per_unit(int s, int m, double factor) { // {{{
+	int mi = sim_motor_index(s, m);
+	if (mi < 0)
+		return;
+	if (!std::isnan(factor))
+		sim_pos_offset[mi] *= factor;
+	else {
+		debug("Error: change_steps_per_unit called with NaN argument");
+		abort();
+	}
+} // }}}
+
+void arch_invertpos(int s, int m) { // {{{
+	int mi = sim_motor_index(s, m);
+	if (mi < 0)
+		return;
+	spaces[s].motor[m]->settings.hw_pos *= -1;
+	if (std::isnan(spaces[s].motor[m]->settings.current_pos))
+		return;
+	sim_pos_offset[mi] = -2 * spaces[s].motor[m]->settings.current_pos - sim_pos_offset[mi];
+} // }}}
+
+void arch_stop(bool fake) { // {{{
+	if (!connected) {
+		stop_pending = true;
+		return;
+	}
+	stop_pending = false;
+	if (!sim_running) {
+		current_fragment_pos = 0;
+		computing_move = false;	// Not running, but preparations could have started.
+		return;
+	}
+	sim_running = false;
+	// Whole fragments are run at once, so the machine stops at the start of the running fragment.
+	if (!fake)
+		abort_move(0);
+	sim_get_current_pos(false);
+	current_fragment = running_fragment;
+	current_fragment_pos = 0;
+	num_active_motors = 0;
+} // }}}
+
+int arch_sample_period(int max_step) { // {{{
+	// The simulated firmware can use any sample period.
+	return max_step > 0 ? max_step : base_hwtime_step;
+} // }}}
+
+bool arch_send_fragment() { // {{{
+	if (!connected || host_block || stopping || discarding != 0 || stop_pending)
+		return false;
+	Sim_Fragment &frag = sim_fragment[current_fragment];
+	int8_t *data = &sim_buffer[current_fragment * (NUM_MOTORS + 1) * BYTES_PER_FRAGMENT];
+	memset(data, 0, (NUM_MOTORS + 1) * BYTES_PER_FRAGMENT);
+	int mi = 0;
+	for (int s = 0; s < NUM_SPACES; mi += spaces[s++].num_motors) {
+		for (int m = 0; m < spaces[s].num_motors && mi + m < NUM_MOTORS; ++m) {
+			if (spaces[s].motor[m]->active)
+				memcpy(&data[(mi + m) * BYTES_PER_FRAGMENT], spaces[s].motor[m]->sim_data.buffer, current_fragment_pos);
+		}
+	}
+	frag.pattern = pattern.active;
+	if (pattern.active)
+		memcpy(&data[NUM_MOTORS * BYTES_PER_FRAGMENT], pattern.sim_data.buffer, current_fragment_pos);
+	frag.num_samples = current_fragment_pos;
+	frag.hwtime_step = settings.hwtime_step;
+	return true;
+} // }}}
+
+void arch_send_queued() { // {{{
+	// Fragments are stored directly in the simulated buffer, so nothing is waiting to be sent.
+} // }}}
+
+void arch_rewind() { // {{{
+	// Nothing is queued outside the buffer, so there is nothing to forget.
+} // }}}
+
+void arch_start_move(int extra) { // {{{
+	if (host_block)
+		return;
+	if (!connected) {
+		start_pending = true;
+		return;
+	}
+	if (sim_running || stopping)
+		return;
+	if ((running_fragment - current_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER <= extra + 2)
+		return;
+	start_pending = false;
+	sim_running = true;
+} // }}}
+
+bool arch_running() { // {{{
+	return sim_running;
+} // }}}
+
+void arch_home() { // {{{
+	// There are no limit switches; homing finishes immediately at the current position.
+	if (!connected)
+		return;
+	computing_move = false;
+	int m0 = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		for (int m = 0; m < spaces[s].num_motors && m0 + m < NUM_MOTORS; ++m) {
+			// Firmware resets motor positions to 0 after homing.
+			sim_pos[m0 + m] = 0;
+			sim_pos_offset[m0 + m] = -spaces[s].motor[m]->settings.current_pos;
+			spaces[s].motor[m]->settings.hw_pos = 0;
+		}
+		m0 += spaces[s].num_motors;
+	}
+	prepare_interrupt();
+	m0 = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		for (int m = 0; m < spaces[s].num_motors; ++m)
+			shmem->interrupt_floats[m0 + m] = spaces[s].motor[m]->settings.current_pos;
+		m0 += spaces[s].num_motors;
+	}
+	shmem->interrupt_ints[0] = m0;
+	send_to_parent(CMD_HOMED);
+} // }}}
+
+void arch_discard() { // {{{
+	// The discarded fragments are overwritten before they are run, so the firmware has nothing to do.
+	discard_pending = false;
+	if (discarding == 0)
+		return;
+	discarding = 0;
+	double motors[spaces[0].num_motors];
+	double xyz[spaces[0].num_axes];
+	for (int m = 0; m < spaces[0].num_motors; ++m)
+		motors[m] = spaces[0].motor[m]->settings.current_pos;
+	spaces[0].motors2xyz(motors, xyz);
+	for (int a = 0; a < spaces[0].num_axes; ++a)
+		spaces[0].axis[a]->current = xyz[a];
+	settings.adjust = 0;
+} // }}}
+
+void arch_send_spi(int bits, const uint8_t *data) { // {{{
+	(void)&bits;
+	(void)&data;
+} // }}}
+// }}}
+
+// Debugging hooks. {{{
+void START_DEBUG() { // {{{
+	fprintf(stderr, "cdriver debug from firmware: ");
+} // }}}
+
+void DO_DEBUG(char c) { // {{{
+	fprintf(stderr, "%c", c);
+} // }}}
+
+void END_DEBUG() { // {{{
+	fprintf(stderr, "\n");
+} // }}}
+// }}}
+
+// Benchmark. {{{
+// Usage: franklin-cdriver-sim [options] job.bin
+// The job is run on a simulated machine without a server, as fast as possible, and statistics are written to standard output.
+// Options:
+//	-t dir		Directory with the space type modules (default: ../type/ next to the executable).
+//	-a n		Number of axes and motors (default 3).
+//	-e n		Number of extruders (default 1).
+//	-s steps	Steps per unit for all motors (default 100).
+//	-l speed	Speed limit of the motors in space 0 (default: none); moves that exceed it are slowed down.
+//	-v speed	Maximum speed (default: the cdriver default).
+//	-r factor	Feed rate override (default 1).
+//	-f n		Number of fragments in the buffer (default 16).
+//	-b n		Number of bytes per fragment (default 16).
+//	-o file		Record the steps to a file.
+//	-y type		Geometry of space 0: cartesian (default), delta or drawbot; see sim_geometry below.
+//	-x steps	Tolerance of fitted motor paths (default: the cdriver default); 0 disables fitting.
+//	-k		Compare every fitted motor position with the exact path and report the largest error.
+//	-H motors	Run the history test below instead of a job.
+// The recording has one line per sample: the sample period in μs, the signed number of steps of every motor and the pattern byte in hex.
+// Waits in the job (dwell, temperatures, confirmation, park) are skipped.
+
+static int sim_interrupt_fd;	// Read end of the interrupt pipe.
+static int sim_answer_fd;	// Write end of the interrupt reply pipe.
+static bool sim_job_failed;	// The job could not be completed; see CMD_FILE_ERROR.
+
+static void sim_answer() { // {{{
+	// There is no server; every interrupt is acknowledged as soon as it is sent.
+	// Replies are written in advance, so prepare_interrupt() never blocks; for every interrupt that was sent, a new one is added.
+	char buffer[256];
+	int n;
+	while ((n = read(sim_interrupt_fd, buffer, sizeof(buffer))) > 0) {
+		for (int i = 0; i < n; ++i) {
+			if (buffer[i] == CMD_FILE_ERROR) {
+				debug("job failed: %s", shmem->interrupt_str);
+				sim_job_failed = true;
+			}
+		}
+		if (write(sim_answer_fd, buffer, n) != n) {
+			debug("failed to answer interrupt");
+			abort();
+		}
+	}
+	prepare_interrupt();
+	// Events are not used.
+	__atomic_store_n(&shmem->event_tail, shmem->event_head, __ATOMIC_SEQ_CST);
+} // }}}
+
+// Geometries for space 0. The machine fits around the area from (0, 0) to (100, 100). {{{
+struct Sim_Geometry {
+	char const *name;
+	int type;	// Index in types.txt.
+	int min_axes, max_axes;
+	int space_floats, motor_floats, motor_rows;
+	double space[1], motor[3][4];	// Type parameters of the space and of the first motor_rows motors; the last row is used for the rest.
+};
+
+static Sim_Geometry const sim_geometry[] = {
+	{"cartesian", 0, 1, 32, 0, 0, 1, {0}, {{0}}},
+	// Angle; minimum and maximum carriage position, rod length and radius.
+	{"delta", 3, 3, 3, 1, 4, 1, {0}, {{0, INFINITY, 400, 200}}},
+	// Position of the anchor of every cord; the third motor follows the z axis.
+	{"drawbot", 6, 2, 3, 0, 2, 3, {0}, {{-50, 150}, {150, 150}, {0, 0}}},
+};
+// }}}
+
+static void sim_load(int s, int type, int num, int axis_floats, double steps_per_unit, Sim_Geometry const *geometry = NULL) { // {{{
+	// Configure space s as num axes of the given type, with one motor per axis.
+	for (int i = 97; i < 100; ++i)
+		shmem->ints[i] = 0;
+	shmem->ints[1] = type;
+	shmem->ints[2] = num;
+	if (geometry) {
+		shmem->ints[98] = geometry->space_floats;
+		for (int i = 0; i < geometry->space_floats; ++i)
+			shmem->floats[100 + i] = geometry->space[i];
+	}
+	spaces[s].load_info();
+	shmem->ints[98] = 0;
+	int mi = 0;
+	for (int ts = 0; ts < s; ++ts)
+		mi += spaces[ts].num_motors;
+	for (int a = 0; a < num; ++a) {
+		shmem->ints[2] = 0;
+		shmem->floats[0] = NAN;
+		shmem->floats[1] = -INFINITY;
+		shmem->floats[2] = INFINITY;
+		shmem->ints[98] = axis_floats;
+		for (int i = 0; i < axis_floats; ++i)
+			shmem->floats[100 + i] = 0;
+		spaces[s].load_axis(a);
+		shmem->ints[98] = 0;
+		// Every motor has a step and a direction pin, nothing else.
+		shmem->ints[2] = 0x100 | (2 * (mi + a));
+		shmem->ints[3] = 0x100 | (2 * (mi + a) + 1);
+		shmem->ints[4] = 0;
+		shmem->ints[5] = 0;
+		shmem->ints[6] = 0;
+		shmem->ints[7] = 0;
+		shmem->floats[0] = steps_per_unit;
+		shmem->floats[1] = NAN;
+		shmem->floats[2] = INFINITY;
+		shmem->floats[3] = INFINITY;
+		if (geometry) {
+			shmem->ints[98] = geometry->motor_floats;
+			for (int i = 0; i < geometry->motor_floats; ++i)
+				shmem->floats[100 + i] = geometry->motor[a < geometry->motor_rows ? a : geometry->motor_rows - 1][i];
+		}
+		spaces[s].load_motor(a);
+		shmem->ints[98] = 0;
+	}
+} // }}}
+
+static double sim_seconds() { // {{{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+} // }}}
+
+static double sim_cpu_seconds() { // {{{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+} // }}}
+
+// History test. {{{
+// Usage: franklin-cdriver-sim [-t dir] [-f fragments] [-b bytes] -H motors
+// The cartesian and extruder spaces both get the given number of motors. The cost of store_settings() per fragment is measured and compared
+// with what it did before: copying the state field by field, and clearing the buffers of all motors. Then random
+// sequences of stores, stores of the same fragment, history resets (as Space::setup() does) and rewinds are run;
+// every rewind is checked against separate copies of the state.
+
+struct Sim_State { // {{{
+	History settings;
+	std::vector <Motor_History> motor;
+	std::vector <Axis_History> axis;
+}; // }}}
+
+static std::mt19937_64 sim_random(1);
+static std::vector <bool> sim_moving;	// For every motor, whether it takes part in the current move.
+
+static double sim_random_value() { // {{{
+	return std::uniform_real_distribution <double>(-100, 100)(sim_random);
+} // }}}
+
+static void sim_state_save(Sim_State &state) { // {{{
+	state.settings = settings;
+	int mi = 0, ai = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		for (int m = 0; m < spaces[s].num_motors; ++m)
+			state.motor[mi++] = spaces[s].motor[m]->settings;
+		for (int a = 0; a < spaces[s].num_axes; ++a)
+			state.axis[ai++] = spaces[s].axis[a]->settings;
+	}
+} // }}}
+
+static bool sim_same(double a, double b) { // {{{
+	// Positions can be NaN, so compare the bits.
+	return memcmp(&a, &b, sizeof(a)) == 0;
+} // }}}
+
+static bool sim_state_check(Sim_State const &state) { // {{{
+	// Compare field by field, so padding is ignored.
+	History const &h = state.settings;
+	for (int i = 0; i < 6; ++i) {
+		if (h.unitg[i] != settings.unitg[i] || h.unith[i] != settings.unith[i])
+			return false;
+	}
+	if (h.Jg != settings.Jg || h.Jh != settings.Jh || h.a0g != settings.a0g || h.a0h != settings.a0h || h.v0g != settings.v0g || h.v0h != settings.v0h || h.x0g != settings.x0g || h.x0h != settings.x0h)
+		return false;
+	if (h.hwtime != settings.hwtime || h.end_time != settings.end_time || h.adjust_start_time != settings.adjust_start_time || h.adjust_time != settings.adjust_time || h.hwtime_step != settings.hwtime_step || h.run_time != settings.run_time)
+		return false;
+	if (h.gcode_line != settings.gcode_line || h.queue_start != settings.queue_start || h.queue_end != settings.queue_end || h.feed != settings.feed || h.feed_rate != settings.feed_rate || h.feed_limit != settings.feed_limit || h.feed_next != settings.feed_next || h.run_index != settings.run_index || h.run_move != settings.run_move || h.adjust != settings.adjust || h.run_file_current != settings.run_file_current)
+		return false;
+	if (h.pattern_size != settings.pattern_size || memcmp(h.pattern, settings.pattern, PATTERN_MAX) != 0)
+		return false;
+	int mi = 0, ai = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		for (int m = 0; m < spaces[s].num_motors; ++m, ++mi) {
+			if (!sim_same(state.motor[mi].current_pos, spaces[s].motor[m]->settings.current_pos) || state.motor[mi].hw_pos != spaces[s].motor[m]->settings.hw_pos)
+				return false;
+		}
+		for (int a = 0; a < spaces[s].num_axes; ++a, ++ai) {
+			Axis_History const &x = spaces[s].axis[a]->settings;
+			if (!sim_same(state.axis[ai].source, x.source) || !sim_same(state.axis[ai].endpos, x.endpos) || !sim_same(state.axis[ai].adjust, x.adjust))
+				return false;
+		}
+	}
+	return true;
+} // }}}
+
+static void sim_state_change(bool all) { // {{{
+	// Make the changes of a typical fragment: the time, the position in the move and the moving motors change;
+	// the move parameters, the pattern and the axes change only when a new move starts.
+	if (sim_random() % 32 == 0) {
+		for (size_t i = 0; i < sim_moving.size(); ++i)
+			sim_moving[i] = sim_random() % 2;
+	}
+	settings.hwtime += 1000;
+	settings.run_time += .001;
+	settings.x0g = sim_random_value();
+	settings.v0g = sim_random_value();
+	if (all || sim_random() % 32 == 0) {
+		settings.Jg = sim_random_value();
+		settings.unitg[sim_random() % 3] = sim_random_value();
+		settings.queue_start += 1;
+		settings.gcode_line += 1;
+		settings.pattern[sim_random() % PATTERN_MAX] = sim_random();
+		settings.feed_limit = sim_random_value();
+		settings.feed_next = sim_random_value();
+		settings.run_move += 1;
+	}
+	int mi = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		for (int m = 0; m < spaces[s].num_motors; ++m, ++mi) {
+			if (!all && !sim_moving[mi])
+				continue;
+			spaces[s].motor[m]->active = true;
+			spaces[s].motor[m]->settings.current_pos = sim_random_value();
+			spaces[s].motor[m]->settings.hw_pos = sim_random();
+		}
+		for (int a = 0; a < spaces[s].num_axes; ++a) {
+			if (!all && sim_random() % 256 != 0)
+				continue;
+			spaces[s].axis[a]->settings.source = sim_random_value();
+			spaces[s].axis[a]->settings.endpos = sim_random_value();
+		}
+	}
+} // }}}
+
+static int sim_history_test(int num_motors) { // {{{
+	int total = 0;
+	for (int s = 0; s < NUM_SPACES; ++s)
+		total += spaces[s].num_motors;
+	sim_moving.assign(total, true);
+	std::vector <Sim_State> copies(FRAGMENTS_PER_BUFFER);
+	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f) {
+		copies[f].motor.resize(total);
+		copies[f].axis.resize(total);
+	}
+	current_fragment = 0;
+	current_fragment_pos = 0;
+	sim_state_change(true);
+	history_reset();
+	// Benchmark: the best of several rounds, for the old store and for store_settings().
+	int const rounds = 5, stores = 100000;
+	double cost[2];
+	for (int method = 0; method < 2; ++method) {
+		cost[method] = INFINITY;
+		for (int r = 0; r < rounds; ++r) {
+			double ns = 0;
+			for (int i = 0; i < stores; ++i) {
+				sim_state_change(false);
+				current_fragment = (current_fragment + 1) % FRAGMENTS_PER_BUFFER;
+				struct timespec start, end;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if (method == 0) {
+					sim_state_save(copies[current_fragment]);
+					for (int s = 0; s < NUM_SPACES; ++s) {
+						for (int m = 0; m < spaces[s].num_motors; ++m) {
+							spaces[s].motor[m]->active = false;
+							memset(spaces[s].motor[m]->sim_data.buffer, 0, BYTES_PER_FRAGMENT);
+						}
+					}
+				}
+				else
+					store_settings();
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				ns += (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+			}
+			if (ns / stores < cost[method])
+				cost[method] = ns / stores;
+		}
+	}
+	printf("motors per space: %d (2 spaces), fragments: %d, state: %d bytes\n", num_motors, FRAGMENTS_PER_BUFFER, int(sizeof(History) + history.num_motors * sizeof(Motor_History) + history.num_axes * sizeof(Axis_History)));
+	printf("old store: %.0f ns per fragment, store_settings: %.0f ns per fragment\n", cost[0], cost[1]);
+	// Correctness.
+	current_fragment = 0;
+	history_reset();
+	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+		sim_state_save(copies[f]);
+	int rewinds = 0, errors = 0;
+	while (rewinds < 40000) {
+		int op = sim_random() % 100;
+		if (op < 55) {
+			// Start the next fragment.
+			sim_state_change(sim_random() % 4 == 0);
+			current_fragment = (current_fragment + 1) % FRAGMENTS_PER_BUFFER;
+			store_settings();
+			sim_state_save(copies[current_fragment]);
+		}
+		else if (op < 75) {
+			// Store the same fragment again.
+			sim_state_change(false);
+			store_settings();
+			sim_state_save(copies[current_fragment]);
+		}
+		else if (op < 76) {
+			// Reset the history, as a change of the number of motors does; every fragment gets the current state.
+			sim_state_change(false);
+			history_reset();
+			for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+				sim_state_save(copies[f]);
+		}
+		else {
+			// Rewind.
+			int back = sim_random() % FRAGMENTS_PER_BUFFER;
+			sim_state_change(true);
+			current_fragment = (current_fragment - back + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
+			restore_settings();
+			rewinds += 1;
+			if (!sim_state_check(copies[current_fragment])) {
+				if (errors < 10)
+					printf("rewind of %d fragments to %d failed\n", back, current_fragment);
+				errors += 1;
+			}
+		}
+	}
+	printf("rewinds: %d, errors: %d\n", rewinds, errors);
+	return errors == 0 ? 0 : 2;
+} // }}}
+// }}}
+
+int sim_main(int argc, char **argv) { // {{{
+	std::string typepath(argv[0]);
+	size_t slash = typepath.rfind('/');
+	typepath = (slash == std::string::npos ? std::string() : typepath.substr(0, slash + 1)) + "../type/";
+	int num_axes = 3;
+	int num_extruders = 1;
+	double steps_per_unit = 100;
+	double speed = NAN;
+	double limit_v = INFINITY;
+	double feed = 1;
+	char const *record = "";
+	int history_motors = 0;
+	Sim_Geometry const *geometry = &sim_geometry[0];
+	double tolerance = NAN;
+	bool check_fit = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:a:e:s:v:l:r:f:b:o:y:x:kH:")) != -1) {
+		switch (opt) {
+		case 't':
+			typepath = std::string(optarg) + "/";
+			break;
+		case 'a':
+			num_axes = atoi(optarg);
+			break;
+		case 'e':
+			num_extruders = atoi(optarg);
+			break;
+		case 's':
+			steps_per_unit = atof(optarg);
+			break;
+		case 'v':
+			speed = atof(optarg);
+			break;
+		case 'l':
+			limit_v = atof(optarg);
+			break;
+		case 'r':
+			feed = atof(optarg);
+			break;
+		case 'f':
+			sim_config_fragments = atoi(optarg);
+			break;
+		case 'b':
+			sim_config_bytes = atoi(optarg);
+			break;
+		case 'o':
+			record = optarg;
+			break;
+		case 'y':
+			geometry = NULL;
+			for (size_t g = 0; g < sizeof(sim_geometry) / sizeof(*sim_geometry); ++g) {
+				if (strcmp(optarg, sim_geometry[g].name) == 0)
+					geometry = &sim_geometry[g];
+			}
+			if (!geometry) {
+				fprintf(stderr, "unknown geometry %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'x':
+			tolerance = atof(optarg);
+			break;
+		case 'k':
+			check_fit = true;
+			break;
+		case 'H':
+			history_motors = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t typedir] [-a axes] [-e extruders] [-s steps_per_unit] [-v max_v] [-l motor_limit_v] [-r feedrate] [-f fragments] [-b bytes] [-o stepfile] [-y type] [-x tolerance] [-k] job.bin | -H motors\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - (history_motors > 0 ? 0 : 1) || history_motors < 0 || history_motors > 64 || num_axes < geometry->min_axes || num_axes > geometry->max_axes || !(feed > 0) || num_extruders < 0 || num_axes + num_extruders > 32 || sim_config_fragments < 8 || sim_config_fragments > 255 || sim_config_bytes < 1 || sim_config_bytes > 255) {
+		fprintf(stderr, "usage: %s [-t typedir] [-a axes] [-e extruders] [-s steps_per_unit] [-v max_v] [-l motor_limit_v] [-r feedrate] [-f fragments] [-b bytes] [-o stepfile] [-y type] [-x tolerance] [-k] job.bin | -H motors\n", argv[0]);
+		return 1;
+	}
+	// Set up the connection to the server as main() does, but with pipes that are never used by a server.
+	shmem = reinterpret_cast <SharedMemory *>(calloc(1, sizeof(SharedMemory)));
+	strncpy(const_cast <char *>(shmem->strs[0]), typepath.c_str(), PATH_MAX - 1);
+	int server[2], irq[2], reply[2];
+	if (pipe(server) || pipe(irq) || pipe(reply)) {
+		debug("failed to create pipes: %s", strerror(errno));
+		return 1;
+	}
+	toserver = open("/dev/null", O_WRONLY);
+	fromserver = server[0];
+	interrupt = irq[1];
+	interrupt_reply = reply[0];
+	sim_interrupt_fd = irq[0];
+	sim_answer_fd = reply[1];
+	fcntl(sim_interrupt_fd, F_SETFL, O_NONBLOCK);
+	char replies[1024];
+	memset(replies, OK, sizeof(replies));
+	if (write(sim_answer_fd, replies, sizeof(replies)) != sizeof(replies)) {
+		debug("failed to prepare interrupt replies");
+		return 1;
+	}
+	pollfds[1].fd = fromserver;
+	pollfds[1].events = POLLIN | POLLPRI;
+	pollfds[1].revents = 0;
+	pollfds[2].fd = interrupt_reply;
+	pollfds[2].events = POLLIN | POLLPRI;
+	pollfds[2].revents = 0;
+	// There is no command ring or event ring.
+	pollfds[3].fd = -1;
+	events_ready = -1;
+	// Without a server, the buffer is refilled on this thread.
+	pollfds[4].fd = -1;
+	setup();
+	arch_connect("", record);
+	if (!connected)
+		return 1;
+	sim_answer();
+	if (history_motors > 0) {
+		// A cartesian space and an extruder space; the follower space cannot be used without a leader.
+		sim_load(0, 0, history_motors, 0, steps_per_unit);
+		sim_load(1, 1, history_motors, 3, steps_per_unit);
+		sim_answer();
+		int ret = sim_history_test(history_motors);
+		arch_disconnect();
+		return ret;
+	}
+	sim_load(0, geometry->type, num_axes, 0, steps_per_unit, geometry);
+	sim_load(1, 1, num_extruders, 3, steps_per_unit);
+	if (geometry->type != 0) {
+		// Motor position 0 is not a valid position for every geometry. Start near the origin instead, but not on it,
+		// because that is the centre of the delta, where its motors2xyz() cannot compute the position.
+		for (int a = 0; a < num_axes; ++a)
+			spaces[0].axis[a]->target = a < 2 ? 1 : 0;
+		spaces[0].xyz2motors();
+		for (int m = 0; m < spaces[0].num_motors; ++m)
+			setpos(0, m, spaces[0].motor[m]->target_pos, m == spaces[0].num_motors - 1);
+	}
+	if (!std::isnan(speed))
+		max_v = speed;
+	for (int m = 0; m < spaces[0].num_motors; ++m)
+		spaces[0].motor[m]->limit_v = limit_v;
+	feedrate = feed;
+	if (!std::isnan(tolerance))
+		motor_fit_tolerance = tolerance;
+	motor_fit_check = check_fit;
+	sim_answer();
+	double start = sim_seconds();
+	double cpu_start = sim_cpu_seconds();
+	if (!run_file(argv[optind], "", true, 0, 1)) {
+		debug("failed to run %s", argv[optind]);
+		return 1;
+	}
+	while (true) {
+		sim_answer();
+		if (num_file_done_events > 0 || !run_file_map)
+			break;
+		if (sim_running) {
+			sim_run_fragment();
+			continue;
+		}
+		sim_refill();
+		if (sim_running)
+			continue;
+		cb_pending = false;
+		if (stopping == 1)
+			stopping = 0;
+		if (computing_move || settings.adjust > 0) {
+			debug("move did not start");
+			break;
+		}
+		int64_t current = settings.run_file_current;
+		if (run_file_wait > 0) {
+			// Skip the wait.
+			run_file_wait -= 1;
+			parkwaiting = false;
+		}
+		run_file_next_command(settings.hwtime);
+		if (run_file_map && !computing_move && settings.run_file_current == current && num_file_done_events == 0 && run_file_wait == 0) {
+			debug("job stopped at record %" LONGFMT, current);
+			break;
+		}
+	}
+	double cpu = sim_cpu_seconds() - cpu_start;
+	double wall = sim_seconds() - start;
+	arch_disconnect();
+	printf("job: %s\n", argv[optind]);
+	printf("wall time: %.3f s, cpu time: %.3f s\n", wall, cpu);
+	printf("machine time: %.3f s (%.1f times real time)\n", sim_machine_time, sim_machine_time / wall);
+	printf("fragments: %" LONGFMT " (%.0f/s), cpu time per fragment: %.2f μs\n", sim_fragments, sim_fragments / wall, sim_fragments > 0 ? cpu / sim_fragments * 1e6 : 0.);
+	printf("samples: %" LONGFMT " (%.0f/s)\n", sim_samples, sim_samples / wall);
+	printf("buffer_refill: %" LONGFMT " calls, worst %d μs, mean %.2f μs\n", sim_refills, sim_refill_max_us, sim_refills > 0 ? sim_refill_total_us / sim_refills : 0.);
+	printf("underruns: %" LONGFMT ", stretched moves: %" LONGFMT ", position errors: %" LONGFMT "\n", int64_t(shmem->underruns), int64_t(shmem->stretched_moves), sim_desyncs);
+	printf("geometry: %s, fitted motor samples (all spaces): %" LONGFMT, geometry->name, int64_t(shmem->fit_samples));
+	if (check_fit)
+		printf(", largest error: %g steps (tolerance %g)", shmem->fit_max_error, motor_fit_tolerance);
+	printf("\n");
+	if (sim_job_failed)
+		return 3;
+	return sim_desyncs == 0 ? 0 : 2;
+} // }}}
+// }}}
@@ -0,0 +1,142 @@
+/* arch-host.h - simulated machine for Franklin {{{
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016-2022 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+// This arch has no hardware: the firmware is simulated in the cdriver process.
+// Fragments are accepted as fast as they are computed, and the steps in them can be recorded to a file.
+// It is used for benchmarking the host and for comparing its output before and after changes.
+// Build it with "make TARGET_ARCH=sim"; see sim_main() for running it without a server.
+
+#ifndef SIM_ARCH_H
+#define SIM_ARCH_H
+
+// Includes and defines. {{{
+#include <stdint.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <cmath>
+#include <sys/mman.h>
+
+#define SIM_BUFFER_DATA_TYPE int8_t
+struct sim_Data {
+	SIM_BUFFER_DATA_TYPE *buffer;
+};
+// The connection to the simulated firmware cannot fail, but it uses the same connect and disconnect handling as a serial port.
+#define SERIAL
+#define ADCBITS 10
+#define ARCH_MOTOR sim_Data sim_data;
+#define ARCH_PATTERN sim_Data sim_data;
+#define ARCH_SPACE
+#define ARCH_NEW_MOTOR(s, m, base) base[m]->sim_data.buffer = new SIM_BUFFER_DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(SIM_BUFFER_DATA_TYPE)]();
+#define DATA_DELETE(s, m) delete[] (spaces[s].motor[m]->sim_data.buffer)
+// Only active motors have data in their buffer; this must be called before they are deactivated.
+#define DATA_CLEAR() do { \
+		for (int s = 0; s < NUM_SPACES; ++s) \
+			for (int m = 0; m < spaces[s].num_motors; ++m) \
+				if (spaces[s].motor[m]->active) \
+					memset((spaces[s].motor[m]->sim_data.buffer), 0, BYTES_PER_FRAGMENT); \
+		if (pattern.active) \
+			memset(pattern.sim_data.buffer, 0, BYTES_PER_FRAGMENT); \
+	} while (0)
+#define DATA_SET(s, m, v) spaces[s].motor[m]->sim_data.buffer[current_fragment_pos] = v;
+#define PATTERN_SET(v) pattern.sim_data.buffer[current_fragment_pos] = v;
+#define SAMPLES_PER_FRAGMENT (BYTES_PER_FRAGMENT / sizeof(SIM_BUFFER_DATA_TYPE))
+#define ARCH_MAX_FDS 1	// Maximum number of fds for arch-specific purposes; it is never used, but serial_wait() polls it.
+// base.cpp calls this instead of the normal main function if it is not started by the server.
+#define ARCH_MAIN sim_main
+
+#endif
+
+// Not defines, because they can change value.
+EXTERN uint8_t NUM_PINS, NUM_DIGITAL_PINS, NUM_ANALOG_INPUTS, NUM_MOTORS, FRAGMENTS_PER_BUFFER, BYTES_PER_FRAGMENT;
+EXTERN uint16_t TIME_PER_ISR;
+// }}}
+
+// Function declarations. {{{
+int hwpacketsize(int len, int *available);
+bool hwpacket(int len);
+void arch_had_ack();
+void SET_INPUT(Pin_t _pin);
+void SET_INPUT_NOPULLUP(Pin_t _pin);
+void RESET(Pin_t _pin);
+void SET(Pin_t _pin);
+void SET_OUTPUT(Pin_t _pin);
+void GET(Pin_t _pin, bool _default, void(*cb)(bool));
+void arch_pin_set_reset(Pin_t _pin, char state);
+void arch_set_duty(Pin_t _pin, double duty);
+void arch_set_pin_motor(Pin_t _pin, int s, int m, int ticks);
+void arch_change(bool motors);
+void arch_motors_change();
+void arch_globals_change();
+void arch_setup_start();
+void arch_setup_end();
+void arch_set_uuid();
+void arch_connect(char const *run_id, char const *port);
+void arch_request_temp(int which);
+void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin = ~0, bool heater_invert = false, int heater_adctemp = 0, int heater_limit_l = ~0, int heater_limit_h = ~0, int fan_pin = ~0, bool fan_invert = false, int fan_adctemp = 0, int fan_limit_l = ~0, int fan_limit_h = ~0, double hold_time = 0);
+void arch_disconnect();
+int arch_fds();
+int arch_tick();
+void arch_reconnect(const char *port);
+void arch_addpos(int s, int m, double diff);
+void arch_change_steps_per_unit(int s, int m, double factor);
+void arch_invertpos(int s, int m);
+void arch_stop(bool fake);
+bool arch_send_fragment();
+int arch_sample_period(int max_step);
+void arch_start_move(int extra);
+bool arch_running();
+void arch_home();
+void arch_discard();
+void arch_send_spi(int len, const uint8_t *data);
+void START_DEBUG();
+void DO_DEBUG(char c);
+void END_DEBUG();
+void sim_run_fragment();
+void sim_refill();
+int sim_main(int argc, char **argv);
+// }}}
+
+struct Sim_Fragment { // {{{
+	int num_samples;	// 0 if the fragment has not been sent.
+	int32_t hwtime_step;
+	bool pattern;	// The pattern channel has data in this fragment.
+}; // }}}
+
+// Declarations of static variables; extern because this is a header file. {{{
+EXTERN bool sim_running;
+EXTERN char *sim_pins;		// Pin states, with the same values as Gpio::state.
+EXTERN double *sim_pos_offset;	// pos + offset = hwpos
+EXTERN int32_t *sim_pos;	// Position of each motor in steps, as counted by the simulated firmware.
+EXTERN int sim_active_motors;
+EXTERN Sim_Fragment *sim_fragment;
+EXTERN int8_t *sim_buffer;	// Fragment data, [fragment][motor][sample]; the pattern channel is motor NUM_MOTORS.
+EXTERN FILE *sim_record;	// Step stream output, or NULL.
+// Statistics for the benchmark.
+EXTERN int64_t sim_fragments, sim_samples, sim_refills, sim_desyncs;
+EXTERN double sim_machine_time;	// Time the executed samples take on a real machine [s].
+EXTERN int32_t sim_refill_max_us;
+EXTERN double sim_refill_total_us;
+// }}}
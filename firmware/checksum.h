@@ -0,0 +1,64 @@
+/* checksum.h - Checksum bytes of serial packets for Franklin {{{
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016-2018 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+// This needs PROGMEM and pgm_read_byte() from arch-firmware-defs.h.
+// The host computes the same bytes from server/cdriver/checksum.h; test/checksum-test.cpp checks that they agree.
+
+#ifndef _FIRMWARE_CHECKSUM_H
+#define _FIRMWARE_CHECKSUM_H
+
+// Parity masks for decoding.
+static constexpr uint8_t MASK[5][4] = {
+	{0xc0, 0xc3, 0xff, 0x09},
+	{0x38, 0x3a, 0x7e, 0x13},
+	{0x26, 0xb5, 0xb9, 0x23},
+	{0x95, 0x6c, 0xd5, 0x43},
+	{0x4b, 0xdc, 0xe2, 0x83}
+};
+
+// The check bits are the xor of the check bits of each nybble separately, so they are looked up per nybble.
+// Byte tables would take 768 bytes, these take 104.  They are kept in flash, so they don't use RAM.
+// The tables are computed from the masks at compile time.
+static constexpr uint8_t parity(uint8_t value) {
+	return value == 0 ? 0 : (value & 1) ^ parity(value >> 1);
+}
+
+static constexpr uint8_t check_bits(uint8_t value, int p, int bit = 0) {
+	return bit == 5 ? 0 : (parity(value & MASK[bit][p]) << (bit + 3)) | check_bits(value, p, bit + 1);
+}
+
+#define CHECK4(p, n, shift) check_bits((n) << shift, p), check_bits((n + 1) << shift, p), check_bits((n + 2) << shift, p), check_bits((n + 3) << shift, p)
+#define CHECK16(p, shift) CHECK4(p, 0, shift), CHECK4(p, 4, shift), CHECK4(p, 8, shift), CHECK4(p, 12, shift)
+static constexpr uint8_t CHECK_LOW[3][16] PROGMEM = { {CHECK16(0, 0)}, {CHECK16(1, 0)}, {CHECK16(2, 0)} };
+static constexpr uint8_t CHECK_HIGH[3][16] PROGMEM = { {CHECK16(0, 4)}, {CHECK16(1, 4)}, {CHECK16(2, 4)} };
+// Check bits for the index in the low 3 bits of the checksum byte.
+static constexpr uint8_t CHECK_INDEX[8] PROGMEM = { CHECK4(3, 0, 0), CHECK4(3, 4, 0) };
+#undef CHECK16
+#undef CHECK4
+
+static inline uint8_t check_byte(uint8_t value, uint8_t p) {
+	return pgm_read_byte(&CHECK_LOW[p][value & 0xf]) ^ pgm_read_byte(&CHECK_HIGH[p][value >> 4]);
+}
+
+static inline uint8_t check_index(uint8_t t) {
+	return pgm_read_byte(&CHECK_INDEX[t & 7]);
+}
+
+#endif
@@ -35,7 +35,7 @@
 
 #define ID_SIZE 8	// Number of bytes in machineid; 8.
 #define UUID_SIZE 16	// Number of bytes in uuid; 16.
-#define PROTOCOL_VERSION 7
+#define PROTOCOL_VERSION 10
 
 #define ADC_INTERVAL 1000	// Delay 1 ms between ADC measurements.
 
@@ -67,6 +67,18 @@
 
 #define SERIAL_BUFFER_SIZE (1 << SERIAL_SIZE_BITS)
 #define SERIAL_MASK (SERIAL_BUFFER_SIZE - 1)
+// Longest packet from the host (CMD_MOVE or CMD_SPI), with sequence number and checksums.
+#define MAX_HOST_DATA_LEN ((3 + BYTES_PER_FRAGMENT > 34 ? 3 + BYTES_PER_FRAGMENT : 34) + 1)
+#define MAX_HOST_PACKET_LEN (MAX_HOST_DATA_LEN + (MAX_HOST_DATA_LEN + 2) / 3)
+// Number of packets the host may send without waiting for acks.  They must fit in the serial buffer, next to some single byte commands.
+#define MAX_SERIAL_WINDOW ((SERIAL_BUFFER_SIZE - 16) / MAX_HOST_PACKET_LEN > 32 ? 32 : (SERIAL_BUFFER_SIZE - 16) / MAX_HOST_PACKET_LEN)
+// The arch can lower it.
+#ifndef SERIAL_WINDOW
+#define SERIAL_WINDOW MAX_SERIAL_WINDOW
+#endif
+#define SEQ_MASK 0x7f
+// Silence on the line after a bad packet, before a resend is requested.
+#define RESYNC_MILLIS 3
 #define FRAGMENTS_PER_MOTOR_MASK ((1 << FRAGMENTS_PER_MOTOR_BITS) - 1)
 // }}}
 
@@ -90,6 +102,7 @@ template <typename _A> _A abs(_A a) { return a > 0 ? a : -a; }
 // Volatile variables which are used by interrupt handlers. {{{
 EXTERN volatile uint16_t debug_value, debug_value1, debug_value2, debug_value3;
 EXTERN volatile uint8_t move_phase, full_phase, full_phase_bits;
+EXTERN uint8_t base_phase_bits;
 EXTERN volatile bool serial_overflow;
 EXTERN volatile uint8_t *serial_buffer_head;
 EXTERN volatile uint8_t *serial_buffer_tail;
@@ -115,6 +128,8 @@ EXTERN uint8_t reply_ready, adcreply_ready;
 EXTERN bool timeout;
 EXTERN uint8_t ff_in;
 EXTERN uint8_t ff_out;
+EXTERN uint8_t window;			// Window that was negotiated in CMD_BEGIN; 0 if the host uses the flip-flop protocol.
+EXTERN uint8_t seq_in;			// Sequence number of the next packet from the host, if there is a window.
 EXTERN uint8_t pending_packet[4][REPLY_BUFFER_SIZE];
 EXTERN int16_t pending_len[4];
 EXTERN uint8_t filling;
@@ -172,7 +187,7 @@ inline bool GET(uint8_t pin_no);
 
 enum Command { // {{{
 	// from host
-	CMD_BEGIN = 0x00,	// 0
+	CMD_BEGIN = 0x00,	// 1:packetlen, 8:run_id, [1:window]
 	CMD_PING,	// 1:code
 	CMD_SET_UUID,	// 16: UUID
 	CMD_SETUP,	// 1:active_motors, 4:us/sample, 1:led_pin, 1:stop_pin 1:probe_pin 1:pin_flags 2:timeout
@@ -181,10 +196,10 @@ enum Command { // {{{
 	CMD_ASETUP,	// 1:adc, 2:linked_pins, 4:limits, 4:values	(including flags)
 	CMD_HOME,	// 4:us/step, {1:dir}*
 
-	CMD_START_MOVE,	// 1:num_samples, 1:num_moving_motors
-	CMD_START_PROBE,// 1:num_samples, 1:num_moving_motors
-	CMD_MOVE,	// 1:which, *:samples
-	CMD_MOVE_SINGLE,// 1:which, *:samples
+	CMD_START_MOVE,	// 1:num_samples, 1:num_moving_motors, 1:phase_bits
+	CMD_START_PROBE,// 1:num_samples, 1:num_moving_motors, 1:phase_bits
+	CMD_MOVE,	// 1:which, 1:encoded length, *:run length encoded samples
+	CMD_MOVE_SINGLE,// 1:which, 1:encoded length, *:run length encoded samples
 	CMD_PATTERN,	// 1:which, *:samples
 	CMD_START,	// 0 start moving.
 	CMD_STOP,	// 0 stop moving.
@@ -198,7 +213,7 @@ enum Command { // {{{
 enum RCommand { // {{{
 	// to host
 		// responses to host requests; only one active at a time.
-	CMD_READY = 0x10,	// 1:packetlen, 4:version, 1:num_dpins, 1:num_adc, 1:num_motors, 1:fragments/motor, 1:bytes/fragment, 2:time/isr
+	CMD_READY = 0x10,	// 1:packetlen, 4:version, 1:num_dpins, 1:num_adc, 1:num_motors, 1:fragments/motor, 1:bytes/fragment, 2:time/isr, 1:window
 	CMD_PONG,	// 1:code
 	CMD_HOMED,	// {4:motor_pos}*
 	CMD_PIN,	// 1:state
@@ -216,7 +231,7 @@ enum RCommand { // {{{
 
 static inline uint8_t command(int16_t pos) { // {{{
 	//debug("cmd %x = %x (%x + %x & %x)", (serial_buffer_tail + pos) & SERIAL_MASK, serial_buffer[(serial_buffer_tail + pos) & SERIAL_MASK], serial_buffer_tail, pos, SERIAL_MASK);
-	return *(volatile uint8_t *)(((uint16_t(serial_buffer_tail) + pos) & SERIAL_MASK) | uint16_t(serial_buffer));
+	return *(volatile uint8_t *)(((uintptr_t(serial_buffer_tail) + pos) & SERIAL_MASK) | uintptr_t(serial_buffer));
 } // }}}
 
 static inline int16_t minpacketlen() { // {{{
@@ -238,9 +253,9 @@ static inline int16_t minpacketlen() { // {{{
 	case CMD_HOME:
 		return 5;
 	case CMD_START_MOVE:
-		return 3;
+		return 4;
 	case CMD_START_PROBE:
-		return 3;
+		return 4;
 	case CMD_MOVE:
 		return 3;
 	case CMD_MOVE_SINGLE:
@@ -268,6 +283,8 @@ static inline int16_t minpacketlen() { // {{{
 struct Settings { // {{{
 	uint8_t flags;
 	uint8_t len;
+	uint8_t phase_bits;	// Number of ISR calls per sample for this fragment is 1 << phase_bits.
+	uint8_t phase;
 	enum {
 		PROBING = 1
 	};
@@ -469,21 +486,34 @@ static inline void write_current_pos(uint8_t offset) { // {{{
 	sei();
 } // }}}
 
+static inline uint16_t decode_sample(uint8_t sample) { // {{{
+	// Return the number of steps that an encoded sample means; the sign bit is ignored.
+	// If the 7 bit value starts with n ones and a zero, it means 64 * n plus the remaining bits times 2 ** n; see move.cpp in the host.
+	uint8_t value = sample << 1;
+	uint16_t high = 0;
+	while (true) {
+		bool carry = value & 0x80;
+		value <<= 1;
+		if (!carry)
+			break;
+		high += 1;
+	}
+	return ((high << 8) | value) >> 2;
+} // }}}
+
 static inline void SLOW_ISR() { // {{{
 #ifndef FAST_ISR
+	// This does the same as the assembly ISR in the avr arch.
 	if (step_state < NUM_NON_MOVING_STATES)
 		return;
 	arch_disable_isr();
 	sei();
 	move_phase += 1;
 	for (uint8_t m = 0; m < active_motors; ++m) {
-		if (~motor[m].intflags & Motor::ACTIVE)
-			continue;
-		int16_t sample = *reinterpret_cast <volatile int16_t *> (&(*current_buffer)[m][current_sample]);
-		if (sample == 0)
+		if ((~motor[m].intflags & Motor::ACTIVE) || (motor[m].intflags & Motor::PATTERN))
 			continue;
-		int8_t target = ((abs(sample) * move_phase) >> full_phase_bits) - motor[m].steps_current;
-		//debug("sample %d %d %d %d %d %d %d", m, sample, abs(sample), move_phase, full_phase, target, motor[m].steps_current);
+		int8_t sample = (*current_buffer)[m][current_sample];
+		uint16_t target = ((uint32_t(decode_sample(sample)) * move_phase) >> full_phase_bits) - motor[m].steps_current;
 		if (target == 0)
 			continue;
 		// Set dir.
@@ -495,7 +525,7 @@ static inline void SLOW_ISR() { // {{{
 			SET(motor[m].dir_pin);
 			//debug("set dir %d", m);
 		}
-		for (uint8_t i = 0; i < target; ++i) {
+		for (uint16_t i = 0; i < target; ++i) {
 			if (motor[m].intflags & Motor::INVERT_STEP) {
 				RESET(motor[m].step_pin);
 				SET(motor[m].step_pin);
@@ -505,9 +535,9 @@ static inline void SLOW_ISR() { // {{{
 				RESET(motor[m].step_pin);
 			}
 			//debug("pulse %d", m);
-			motor[m].steps_current += 1;
-			motor[m].current_pos += sample > 0 ? 1 : -1;
 		}
+		motor[m].steps_current += target;
+		motor[m].current_pos += sample < 0 ? -int32_t(target) : int32_t(target);
 	}
 	//debug("iteration frag %d sample %d = %d current %d pos %d", current_fragment, current_sample, (*current_buffer)[0][current_sample], motor[0].steps_current, motor[0].current_pos);
 	if (move_phase >= full_phase) {
@@ -515,27 +545,29 @@ static inline void SLOW_ISR() { // {{{
 		step_state -= STATE_DECAY;
 		for (uint8_t m = 0; m < active_motors; ++m)
 			motor[m].steps_current = 0;
-		current_sample += 2;
+		current_sample += 1;
 		if (current_sample >= current_len) {
 			current_sample = 0;
-			current_fragment = (current_fragment + 1) & ((1 << FRAGMENTS_PER_MOTOR_BITS) - 1);
+			current_fragment = (current_fragment + 1) & FRAGMENTS_PER_MOTOR_MASK;
 			BUFFER_CHECK(buffer, current_fragment);
 			current_buffer = &buffer[current_fragment];
 			if (current_fragment != last_fragment) {
 				for (uint8_t m = 0; m < active_motors; ++m) {
 					//debug("active %d %d", m, (*current_buffer)[m][0]);
 					BUFFER_CHECK(motor, m);
-					if ((*current_buffer)[m][0] != 0 || (*current_buffer)[m][1] != uint8_t(0x80))
+					if ((*current_buffer)[m][0] != -0x80)
 						motor[m].intflags |= Motor::ACTIVE;
 					else
 						motor[m].intflags &= ~Motor::ACTIVE;
 				}
 				BUFFER_CHECK(settings, current_fragment);
 				current_len = settings[current_fragment].len;
+				full_phase_bits = settings[current_fragment].phase_bits;
+				full_phase = settings[current_fragment].phase;
 			}
 			else {
 				// Underrun.
-				arch_set_speed(0);
+				step_state = STEP_STATE_STOP;
 				//debug("underrun");
 			}
 		}
@@ -60,8 +60,10 @@ void packet()
 		home_step_time = 0;
 		for (uint8_t m = 0; m < NUM_MOTORS; ++m)
 			motor[m].current_pos = 0;
+		// Older hosts don't request a window.
+		uint8_t requested = command(1) > 10 ? command(10) : 0;
 		reply[0] = CMD_READY;
-		reply[1] = 13;
+		reply[1] = 14;
 		*reinterpret_cast <uint32_t *>(&reply[2]) = PROTOCOL_VERSION;
 		reply[6] = NUM_DIGITAL_PINS;
 		reply[7] = NUM_ANALOG_INPUTS;
@@ -70,8 +72,14 @@ void packet()
 		reply[10] = BYTES_PER_FRAGMENT;
 		reply[11] = TIME_PER_ISR & 0xff;
 		reply[12] = TIME_PER_ISR >> 8;
+		// The host uses the flip-flop protocol for windows of 3 or less, so don't grant those.
+		reply[13] = min(requested, SERIAL_WINDOW) > 3 ? min(requested, SERIAL_WINDOW) : 0;
 		reply_ready = reply[1];	// Update the length there if it needs to change.
+		// This packet is acked with the flip-flop; the window is used from the next one.
+		window = 0;
 		write_ack();
+		window = reply[13];
+		seq_in = 0;
 		return;
 	}
 	case CMD_PING:
@@ -141,10 +149,8 @@ void packet()
 		while (fpb < 8 && time_per_sample / TIME_PER_ISR >= uint16_t(1) << fpb)
 			fpb += 1;
 		fpb -= 1;
-		cli();
-		full_phase_bits = fpb;
-		full_phase = 1 << full_phase_bits;
-		sei();
+		// The timer is only reprogrammed at START; fragments that are already queued keep their own sample length.
+		base_phase_bits = fpb;
 		//debug("time per sample: %d μs, full phase bits: %d", time_per_sample, fpb);
 		p = spiss_pin;
 		spiss_pin = command(12);
@@ -355,6 +361,8 @@ void packet()
 			// current_sample is always 0 while homing; set len to 2, so it doesn't go to the next fragment.
 			settings[current_fragment].len = 4;
 			current_len = settings[current_fragment].len;
+			full_phase_bits = base_phase_bits;
+			full_phase = 1 << full_phase_bits;
 			//debug("home no probe %d", current_fragment);
 			settings[current_fragment].flags &= ~Settings::PROBING;
 			BUFFER_CHECK(buffer, current_fragment);
@@ -399,6 +407,12 @@ void packet()
 		}
 		settings[last_fragment].len = command(1);
 		filling = command(2);
+		// The host can make samples shorter or longer than the set up time_per_sample by changing the number of ISR calls per sample.  0xff means to use the default.
+		if (command(3) <= 7)
+			settings[last_fragment].phase_bits = command(3);
+		else
+			settings[last_fragment].phase_bits = base_phase_bits;
+		settings[last_fragment].phase = 1 << settings[last_fragment].phase_bits;
 		for (uint8_t m = 0; m < active_motors; ++m) {
 			buffer[last_fragment][m][0] = -0x80;	// Sentinel indicating no data is available for this motor.
 		}
@@ -442,8 +456,31 @@ void packet()
 			write_stall();
 			return;
 		}
-		for (uint8_t b = 0; b < last_len; ++b)
-			buffer[last_fragment][m][b] = static_cast <int8_t>(command(2 + b));
+		// Decode the samples.  This is done here and not in the ISR, so the ISR still reads plain samples.
+		// A header byte h is followed by (h & 0x7f) + 1 literal bytes, or, if bit 7 is set, by one byte that is repeated that many times.
+		uint8_t b = 0;
+		uint8_t p = 0;
+		while (p < command(2)) {
+			uint8_t h = command(3 + p++);
+			uint8_t n = (h & 0x7f) + 1;
+			if (n > last_len - b || p + ((h & 0x80) ? 1 : n) > command(2))
+				break;
+			if (h & 0x80) {
+				int8_t value = static_cast <int8_t>(command(3 + p++));
+				while (n-- > 0)
+					buffer[last_fragment][m][b++] = value;
+			}
+			else {
+				while (n-- > 0)
+					buffer[last_fragment][m][b++] = static_cast <int8_t>(command(3 + p++));
+			}
+		}
+		if (b != last_len || p != command(2)) {
+			debug("invalid fragment encoding for motor %d", m);
+			buffer[last_fragment][m][0] = -0x80;
+			write_stall();
+			return;
+		}
 		if (bool(motor[m].flags & Motor::PATTERN) ^ (command(0) == CMD_PATTERN)) {
 			debug("pattern state of motor %d and command don't match", m);
 			write_stall();
@@ -452,11 +489,11 @@ void packet()
 		if (command(0) != CMD_MOVE_SINGLE) {
 			for (uint8_t f = 0; f < active_motors; ++f) {
 				if ((motor[f].follow & 0x7f) == m) {
-					for (uint8_t b = 0; b < last_len; b += 2) {
-						int8_t value = buffer[last_fragment][m][b];
+					for (uint8_t i = 0; i < last_len; i += 2) {
+						int8_t value = buffer[last_fragment][m][i];
 						if (motor[f].follow & 0x80)
 							value = -value;
-						buffer[last_fragment][f][b] = value;
+						buffer[last_fragment][f][i] = value;
 					}
 				}
 			}
@@ -500,6 +537,8 @@ void packet()
 		}
 		current_sample = 0;
 		current_len = settings[current_fragment].len;
+		full_phase_bits = settings[current_fragment].phase_bits;
+		full_phase = settings[current_fragment].phase;
 		//debug("step_state start 0");
 		step_state = STEP_STATE_PROBE;
 		arch_set_speed(time_per_sample);
@@ -525,8 +564,8 @@ void packet()
 				break;
 			}
 		}
-		// Fall through.
 	}
+		// Fall through.
 	case CMD_STOP:
 	{
 		cmddebug("CMD_STOP");
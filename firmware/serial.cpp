@@ -19,6 +19,7 @@
  */
 
 #include "firmware.h"
+#include "checksum.h"
 
 //#define sdebug(fmt, ...) debug("buf %x %x %x " fmt, serial_buffer_head, serial_buffer_tail, command_end, ##__VA_ARGS__)
 #define sdebug(...) do {} while (0)
@@ -41,52 +42,84 @@
 // static const uint8_t MASK1[3] = {0x4b, 0x2d, 0x1e}
 // Codes (low nybble is data): f0 91 a2 c3 c4 a5 96 f7 88 e9 da bb bc dd ee (8f)
 // These are defined in firmware.h.
+
+// If the host requests a window in CMD_BEGIN, it may send that many packets before waiting for an ack.
+// Every packet except CMD_BEGIN then ends with a 7 bit sequence number.
+// Acks, nacks and stalls from the firmware are followed by the sequence number they are about, with odd parity in bit 7.
+// The low 2 bits of that number are also in the code, like the flip-flop.
+// An ack means that all packets up to and including that one are handled; a nack requests a resend of all packets from that one.
+// Packets are handled from the serial buffer, so the ones after a lost packet are dropped.
+// Packets from the firmware still use the flip-flop.  CMD_ID returns to the flip-flop protocol.
 // }}}
 
 // Static variables. {{{
 static bool had_stall = true;
+static bool seq_nacked;	// A nack was sent for seq_in; don't send it again for every packet that follows.
+static bool resyncing;	// Input is dropped until the line is quiet.
 static uint16_t last_millis;
 
-// Parity masks for decoding.
-static const uint8_t MASK[5][4] = {
-	{0xc0, 0xc3, 0xff, 0x09},
-	{0x38, 0x3a, 0x7e, 0x13},
-	{0x26, 0xb5, 0xb9, 0x23},
-	{0x95, 0x6c, 0xd5, 0x43},
-	{0x4b, 0xdc, 0xe2, 0x83}
-};
-
 static const uint8_t cmd_ack[4] = { CMD_ACK0, CMD_ACK1, CMD_ACK2, CMD_ACK3 };
 static const uint8_t cmd_nack[4] = { CMD_NACK0, CMD_NACK1, CMD_NACK2, CMD_NACK3 };
 static const uint8_t cmd_stall[4] = { CMD_STALL0, CMD_STALL1, CMD_STALL2, CMD_STALL3 };
 // }}}
 
 static inline int16_t fullpacketlen() { // {{{
+	int16_t len;
 	if ((command(0) & 0x1f) == CMD_BEGIN) {
+		// This is always sent with the flip-flop protocol, so it has no sequence number.
 		return command(1);
 	}
 	else if ((command(0) & 0x1f) == CMD_HOME) {
-		return 5 + active_motors;
+		len = 5 + active_motors;
 	}
 	else if ((command(0) & 0x1f) == CMD_MOVE || (command(0) & 0x1f) == CMD_MOVE_SINGLE) {
-		return 2 + last_len;
+		len = 3 + command(2);
 	}
 	else if ((command(0) & 0x1f) == CMD_SPI) {
-		return 2 + ((command(1) + 7) >> 3);
+		len = 2 + ((command(1) + 7) >> 3);
 	}
 	else
-		return minpacketlen();
+		len = minpacketlen();
+	return window ? len + 1 : len;
+}
+// }}}
+
+static void write_seq(uint8_t code, uint8_t seq) { // {{{
+	// Send an ack, nack or stall with its sequence number.
+	uint8_t parity = seq;
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	arch_serial_write(code);
+	arch_serial_write(seq | ((~parity & 1) << 7));
+}
+// }}}
+
+static void write_nack() { // {{{
+	if (window)
+		write_seq(cmd_nack[seq_in & 3], seq_in);
+	else
+		arch_serial_write(cmd_nack[ff_in]);
+}
+// }}}
+
+static void resync() { // {{{
+	// After a bad packet, the following bytes cannot be framed: the lost or damaged byte may have been a length.
+	// Drop everything until the line is quiet, then request a resend; that starts at a packet boundary.
+	cli();
+	serial_buffer_tail = serial_buffer_head;
+	serial_overflow = false;
+	sei();
+	command_end = 0;
+	resyncing = true;
+	last_millis = millis();
 }
 // }}}
 
 static void clear_overflow() { // {{{
 	debug("serial flushed after overflow");
-	command_end = 0;
-	serial_buffer_head = serial_buffer;
-	serial_buffer_tail = serial_buffer;
-	serial_overflow = false;
 	debug_dump();
-	arch_serial_write(cmd_nack[ff_in]);
+	resync();
 }
 // }}}
 
@@ -102,13 +135,33 @@ static inline void inc_tail(int16_t amount) { // {{{
 	if (amount <= 0)
 		amount = 1;
 	cli();
-	serial_buffer_tail = (volatile uint8_t *)(((uint16_t(serial_buffer_tail) + amount) & SERIAL_MASK) | uint16_t(serial_buffer));
+	serial_buffer_tail = (volatile uint8_t *)(((uintptr_t(serial_buffer_tail) + amount) & SERIAL_MASK) | uintptr_t(serial_buffer));
 	if (serial_overflow && serial_buffer_head == serial_buffer_tail)
 		clear_overflow();
 	sei();
 }
 // }}}
 
+static void packet_acked() { // {{{
+	// The oldest packet in flight has been received by the host.
+	uint8_t which = (ff_out - out_busy) & 3;
+	out_busy -= 1;
+	if ((pending_packet[which][0] & 0x1f) == CMD_LIMIT) {
+		current_fragment = (current_fragment + 1) & FRAGMENTS_PER_MOTOR_MASK;
+		last_fragment = current_fragment;
+		notified_current_fragment = current_fragment;
+		filling = 0;
+		stopping = -1;
+		for (uint8_t m = 0; m < active_motors; ++m) {
+			if (motor[m].flags & Motor::LIMIT) {
+				stopping = m;
+				break;
+			}
+		}
+	}
+}
+// }}}
+
 // Check if there is serial data available.  This is not running from an interrupt, because it must 
 void serial() { // {{{
 	uint16_t milliseconds = millis();
@@ -126,6 +179,18 @@ void serial() { // {{{
 		}
 	}
 	had_data = false;
+	if (resyncing) {
+		arch_watchdog_reset();
+		if (serial_available()) {
+			resync();
+			return;
+		}
+		if (uint16_t(milliseconds - last_millis) < RESYNC_MILLIS)
+			return;
+		resyncing = false;
+		seq_nacked = window;
+		write_nack();
+	}
 	while (command_end == 0)
 	{
 		if (!serial_available()) {
@@ -142,50 +207,44 @@ void serial() { // {{{
 		{
 		case CMD_ACK3:
 			which += 1;
+			// Fall through.
 		case CMD_ACK2:
 			which += 1;
+			// Fall through.
 		case CMD_ACK1:
 			which += 1;
+			// Fall through.
 		case CMD_ACK0:
 		{
 			// Ack: everything was ok; flip the flipflop.
 			//debug("a%d out %d busy %d", which, ff_out, out_busy);
 			//debug("a%d", ff_out);
-			if (out_busy > 0 && ((ff_out - out_busy) & 3) == which) {	// Only if we expected it and it is the right type.
-				out_busy -= 1;
-				if ((pending_packet[which][0] & 0x1f) == CMD_LIMIT) {
-					current_fragment = (current_fragment + 1) & FRAGMENTS_PER_MOTOR_MASK;
-					last_fragment = current_fragment;
-					notified_current_fragment = current_fragment;
-					filling = 0;
-					stopping = -1;
-					for (uint8_t m = 0; m < active_motors; ++m) {
-						if (motor[m].flags & Motor::LIMIT) {
-							stopping = m;
-							break;
-						}
-					}
-				}
-			}
+			if (out_busy > 0 && ((ff_out - out_busy) & 3) == which)	// Only if we expected it and it is the right type.
+				packet_acked();
 			inc_tail(1);
 			continue;
 		}
 		case CMD_NACK3:
 			which += 1;
+			// Fall through.
 		case CMD_NACK2:
 			which += 1;
+			// Fall through.
 		case CMD_NACK1:
 			which += 1;
+			// Fall through.
 		case CMD_NACK0:
 		{
 			arch_claim_serial();
 			// Nack: the host didn't properly receive the packet: resend.
 			//debug("n%d out %d busy %d", which, ff_out, out_busy);
 			//debug_dump();
-			// Unless the last packet was already received; in that case ignore the NACK.
+			// The nack is for the packet the host expects, so the ones before it have been received, even if their acks were lost.
 			uint8_t amount = (ff_out - which) & 3;
 			if (amount <= out_busy) {
 				//debug("resend at request %x", pending_packet[ff_out][0] & 0xff);
+				while (out_busy > amount)
+					packet_acked();
 				ff_out = (ff_out - amount) & 3;
 				out_busy -= amount;
 				while (amount--) {
@@ -203,7 +262,9 @@ void serial() { // {{{
 			// connects to the machine.  This may be a reconnect,
 			// and can happen at any time.
 			// Response is to send the machine id, and temporarily disable all temperature readings.
+			// The host does not know about a window until it sends CMD_BEGIN.
 			arch_claim_serial();
+			window = 0;
 			send_id(CMD_ID);
 			inc_tail(1);
 			continue;
@@ -282,56 +343,77 @@ void serial() { // {{{
 			for (int i = 0; i < (fulllen + 2) / 3 * 4; ++i)
 				debug("cmd %d: %x", i, command(i));
 			debug_dump();
-			inc_tail(cmd_len);
+			resync();
 			return;
 		}
-		for (uint8_t bit = 0; bit < 5; ++bit)
+		uint8_t check = (t & 7) | check_index(t);
+		for (uint8_t p = 0; p < 3; ++p) {
+			int16_t pos = 3 * t + p;
+			if ((fulllen != 1 || (pos != 1 && pos != 2)) && ((fulllen != 2 && (fulllen != 4 || t != 1)) || pos != fulllen + t))
+				check ^= check_byte(command(3 * t + p), p);
+		}
+		if (check != sum)
 		{
-			uint8_t check = sum & MASK[bit][3];
-			for (uint8_t p = 0; p < 3; ++p) {
-				int16_t pos = 3 * t + p;
-				if ((fulllen != 1 || (pos != 1 && pos != 2)) && ((fulllen != 2 && (fulllen != 4 || t != 1)) || pos != fulllen + t))
-					check ^= command(3 * t + p) & MASK[bit][p];
-			}
-			check ^= check >> 4;
-			check ^= check >> 2;
-			check ^= check >> 1;
-			if (check & 1)
-			{
-				debug("incorrect checksum %d %d %x %x %x %x %d", t, bit, command(3 * t), command(3 * t + 1), command(3 * t + 2), command(fulllen + t), fulllen);
-				debug_dump();
-				inc_tail(cmd_len);
-				return;
-			}
+			debug("incorrect checksum %d %x %x %x %x %d", t, command(3 * t), command(3 * t + 1), command(3 * t + 2), command(fulllen + t), fulllen);
+			debug_dump();
+			resync();
+			return;
 		}
 	}
 	// Packet is good.
 	sdebug2("good");
 	if (had_stall) {
 		debug("repeating stall");
-		arch_serial_write(cmd_stall[ff_in]);
+		if (window && (command(0) & 0x1f) != CMD_BEGIN) {
+			uint8_t seq = command(fulllen - 1) & SEQ_MASK;
+			write_seq(cmd_stall[seq & 3], seq);
+		}
+		else
+			arch_serial_write(cmd_stall[ff_in]);
 		inc_tail(cmd_len);
 		return;
 	}
-	// Flip-flop must have good state.
-	uint8_t which = (command(0) >> 5) & 3;
-	if (which != ff_in)
-	{
-		// Wrong: this must be a retry to send the previous packet, so our ack was lost.
-		// Resend the ack, but don't do anything (the action has already been taken).
-		// Don't complain about pings, those are part of the handshake.
-		if ((*serial_buffer_tail & 0x1f) != CMD_PING)
-			debug("duplicate command %x len: %d", *serial_buffer_tail, cmd_len);
+	if (window && (command(0) & 0x1f) != CMD_BEGIN) {
+		// Sequence number must be the next one.
+		uint8_t ahead = (command(fulllen - 1) - seq_in) & SEQ_MASK;
+		if (ahead != 0) {
+			inc_tail(cmd_len);
+			if (ahead < (SEQ_MASK + 1) / 2) {
+				// A packet was lost; request it and everything after it.
+				if (!seq_nacked) {
+					seq_nacked = true;
+					write_nack();
+				}
+			}
+			else {
+				// This was handled before, so our ack was lost; resend it.
+				write_seq(cmd_ack[(seq_in - 1) & 3], (seq_in - 1) & SEQ_MASK);
+			}
+			return;
+		}
+		seq_nacked = false;
+	}
+	else {
+		// Flip-flop must have good state.
+		uint8_t which = (command(0) >> 5) & 3;
+		if (which != ff_in)
+		{
+			// Wrong: this must be a retry to send the previous packet, so our ack was lost.
+			// Resend the ack, but don't do anything (the action has already been taken).
+			// Don't complain about pings, those are part of the handshake.
+			if ((*serial_buffer_tail & 0x1f) != CMD_PING)
+				debug("duplicate command %x len: %d", *serial_buffer_tail, cmd_len);
 #ifdef DEBUG_FF
-		debug("old ff_in: %d", ff_in);
+			debug("old ff_in: %d", ff_in);
 #endif
-		inc_tail(cmd_len);
-		arch_serial_write(cmd_ack[which]);
-		return;
-	}
+			inc_tail(cmd_len);
+			arch_serial_write(cmd_ack[which]);
+			return;
+		}
 #ifdef DEBUG_FF
-	debug("new ff_in: %d", ff_in);
+		debug("new ff_in: %d", ff_in);
 #endif
+	}
 	// Clear flag for easier parsing.
 	*serial_buffer_tail &= 0x1f;
 	//debug(">%x", command(0));
@@ -376,23 +458,7 @@ static int16_t prepare_packet(int16_t len, uint8_t *packet = 0)
 	else if (len == 4)
 		packet[5] = 0;
 	for (int16_t t = 0; t < (len + 2) / 3; ++t)
-	{
-		uint8_t sum = t & 7;
-		for (uint8_t bit = 0; bit < 5; ++bit)
-		{
-			uint8_t check = 0;
-			for (uint8_t p = 0; p < 3; ++p) {
-				check ^= packet[3 * t + p] & MASK[bit][p];
-			}
-			check ^= sum & MASK[bit][3];
-			check ^= check >> 4;
-			check ^= check >> 2;
-			check ^= check >> 1;
-			if (check & 1)
-				sum ^= 1 << (bit + 3);
-		}
-		packet[len + t] = sum;
-	}
+		packet[len + t] = (t & 7) | (check_index(t) ^ check_byte(packet[3 * t], 0) ^ check_byte(packet[3 * t + 1], 1) ^ check_byte(packet[3 * t + 2], 2));
 	if (packetlen)
 		*packetlen = len + (len + 2) / 3;
 	return len + (len + 2) / 3;
@@ -574,6 +640,11 @@ void write_ack()
 	//debug("acking %d", out_busy);
 	//debug_dump();
 	had_stall = false;
+	if (window) {
+		write_seq(cmd_ack[seq_in & 3], seq_in);
+		seq_in = (seq_in + 1) & SEQ_MASK;
+		return;
+	}
 	arch_serial_write(cmd_ack[ff_in]);
 	ff_in = (ff_in + 1) & 3;
 }
@@ -582,6 +653,10 @@ void write_stall()
 {
 	//debug("stalling");
 	had_stall = true;
+	if (window) {
+		write_seq(cmd_stall[seq_in & 3], seq_in);
+		return;
+	}
 	arch_serial_write(cmd_stall[ff_in]);
 }
 // }}}
@@ -59,6 +59,7 @@ void setup()
 	out_busy = 0;
 	ff_in = 0;
 	ff_out = 0;
+	window = 0;
 	reply_ready = 0;
 	adcreply_ready = 0;
 	timeout = false;
@@ -74,6 +75,8 @@ void setup()
 	active_motors = 0;
 	move_phase = 0;
 	full_phase = 1;
+	full_phase_bits = 0;
+	base_phase_bits = 0;
 	// Set up led state.
 	led_fast = 0;
 	led_last = millis();
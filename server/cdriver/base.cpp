@@ -29,7 +29,9 @@
 // Only for connections that can fail.
 void disconnect(bool notify, char const *reason, ...) { // {{{
 	// Hardware has disconnected.  Notify host and wait for reconnect.
+	motion_hold();
 	arch_disconnect();
+	motion_unhold();
 	if (notify) {
 		if (reason == NULL)
 			shmem->interrupt_str[0] = '\0';
@@ -106,9 +108,20 @@ static void handle_request() { // {{{
 		//abort();
 	}
 	cdebug("command was %x", cmd);
+	// Requests in the command ring were submitted before this one.
+	ring_request();
 	request(cmd);
 } // }}}
 
+static void handle_ring() { // {{{
+	uint64_t count;
+	if (read(ring_submit, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN) {
+		debug("cannot read command ring signal from server: %s", strerror(errno));
+		exit(0);
+	}
+	ring_request();
+} // }}}
+
 static void handle_interrupt_reply() { // {{{
 	char cmd;
 	while (true) {
@@ -126,37 +139,43 @@ static void handle_interrupt_reply() { // {{{
 	if (!interrupt_pending)
 		debug("received interrupt reply without pending interrupt");
 	if (stopping == 2) {
+		motion_hold();
 		sending_fragment = 0;
 		stopping = 1;
+		motion_unhold();
 	}
 	cdebug("received interrupt reply");
 	interrupt_pending = false;
 } // }}}
 
 static void handle_pending_events() { // {{{
-	if (interrupt_pending)
-		return;
-	if (num_file_done_events > 0) {
-		prepare_interrupt();
-		send_to_parent(CMD_FILE_DONE);
-		num_file_done_events -=1;
-		return;
+	// Events don't wait for the server, so they can be sent while an interrupt is pending.
+	while (num_file_done_events > 0) {
+		num_file_done_events -= 1;
+		send_event(CMD_FILE_DONE);
 	}
 	cdebug("pending %d", cb_pending);
-	if (cb_pending && !arch_running()) {
+	if (cb_pending && !arch_running() && motion_idle()) {
 		cdebug("sending movecb");
-		prepare_interrupt();
 		cb_pending = false;
-		send_to_parent(CMD_MOVECB);
-		return;
+		send_event(CMD_MOVECB);
 	}
+	if (interrupt_pending)
+		return;
 	if (stopping == 1) {
+		motion_hold();
 		stopping = 0;
+		motion_unhold();
 	}
 	buffer_refill();
 } // }}}
 
 int main(int argc, char **argv) { // {{{
+#ifdef ARCH_MAIN
+	// The arch can be run without a server; it is used that way if the first argument is not the shared memory fd.
+	if (argc > 1 && (argv[1][0] < '0' || argv[1][0] > '9'))
+		return ARCH_MAIN(argc, argv);
+#endif
 	(void)&argc;
 	memfd = atoi(argv[1]);
 	shmem = reinterpret_cast <SharedMemory *>(mmap(NULL, sizeof(SharedMemory), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0));
@@ -165,13 +184,21 @@ int main(int argc, char **argv) { // {{{
 	fromserver = shmem->ints[1];
 	interrupt = shmem->ints[2];
 	interrupt_reply = shmem->ints[3];
+	ring_submit = shmem->ints[4];
+	ring_done = shmem->ints[5];
+	events_ready = shmem->ints[6];
 	pollfds[1].fd = fromserver;
 	pollfds[1].events = POLLIN | POLLPRI;
 	pollfds[1].revents = 0;
 	pollfds[2].fd = interrupt_reply;
 	pollfds[2].events = POLLIN | POLLPRI;
 	pollfds[2].revents = 0;
+	pollfds[3].fd = ring_submit;
+	pollfds[3].events = POLLIN | POLLPRI;
+	pollfds[3].revents = 0;
+	pollfds[4].fd = -1;
 	setup();
+	motion_start();
 	delayed_reply(); // Let server know we are ready.
 	struct itimerspec zero;
 	zero.it_interval.tv_sec = 0;
@@ -186,17 +213,13 @@ int main(int argc, char **argv) { // {{{
 			bool action = false;
 			if (arch_fds() && serialdev && serialdev->available())
 				action |= serial(true);
-			if (!interrupt_pending && pins_changed > 0) {
+			if (pins_changed > 0) {
 				for (int i = 0; i < num_gpios; ++i) {
 					if (gpios[i].changed) {
 						gpios[i].changed = false;
 						pins_changed -= 1;
-						prepare_interrupt();	// Does nothing, but good to always have it paired with send_to_parent.
-						shmem->interrupt_ints[0] = i;
-						shmem->interrupt_ints[1] = gpios[i].pin.inverted() ? !gpios[i].value : gpios[i].value;
-						send_to_parent(CMD_PINCHANGE);
+						send_event(CMD_PINCHANGE, i, gpios[i].pin.inverted() ? !gpios[i].value : gpios[i].value);
 						action = true;
-						break;
 					}
 				}
 				if (!action) {
@@ -207,17 +230,35 @@ int main(int argc, char **argv) { // {{{
 			if (!action)
 				break;
 		}
+		// Send fragments that the motion thread has computed.
+		arch_send_queued();
+		// Acks are not sent when they are written, so send them now.
+		if (arch_fds() && serialdev)
+			serialdev->flush();
 		//debug("polling with delay %d", delay);
 		poll(pollfds, arch_fds() + BASE_FDS, delay);
+		if (pollfds[4].revents)
+			motion_drain();
 		//debug("poll values in %d pri %d err %d hup %d nval %d out %d", POLLIN, POLLPRI, POLLERR, POLLHUP, POLLNVAL, POLLOUT);
 		cdebug("poll return %d %d %d (pending %d)", pollfds[0].revents, pollfds[1].revents, pollfds[2].revents, interrupt_pending);
 		if (pollfds[0].revents) {
 			timerfd_settime(pollfds[0].fd, 0, &zero, NULL);
-			if (run_file_wait > 0)
+			motion_hold();
+			if (run_file_wait > 0) {
 				run_file_wait -= 1;
+				// Continue the job.  If a move is in progress, it continues when that move is done.
+				if (run_file_wait == 0 && !computing_move)
+					run_file_next_command(settings.hwtime);
+			}
+			motion_unhold();
 		}
 		if (pollfds[2].revents)
 			handle_interrupt_reply();
+		// Fill the buffer before spending time on a request, so requests cannot cause underruns.
+		if (pollfds[1].revents && !interrupt_pending)
+			buffer_refill();
+		if (pollfds[3].revents)
+			handle_ring();
 		if (pollfds[1].revents)
 			handle_request();
 		handle_pending_events();
@@ -226,6 +267,10 @@ int main(int argc, char **argv) { // {{{
 } // }}}
 
 void send_to_parent(char cmd) { // {{{
+	if (motion_thread_self()) {
+		debug("send_to_parent called from the motion thread");
+		abort();
+	}
 	if (interrupt_pending) {
 		debug("send_to_parent called without previous prepare_interrupt!");
 		abort();
@@ -235,6 +280,8 @@ void send_to_parent(char cmd) { // {{{
 		stopping = 2;
 	}
 	cdebug("sending interrupt 0x%x", cmd);
+	// Let the module handle the events that were queued before this first.
+	__atomic_store_n(&shmem->interrupt_events, shmem->event_head, __ATOMIC_RELEASE);
 	if (write(interrupt, &cmd, 1) != 1) {
 		debug("failed to write to parent");
 		abort();
@@ -243,15 +290,69 @@ void send_to_parent(char cmd) { // {{{
 	interrupt_pending = true;
 } // }}}
 
+void send_event(char type, int i0, int i1, double value) { // {{{
+	uint32_t head = shmem->event_head;
+	if (head - __atomic_load_n(&shmem->event_tail, __ATOMIC_ACQUIRE) >= EVENT_RING_SIZE) {
+		// The ring is full; send the event as an interrupt instead.
+		shmem->event_overflows += 1;
+		prepare_interrupt();
+		shmem->interrupt_ints[0] = i0;
+		shmem->interrupt_ints[1] = i1;
+		shmem->interrupt_floats[0] = value;
+		send_to_parent(type);
+		return;
+	}
+	volatile EventEntry &entry = shmem->events[head % EVENT_RING_SIZE];
+	entry.type = type;
+	entry.ints[0] = i0;
+	entry.ints[1] = i1;
+	entry.value = value;
+	// The module stores event_tail and then checks event_head again when it is done reading.
+	// With sequentially consistent ordering, either it sees this entry, or this sees that the ring was empty and signals it.
+	__atomic_store_n(&shmem->event_head, head + 1, __ATOMIC_SEQ_CST);
+	if (events_ready < 0 || __atomic_load_n(&shmem->event_tail, __ATOMIC_SEQ_CST) != head)
+		return;
+	uint64_t one = 1;
+	if (write(events_ready, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+		debug("failed to signal event ring to server: %s", strerror(errno));
+		exit(0);
+	}
+} // }}}
+
 void prepare_interrupt() { // {{{
+	if (motion_thread_self()) {
+		// The motion thread never waits for the server.
+		debug("prepare_interrupt called from the motion thread");
+		abort();
+	}
+	if (!interrupt_pending)
+		return;
+	// Nothing is computed while waiting without a motion thread, or while it is held, so this can cause underruns; keep track of it.
+	bool was_moving = computing_move && (!motion_threaded || motion_holding());
+	int32_t start = utime();
+	// The firmware should not wait for acks while this waits for the server.
+	if (arch_fds() && serialdev)
+		serialdev->flush();
 	while (interrupt_pending) {
 		// Ignore timeouts.
 		pollfds[1].revents = 0;
 		pollfds[2].revents = 0;
+		pollfds[3].revents = 0;
+		pollfds[4].revents = 0;
 		poll(&pollfds[1], BASE_FDS - 1, -1);
+		if (pollfds[4].revents) {
+			motion_drain();
+			arch_send_queued();
+		}
 		if (pollfds[2].revents)
 			handle_interrupt_reply();
+		if (pollfds[3].revents)
+			handle_ring();
 		if (pollfds[1].revents)
 			handle_request();
 	}
+	if (was_moving) {
+		shmem->host_waits += 1;
+		shmem->host_wait_us += utime() - start;
+	}
 } // }}}
@@ -35,9 +35,13 @@
 #include <sys/types.h>
 #include <sys/timerfd.h>
 #include <string>
+#include <vector>
 
-#define PROTOCOL_VERSION ((uint32_t)7)	// Required version response in BEGIN.
-#define BASE_FDS 3
+#define PROTOCOL_VERSION ((uint32_t)10)	// Newest supported version response in BEGIN.
+#define OLDEST_PROTOCOL_VERSION ((uint32_t)9)	// Oldest version that is still accepted; it has no window.  Older firmware must be flashed again.
+#define MAX_WINDOW 32	// Maximum number of packets that are sent to the firmware before waiting for an ack.
+#define SEQ_MASK 0x7f	// Sequence numbers of packets to the firmware if there is a window.
+#define BASE_FDS 5
 
 #define MAXLONG (int32_t((uint32_t(1) << 31) - 1))
 #define MAXINT MAXLONG
@@ -163,6 +167,9 @@ struct History {
 	double run_time;
 	int64_t gcode_line;
 	int queue_start, queue_end;
+	double feed, feed_rate;	// Move time per sample time for the feed rate override, and its change per second; see warp_step() in move.cpp.
+	double feed_limit, feed_next;	// Largest feed that the current move allows, and that the next move allows at its start; see run_limits() in move.cpp.
+	int run_index, run_move;	// Number of the current run of moves, and of the current move in it.
 	double adjust;	// adjustment factor; runs from 1 to 0.
 	int64_t run_file_current;
 	uint8_t pattern[PATTERN_MAX];
@@ -185,8 +192,24 @@ struct Axis_History {
 	double adjust;	// Full length adjustment vector component.
 };
 
+// The state at the start of each fragment, for rewinding; see store_settings() in move.cpp. Every fragment has
+// a copy of settings and of the settings of all motors and axes, in the order of the spaces.
+struct History_Ring {
+	int num_motors, num_axes;	// Total over all spaces.
+	History *settings;	// One for each fragment.
+	Motor_History *motor;	// num_motors entries for each fragment.
+	Axis_History *axis;	// num_axes entries for each fragment.
+};
+
+// Segments that are waiting to be moved. settings.queue_start and settings.queue_end index it; they are not
+// limited by its size, because the storage is used as a ring. It grows when more segments are added than fit.
+struct Move_Queue {
+	std::vector <MoveCommand> data;	// The size is a power of two.
+	MoveCommand &operator[](int q) { return data[q & (data.size() - 1)]; }
+	void make_room(int q);	// Make sure that q can be written without overwriting queued segments.
+};
+
 struct Axis {
-	Axis_History *history;
 	Axis_History settings;
 	double park;		// Park position; not used by the firmware, but stored for use by the host.
 	uint8_t park_order;
@@ -201,7 +224,6 @@ struct Axis {
 #include "arch-host.h"
 
 struct Motor {
-	Motor_History *history;
 	Motor_History settings;
 	Pin_t step_pin;
 	Pin_t dir_pin;
@@ -233,6 +255,12 @@ struct SpaceType {
 	void (*motors2xyz)(Space *s, const double *motors, double *xyz);
 	void (*xyz2motors)(Space *s);
 
+	// Optional: compute motor positions for several samples at once; see franklin-module.h.
+	void (*xyz2motors_batch)(Space *s, int n, double const *const *axes, double *const *motors);
+
+	// Optional: compute the derivatives of the motor positions to the axes; see franklin-module.h.
+	void (*jacobian)(Space *s, int n, double const *const *axes, double *const *jacobian);
+
 	// Check if position is valid and if not, move it to a valid value.
 	void (*check_position)(Space *s, double *data);
 
@@ -276,6 +304,8 @@ struct Space {
 	void init(int space_id);
 	void setup_nums(int na, int nm);
 	void xyz2motors();
+	bool xyz2motors_batch(int n, double const *const *axes, double *const *motors);
+	bool jacobian(int n, double const *const *axes, double *const *jacobian);
 	void motors2xyz(const double *motors, double *xyz);
 	ARCH_SPACE
 };
@@ -305,6 +335,8 @@ static int const FULL_COMMAND_SIZE = COMMAND_SIZE + (COMMAND_SIZE + 2) / 3;
 // Globals
 EXTERN double max_deviation;
 EXTERN double max_v, max_a, max_J, adjust_speed;
+EXTERN double motor_fit_tolerance;	// Maximum error of a fitted motor path, in steps; 0 to always use the exact path.
+EXTERN bool motor_fit_check;	// Compare every fitted sample with the exact path, for testing; see batch_fill() in move.cpp.
 EXTERN uint8_t num_extruders;
 EXTERN int num_temps;
 EXTERN int num_gpios;
@@ -314,7 +346,7 @@ EXTERN Pin_t led_pin, stop_pin, probe_pin, spiss_pin;
 EXTERN uint16_t timeout;
 EXTERN int bed_id, fan_id, spindle_id;
 //EXTERN double room_T;	//[°C]
-EXTERN double feedrate;		// Multiplication factor for f values, used at start of move.
+EXTERN double feedrate;		// Feed rate override: multiplication factor for the speed of all moves; it is applied gradually.
 EXTERN double targetx, targety, targetangle, zoffset;	// Offset for axis 2 of space 0.
 // Other variables.
 EXTERN Serial_t *serialdev;
@@ -326,24 +358,27 @@ EXTERN Gpio *gpios;
 EXTERN Pattern pattern;
 EXTERN FILE *store_adc;
 EXTERN uint8_t temps_busy;
-EXTERN MoveCommand queue[10];
+EXTERN Move_Queue queue;
 EXTERN int default_hwtime_step, min_hwtime_step;
+EXTERN int base_hwtime_step;		// Sample period that the firmware is set up with; moves can use shorter or longer samples, see arch_sample_period().
 EXTERN uint8_t which_autosleep;		// which autosleep message to send (0: none, 1: motor, 2: temp, 3: both)
 EXTERN uint8_t ping;			// bitmask of waiting ping replies.
 EXTERN bool initialized;
 EXTERN bool probing, single;
 EXTERN bool motors_busy;
 EXTERN int out_busy;
+EXTERN int out_window;		// Packets that can be sent before waiting for an ack: 3 with the flip-flop protocol, more with a window.
+EXTERN bool windowed;		// The firmware accepted a window; packets have a sequence number and acks are cumulative.
 EXTERN int32_t out_time;
-EXTERN char pending_packet[4][FULL_COMMAND_SIZE];
-EXTERN int pending_len[4];
-EXTERN void (*serial_cb[4])();
+EXTERN char pending_packet[MAX_WINDOW][FULL_COMMAND_SIZE];
+EXTERN int pending_len[MAX_WINDOW];
+EXTERN void (*serial_cb[MAX_WINDOW])();
 EXTERN int32_t last_active;
 EXTERN int32_t last_micros;
 EXTERN int16_t led_phase;
 EXTERN Resume resume;
 EXTERN bool pausing, resume_pending, parkwaiting;
-EXTERN History *history;
+EXTERN History_Ring history;
 EXTERN History settings;
 EXTERN double final_x[6], final_v[6], final_a[6];	// For checking that the segments fit.
 EXTERN bool computing_move;	// True as long as steps are sent to firmware.
@@ -363,7 +398,7 @@ EXTERN int current_fragment, running_fragment;
 EXTERN unsigned current_fragment_pos;
 EXTERN int num_active_motors;
 EXTERN struct pollfd pollfds[BASE_FDS + ARCH_MAX_FDS];
-EXTERN void (*wait_for_reply[4])();
+EXTERN void (*wait_for_reply[MAX_WINDOW])();
 EXTERN int expected_replies;
 EXTERN int pins_changed;
 
@@ -396,16 +431,21 @@ void debug_dump();
 
 // packet.cpp
 void request(int req);
+void ring_request();
 bool compute_current_pos(double x[6], double v[6], double a[6], bool store);
 int prepare_retarget(int q, int tool, double x[6], double v[6], double a[6], bool resuming = false);
 void smooth_stop(int q, double x[6], double v[6]);
 void do_resume();
 int go_to(bool relative, MoveCommand const *move, bool queue_only = false);
+void queue_move(bool relative, MoveCommand const *move);
+void stream_clear();
+int stream_length();
 void settemp(int which, double target);
 void waittemp(int which, double mintemp, double maxtemp);
 void setpos(int which, int t, double f, bool reset);
 void delayed_reply();
 void send_to_parent(char cmd);
+void send_event(char type, int i0 = 0, int i1 = 0, double value = 0);	// Queue an event for the server without waiting.
 void prepare_interrupt();
 
 // serial.cpp
@@ -416,13 +456,28 @@ void send_packet();
 void write_ack();
 void write_nack();
 EXTERN uint8_t ff_in;	// Index of next in-packet that is expected.
-EXTERN uint8_t ff_out;	// Index of next out-packet that will be sent.
+EXTERN uint8_t ff_out;	// Index of next out-packet that will be sent; its sequence number if there is a window.
+void serial_window(int window);
 
 // move.cpp
 void next_move(int32_t start_time);
 void abort_move(int pos);
 void discard();
 void discard_finals();
+// The motion thread computes fragments; the main thread holds it to use the planner state. See move.cpp.
+void motion_start();
+bool motion_thread_self();
+void motion_hold();
+void motion_unhold();
+bool motion_holding();
+void motion_drain();
+void motion_wait();
+bool motion_idle();
+void motion_queue_move(bool relative, MoveCommand const *move);
+bool motion_getpos(int s, int a, double *axis, double *motor);
+int motion_queued();
+int32_t motion_hwtime();
+EXTERN bool motion_threaded;
 
 // run.cpp
 struct ProbeFile {
@@ -434,6 +489,15 @@ struct ProbeFile {
 bool run_file(char const *name, char const *probe_name, bool start, double sina, double cosa);
 void abort_run_file();
 void run_file_next_command(int32_t start_time);
+// Position in the run file after the moves that have been decoded ahead of the queue; see run_file_lookahead() in run.cpp.
+struct Run_Lookahead {
+	int64_t record;	// Next record to decode.
+	double abc[3], abc_h[3];	// Pending ABC record.
+	int pattern_size;	// Pending pattern.
+	uint8_t pattern[PATTERN_MAX];
+};
+bool run_file_lookahead_start(Run_Lookahead *look);
+int run_file_lookahead(Run_Lookahead *look, MoveCommand *moves, int num);
 void run_adjust_probe(double x, double y, double z);
 double run_find_pos(const double pos[3]);
 EXTERN std::string probe_file_name;
@@ -441,9 +505,7 @@ EXTERN off_t probe_file_size;
 EXTERN ProbeFile *probe_file_map;
 EXTERN std::string run_file_name;
 EXTERN off_t run_file_size;
-EXTERN Run_Record *run_file_map;
-EXTERN int run_file_num_strings;
-EXTERN off_t run_file_first_string;
+EXTERN char const *run_file_map;
 EXTERN int64_t run_file_num_records;
 EXTERN int run_file_wait;
 EXTERN struct itimerspec run_file_timer;
@@ -458,8 +520,6 @@ void setup();
 void connect_machine(char const *port, char const *run_id);
 void connect_end();
 void check_protocol();
-Axis_History *setup_axis_history();
-Motor_History *setup_motor_history();
 EXTERN bool host_block;
 EXTERN bool connected;
 
@@ -468,6 +528,8 @@ void handle_temp(int id, int temp);
 
 // space.cpp
 void buffer_refill();
+void history_reset();
+void motor_fit_reset();
 void store_settings();
 void restore_settings();
 void reset_pos(Space *s);
@@ -514,6 +576,8 @@ double arch_round_pos(int s, int m, double pos);
 //void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin = ~0, bool heater_invert = false, int heater_adctemp = 0, int heater_limit_l = ~0, int heater_limit_h = ~0, int fan_pin = ~0, bool fan_invert = false, int fan_adctemp = 0, int fan_limit_l = ~0, int fan_limit_h = ~0, double hold_time = 0);
 void arch_start_move(int extra);
 bool arch_send_fragment();
+void arch_send_queued();
+void arch_rewind();
 
 #ifdef SERIAL
 int hwpacketsize(int len, int *available);
@@ -0,0 +1,64 @@
+/* checksum.h - Checksum bytes of serial packets for Franklin {{{
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016-2018 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+// The firmware computes the same bytes from firmware/checksum.h; test/checksum-test.cpp checks that they agree.
+
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <stdint.h>
+
+// Parity masks for decoding. {{{
+static constexpr uint8_t MASK[5][4] = {
+	{0xc0, 0xc3, 0xff, 0x09},
+	{0x38, 0x3a, 0x7e, 0x13},
+	{0x26, 0xb5, 0xb9, 0x23},
+	{0x95, 0x6c, 0xd5, 0x43},
+	{0x4b, 0xdc, 0xe2, 0x83}};
+
+// The check bits are the xor of the check bits of each byte separately, so they are looked up per byte.
+// The tables are computed from the masks at compile time.
+static constexpr uint8_t parity(uint8_t value) {
+	return value == 0 ? 0 : (value & 1) ^ parity(value >> 1);
+}
+
+static constexpr uint8_t check_bits(uint8_t value, int p, int bit = 0) {
+	return bit == 5 ? 0 : (parity(value & MASK[bit][p]) << (bit + 3)) | check_bits(value, p, bit + 1);
+}
+
+#define CHECK4(p, n) check_bits(n, p), check_bits(n + 1, p), check_bits(n + 2, p), check_bits(n + 3, p)
+#define CHECK16(p, n) CHECK4(p, n), CHECK4(p, n + 4), CHECK4(p, n + 8), CHECK4(p, n + 12)
+#define CHECK64(p, n) CHECK16(p, n), CHECK16(p, n + 16), CHECK16(p, n + 32), CHECK16(p, n + 48)
+#define CHECK256(p) CHECK64(p, 0), CHECK64(p, 64), CHECK64(p, 128), CHECK64(p, 192)
+static constexpr uint8_t CHECK[3][256] = { {CHECK256(0)}, {CHECK256(1)}, {CHECK256(2)} };
+// Check bits for the index in the low 3 bits of the checksum byte.
+static constexpr uint8_t CHECK_INDEX[8] = { CHECK4(3, 0), CHECK4(3, 4) };
+#undef CHECK256
+#undef CHECK64
+#undef CHECK16
+#undef CHECK4
+
+// Checksum byte t for the 3 data bytes that start at data.
+static inline uint8_t checksum(uint8_t t, uint8_t const *data) {
+	return (t & 7) | (CHECK[0][data[0]] ^ CHECK[1][data[1]] ^ CHECK[2][data[2]] ^ CHECK_INDEX[t & 7]);
+}
+// }}}
+
+#endif
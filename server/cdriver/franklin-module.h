@@ -50,6 +50,19 @@ extern "C" {
 	void motors2xyz(Space *s, const double *motors, double *xyz);
         void xyz2motors(Space *s);
 
+        // Optional: compute motor positions for n consecutive samples of a move.
+        // axes[a][i] is the target of axis a for sample i; none of them are NaN.
+        // motors[m][i] is set to the default (axes[m][i]) and should be replaced.
+        // Where xyz2motors uses the current motor position, sample i must use
+        // motors[m][i - 1]; the current position is still correct for sample 0.
+        void xyz2motors_batch(Space *s, int n, double const *const *axes, double *const *motors);
+
+        // Optional: compute the derivatives of the motor positions to the axis positions at n points.
+        // axes[a][i] is the position of axis a at point i; none of them are NaN.
+        // jacobian[m * s->num_axes + a][i] is d motor m / d axis a at point i.
+        // It is set to the default (1 if m == a, otherwise 0) and should be replaced.
+        void jacobian(Space *s, int n, double const *const *axes, double *const *jacobian);
+
         // Check if position is valid and if not, move it to a valid value.
         void check_position(Space *s, double *data);
 
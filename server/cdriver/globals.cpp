@@ -100,6 +100,10 @@ bool globals_load() {
 	targety = shmem->floats[7];
 	targetangle = shmem->floats[8];
 	zoffset = shmem->floats[9];
+	if (motor_fit_tolerance != shmem->floats[10]) {
+		motor_fit_tolerance = shmem->floats[10];
+		motor_fit_reset();
+	}
 	bool store = shmem->ints[14];
 	if (store && !store_adc) {
 		store_adc = fopen("/tmp/franklin-adc-dump", "a");
@@ -140,4 +144,5 @@ void globals_save() {
 	shmem->floats[7] = targety;
 	shmem->floats[8] = targetangle;
 	shmem->floats[9] = zoffset;
+	shmem->floats[10] = motor_fit_tolerance;
 }
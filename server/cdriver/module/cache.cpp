@@ -0,0 +1,258 @@
+/* cache.cpp - Caching parsed G-Code for Franklin.
+ * Copyright 2018 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Includes. {{{
+#include "module.h"
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+// }}}
+
+// Cached run files are stored as <key>.bin, with the parse errors for it in <key>.err.
+// The key is a hash of the G-Code and of all settings that are used by the parser.
+// Entries that have not been used for the longest time are removed when the cache grows too large.
+
+// Change this when the parser output changes, so old cache entries are not used anymore.
+#define PARSE_CACHE_VERSION 3
+
+// Parses can run in background threads, so everything below is protected by cache_lock.
+static std::mutex cache_lock;
+static std::string cache_dir;
+static int64_t cache_max_size;
+static int64_t cache_hits, cache_misses;
+
+static void hash_data(uint64_t &hash, void const *data, size_t size) { // {{{
+	// FNV-1a, applied to 64 bit words when possible.
+	uint64_t const prime = 0x100000001b3ULL;
+	uint8_t const *bytes = reinterpret_cast <uint8_t const *>(data);
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, &bytes[i], sizeof(word));
+		hash = (hash ^ word) * prime;
+	}
+	for (; i < size; ++i)
+		hash = (hash ^ bytes[i]) * prime;
+} // }}}
+
+static bool compute_key(std::string const &infilename, std::string *key) { // {{{
+	int fd = open(infilename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	// Two independent hashes, for a 128 bit key.
+	uint64_t hash[2] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+	int64_t size = st.st_size;
+	if (size > 0) {
+		void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+		madvise(map, size, MADV_SEQUENTIAL);
+		hash_data(hash[0], map, size);
+		// Second hash runs backwards in blocks, so the two are not trivially related.
+		for (int64_t pos = size; pos > 0; pos -= 4096) {
+			int64_t start = std::max(int64_t(0), pos - 4096);
+			hash_data(hash[1], reinterpret_cast <char const *>(map) + start, pos - start);
+		}
+		munmap(map, size);
+	}
+	close(fd);
+	// Settings which influence the result.
+	int version = PARSE_CACHE_VERSION;
+	int record_size = sizeof(Run_Record);
+	for (int h = 0; h < 2; ++h) {
+		hash_data(hash[h], &version, sizeof(version));
+		hash_data(hash[h], &record_size, sizeof(record_size));
+		hash_data(hash[h], &size, sizeof(size));
+		hash_data(hash[h], &max_deviation, sizeof(max_deviation));
+		hash_data(hash[h], &max_v, sizeof(max_v));
+		hash_data(hash[h], &max_a, sizeof(max_a));
+		hash_data(hash[h], &max_J, sizeof(max_J));
+		hash_data(hash[h], &parse_window_records, sizeof(parse_window_records));
+		hash_data(hash[h], &parse_window_distance, sizeof(parse_window_distance));
+		hash_data(hash[h], &num_extruders, sizeof(num_extruders));
+		for (int e = 0; e < num_extruders; ++e)
+			hash_data(hash[h], extruder_data[e].offset, sizeof(extruder_data[e].offset));
+	}
+	char buffer[33];
+	snprintf(buffer, sizeof(buffer), "%016" PRIx64 "%016" PRIx64, hash[0], hash[1]);
+	*key = buffer;
+	return true;
+} // }}}
+
+static bool copy_file(std::string const &src, std::string const &dst) { // {{{
+	// Use a hard link if possible; the run file is never changed after it is written.
+	unlink(dst.c_str());
+	if (link(src.c_str(), dst.c_str()) == 0)
+		return true;
+	int in = open(src.c_str(), O_RDONLY);
+	if (in < 0)
+		return false;
+	struct stat st;
+	if (fstat(in, &st) < 0) {
+		close(in);
+		return false;
+	}
+	int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		close(in);
+		return false;
+	}
+	off_t pos = 0;
+	while (pos < st.st_size) {
+		ssize_t ret = sendfile(out, in, &pos, st.st_size - pos);
+		if (ret <= 0) {
+			close(in);
+			close(out);
+			unlink(dst.c_str());
+			return false;
+		}
+	}
+	close(in);
+	close(out);
+	return true;
+} // }}}
+
+static void evict() { // {{{
+	// Remove least recently used entries until the cache is small enough.
+	// A run file that was handed out is a hard link to its entry.  While that link exists, removing the entry frees nothing,
+	// so such entries are neither counted nor removed.  Sizes are the allocated blocks, which is what removing an entry frees.
+	struct Entry {
+		std::string name;
+		time_t mtime;
+		int64_t size;
+		bool operator<(Entry const &other) const { return mtime < other.mtime; }
+	};
+	std::vector <Entry> entries;
+	int64_t total = 0;
+	DIR *dir = opendir(cache_dir.c_str());
+	if (!dir)
+		return;
+	while (dirent *d = readdir(dir)) {
+		std::string name = d->d_name;
+		if (name.size() < 4 || name.substr(name.size() - 4) != ".bin")
+			continue;
+		std::string base = cache_dir + "/" + name.substr(0, name.size() - 4);
+		struct stat st;
+		if (stat((base + ".bin").c_str(), &st) < 0 || st.st_nlink > 1)
+			continue;
+		Entry e;
+		e.name = base;
+		e.mtime = st.st_mtime;
+		e.size = int64_t(st.st_blocks) * 512;
+		if (stat((base + ".err").c_str(), &st) == 0)
+			e.size += int64_t(st.st_blocks) * 512;
+		total += e.size;
+		entries.push_back(e);
+	}
+	closedir(dir);
+	std::sort(entries.begin(), entries.end());
+	for (auto &e: entries) {
+		if (total <= cache_max_size)
+			break;
+		unlink((e.name + ".bin").c_str());
+		unlink((e.name + ".err").c_str());
+		total -= e.size;
+	}
+} // }}}
+
+void parse_cache_setup(char const *dir, int64_t max_size) { // {{{
+	std::lock_guard <std::mutex> guard(cache_lock);
+	cache_dir = dir;
+	cache_max_size = max_size;
+	if (cache_dir.empty() || max_size <= 0)
+		return;
+	mkdir(cache_dir.c_str(), 0777);
+	evict();
+} // }}}
+
+bool parse_cache_lookup(std::string const &infilename, std::string const &outfilename, std::string *key, std::vector <std::string> *errors) { // {{{
+	// Returns true if a cached result has been written to outfilename.
+	// Otherwise, key is set for storing the result, or empty if the result should not be cached.
+	key->clear();
+	// Never overwrite a file that may be a link to a cache entry.
+	unlink(outfilename.c_str());
+	std::string dir;
+	{
+		std::lock_guard <std::mutex> guard(cache_lock);
+		if (cache_dir.empty() || cache_max_size <= 0)
+			return false;
+		dir = cache_dir;
+	}
+	// The key is computed without holding the lock, because it reads the whole input.
+	std::string k;
+	if (!compute_key(infilename, &k))
+		return false;
+	std::lock_guard <std::mutex> guard(cache_lock);
+	std::string base = dir + "/" + k;
+	// Mark entry as recently used.
+	if (utime((base + ".bin").c_str(), NULL) == 0 && copy_file(base + ".bin", outfilename)) {
+		std::ifstream errfile((base + ".err").c_str());
+		std::string line;
+		while (std::getline(errfile, line))
+			errors->push_back(line);
+		cache_hits += 1;
+		return true;
+	}
+	cache_misses += 1;
+	*key = k;
+	return false;
+} // }}}
+
+void parse_cache_store(std::string const &key, std::string const &outfilename, std::vector <std::string> const &errors) { // {{{
+	std::lock_guard <std::mutex> guard(cache_lock);
+	if (key.empty() || cache_dir.empty())
+		return;
+	std::string base = cache_dir + "/" + key;
+	// Write the errors first, so an entry with a .bin file is always complete.
+	{
+		std::ofstream errfile((base + ".err").c_str());
+		for (auto &e: errors)
+			errfile << e << '\n';
+	}
+	if (!copy_file(outfilename, base + ".tmp")) {
+		unlink((base + ".err").c_str());
+		return;
+	}
+	rename((base + ".tmp").c_str(), (base + ".bin").c_str());
+	evict();
+} // }}}
+
+void parse_cache_stats(int64_t *hits, int64_t *misses) { // {{{
+	std::lock_guard <std::mutex> guard(cache_lock);
+	*hits = cache_hits;
+	*misses = cache_misses;
+} // }}}
+// vim: set foldmethod=marker :
@@ -25,7 +25,13 @@
 #include <linux/memfd.h>
 #include <sys/syscall.h>
 #include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <algorithm>
 #include <cmath>
+#include <map>
+#include <thread>
 
 #ifndef memfd_create
 #define memfd_create(...) syscall(SYS_memfd_create, __VA_ARGS__)
@@ -67,7 +73,8 @@ static inline char send_to_child(char cmd) {
 	test.fd = toserver;
 	test.events = POLLIN | POLLPRI;
 	test.revents = 0;
-	int p = poll(&test, 1, 0);
+	// Without a request, this waits for the child to say that it is ready, which it may already have done.
+	int p = cmd == (char)-1 ? 0 : poll(&test, 1, 0);
 	if (p < 0) {
 		debug("send_to_child: test poll fails: %s", strerror(errno));
 	}
@@ -103,6 +110,112 @@ static inline char send_to_child(char cmd) {
 	return cmd;
 }
 
+// Command ring. {{{
+static uint32_t ring_collected;	// Entries before this have been moved to ring_results.
+static int ring_next_id;
+static bool ring_reply[RING_SIZE];	// The result for this entry is wanted.
+static std::map <int, PyObject *> ring_results;
+
+static void ring_collect() {
+	uint32_t handled = __atomic_load_n(&shmem->ring_handled, __ATOMIC_ACQUIRE);
+	for (; ring_collected != handled; ++ring_collected) {
+		volatile RingEntry &entry = shmem->ring[ring_collected % RING_SIZE];
+		if (!ring_reply[ring_collected % RING_SIZE])
+			continue;
+		PyObject *result;
+		switch (entry.cmd) {
+		case CMD_GETPOS:
+			result = Py_BuildValue("dd", entry.floats[0], entry.floats[1]);
+			break;
+		case CMD_MOVE:
+			result = PyBool_FromLong(!entry.ints[1]);
+			break;
+		default:
+			Py_INCREF(Py_None);
+			result = Py_None;
+			break;
+		}
+		ring_results[int(entry.id)] = result;
+	}
+}
+
+static void ring_wait() {
+	// Wait until cdriver has handled more entries.
+	struct pollfd pfd;
+	pfd.fd = ring_done;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	Py_BEGIN_ALLOW_THREADS
+	poll(&pfd, 1, -1);
+	Py_END_ALLOW_THREADS
+	uint64_t count;
+	if (read(ring_done, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN) {
+		debug("failed to read command ring signal from child: %s", strerror(errno));
+		exit(0);
+	}
+}
+
+static volatile RingEntry &ring_entry(int cmd) {
+	// Wait for a free entry; the results of handled entries are collected to make room.
+	while (shmem->ring_head - ring_collected >= RING_SIZE) {
+		ring_collect();
+		if (shmem->ring_head - ring_collected >= RING_SIZE)
+			ring_wait();
+	}
+	volatile RingEntry &entry = shmem->ring[shmem->ring_head % RING_SIZE];
+	entry.id = ring_next_id++;
+	entry.cmd = cmd;
+	return entry;
+}
+
+static void ring_send(bool reply) {
+	ring_reply[shmem->ring_head % RING_SIZE] = reply;
+	// The entry must be complete before cdriver can see it.
+	__atomic_store_n(&shmem->ring_head, shmem->ring_head + 1, __ATOMIC_RELEASE);
+	uint64_t one = 1;
+	if (write(ring_submit, &one, sizeof(one)) != sizeof(one)) {
+		debug("failed to signal command ring to child: %s", strerror(errno));
+		exit(0);
+	}
+}
+// }}}
+
+// Event ring. {{{
+static PyObject *event_dict(volatile EventEntry const &entry) {
+	switch (entry.type) {
+	case CMD_FILE_DONE:
+		return Py_BuildValue("{ss}", "type", "file-done");
+	case CMD_MOVECB:
+		return Py_BuildValue("{ss}", "type", "move-cb");
+	case CMD_PINCHANGE:
+		return Py_BuildValue("{ss,si,si}", "type", "pinchange", "pin", entry.ints[0], "state", entry.ints[1]);
+	case CMD_UPDATE_PIN:
+		return Py_BuildValue("{ss,si,si}", "type", "update-pin", "pin", entry.ints[0], "state", entry.ints[1]);
+	case CMD_UPDATE_TEMP:
+		return Py_BuildValue("{ss,si,sd}", "type", "update-temp", "temp", entry.ints[0], "value", entry.value);
+	case CMD_TEMPCB:
+		return Py_BuildValue("{ss,si}", "type", "temp-cb", "temp", entry.ints[0]);
+	default:
+		PyErr_Format(PyExc_AssertionError, "Event ring contains unexpected code 0x%x", entry.type);
+		return NULL;
+	}
+}
+
+static bool event_read(uint32_t end, PyObject *list) {
+	// Append the events before end to list and free their entries.
+	uint32_t tail = shmem->event_tail;
+	bool ok = true;
+	for (; ok && tail != end; ++tail) {
+		PyObject *event = event_dict(shmem->events[tail % EVENT_RING_SIZE]);
+		ok = event != NULL && PyList_Append(list, event) == 0;
+		Py_XDECREF(event);
+	}
+	// See send_event() in cdriver for the ordering.
+	__atomic_store_n(&shmem->event_tail, tail, __ATOMIC_SEQ_CST);
+	return ok;
+}
+// }}}
+
 #ifdef SERIAL
 static PyObject *set_uuid(PyObject *Py_UNUSED(self), PyObject *args) {
 	FUNCTION_START;
@@ -164,8 +277,9 @@ static PyObject *move(PyObject *Py_UNUSED(self), PyObject *args, PyObject *keywo
 	shmem->move.probe = false;
 	shmem->move.pattern_size = 0;
 	shmem->ints[0] = 0;
-	const char *keywordnames[] = {"tool", "x", "y", "z", "a", "b", "c", "e", "v", "single", "probe", "relative", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args, keywords, "idddddddd|ppp", const_cast <char **>(keywordnames),
+	shmem->ints[2] = 0;
+	const char *keywordnames[] = {"tool", "x", "y", "z", "a", "b", "c", "e", "v", "single", "probe", "relative", "queue", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, keywords, "idddddddd|pppp", const_cast <char **>(keywordnames),
 				&shmem->move.tool,
 				&shmem->move.target[0], &shmem->move.target[1], &shmem->move.target[2],
 				&shmem->move.target[3], &shmem->move.target[4], &shmem->move.target[5],
@@ -173,7 +287,8 @@ static PyObject *move(PyObject *Py_UNUSED(self), PyObject *args, PyObject *keywo
 				&shmem->move.v0,
 				&shmem->move.single,
 				&shmem->move.probe,
-				&shmem->ints[0]))
+				&shmem->ints[0],
+				&shmem->ints[2]))
 		return NULL;
 	if (std::isnan(shmem->move.v0))
 		shmem->move.v0 = INFINITY;
@@ -189,6 +304,42 @@ static PyObject *move(PyObject *Py_UNUSED(self), PyObject *args, PyObject *keywo
 		Py_RETURN_TRUE;
 }
 
+static PyObject *move_start(PyObject *Py_UNUSED(self), PyObject *args, PyObject *keywords) {
+	FUNCTION_START;
+	// Queue a move in the command ring.  Returns the request id, or None if reply is false.
+	int tool, single = false, probe = false, relative = false, queue = false, reply = true;
+	double target[6], e, v;
+	const char *keywordnames[] = {"tool", "x", "y", "z", "a", "b", "c", "e", "v", "single", "probe", "relative", "queue", "reply", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, keywords, "idddddddd|ppppp", const_cast <char **>(keywordnames),
+				&tool,
+				&target[0], &target[1], &target[2],
+				&target[3], &target[4], &target[5],
+				&e, &v,
+				&single, &probe, &relative, &queue, &reply))
+		return NULL;
+	if (std::isnan(v))
+		v = INFINITY;
+	if (v == 0) {
+		debug("Invalid speed");
+		exit(1);
+	}
+	volatile RingEntry &entry = ring_entry(CMD_MOVE);
+	entry.ints[0] = relative;
+	entry.ints[1] = 0;
+	entry.ints[2] = queue;
+	entry.ints[3] = tool;
+	entry.ints[4] = (single ? 1 : 0) | (probe ? 2 : 0);
+	for (int i = 0; i < 6; ++i)
+		entry.floats[i] = target[i];
+	entry.floats[6] = e;
+	entry.floats[7] = v;
+	int id = entry.id;
+	ring_send(reply);
+	if (!reply)
+		Py_RETURN_NONE;
+	return Py_BuildValue("i", id);
+}
+
 void parse_error(void *errors, char const *format, ...) {
 	va_list ap;
 	va_start(ap, format);
@@ -202,8 +353,31 @@ void parse_error(void *errors, char const *format, ...) {
 	char buffer[size + 1];
 	vsnprintf(buffer, size + 1, format, ap);
 	va_end(ap);
-	PyObject *msg = Py_BuildValue("s#", buffer, size);
-	PyList_Append(reinterpret_cast <PyObject *>(errors), msg);
+	reinterpret_cast <std::vector <std::string> *>(errors)->push_back(std::string(buffer, size));
+}
+
+static bool parse_with_cache(std::string const &infile, std::string const &outfile, std::vector <std::string> *errors, Parse_Status *status) {
+	// This does not use any Python objects, so it can run without the GIL.
+	// Returns false if the parse was cancelled.
+	std::string key;
+	// The spatial index of a previous run file is not valid for the new one.
+	unlink((outfile + RUN_SPATIAL_SUFFIX).c_str());
+	if (parse_cache_lookup(infile, outfile, &key, errors))
+		return true;
+	if (!parse_gcode(infile, outfile, errors, status))
+		return false;
+	parse_cache_store(key, outfile, *errors);
+	return true;
+}
+
+static PyObject *build_errors(std::vector <std::string> const &errors) {
+	PyObject *ret = PyList_New(0);
+	for (auto &m: errors) {
+		PyObject *msg = Py_BuildValue("s#", m.c_str(), Py_ssize_t(m.size()));
+		PyList_Append(ret, msg);
+		Py_DECREF(msg);
+	}
+	return ret;
 }
 
 static PyObject *parse_gcode(PyObject *Py_UNUSED(self), PyObject *args) {
@@ -213,9 +387,153 @@ static PyObject *parse_gcode(PyObject *Py_UNUSED(self), PyObject *args) {
 	if (!PyArg_ParseTuple(args, "yy", &infile, &outfile))
 		return NULL;
 	// This is not sent to the child, so that the child can remain running a job while the G-Code is being parsed.
-	PyObject *errors = PyList_New(0);
-	parse_gcode(infile, outfile, errors);
-	return errors;
+	std::vector <std::string> errors;
+	Py_BEGIN_ALLOW_THREADS
+	parse_with_cache(infile, outfile, &errors, NULL);
+	Py_END_ALLOW_THREADS
+	return build_errors(errors);
+}
+
+// Parsing in the background. {{{
+// A parse job is identified by its file descriptor, which becomes readable when the job is done.
+struct Parse_Job {
+	std::string infile, outfile;
+	std::vector <std::string> errors;
+	Parse_Status status;
+	std::thread thread;
+	int fd;
+	bool cancelled;
+};
+static std::map <int, Parse_Job *> parse_jobs;
+
+static void parse_job_run(Parse_Job *job) {
+	job->cancelled = !parse_with_cache(job->infile, job->outfile, &job->errors, &job->status);
+	uint64_t one = 1;
+	if (write(job->fd, &one, sizeof(one)) != sizeof(one))
+		debug("unable to signal end of parse: %s", strerror(errno));
+}
+
+static Parse_Job *get_parse_job(PyObject *args) {
+	int fd;
+	if (!PyArg_ParseTuple(args, "i", &fd))
+		return NULL;
+	auto job = parse_jobs.find(fd);
+	if (job == parse_jobs.end()) {
+		PyErr_SetString(PyExc_ValueError, "no such parse job");
+		return NULL;
+	}
+	return job->second;
+}
+
+static PyObject *parse_gcode_start(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Start parsing a file in a separate thread.  Returns a file descriptor which is readable when the parse is done.
+	char *infile, *outfile;
+	if (!PyArg_ParseTuple(args, "yy", &infile, &outfile))
+		return NULL;
+	int fd = eventfd(0, EFD_CLOEXEC);
+	if (fd < 0)
+		return PyErr_SetFromErrno(PyExc_OSError);
+	Parse_Job *job = new Parse_Job;
+	job->infile = infile;
+	job->outfile = outfile;
+	job->fd = fd;
+	job->cancelled = false;
+	job->thread = std::thread(parse_job_run, job);
+	parse_jobs[fd] = job;
+	return Py_BuildValue("i", fd);
+}
+
+static PyObject *parse_gcode_progress(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Return (bytes handled, total bytes, records written) of a running parse.
+	Parse_Job *job = get_parse_job(args);
+	if (!job)
+		return NULL;
+	return Py_BuildValue("LLL", (long long)job->status.bytes, (long long)job->status.total, (long long)job->status.records);
+}
+
+static PyObject *parse_gcode_cancel(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Request a running parse to stop.  It still needs to be finished.
+	Parse_Job *job = get_parse_job(args);
+	if (!job)
+		return NULL;
+	job->status.cancel = true;
+	Py_RETURN_NONE;
+}
+
+static PyObject *parse_gcode_finish(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Wait for a parse to end and clean it up.  Returns the list of errors, or None if it was cancelled.
+	Parse_Job *job = get_parse_job(args);
+	if (!job)
+		return NULL;
+	parse_jobs.erase(job->fd);
+	Py_BEGIN_ALLOW_THREADS
+	job->thread.join();
+	Py_END_ALLOW_THREADS
+	close(job->fd);
+	PyObject *ret;
+	if (job->cancelled) {
+		Py_INCREF(Py_None);
+		ret = Py_None;
+	}
+	else
+		ret = build_errors(job->errors);
+	delete job;
+	return ret;
+}
+// }}}
+
+static PyObject *parse_cache(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Set up the cache for parsed files.  A maximum size of 0 disables it.
+	char *dir;
+	long long max_size;
+	if (!PyArg_ParseTuple(args, "yL", &dir, &max_size))
+		return NULL;
+	parse_cache_setup(dir, max_size);
+	Py_RETURN_NONE;
+}
+
+static PyObject *parse_window(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Limit the number of moves and the path length that the parser plans ahead.  0 means no limit.
+	long long records;
+	double distance;
+	if (!PyArg_ParseTuple(args, "Ld", &records, &distance))
+		return NULL;
+	parse_window_records = records;
+	parse_window_distance = distance;
+	Py_RETURN_NONE;
+}
+
+static PyObject *set_parse_threads(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Set the number of threads for parsing.  0 means one for every processor.
+	int num;
+	if (!PyArg_ParseTuple(args, "i", &num))
+		return NULL;
+	parse_threads = num;
+	Py_RETURN_NONE;
+}
+
+static PyObject *parse_cache_info(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	if (!PyArg_ParseTuple(args, ""))
+		return NULL;
+	int64_t hits, misses;
+	parse_cache_stats(&hits, &misses);
+	return Py_BuildValue("{s:L,s:L}", "hits", (long long)hits, "misses", (long long)misses);
+}
+
+static PyObject *motion_stats(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// These are kept in shared memory by the child, so no request is needed.
+	if (!PyArg_ParseTuple(args, ""))
+		return NULL;
+	return Py_BuildValue("{s:L,s:L,s:d,s:L,s:d,s:L,s:d,s:L,s:L,s:L,s:L,s:L,s:L}", "underruns", (long long)shmem->underruns, "host_waits", (long long)shmem->host_waits, "host_wait_time", shmem->host_wait_us / 1e6, "history_stores", (long long)shmem->history_stores, "history_store_time", shmem->history_samples > 0 ? shmem->history_store_ns / 1e9 / shmem->history_samples : 0., "fit_samples", (long long)shmem->fit_samples, "fit_max_error", shmem->fit_max_error, "stretched_moves", (long long)shmem->stretched_moves, "event_overflows", (long long)shmem->event_overflows, "packets_sent", (long long)shmem->packets_sent, "packets_resent", (long long)shmem->packets_resent, "link_nacks", (long long)shmem->link_nacks, "link_timeouts", (long long)shmem->link_timeouts);
 }
 
 static PyObject *run_file(PyObject *Py_UNUSED(self), PyObject *args) {
@@ -232,6 +550,153 @@ static PyObject *run_file(PyObject *Py_UNUSED(self), PyObject *args) {
 	Py_RETURN_NONE;
 }
 
+// Reading run files. {{{
+// A mapped run file; while it is being parsed, only the part that has been completed is mapped.
+struct Run_File_Map {
+	char const *map;
+	int64_t size;
+	int done;	// Like Run_Progress::done.
+	Run_Reader reader;
+	Run_File_Map() : map(NULL), size(0), done(0) {}
+	~Run_File_Map() {
+		if (map)
+			munmap(const_cast <char *>(map), size);
+	}
+	bool open(char const *filename) {
+		// The progress file must be read first, so the parser cannot finish in between.
+		Run_Progress progress;
+		progress.done = 1;
+		int progress_fd = ::open((std::string(filename) + RUN_PROGRESS_SUFFIX).c_str(), O_RDONLY);
+		if (progress_fd >= 0) {
+			if (read(progress_fd, &progress, sizeof(progress)) != sizeof(progress)) {
+				// The parser has only just created it.
+				progress.done = 0;
+				progress.size = 0;
+			}
+			close(progress_fd);
+		}
+		int fd = ::open(filename, O_RDONLY);
+		if (fd < 0) {
+			PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			close(fd);
+			PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+			return false;
+		}
+		done = progress.done;
+		size = done > 0 ? st.st_size : progress.size;
+		if (size > 0) {
+			void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+			if (m == MAP_FAILED) {
+				close(fd);
+				PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+				return false;
+			}
+			map = reinterpret_cast <char const *>(m);
+		}
+		close(fd);
+		if (!reader.open(map, size)) {
+			// A file that is being parsed may not have a header yet.
+			if (done <= 0 && size < int64_t(sizeof(Run_Header)))
+				return true;
+			PyErr_SetString(PyExc_ValueError, "invalid run file");
+			return false;
+		}
+		return true;
+	}
+};
+
+static PyObject *run_file_info(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Get (done, number of records, strings, bbox, time) of a run file.
+	// Done is 1 for a complete file, 0 while it is being parsed and -1 if parsing was cancelled.
+	// Strings, bbox and time are only available when the file is complete; otherwise they are [], None and NaN.
+	char const *filename;
+	if (!PyArg_ParseTuple(args, "y", &filename))
+		return NULL;
+	Run_File_Map f;
+	if (!f.open(filename))
+		return NULL;
+	if (!f.reader.map || !f.reader.complete())
+		return Py_BuildValue("iL[]Od", f.done > 0 ? 0 : f.done, (long long)f.reader.num_records, Py_None, NAN);
+	PyObject *strings = PyList_New(f.reader.header.num_strings);
+	for (uint32_t i = 0; i < f.reader.header.num_strings; ++i) {
+		char const *str;
+		uint32_t len;
+		if (!f.reader.get_string(i, &str, &len)) {
+			Py_DECREF(strings);
+			PyErr_SetString(PyExc_ValueError, "invalid string in run file");
+			return NULL;
+		}
+		PyList_SET_ITEM(strings, i, PyUnicode_DecodeUTF8(str, len, "replace"));
+	}
+	double b[6];
+	memcpy(b, f.reader.header.bbox, sizeof(b));
+	return Py_BuildValue("iLN(dddddd)d", 1, (long long)f.reader.num_records, strings, b[0], b[1], b[2], b[3], b[4], b[5], f.reader.header.time);
+}
+
+static PyObject *run_file_records(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Get a list of records from a run file; every record is a tuple of its members in the order of Run_Record.
+	char const *filename;
+	long long first, num;
+	if (!PyArg_ParseTuple(args, "yLL", &filename, &first, &num))
+		return NULL;
+	Run_File_Map f;
+	if (!f.open(filename))
+		return NULL;
+	PyObject *ret = PyList_New(0);
+	for (int64_t i = std::max(first, 0LL); i < first + num && i < f.reader.num_records; ++i) {
+		Run_Record const *r = f.reader.get(i);
+		if (!r) {
+			Py_DECREF(ret);
+			PyErr_SetString(PyExc_ValueError, "invalid record in run file");
+			return NULL;
+		}
+		PyObject *record = Py_BuildValue("iidddddddddddL", r->type, r->tool, r->X[0], r->X[1], r->X[2], r->h[0], r->h[1], r->h[2], r->Jg, r->tf, r->v0, r->E, r->time, (long long)r->gcode_line);
+		PyList_Append(ret, record);
+		Py_DECREF(record);
+	}
+	return ret;
+}
+
+static PyObject *state_map(std::map <int32_t, double> const &values) {
+	PyObject *ret = PyDict_New();
+	for (auto &v: values) {
+		PyObject *key = PyLong_FromLong(v.first);
+		PyObject *value = PyFloat_FromDouble(v.second);
+		PyDict_SetItem(ret, key, value);
+		Py_DECREF(key);
+		Py_DECREF(value);
+	}
+	return ret;
+}
+
+static PyObject *run_file_seek(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	// Find the first record for a G-Code line, or if line is negative, the last record that starts at or before time.
+	// Returns the record and the machine state before it: (record, tool, (x, y, z), e, {temp channel: value}, {gpio: value}).
+	char const *filename;
+	long long line;
+	double time;
+	if (!PyArg_ParseTuple(args, "yLd", &filename, &line, &time))
+		return NULL;
+	Run_File_Map f;
+	if (!f.open(filename))
+		return NULL;
+	int64_t record = line >= 0 ? f.reader.find_line(line) : f.reader.find_time(time);
+	Run_State state;
+	if (record < 0 || !f.reader.state_at(record, &state)) {
+		PyErr_SetString(PyExc_ValueError, "invalid record in run file");
+		return NULL;
+	}
+	return Py_BuildValue("Li(ddd)dNN", (long long)record, state.tool, state.X[0], state.X[1], state.X[2], state.E, state_map(state.temps), state_map(state.gpios));
+}
+// }}}
+
 static PyObject *sleep(PyObject *Py_UNUSED(self), PyObject *args) {
 	FUNCTION_START;
 	// Enable or disable motor current
@@ -298,6 +763,51 @@ static PyObject *getpos(PyObject *Py_UNUSED(self), PyObject *args) {
 	return ret;
 }
 
+static PyObject *getpos_start(PyObject *Py_UNUSED(self), PyObject *args) {
+	//FUNCTION_START;
+	// Request current position through the command ring; returns the request id.
+	int space, axis;
+	if (!PyArg_ParseTuple(args, "ii", &space, &axis))
+		return NULL;
+	volatile RingEntry &entry = ring_entry(CMD_GETPOS);
+	entry.ints[0] = space;
+	entry.ints[1] = axis;
+	int id = entry.id;
+	ring_send(true);
+	return Py_BuildValue("i", id);
+}
+
+static PyObject *ring_result(PyObject *Py_UNUSED(self), PyObject *args) {
+	//FUNCTION_START;
+	// Get the result of a request in the command ring.  If wait is false and it is not available yet, return None.
+	int id, wait = true;
+	if (!PyArg_ParseTuple(args, "i|p", &id, &wait))
+		return NULL;
+	while (true) {
+		ring_collect();
+		auto result = ring_results.find(id);
+		if (result != ring_results.end()) {
+			PyObject *ret = result->second;
+			ring_results.erase(result);
+			return ret;
+		}
+		if (ring_collected == shmem->ring_head) {
+			PyErr_SetString(PyExc_KeyError, "no such request in command ring");
+			return NULL;
+		}
+		if (!wait)
+			Py_RETURN_NONE;
+		ring_wait();
+	}
+}
+
+static PyObject *ring_fileno(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	if (!PyArg_ParseTuple(args, ""))
+		return NULL;
+	return Py_BuildValue("i", ring_done);
+}
+
 static PyObject *read_globals(PyObject *Py_UNUSED(self), PyObject *args) {
 	FUNCTION_START;
 	if (!PyArg_ParseTuple(args, ""))
@@ -308,7 +818,7 @@ static PyObject *read_globals(PyObject *Py_UNUSED(self), PyObject *args) {
 	max_v = shmem->floats[2];
 	max_a = shmem->floats[3];
 	max_J = shmem->floats[4];
-	return Py_BuildValue("{si,si,si,si,si,si,si,si,si,si,si,si,si,si,si,sd,sd,sd,sd,sd,sd,sd,sd,sd}",
+	return Py_BuildValue("{si,si,si,si,si,si,si,si,si,si,si,si,si,si,si,sd,sd,sd,sd,sd,sd,sd,sd,sd,sd}",
 			"num_pins", shmem->ints[0],
 			"num_temps", shmem->ints[1],
 			"num_gpios", shmem->ints[2],
@@ -333,7 +843,8 @@ static PyObject *read_globals(PyObject *Py_UNUSED(self), PyObject *args) {
 			"targetx", shmem->floats[6],
 			"targety", shmem->floats[7],
 			"targetangle", shmem->floats[8],
-			"zoffset", shmem->floats[9]);
+			"zoffset", shmem->floats[9],
+			"motor_fit_tolerance", shmem->floats[10]);
 }
 
 static void set_int(int num, char const *name, PyObject *dict) {
@@ -398,6 +909,7 @@ static PyObject *write_globals(PyObject *Py_UNUSED(self), PyObject *args) {
 	set_float(7, "targety", dict);
 	set_float(8, "targetangle", dict);
 	set_float(9, "zoffset", dict);
+	set_float(10, "motor_fit_tolerance", dict);
 	send_to_child(CMD_WRITE_GLOBALS);
 	return assert_empty_dict(dict, "write_globals");
 }
@@ -804,21 +1316,21 @@ static PyObject *get_interrupt(PyObject *Py_UNUSED(self), PyObject *args) {
 		debug("unable to read interrupt");
 		exit(1);
 	}
+	// Events that were queued before the interrupt are returned first.
+	PyObject *events = PyList_New(0);
+	if (!event_read(__atomic_load_n(&shmem->interrupt_events, __ATOMIC_ACQUIRE), events)) {
+		Py_DECREF(events);
+		events = NULL;
+	}
 	PyObject *ret;
 	if (DEBUG_FUNCTIONS) {
-		char const *interrupt_cmd_name[] = { "LIMIT", "FILE_DONE", "MOVECB", "HOMED", "TIMEOUT", "PINCHANGE", "PINNAME", "DISCONNECT", "UPDATE_PIN", "UPDATE_TEMP", "CONFIRM", "PARKWAIT", "CONNECTED", "TEMPCB", "MESSAGE" };
+		char const *interrupt_cmd_name[] = { "LIMIT", "FILE_DONE", "MOVECB", "HOMED", "TIMEOUT", "PINCHANGE", "PINNAME", "DISCONNECT", "UPDATE_PIN", "UPDATE_TEMP", "CONFIRM", "PARKWAIT", "CONNECTED", "TEMPCB", "MESSAGE", "FILE_ERROR" };
 		debug("interrupt received: %s", unsigned(c) < sizeof(interrupt_cmd_name) / sizeof(*interrupt_cmd_name) ? interrupt_cmd_name[unsigned(c)] : "(invalid)");
 	}
 	switch (c) {
 	case CMD_LIMIT:
 		ret = Py_BuildValue("{ss,si,si,sd}", "type", "limit", "space", shmem->interrupt_ints[0], "motor", shmem->interrupt_ints[1], "pos", shmem->interrupt_floats[0]);
 		break;
-	case CMD_FILE_DONE:
-		ret = Py_BuildValue("{ss}", "type", "file-done");
-		break;
-	case CMD_MOVECB:
-		ret = Py_BuildValue("{ss}", "type", "move-cb");
-		break;
 	case CMD_HOMED:
 	{
 		int n = shmem->interrupt_ints[0];
@@ -832,9 +1344,6 @@ static PyObject *get_interrupt(PyObject *Py_UNUSED(self), PyObject *args) {
 	case CMD_TIMEOUT:
 		ret = Py_BuildValue("{ss}", "type", "timeout");
 		break;
-	case CMD_PINCHANGE:
-		ret = Py_BuildValue("{ss,si,si}", "type", "pinchange", "pin", shmem->interrupt_ints[0], "state", shmem->interrupt_ints[1]);
-		break;
 	case CMD_PINNAME:
 		//debug("name for pin %d: %x %s %d", shmem->interrupt_ints[0], shmem->interrupt_str[0], &shmem->interrupt_str[1], shmem->interrupt_ints[1]);
 		ret = Py_BuildValue("{ss,si,si,sy#}", "type", "pinname", "pin", shmem->interrupt_ints[0], "mode", shmem->interrupt_str[0], "name", &shmem->interrupt_str[1], shmem->interrupt_ints[1]);
@@ -842,12 +1351,25 @@ static PyObject *get_interrupt(PyObject *Py_UNUSED(self), PyObject *args) {
 	case CMD_DISCONNECT:
 		ret = Py_BuildValue("{ss,ss}", "type", "disconnect", "reason", shmem->interrupt_str);
 		break;
-	case CMD_UPDATE_PIN:
-		ret = Py_BuildValue("{ss,si,si}", "type", "update-pin", "pin", shmem->interrupt_ints[0], "state", shmem->interrupt_ints[1]);
+	case CMD_FILE_ERROR:
+		ret = Py_BuildValue("{ss,ss}", "type", "file-error", "reason", shmem->interrupt_str);
 		break;
+	case CMD_FILE_DONE:
+	case CMD_MOVECB:
+	case CMD_PINCHANGE:
+	case CMD_UPDATE_PIN:
 	case CMD_UPDATE_TEMP:
-		ret = Py_BuildValue("{ss,si,sd}", "type", "update-temp", "temp", shmem->interrupt_ints[0], "value", shmem->interrupt_floats[0]);
+	case CMD_TEMPCB:
+	{
+		// These are sent as events, unless the event ring was full.
+		EventEntry entry;
+		entry.type = c;
+		entry.ints[0] = shmem->interrupt_ints[0];
+		entry.ints[1] = shmem->interrupt_ints[1];
+		entry.value = shmem->interrupt_floats[0];
+		ret = event_dict(entry);
 		break;
+	}
 	case CMD_CONFIRM:
 		ret = Py_BuildValue("{ss,si,ss#}", "type", "confirm", "tool-changed", shmem->interrupt_ints[0], "message", shmem->interrupt_str, shmem->interrupt_ints[1]);
 		break;
@@ -857,9 +1379,6 @@ static PyObject *get_interrupt(PyObject *Py_UNUSED(self), PyObject *args) {
 	case CMD_CONNECTED:
 		ret = Py_BuildValue("{ss}", "type", "connected");
 		break;
-	case CMD_TEMPCB:
-		ret = Py_BuildValue("{ss,si}", "type", "temp-cb", "temp", shmem->interrupt_ints[0]);
-		break;
 	case CMD_MESSAGE:
 		ret = Py_BuildValue("{ss}", "message", shmem->interrupt_str[0]);
 		break;
@@ -872,7 +1391,59 @@ static PyObject *get_interrupt(PyObject *Py_UNUSED(self), PyObject *args) {
 	if (write(interrupt_reply, &c, 1) != 1)
 		exit(1);
 	cdebug("reply sent");
-	return ret;
+	// get_events() stops at a pending interrupt, so make sure the events after it are read.
+	if (__atomic_load_n(&shmem->event_head, __ATOMIC_ACQUIRE) != shmem->event_tail) {
+		uint64_t one = 1;
+		if (write(events_ready, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+			exit(1);
+	}
+	if (ret == NULL || events == NULL) {
+		Py_XDECREF(ret);
+		Py_XDECREF(events);
+		return NULL;
+	}
+	if (PyList_Append(events, ret) != 0) {
+		Py_DECREF(events);
+		events = NULL;
+	}
+	Py_DECREF(ret);
+	return events;
+}
+
+static PyObject *event_fileno(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	if (!PyArg_ParseTuple(args, ""))
+		return NULL;
+	return Py_BuildValue("i", events_ready);
+}
+
+static PyObject *get_events(PyObject *Py_UNUSED(self), PyObject *args) {
+	FUNCTION_START;
+	if (!PyArg_ParseTuple(args, ""))
+		return NULL;
+	uint64_t count;
+	if (read(events_ready, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN) {
+		debug("failed to read event ring signal from child: %s", strerror(errno));
+		exit(0);
+	}
+	PyObject *ret = PyList_New(0);
+	while (true) {
+		uint32_t head = __atomic_load_n(&shmem->event_head, __ATOMIC_SEQ_CST);
+		// Events after a pending interrupt are returned after it is handled; the head must be read before this check.
+		struct pollfd pfd;
+		pfd.fd = interrupt;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		bool pending = poll(&pfd, 1, 0) > 0;
+		if (pending)
+			head = __atomic_load_n(&shmem->interrupt_events, __ATOMIC_ACQUIRE);
+		if (!event_read(head, ret)) {
+			Py_DECREF(ret);
+			return NULL;
+		}
+		if (pending || __atomic_load_n(&shmem->event_head, __ATOMIC_SEQ_CST) == head)
+			return ret;
+	}
 }
 
 static PyObject *init_module(PyObject *Py_UNUSED(self), PyObject *args) {
@@ -917,6 +1488,21 @@ static PyObject *init_module(PyObject *Py_UNUSED(self), PyObject *args) {
 	shmem->ints[1] = pipe_fromserver[0];
 	shmem->ints[2] = pipe_interrupt[1];
 	shmem->ints[3] = pipe_interrupt_reply[0];
+	// These are used by both processes.
+	ring_submit = eventfd(0, EFD_NONBLOCK);
+	ring_done = eventfd(0, EFD_NONBLOCK);
+	if (ring_submit < 0 || ring_done < 0) {
+		debug("failed to create eventfd");
+		return PyErr_SetFromErrno(PyExc_ImportError);
+	}
+	shmem->ints[4] = ring_submit;
+	shmem->ints[5] = ring_done;
+	events_ready = eventfd(0, EFD_NONBLOCK);
+	if (events_ready < 0) {
+		debug("failed to create eventfd");
+		return PyErr_SetFromErrno(PyExc_ImportError);
+	}
+	shmem->ints[6] = events_ready;
 	switch (fork()) {
 		case -1:
 			// Error.
@@ -958,8 +1544,21 @@ static PyMethodDef Methods[] = {
 	{"reconnect", reconnect, METH_VARARGS, "Reconnect a machine."},
 #endif
 	{"move", reinterpret_cast<PyCFunction>(move), METH_VARARGS | METH_KEYWORDS, "Queue a move."},
+	{"move_start", reinterpret_cast<PyCFunction>(move_start), METH_VARARGS | METH_KEYWORDS, "Queue a move without waiting for it to be handled."},
 	{"parse_gcode", parse_gcode, METH_VARARGS, "Parse a file of G-Code."},
+	{"parse_gcode_start", parse_gcode_start, METH_VARARGS, "Start parsing a file of G-Code in the background."},
+	{"parse_gcode_progress", parse_gcode_progress, METH_VARARGS, "Get progress of a background parse."},
+	{"parse_gcode_cancel", parse_gcode_cancel, METH_VARARGS, "Cancel a background parse."},
+	{"parse_gcode_finish", parse_gcode_finish, METH_VARARGS, "Clean up a background parse and get its errors."},
+	{"parse_cache", parse_cache, METH_VARARGS, "Set up cache for parsed G-Code."},
+	{"parse_cache_info", parse_cache_info, METH_VARARGS, "Get hit and miss counts of the parse cache."},
+	{"motion_stats", motion_stats, METH_VARARGS, "Get buffer underrun and fragment history statistics."},
+	{"parse_window", parse_window, METH_VARARGS, "Set the lookahead window of the parser."},
+	{"parse_threads", set_parse_threads, METH_VARARGS, "Set the number of threads for the parser."},
 	{"run_file", run_file, METH_VARARGS, "Run a parsed file."},
+	{"run_file_info", run_file_info, METH_VARARGS, "Get information about a parsed file."},
+	{"run_file_records", run_file_records, METH_VARARGS, "Get records from a parsed file."},
+	{"run_file_seek", run_file_seek, METH_VARARGS, "Find a line or time in a parsed file and the state before it."},
 	{"sleep", sleep, METH_VARARGS, "Disable the motors."},
 	{"settemp", settemp, METH_VARARGS, "Set temperature target."},
 	{"waittemp", waittemp, METH_VARARGS, "Wait for a temperature control to reach its target."},
@@ -967,6 +1566,9 @@ static PyMethodDef Methods[] = {
 	{"power_value", power_value, METH_VARARGS, "Read power usage for a temperature control."},
 	{"setpos", setpos, METH_VARARGS, "Set current extruder position."},
 	{"getpos", getpos, METH_VARARGS, "Get current position of an axis."},
+	{"getpos_start", getpos_start, METH_VARARGS, "Request current position of an axis without waiting for it."},
+	{"ring_result", ring_result, METH_VARARGS, "Get the result of a request that was started."},
+	{"ring_fileno", ring_fileno, METH_VARARGS, "Get file descriptor which signals results of started requests."},
 	{"read_globals", read_globals, METH_VARARGS, "Read global variables."},
 	{"write_globals", write_globals, METH_VARARGS, "Set global variables."},
 	{"read_space_info", read_space_info, METH_VARARGS, "Read settings for a space."},
@@ -993,7 +1595,9 @@ static PyMethodDef Methods[] = {
 	{"tp_findpos", tp_findpos, METH_VARARGS, "Find position in toolpath closest to a point."},
 	{"motors2xyz", motors2xyz, METH_VARARGS, "Convert motor positions to tool position."},
 	{"fileno", fileno, METH_VARARGS, "Get file descriptor which will signal asynchronous events."},
-	{"get_interrupt", get_interrupt, METH_VARARGS, "Read and parse interrupt from chlid process."},
+	{"get_interrupt", get_interrupt, METH_VARARGS, "Read and parse interrupt from chlid process; returns a list of the events before it and the interrupt."},
+	{"event_fileno", event_fileno, METH_VARARGS, "Get file descriptor which signals queued events."},
+	{"get_events", get_events, METH_VARARGS, "Read and parse all queued events from child process."},
 	{"init", init_module, METH_VARARGS, "Initialize module and start child process."},
 	{NULL, NULL, 0, NULL}
 };
@@ -22,6 +22,9 @@
 #include <cstdio>
 #include <stdint.h>
 #include <cinttypes>
+#include <vector>
+#include <string>
+#include <map>
 
 // EXTERN is defined in exactly one file; the variables are defined in that file.
 #ifndef EXTERN
@@ -77,6 +80,122 @@ struct Run_Record {
 	int64_t gcode_line;
 } __attribute__((__packed__));
 
+// Run file format; see runfile.cpp for the encoding of the blocks.
+// Run_Header
+// blocks of at most RUN_BLOCK_RECORDS records, each starting with uint32_t payload size, uint32_t number of records
+// int64_t block_offset[num_blocks]
+// Run_Seek seek[num_blocks]
+// int64_t checkpoint_offset[num_checkpoints], followed by the checkpoints; see Run_State::write.
+// uint32_t string_length[num_strings]
+// string data
+// The header is written again when the file is complete; before that, num_records is 0.
+#define RUN_FILE_MAGIC "FRANKRUN"
+#define RUN_FILE_VERSION 3
+#define RUN_BLOCK_RECORDS 256
+#define RUN_CHECKPOINT_BLOCKS 16
+struct Run_Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_records;
+	int64_t num_records;
+	int64_t index_offset;	// Offset of block_offset[].
+	int64_t seek_offset;	// Offset of seek[].
+	int64_t checkpoint_offset;	// Offset of checkpoint_offset[].
+	uint32_t num_checkpoints;	// There is a checkpoint before every checkpoint_blocks'th block.
+	uint32_t checkpoint_blocks;
+	int64_t strings_offset;	// Offset of string_length[].
+	uint32_t num_strings;
+	double bbox[6];	// xmin, xmax, ymin, ymax, zmin, zmax.
+	double time;
+} __attribute__((__packed__));
+
+// Seek information for the first record of a block.
+struct Run_Seek {
+	int64_t gcode_line;	// Highest G-Code line of all records up to and including this one.
+	double time;
+} __attribute__((__packed__));
+
+// Machine state that records change, for continuing a job at any record.
+struct Run_State {
+	int64_t record;	// Number of records that have been applied.
+	int32_t tool;
+	double X[3];	// Last position of a move.
+	double E;
+	std::map <int32_t, double> temps;	// Targets from RUN_SETTEMP, by channel as stored in the record.
+	std::map <int32_t, double> gpios;	// Values from RUN_GPIO, by pin as stored in the record.
+	Run_State() : record(0), tool(0), X{NAN, NAN, NAN}, E(NAN) {}
+	void apply(Run_Record const &r);
+	void write(std::string &out) const;
+	bool read(char const *data, int64_t size);
+};
+
+// Random access to the records of a run file.  Blocks are decoded when they are needed.
+struct Run_Reader {
+	char const *map;
+	int64_t size;
+	Run_Header header;
+	std::vector <int64_t> blocks;	// Offsets of the blocks that are available.
+	int64_t num_records;	// Number of records in those blocks.
+	int64_t scan_pos;	// Offset of the first block that has not been found yet, while the file is being written.
+	// The last two decoded blocks are kept, so reading ahead does not evict the block that is being run.
+	int64_t cached_block[2];
+	std::vector <Run_Record> cache[2];
+	int cache_old;	// The slot that was used least recently.
+	Run_Reader() : map(NULL), size(0), num_records(0), scan_pos(0), cache_old(0) { cached_block[0] = -1; cached_block[1] = -1; }
+	bool open(char const *data, int64_t data_size);
+	bool update(char const *data, int64_t data_size);
+	Run_Record const *get(int64_t index);
+	bool get_string(uint32_t index, char const **data, uint32_t *len) const;
+	bool complete() const { return header.index_offset > 0; }
+	int64_t find_line(int64_t line);
+	int64_t find_time(double time);
+	bool state_at(int64_t record, Run_State *state);
+};
+void run_encode_block(Run_Record const *records, int count, std::string &out);
+
+// Bounding volume hierarchy over the moves of a run file, for finding the record
+// that is closest to a position.  It is built when it is first needed and stored
+// in a file next to the run file, named like it with RUN_SPATIAL_SUFFIX appended.
+#define RUN_SPATIAL_SUFFIX ".spatial"
+#define RUN_SPATIAL_MAGIC "FRANKBVH"
+#define RUN_SPATIAL_VERSION 1
+#define RUN_SPATIAL_LEAF 8
+struct Run_Segment {
+	double start[3], end[3];
+	int64_t record;
+};
+struct Run_Spatial_Node {
+	double bbox[6];	// xmin, xmax, ymin, ymax, zmin, zmax.
+	int32_t first;	// First segment for a leaf; second child for an internal node (the first child follows it).
+	int32_t count;	// Number of segments for a leaf; 0 for an internal node.
+	int64_t min_record;	// Lowest record of all segments in the node.
+};
+struct Run_Spatial_Index {
+	std::vector <Run_Segment> segments;
+	std::vector <Run_Spatial_Node> nodes;
+	int64_t first_known[8];	// For every set of coordinates (bit k for coordinate k), the first move that has all of them.
+	bool build(Run_Reader &reader, int64_t num_records);
+	bool load(std::string const &filename, Run_Header const &header);
+	void save(std::string const &filename, Run_Header const &header) const;
+	double find(double const pos[3]) const;
+	Run_Spatial_Index() { clear(); }
+	void clear();
+};
+
+// While the parser is writing a run file, it keeps this struct in a file next
+// to it, named like the run file with RUN_PROGRESS_SUFFIX appended.  The file
+// is removed when the parser is done.  This allows a job to start running
+// while the rest of it is still being parsed.
+#define RUN_PROGRESS_SUFFIX ".part"
+struct Run_Progress {
+	int64_t num_records;	// Number of complete records in the run file.
+	int64_t size;		// Number of bytes in the run file that contain those records.
+	int64_t done;		// 1 when strings and footer have been written as well, -1 if the parse was cancelled.
+	int64_t pid;		// Process that is parsing; if it is gone, the file will not be completed.
+};
+// A reader that follows a run file gives up if the parser has not written records for this long (in ms).
+#define RUN_STREAM_TIMEOUT 60000
+
 enum Command {
 	// from host
 	CMD_SET_UUID,		// 00	22 bytes: uuid.
@@ -137,6 +256,7 @@ enum InterruptCommand {
 	CMD_CONNECTED,		// 0c
 	CMD_TEMPCB,		// 0d	1 byte: which channel.  Byte storage for which needs to be sent.
 	CMD_MESSAGE,		// 0e
+	CMD_FILE_ERROR,		// 0f	interrupt_str: why the run file could not be completed.
 };
 
 enum RunType {
@@ -157,6 +277,38 @@ enum RunType {
 	RUN_PATTERN,		// 0e
 };
 
+// Command ring.
+// Requests that only need a few arguments can be queued here instead of being sent with send_to_child, so several of them can be in flight.
+// The module fills entries at ring_head and signals ring_submit; cdriver handles them in order, replaces the arguments with the results and signals ring_done.
+// Supported requests:
+// CMD_GETPOS	ints: space, axis.  Results: floats: axis position, motor position.
+// CMD_MOVE	ints: relative, -, queue, tool, single | probe << 1; floats: target[6], e, v.  Result: ints[1] like for CMD_MOVE.
+#define RING_SIZE 64
+#define RING_INTS 5
+#define RING_FLOATS 8
+struct RingEntry {
+	int id;		// Request ID, chosen by the module.
+	int cmd;
+	int ints[RING_INTS];
+	double floats[RING_FLOATS];
+};
+
+// Event ring.
+// Frequent interrupts are appended here by cdriver without waiting for a reply; the module reads them in batches.
+// cdriver signals events_ready when an entry is added to an empty ring.  If the ring is full, the event is sent as a normal interrupt and counted in event_overflows.
+// Events that were queued before an interrupt are handled before it; interrupt_events is the value of event_head when the interrupt was sent.
+// Supported events:
+// CMD_FILE_DONE, CMD_MOVECB	no arguments.
+// CMD_PINCHANGE, CMD_UPDATE_PIN	ints: pin, state.
+// CMD_UPDATE_TEMP	ints: temp; value: target.
+// CMD_TEMPCB	ints: temp.
+#define EVENT_RING_SIZE 256
+struct EventEntry {
+	int type;	// InterruptCommand.
+	int ints[2];
+	double value;
+};
+
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
@@ -169,11 +321,35 @@ struct SharedMemory {
 	volatile int interrupt_ints[2];
 	volatile float interrupt_floats[500];
 	volatile char interrupt_str[PATH_MAX + 1];
+	// Statistics, written by cdriver and read directly by the module.
+	volatile int64_t underruns;	// Number of times the firmware ran out of fragments while a move was computed.
+	volatile int64_t host_waits;	// Number of times cdriver waited for the host to handle an interrupt while moving.
+	volatile int64_t host_wait_us;	// Total time of those waits.
+	volatile int64_t history_stores;	// Number of fragment states stored for rewinding.
+	volatile int64_t history_samples;	// Number of those stores that were timed.
+	volatile int64_t history_store_ns;	// Total time of the timed stores.
+	volatile int64_t fit_samples;	// Number of samples computed from a fitted motor path.
+	volatile double fit_max_error;	// Largest error of a fitted sample, in steps; only measured if motor_fit_check is set.
+	volatile int64_t stretched_moves;	// Number of moves that were slowed down to stay within the motor limits.
+	volatile int64_t packets_sent;	// Number of packets that were sent to the firmware, including resends.
+	volatile int64_t packets_resent;	// Number of those that were resent after a nack or a timeout.
+	volatile int64_t link_nacks;	// Number of nacks that were received from the firmware.
+	volatile int64_t link_timeouts;	// Number of times the firmware was silent while packets were in flight.
+	// Command ring; the indices only increase and are accessed with atomic operations.
+	volatile RingEntry ring[RING_SIZE];
+	uint32_t ring_head;	// Entries before this have been submitted; written by the module.
+	uint32_t ring_handled;	// Entries before this have results; written by cdriver.
+	// Event ring; the indices only increase and are accessed with atomic operations.
+	volatile EventEntry events[EVENT_RING_SIZE];
+	uint32_t event_head;	// Entries before this have been queued; written by cdriver.
+	uint32_t event_tail;	// Entries before this have been read; written by the module.
+	uint32_t interrupt_events;	// event_head when the pending interrupt was sent; written by cdriver.
+	volatile int64_t event_overflows;	// Number of events that were sent as interrupts because the ring was full.
 };
 
 extern "C" {
 	EXTERN SharedMemory *shmem;
-	EXTERN int memfd, fromserver, toserver, interrupt, interrupt_reply;
+	EXTERN int memfd, fromserver, toserver, interrupt, interrupt_reply, ring_submit, ring_done, events_ready;
 }
 
 template <typename T> inline T min(T a, T b) {
@@ -252,7 +428,7 @@ static inline double compute_max_v(double x, double v, double max_J, double max_
 
 #ifdef MODULE
 
-#include <string>
+#include <atomic>
 
 #define debug(...) do { fprintf(stderr, "$"); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); fflush(stderr); } while (0)
 
@@ -262,11 +438,31 @@ extern "C" {
 	EXTERN double max_v, max_a, max_J;
 	EXTERN int num_extruders;
 	EXTERN ExtruderAxisData *extruder_data;
+	EXTERN int64_t parse_window_records;	// Maximum number of moves the parser plans ahead; 0 for no limit.
+	EXTERN double parse_window_distance;	// Maximum path length the parser plans ahead; 0 for no limit.
+	EXTERN int parse_threads;	// Number of threads for parsing; 0 to use all processors.
+
+	// State of a parse that is running in another thread.
+	struct Parse_Status {
+		std::atomic <int64_t> bytes;	// Number of bytes of input that have been handled.
+		std::atomic <int64_t> total;	// Size of the input file.
+		std::atomic <int64_t> records;	// Number of records that have been written.
+		std::atomic <bool> cancel;	// Set to stop the parser; the output is removed.
+		Parse_Status() : bytes(0), total(0), records(0), cancel(false) {}
+	};
 
+	// errors is a std::vector <std::string> *; parse_error appends to it, so it can be used without the GIL.
 	void parse_error(void *errors, char const *format, ...);
-	void parse_gcode(std::string const &infilename, std::string const &outfilename, void *errors);
+	// Returns false if the parse was cancelled.
+	bool parse_gcode(std::string const &infilename, std::string const &outfilename, void *errors, Parse_Status *status = NULL);
 }
 
+// Cache of parsed files; see cache.cpp.
+void parse_cache_setup(char const *dir, int64_t max_size);
+bool parse_cache_lookup(std::string const &infilename, std::string const &outfilename, std::string *key, std::vector <std::string> *errors);
+void parse_cache_store(std::string const &key, std::string const &outfilename, std::vector <std::string> const &errors);
+void parse_cache_stats(int64_t *hits, int64_t *misses);
+
 #endif
 
 #endif
@@ -21,11 +21,22 @@
 #include <fstream>
 #include <vector>
 #include <map>
-#include <list>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <algorithm>
 #include <cctype>
 #include <cmath>
 #include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 // }}}
 
 //#define pdebug(format, ...) debug("%4lld " format, P1->gcode_line, ##__VA_ARGS__)
@@ -40,6 +51,70 @@
 
 static double const C0 = 273.15; // 0 degrees celsius in kelvin.
 
+// Size of the pieces of input that are lexed in parallel.
+#define SLAB_SIZE (1 << 20)
+
+struct Pool { // {{{
+	// Threads for work that can be done in parallel.
+	// The parser thread runs queued tasks while it waits for a result, so this also works without any threads.
+	std::vector <std::thread> threads;
+	std::mutex lock;
+	std::condition_variable wake;	// Signalled when a task is added, or when the pool is stopped.
+	std::condition_variable idle;	// Signalled when a task has finished.
+	std::deque <std::function <void()> > tasks;
+	bool stopping;
+	Pool(int num) : stopping(false) { // {{{
+		for (int i = 0; i < num; ++i)
+			threads.push_back(std::thread(&Pool::work, this));
+	} // }}}
+	~Pool() { // {{{
+		{
+			std::lock_guard <std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &t: threads)
+			t.join();
+	} // }}}
+	void add(std::function <void()> const &task) { // {{{
+		{
+			std::lock_guard <std::mutex> guard(lock);
+			tasks.push_back(task);
+		}
+		wake.notify_one();
+	} // }}}
+	bool run_task(std::unique_lock <std::mutex> &l) { // {{{
+		// Run the first queued task, if there is one.  The lock is held when this is called and when it returns.
+		if (tasks.empty())
+			return false;
+		auto task = tasks.front();
+		tasks.pop_front();
+		l.unlock();
+		task();
+		l.lock();
+		idle.notify_all();
+		return true;
+	} // }}}
+	void work() { // {{{
+		std::unique_lock <std::mutex> l(lock);
+		while (true) {
+			if (run_task(l))
+				continue;
+			if (stopping)
+				return;
+			wake.wait(l);
+		}
+	} // }}}
+	void wait(std::function <bool()> const &done) { // {{{
+		// Help with queued tasks until done() returns true.
+		std::unique_lock <std::mutex> l(lock);
+		while (!done()) {
+			if (!run_task(l))
+				idle.wait(l);
+		}
+	} // }}}
+}; // }}}
+
 // The class below only to hold its variables in a convenient way.  The constructor does all the work; once the object is constructed, it should be discarded.
 // The parse_gcode function defined at the end is the only public part of this file and it does just that.
 struct Parser { // {{{
@@ -48,6 +123,41 @@ struct Parser { // {{{
 		int code;
 		double num;
 	}; // }}}
+	struct Lexer { // {{{
+		// Splitting a line into chunks does not depend on the state of the parser, so lines can be lexed in parallel.
+		char const *line;	// Points into data and is not NUL-terminated.
+		unsigned linelen;
+		unsigned linepos;
+		char const *comment;	// Comment on the line; also points into data.
+		unsigned comment_len;
+		char const *message;	// Text of M117, or NULL.
+		unsigned message_len;
+		unsigned int_errors;	// Number of times an int was requested at the end of the line.
+		bool get_chunk(Chunk &ret);
+		void read_space();
+		int read_int(double *power = NULL, int *sign = NULL);
+		double read_fraction();
+	}; // }}}
+	struct Line { // {{{
+		// Result of lexing one line.
+		char const *line;
+		unsigned linelen;
+		char const *comment;
+		unsigned comment_len;
+		char const *message;
+		unsigned message_len;
+		unsigned int_errors;
+		size_t first_chunk;	// Index of the first chunk of this line in Slab::chunks.
+		unsigned num_chunks;
+	}; // }}}
+	struct Slab { // {{{
+		// A part of the input that starts and ends at a line boundary.
+		size_t start, end;
+		std::vector <Line> lines;	// Reused, so they do not allocate once they have grown.
+		std::vector <Chunk> chunks;
+		std::atomic <bool> lexed;
+		bool active;	// False if there was no more input to put in this slab.
+	}; // }}}
 	struct Record { // {{{
 		bool arc;
 		int tool;
@@ -57,7 +167,7 @@ struct Parser { // {{{
 		double center[6];
 		double normal[6];
 		double time;
-		std::string pattern;
+		Record() {}
 		Record(int64_t gcode_line, bool arc_, int tl, double x, double y, double z, double a, double b, double c, double f_, double e_, double cx = NAN, double cy = NAN, double cz = NAN, double nx = NAN, double ny = NAN, double nz = NAN) : arc(arc_), tool(tl), f(f_), e(e_), gcode_line(gcode_line) {
 			pos[0] = x;
 			pos[1] = y;
@@ -87,10 +197,66 @@ struct Parser { // {{{
 		double Jg, Jh;	// Jerk along and perpendicular to segment.
 		int64_t gcode_line;
 	}; // }}}
+	struct Ring { // {{{
+		// Queue of Records in contiguous memory, so the passes over it don't need to chase pointers.
+		// Positions count from the start of the parse, so iterators remain valid when records are removed from the front.
+		std::vector <Record> records;	// Size is always a power of two.
+		int64_t first, last;	// Position of the first record and one past the last record.
+		struct iterator { // {{{
+			Ring *ring;
+			int64_t pos;
+			Record &operator*() const { return ring->records[pos & (ring->records.size() - 1)]; }
+			Record *operator->() const { return &**this; }
+			iterator &operator++() { ++pos; return *this; }
+			iterator &operator--() { --pos; return *this; }
+			iterator operator+(int64_t n) const { return iterator{ring, pos + n}; }
+			iterator operator-(int64_t n) const { return iterator{ring, pos - n}; }
+			bool operator==(iterator const &other) const { return pos == other.pos; }
+			bool operator!=(iterator const &other) const { return pos != other.pos; }
+		}; // }}}
+		Ring() : records(64), first(0), last(0) {}
+		size_t size() const { return last - first; }
+		iterator begin() { return iterator{this, first}; }
+		iterator end() { return iterator{this, last}; }
+		Record &front() { return *begin(); }
+		Record &back() { return *(end() - 1); }
+		void pop_front() { ++first; }
+		void push_back(Record const &record) { // {{{
+			if (size() < records.size()) {
+				*end() = record;
+				++last;
+				return;
+			}
+			// Full: double the size.  record may be in the old storage, so copy it before that is released.
+			Record copy = record;
+			std::vector <Record> bigger(records.size() * 2);
+			for (int64_t i = first; i < last; ++i)
+				bigger[i & (bigger.size() - 1)] = records[i & (records.size() - 1)];
+			records.swap(bigger);
+			*end() = copy;
+			++last;
+		} // }}}
+	}; // }}}
 	// Variables. {{{
-	std::ifstream infile;
+	char const *data;	// Memory mapped input file.
+	size_t data_size;
+	size_t data_pos;
 	std::ofstream outfile;
+	std::string progress_name;	// Sidecar file for streaming the output while it is written.
+	int progress_fd;
+	int64_t num_records;
+	std::vector <Run_Record> block;	// Records that have not been written yet.
+	std::vector <int64_t> block_offsets;
+	std::vector <Run_Seek> seeks;	// Seek information for every block.
+	int64_t max_line;	// Highest G-Code line in the output so far.
+	Run_State state;	// State after the last record, for writing checkpoints.
+	std::string checkpoints;
+	std::vector <int64_t> checkpoint_offsets;	// Offsets in checkpoints.
+	int64_t out_size;	// Number of bytes written to outfile.
+	std::string encoded;	// Scratch space for write_block.
 	void *errors;
+	Parse_Status *status;	// Progress for the caller; may be NULL.
+	bool cancelled;
 	char type;
 	int code;
 	double num;
@@ -100,7 +266,6 @@ struct Parser { // {{{
 	std::string message;
 	double bbox[2][6];
 	std::vector <std::string> strings;
-	std::list <unsigned> stringmap;
 	double unit;
 	bool rel;
 	bool erel;
@@ -112,27 +277,41 @@ struct Parser { // {{{
 	bool extruding;
 	double current_f[2];
 	bool tool_changed;
-	std::list <Record> pending;
+	Ring pending;
+	Ring::iterator prepared;	// Last record for which the static information has been computed.
+	Ring::iterator planned;	// Last record that the velocity planning has reached.
+	double pending_length;	// Length of the path in pending.
+	std::vector <double> lowest_f;	// Scratch space for flush_window.
 	int64_t lineno;
-	std::string line;
-	unsigned linepos;
+	char const *line;	// Current line; points into data and is not NUL-terminated.
+	unsigned linelen;
+	char const *comment;	// Comment on current line; also points into data.
+	unsigned comment_len;
+	Pool *pool;
+	std::vector <Slab> slabs;
 	double arc_normal[6];
 	double last_time;
-	std::list <Chunk> command;
+	std::vector <Chunk> command;
 	double max_dev;
 	std::string pattern_data;
 	// }}}
 	// Member functions. {{{
-	Parser(std::string const &infilename, std::string const &outfilename, void *errors);
-	void get_full_line();
+	Parser(std::string const &infilename, std::string const &outfilename, void *errors, Parse_Status *status);
+	void queue_slab(Slab &slab);
+	void lex_slab(Slab &slab);
+	bool handle_line(Line const &l, Chunk const *chunks);
+	std::string comment_head(unsigned len) const { return std::string(comment, std::min(len, comment_len)); }
 	bool handle_command(bool handle_pattern);
-	bool get_chunk(Chunk &ret, std::string &comment);
 	int add_string(std::string const &str);
-	void read_space();
-	int read_int(double *power = NULL, int *sign = NULL);
-	double read_fraction();
 	void handle_coordinate(double value, int index, bool *controlled, bool rel);
 	void flush_pending(bool finish = true);
+	void in_parallel(int64_t num, std::function <void(int64_t, int64_t)> const &job);
+	void prepare_pending();
+	void plan_pending();
+	void write_pending(Ring::iterator stop);
+	void flush_window();
+	void write_block();
+	void report_progress(int done);
 	void add_record(int64_t gcode_line, RunType cmd, int tool = 0, double x = NAN, double y = NAN, double z = NAN, double hx = 0, double hy = 0, double hz = 0, double Jg = 0, double tf = NAN, double v0 = NAN, double e = NAN);
 	void add_move_record(int64_t gcode_line, RunType cmd, int tool, double X[6], bool have_abc, double h[6], double Jg, double tf, double v0, double factor, double e_start, double e_len);
 	void reset_pending_pos();
@@ -151,26 +330,31 @@ void Parser::reset_pending_pos() { // {{{
 	initialize_pending_front();
 } // }}}
 
-bool Parser::get_chunk(Chunk &ret, std::string &comment) { // {{{
+bool Parser::Lexer::get_chunk(Chunk &ret) { // {{{
 	// Clear type so a premature return will also have an empty value.
 	ret.type = 0;
 	read_space();
-	if (linepos >= line.size())
+	if (linepos >= linelen)
 		return false;
 	char t = line[linepos++];
 	read_space();
 	if (t == ';') {
-		comment = line.substr(linepos);
-		linepos = line.size();
+		comment = line + linepos;
+		comment_len = linelen - linepos;
+		linepos = linelen;
 		return false;
 	}
 	while (t == '(') {
-		auto p = line.find(')', linepos);
-		comment = line.substr(linepos, p - linepos);
-		linepos = p + 1;
+		char const *p = reinterpret_cast <char const *>(memchr(line + linepos, ')', linelen - linepos));
+		unsigned end = p ? p - line : linelen;
+		comment = line + linepos;
+		comment_len = end - linepos;
+		linepos = end + 1;
 		read_space();
+		if (linepos >= linelen)
+			return false;
 		t = line[linepos++];
-		if (linepos >= line.size())
+		if (linepos >= linelen)
 			return false;
 	}
 	read_space();
@@ -182,11 +366,13 @@ bool Parser::get_chunk(Chunk &ret, std::string &comment) { // {{{
 	if (ret.type == 'M' && ret.code == 117) {
 		read_space();
 		ret.type = 0;
-		comment = "MSG," + line.substr(linepos);
-		linepos = line.size();
+		message = line + linepos;
+		message_len = linelen - linepos;
+		comment_len = 0;
+		linepos = linelen;
 		return false;
 	}
-	if (linepos >= line.size() || line[linepos] != '.')
+	if (linepos >= linelen || line[linepos] != '.')
 		return true;
 	linepos += 1;
 	ret.num += sign * read_fraction();
@@ -262,7 +448,7 @@ bool Parser::handle_command(bool handle_pattern) { // {{{
 					else if (arg.type == 'R')
 						R = arg.num;
 					else
-						parse_error(errors, "%" LONGFMT ": ignoring invalid parameter %c: %s", lineno, arg.type, line.c_str());
+						parse_error(errors, "%" LONGFMT ": ignoring invalid parameter %c: %.*s", lineno, arg.type, int(linelen), line);
 				}
 				if (!std::isnan(F)) {
 					current_f[code == 0 ? 0 : 1] = F * unit / 60;
@@ -338,8 +524,11 @@ bool Parser::handle_command(bool handle_pattern) { // {{{
 						flushdebug("partial flush because dist is long");
 						flush_pending(false);
 					}
-					if (handle_pattern && code == 1)
-						pending.back().pattern = pattern_data;
+					else
+						flush_window();
+					// Run files have no way to attach a pattern to the records of a segment.
+					if (handle_pattern)
+						parse_error(errors, "%" LONGFMT ": Warning: ignoring pattern, because patterns in G-Code are not supported", lineno);
 					pattern_data.clear();
 				}
 				else {
@@ -391,7 +580,7 @@ bool Parser::handle_command(bool handle_pattern) { // {{{
 					else if (arg.type == 'F')
 						F = arg.num;
 					else
-						parse_error(errors, "%" LONGFMT ": ignoring invalid arc parameter %c: %s", lineno, arg.type, line.c_str());
+						parse_error(errors, "%" LONGFMT ": ignoring invalid arc parameter %c: %.*s", lineno, arg.type, int(linelen), line);
 				}
 				if (!std::isnan(F)) {
 					current_f[1] = F * unit / 60;
@@ -520,7 +709,7 @@ bool Parser::handle_command(bool handle_pattern) { // {{{
 					else if (arg.type == 'K')
 						K = arg.num;
 					else
-						parse_error(errors, "%" LONGFMT ": ignoring invalid arc parameter %c: %s", lineno, arg.type, line.c_str());
+						parse_error(errors, "%" LONGFMT ": ignoring invalid arc parameter %c: %.*s", lineno, arg.type, int(linelen), line);
 				}
 				if (!std::isnan(F)) {
 					current_f[1] = F * unit / 60;
@@ -815,13 +1004,12 @@ int Parser::add_string(std::string const &str) { // {{{
 	if (found != strings.end())
 		return found - strings.begin();
 	strings.push_back(str);
-	stringmap.push_back(str.size());
 	return strings.size() - 1;
 } // }}}
 
-void Parser::read_space() { // {{{
+void Parser::Lexer::read_space() { // {{{
 	while (true) {
-		if (linepos >= line.size())
+		if (linepos >= linelen)
 			break;
 		if (line[linepos] == ' ' || line[linepos] == '\t' || line[linepos] == '\r') {
 			linepos += 1;
@@ -831,9 +1019,9 @@ void Parser::read_space() { // {{{
 	}
 } // }}}
 
-int Parser::read_int(double *power, int *sign) { // {{{
-	if (linepos >= line.size()) {
-		parse_error(errors, "%" LONGFMT ": int requested at end of line", lineno);
+int Parser::Lexer::read_int(double *power, int *sign) { // {{{
+	if (linepos >= linelen) {
+		int_errors += 1;
 		return 0;
 	}
 	int s = 1;
@@ -843,8 +1031,8 @@ int Parser::read_int(double *power, int *sign) { // {{{
 		// Fall through.
 	case '+':
 		linepos += 1;
-		if (linepos >= line.size()) {
-			parse_error(errors, "%" LONGFMT ": int requested at end of line", lineno);
+		if (linepos >= linelen) {
+			int_errors += 1;
 			return 0;
 		}
 		break;
@@ -856,7 +1044,7 @@ int Parser::read_int(double *power, int *sign) { // {{{
 	read_space();
 	int ret = 0;
 	while (true) {
-		if (linepos >= line.size())
+		if (linepos >= linelen)
 			return s * ret;
 		char c = line[linepos];
 		if (c < '0' || c > '9')
@@ -870,21 +1058,64 @@ int Parser::read_int(double *power, int *sign) { // {{{
 	}
 } // }}}
 
-double Parser::read_fraction() { // {{{
+double Parser::Lexer::read_fraction() { // {{{
 	double power = 1;
 	double n = read_int(&power);
 	return n / power;
 } // }}}
 
-void Parser::get_full_line() { // {{{
-	char buffer[200];
-	line.clear();
-	while (infile) {
-		infile.getline(buffer, sizeof(buffer));
-		line += buffer;
-		if (infile.fail())
-			continue;
-		break;
+void Parser::queue_slab(Slab &slab) { // {{{
+	// Put the next part of the input in slab and queue it for lexing.
+	slab.active = data_pos < data_size;
+	if (!slab.active)
+		return;
+	slab.start = data_pos;
+	slab.end = std::min(data_size, data_pos + SLAB_SIZE);
+	if (slab.end < data_size) {
+		// Extend the slab to the end of the line.
+		char const *end = reinterpret_cast <char const *>(memchr(data + slab.end, '\n', data_size - slab.end));
+		slab.end = end ? end - data + 1 : data_size;
+	}
+	data_pos = slab.end;
+	slab.lexed = false;
+	Slab *target = &slab;
+	pool->add([this, target]() {
+		lex_slab(*target);
+		target->lexed = true;
+	});
+} // }}}
+
+void Parser::lex_slab(Slab &slab) { // {{{
+	// This runs in a pool thread, so it must not use the state of the parser.
+	slab.lines.clear();
+	slab.chunks.clear();
+	size_t pos = slab.start;
+	while (pos < slab.end) {
+		Lexer lexer;
+		lexer.line = data + pos;
+		char const *end = reinterpret_cast <char const *>(memchr(lexer.line, '\n', slab.end - pos));
+		lexer.linelen = end ? end - lexer.line : slab.end - pos;
+		pos += lexer.linelen + 1;
+		lexer.linepos = 0;
+		lexer.comment = NULL;
+		lexer.comment_len = 0;
+		lexer.message = NULL;
+		lexer.message_len = 0;
+		lexer.int_errors = 0;
+		Line l;
+		l.first_chunk = slab.chunks.size();
+		Chunk chunk;
+		while (lexer.get_chunk(chunk))
+			slab.chunks.push_back(chunk);
+		l.line = lexer.line;
+		l.linelen = lexer.linelen;
+		l.comment = lexer.comment;
+		l.comment_len = lexer.comment_len;
+		l.message = lexer.message;
+		l.message_len = lexer.message_len;
+		l.int_errors = lexer.int_errors;
+		l.num_chunks = slab.chunks.size() - l.first_chunk;
+		slab.lines.push_back(l);
 	}
 } // }}}
 
@@ -913,6 +1144,9 @@ void decode_base64(std::string const &comment, int inpos, uint8_t *data, int out
 
 void Parser::initialize_pending_front() { // {{{
 	auto f = pending.begin();
+	prepared = f;
+	planned = f;
+	pending_length = 0;
 	for (int i = 0; i < 6; ++i) {
 		f->s[i] = 0;
 		f->unit[i] = 0;
@@ -923,8 +1157,152 @@ void Parser::initialize_pending_front() { // {{{
 	f->v1 = 0;
 } // }}}
 
-Parser::Parser(std::string const &infilename, std::string const &outfilename, void *errors) // {{{
-		: infile(infilename.c_str()), outfile(outfilename.c_str(), std::ios::binary), errors(errors) {
+bool Parser::handle_line(Line const &l, Chunk const *chunks) { // {{{
+	// Handle one lexed line.  Returns false if parsing should stop.
+	lineno += 1;
+	line = l.line;
+	linelen = l.linelen;
+	comment = l.comment;
+	comment_len = l.comment_len;
+	for (unsigned i = 0; i < l.int_errors; ++i)
+		parse_error(errors, "%" LONGFMT ": int requested at end of line", lineno);
+	if (l.message)
+		message = std::string(l.message, l.message_len);
+	if (comment_head(4) == "MSG,")
+		message = std::string(comment + 4, comment_len - 4);
+	if (comment_head(7) == "SYSTEM:") {
+		int s = add_string(std::string(comment + 7, comment_len - 7));
+		flushdebug("flushing for system");
+		flush_pending();
+		add_record(lineno, RUN_SYSTEM, s);
+	}
+	if (comment_head(8) == "PATTERN:") {
+		std::string comment(this->comment, comment_len);
+		// Decode base64 code for pattern.
+		uint8_t data[2 * PATTERN_MAX];
+		for (int i = 0; 4 * i + 3 < int(comment.size()) - 8 && 3 * i + 2 < 2 * PATTERN_MAX; i += 1) {
+			// input = comment[8 + 4 * i:8 + 4 * (i + 1)]
+			// output = data[3 * i:3 * (i + 1)]
+			decode_base64(comment, 8 + 4 * i, data, 3 * i);
+		}
+		int size = min(int((comment.size() - 8) / 4) * 3, 2 * PATTERN_MAX);
+		if (comment[comment.size() - 1] == '=') {
+			if (comment[comment.size() - 2] == '=')
+				size -= 2;
+			else
+				size -= 1;
+		}
+		pattern_data = std::string(reinterpret_cast <char *>(data), size);
+		//debug("read pattern (%d=%d): %s", size, pattern_data.size(), pattern_data.c_str());
+	}
+	else
+		pattern_data.clear();
+	// Chunks in [first, last) have not been handled yet.
+	unsigned first = 0, last = l.num_chunks;
+	if (first == last)
+		return true;
+	if (chunks[first].type == 'N') {
+		lineno = chunks[first].code;
+		first += 1;
+	}
+	// Chunks of all lines are stored together, so every access must stay below last.
+	if (first < last && chunks[first].type == 'S') {
+		// Spindle speed.
+		spindle_speed = chunks[first].num;
+		first += 1;
+	}
+	if (first < last && chunks[last - 1].type == '*') {
+		// Ignore checksums; the code isn't sent over an unreliable line and the checksum method is horrible anyway so if you need it, use something better.
+		last -= 1;
+	}
+	type = 0;
+	bool stop = false;
+	if (first < last && chunks[first].type == 'T') {
+		type = 'T';
+		code = chunks[first].code;
+		num = chunks[first].num;
+		first += 1;
+	}
+	while (first < last) {
+		if (chunks[first].type == 'G' || chunks[first].type == 'M' || chunks[first].type == 'D') {
+			if (type != 0) {
+				if (!handle_command(false)) {
+					stop = true;
+					break;
+				}
+				type = 0;
+			}
+			type = chunks[first].type;
+			code = chunks[first].code;
+			num = chunks[first].num;
+			first += 1;
+			continue;
+		}
+		if (type == 0) {
+			if (modetype == 0) {
+				parse_error(errors, "%" LONGFMT ": G-Code must have only G, M, T, S, or D-commands until first mode-command: %.*s", lineno, int(linelen), line);
+				break;
+			}
+			type = modetype;
+			code = modecode;
+			num = modenum;
+		}
+		command.push_back(chunks[first]);
+		first += 1;
+	}
+	if (stop)
+		return false;
+	if (type != 0) {
+		if (!pattern_data.empty() && (type != 'G' || num != 1))
+			parse_error(errors, "%" LONGFMT ": Warning: ignoring pattern comment because command is not G1", lineno);
+		if (!handle_command(!pattern_data.empty()))
+			return false;
+	}
+	return true;
+} // }}}
+
+Parser::Parser(std::string const &infilename, std::string const &outfilename, void *errors, Parse_Status *status) // {{{
+		: data(NULL), data_size(0), data_pos(0), progress_name(outfilename + RUN_PROGRESS_SUFFIX), num_records(0), max_line(0), out_size(0), errors(errors), status(status), cancelled(false) {
+	timespec start_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	// Map the input file, so lines can be tokenized in place.
+	int fd = open(infilename.c_str(), O_RDONLY);
+	if (fd < 0)
+		parse_error(errors, "unable to open input file %s: %s", infilename.c_str(), strerror(errno));
+	else {
+		struct stat st;
+		if (fstat(fd, &st) < 0)
+			parse_error(errors, "unable to stat input file %s: %s", infilename.c_str(), strerror(errno));
+		else if (st.st_size > 0) {
+			void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map == MAP_FAILED)
+				parse_error(errors, "unable to map input file %s: %s", infilename.c_str(), strerror(errno));
+			else {
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+				data = reinterpret_cast <char const *>(map);
+				data_size = st.st_size;
+				if (status)
+					status->total = data_size;
+			}
+		}
+		close(fd);
+	}
+	// Create the progress file before the output, so a reader never sees an incomplete output without it.
+	progress_fd = open(progress_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (progress_fd < 0)
+		parse_error(errors, "unable to create progress file %s: %s", progress_name.c_str(), strerror(errno));
+	outfile.open(outfilename.c_str(), std::ios::binary);
+	// Write a header without records; it is replaced when the file is complete.
+	Run_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RUN_FILE_MAGIC, sizeof(header.magic));
+	header.version = RUN_FILE_VERSION;
+	header.block_records = RUN_BLOCK_RECORDS;
+	outfile.write(reinterpret_cast <char *>(&header), sizeof(header));
+	out_size = sizeof(header);
+	block.reserve(RUN_BLOCK_RECORDS);
+	if (progress_fd >= 0)
+		report_progress(0);
 	strings.push_back("");
 	modetype = 0;
 	unit = 1;
@@ -941,136 +1319,123 @@ Parser::Parser(std::string const &infilename, std::string const &outfilename, vo
 	current_f[0] = INFINITY;
 	current_f[1] = INFINITY;
 	// Pending initial state contains the current position.
-	pending.push_front(Record(lineno, false, 0, NAN, NAN, NAN, NAN, NAN, NAN, INFINITY, NAN));
+	pending.push_back(Record(lineno, false, 0, NAN, NAN, NAN, NAN, NAN, NAN, INFINITY, NAN));
 	lineno = 0;
-	reset_pending_pos();
-	max_dev = max_deviation;
 	for (int i = 0; i < 6; ++i)
 		pos[i] = NAN;
+	reset_pending_pos();
+	max_dev = max_deviation;
 	for (int i = 0; i < 2; ++i) {
 		for (int j = 0; j < 6; ++j)
 			bbox[i][j] = NAN;
 	}
-	while (infile) {
-		get_full_line();
-		lineno += 1;
-		linepos = 0;
-		std::list <Chunk> chunks;
-		Chunk chunk;
-		std::string comment;
-		while (true) {
-			if (!get_chunk(chunk, comment))
-				break;
-			chunks.push_back(chunk);
-		}
-		if (comment.substr(0, 4) == "MSG,")
-			message = comment.substr(4);
-		if (comment.substr(0, 7) == "SYSTEM:") {
-			int s = add_string(comment.substr(7));
-			flushdebug("flushing for system");
-			flush_pending();
-			add_record(lineno, RUN_SYSTEM, s);
-		}
-		if (comment.substr(0, 4) == "PATTERN:") {
-			// Decode base64 code for pattern.
-			uint8_t data[2 * PATTERN_MAX];
-			for (int i = 0; 4 * i + 3 < int(comment.size()) - 4 && 3 * i + 2 < 2 * PATTERN_MAX; i += 1) {
-				// input = comment[4 + 4 * i:4 + 4 * (i + 1)]
-				// output = data[3 * i:3 * (i + 1)]
-				decode_base64(comment, 4 + 4 * i, data, 3 * i);
-			}
-			int size = ((comment.size() - 4) / 4) * 3;
-			if (comment[comment.size() - 1] == '=') {
-				if (comment[comment.size() - 2] == '=')
-					size -= 2;
-				else
-					size -= 1;
-			}
-			pattern_data = std::string(reinterpret_cast <char *>(data), size);
-			//debug("read pattern (%d=%d): %s", size, pattern_data.size(), pattern_data.c_str());
-		}
-		else
-			pattern_data.clear();
-		if (chunks.size() == 0)
-			continue;
-		if (chunks.front().type == 'N') {
-			lineno = chunks.front().code;
-			chunks.pop_front();
-		}
-		if (chunks.front().type == 'S') {
-			// Spindle speed.
-			spindle_speed = chunks.front().num;
-			chunks.pop_front();
-		}
-		if (chunks.back().type == '*') {
-			// Ignore checksums; the code isn't sent over an unreliable line and the checksum method is horrible anyway so if you need it, use something better.
-			chunks.pop_back();
-		}
-		type = 0;
+	// Lex the input in parallel, and handle the lines in order.
+	int num_threads = parse_threads > 0 ? parse_threads : std::thread::hardware_concurrency();
+	if (num_threads < 1)
+		num_threads = 1;
+	pool = new Pool(num_threads - 1);
+	// Enough slabs to keep all threads busy while the parser handles one of them.
+	std::vector <Slab> slab_storage(2 * num_threads + 1);
+	slabs.swap(slab_storage);
+	for (auto &slab: slabs)
+		queue_slab(slab);
+	for (size_t current = 0; slabs[current].active; current = (current + 1) % slabs.size()) {
+		Slab &slab = slabs[current];
+		pool->wait([&slab]() { return bool(slab.lexed); });
 		bool stop = false;
-		if (chunks.front().type == 'T') {
-			type = 'T';
-			code = chunks.front().code;
-			num = chunks.front().num;
-			chunks.pop_front();
-		}
-		while (chunks.size() > 0) {
-			if (chunks.front().type == 'G' || chunks.front().type == 'M' || chunks.front().type == 'D') {
-				if (type != 0) {
-					if (!handle_command(false)) {
-						stop = true;
-						break;
-					}
-					type = 0;
-				}
-				type = chunks.front().type;
-				code = chunks.front().code;
-				num = chunks.front().num;
-				chunks.pop_front();
-				continue;
-			}
-			if (type == 0) {
-				if (modetype == 0) {
-					parse_error(errors, "%" LONGFMT ": G-Code must have only G, M, T, S, or D-commands until first mode-command: %s", lineno, line.c_str());
-					break;
-				}
-				type = modetype;
-				code = modecode;
-				num = modenum;
+		for (auto &l: slab.lines) {
+			if (!handle_line(l, slab.chunks.data() + l.first_chunk)) {
+				stop = true;
+				break;
 			}
-			command.push_back(chunks.front());
-			chunks.pop_front();
 		}
 		if (stop)
 			break;
-		if (type != 0) {
-			if (!pattern_data.empty() && (type != 'G' || num != 1))
-				parse_error(errors, "%" LONGFMT ": Warning: ignoring pattern comment because command is not G1", lineno);
-			if (!handle_command(!pattern_data.empty()))
+		if (status) {
+			status->bytes = slab.end;
+			if (status->cancel) {
+				cancelled = true;
 				break;
+			}
 		}
+		queue_slab(slab);
+	}
+	if (cancelled) {
+		// Tell a reader that no more records will come, and remove the partial output.
+		debug("parsing %s cancelled after %" LONGFMT " records", infilename.c_str(), num_records);
+		outfile.close();
+		unlink(outfilename.c_str());
+		if (progress_fd >= 0) {
+			report_progress(-1);
+			close(progress_fd);
+			unlink(progress_name.c_str());
+		}
+		delete pool;
+		if (data)
+			munmap(const_cast <char *>(data), data_size);
+		return;
 	}
 	// Write final data.
 	flushdebug("flushing for EOF");
 	flush_pending();
-	// Strings.
-	for (auto str: strings)
+	write_block();
+	// Block index.
+	header.num_records = num_records;
+	header.index_offset = out_size;
+	outfile.write(reinterpret_cast <char *>(block_offsets.data()), block_offsets.size() * sizeof(int64_t));
+	out_size += block_offsets.size() * sizeof(int64_t);
+	// Seek table.
+	header.seek_offset = out_size;
+	outfile.write(reinterpret_cast <char *>(seeks.data()), seeks.size() * sizeof(Run_Seek));
+	out_size += seeks.size() * sizeof(Run_Seek);
+	// Checkpoints.
+	header.checkpoint_offset = out_size;
+	header.num_checkpoints = checkpoint_offsets.size();
+	header.checkpoint_blocks = RUN_CHECKPOINT_BLOCKS;
+	int64_t checkpoint_base = out_size + checkpoint_offsets.size() * sizeof(int64_t);
+	for (auto offset: checkpoint_offsets) {
+		int64_t pos = checkpoint_base + offset;
+		outfile.write(reinterpret_cast <char *>(&pos), sizeof(pos));
+	}
+	outfile.write(checkpoints.data(), checkpoints.size());
+	out_size = checkpoint_base + checkpoints.size();
+	// String lengths, followed by the strings.
+	header.strings_offset = out_size;
+	header.num_strings = strings.size();
+	for (auto &str: strings) {
+		uint32_t len = str.size();
+		outfile.write(reinterpret_cast <char *>(&len), sizeof(len));
+		out_size += sizeof(len);
+	}
+	for (auto &str: strings) {
 		outfile << str;
-	// String lengths.
-	for (auto str: stringmap) {
-		uint32_t bin = str;
-		outfile.write(reinterpret_cast <char *>(&bin), sizeof(bin));
+		out_size += str.size();
 	}
-	// Number of strings.
-	uint32_t strnum = strings.size() - 1;
-	outfile.write(reinterpret_cast <char *>(&strnum), sizeof(strnum));
-	// Bbox.
+	// Bbox and time.
 	for (int j = 0; j < 3; ++j) {
 		for (int i = 0; i < 2; ++i)
-			outfile.write(reinterpret_cast <char *>(&bbox[i][j]), sizeof(double));
+			header.bbox[j * 2 + i] = bbox[i][j];
+	}
+	header.time = last_time;
+	outfile.seekp(0);
+	outfile.write(reinterpret_cast <char *>(&header), sizeof(header));
+	outfile.close();
+	if (status)
+		status->bytes = data_size;
+	if (progress_fd >= 0) {
+		report_progress(1);
+		close(progress_fd);
+		unlink(progress_name.c_str());
 	}
-	// Time
-	outfile.write(reinterpret_cast <char *>(&last_time), sizeof(last_time));
+	// Stop the threads before the input they read is unmapped.
+	delete pool;
+	if (data)
+		munmap(const_cast <char *>(data), data_size);
+	// Report throughput, to keep track of parser performance.
+	timespec end_time;
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	double elapsed = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+	debug("parsed %s: %.1f MB, %" LONGFMT " records in %.3f s (%.1f MB/s, %.0f records/s)", infilename.c_str(), data_size / 1e6, num_records, elapsed, elapsed > 0 ? data_size / 1e6 / elapsed : 0., elapsed > 0 ? num_records / elapsed : 0.);
 } // }}}
 
 // Helper function to normalize a vector.
@@ -1125,61 +1490,117 @@ void Parser::flush_pending(bool finish) { // {{{
 	}
 	else if (pending.size() <= 1)
 		return;
-	// Compute static information about path. {{{
-	for (auto P0 = pending.begin(), P1 = ++pending.begin(); P1 != pending.end(); ++P0, ++P1) {
-		P0->f = min(max_v, P0->f);
-		P1->f = min(max_v, P1->f);
-		P1->e0 = (P0->e + P1->e) / 2;
-		for (int i = 0; i < 6; ++i) {
-			P1->s[i] = P1->pos[i] - P0->pos[i];
-			P1->from[i] = P0->pos[i] + P1->s[i] * .5;
-			//debug("pos %d: %f - %f = %f from %f", i, P1->pos[i], P0->pos[i], P1->s[i], P1->from[i]);
-		}
-		normalize(P1->unit, P1->s);
-		P1->length = 0;
-		for (int i = 0; i < 6; ++i) {
-			//debug("component: %f", P1->s[i]);
-			if (std::isnan(P1->s[i]))
-				P1->s[i] = 0; // If P0->x or P1->x is NaN, treat the length as zero.
-			P1->length += P1->s[i] * P1->s[i];
+	prepare_pending();
+	plan_pending();
+	// Don't write last record.
+	write_pending(--pending.end());
+	if (finish)
+		initialize_pending_front();
+	else {
+		prepared = pending.begin();
+		planned = pending.begin();
+	}
+} // }}}
+
+void Parser::in_parallel(int64_t num, std::function <void(int64_t, int64_t)> const &job) { // {{{
+	// Call job for ranges that together cover [0, num) in the pool, and wait until all are done.
+	int64_t const batch = 1024;
+	if (num <= batch) {
+		job(0, num);
+		return;
+	}
+	std::atomic <int64_t> remaining((num + batch - 1) / batch);
+	for (int64_t first = 0; first < num; first += batch) {
+		int64_t last = std::min(num, first + batch);
+		pool->add([&job, &remaining, first, last]() {
+			job(first, last);
+			remaining -= 1;
+		});
+	}
+	pool->wait([&remaining]() { return remaining == 0; });
+} // }}}
+
+void Parser::prepare_pending() { // {{{
+	// Compute static information about path, for the records that have been added since the last call.
+	// Segments only depend on their end points and corners only on the segments around them, so both are computed in parallel.
+	auto const start = prepared;
+	int64_t num = pending.end().pos - start.pos - 1;
+	if (num <= 0)
+		return;
+	start->f = min(max_v, start->f);
+	// Segments.
+	in_parallel(num, [start](int64_t first, int64_t last) {
+		for (auto P1 = start + (first + 1); P1 != start + (last + 1); ++P1) {
+			auto P0 = P1 - 1;
+			P1->f = min(max_v, P1->f);
+			P1->e0 = (P0->e + P1->e) / 2;
+			for (int i = 0; i < 6; ++i) {
+				P1->s[i] = P1->pos[i] - P0->pos[i];
+				P1->from[i] = P0->pos[i] + P1->s[i] * .5;
+				//debug("pos %d: %f - %f = %f from %f", i, P1->pos[i], P0->pos[i], P1->s[i], P1->from[i]);
+			}
+			normalize(P1->unit, P1->s);
+			P1->length = 0;
+			for (int i = 0; i < 6; ++i) {
+				//debug("component: %f", P1->s[i]);
+				if (std::isnan(P1->s[i]))
+					P1->s[i] = 0; // If P0->x or P1->x is NaN, treat the length as zero.
+				P1->length += P1->s[i] * P1->s[i];
+			}
+			P1->length = sqrt(P1->length);
 		}
-		P1->length = sqrt(P1->length);
-		/*
-		P0->n[0] = (P1->s[1] * P0->s[2]) - (P1->s[2] * P0->s[1]);
-		P0->n[1] = (P1->s[2] * P0->s[0]) - (P1->s[0] * P0->s[2]);
-		P0->n[2] = (P1->s[0] * P0->s[1]) - (P1->s[1] * P0->s[0]);
-		P0->nnAL[0] = (P0->n[2] * P0->s[1]) - (P0->n[1] * P0->s[2]);
-		P0->nnAL[1] = (P0->n[0] * P0->s[2]) - (P0->n[2] * P0->s[0]);
-		P0->nnAL[2] = (P0->n[1] * P0->s[0]) - (P0->n[0] * P0->s[1]);
-		P0->nnLK[0] = (P0->n[2] * P1->s[1]) - (P0->n[1] * P1->s[2]);
-		P0->nnLK[1] = (P0->n[0] * P1->s[2]) - (P0->n[2] * P1->s[0]);
-		P0->nnLK[2] = (P0->n[1] * P1->s[0]) - (P0->n[0] * P1->s[1]);
-		double nnAL_length = sqrt(P0->nnAL[0] * P0->nnAL[0] + P0->nnAL[1] * P0->nnAL[1] + P0->nnAL[2] * P0->nnAL[2]);
-		double nnLK_length = sqrt(P0->nnLK[0] * P0->nnLK[0] + P0->nnLK[1] * P0->nnLK[1] + P0->nnLK[2] * P0->nnLK[2]);
-		for (int i = 0; i < 6; ++i) {
-			P1->unit[i] = P1->length == 0 ? 0 : P1->s[i] / P1->length;
-			if (std::isnan(P1->unit[i]))
-				P1->unit[i] = 0;
-			if (nnAL_length > 0)
-				P0->nnAL[i] /= nnAL_length;
-			else
-				P0->nnAL[i] = 0;
-			if (nnLK_length > 0)
-				P0->nnLK[i] /= nnLK_length;
-			else
-				P0->nnLK[i] = 0;
+	});
+	// Corners.
+	in_parallel(num, [start](int64_t first, int64_t last) {
+		for (auto P1 = start + (first + 1); P1 != start + (last + 1); ++P1) {
+			auto P0 = P1 - 1;
+			/*
+			P0->n[0] = (P1->s[1] * P0->s[2]) - (P1->s[2] * P0->s[1]);
+			P0->n[1] = (P1->s[2] * P0->s[0]) - (P1->s[0] * P0->s[2]);
+			P0->n[2] = (P1->s[0] * P0->s[1]) - (P1->s[1] * P0->s[0]);
+			P0->nnAL[0] = (P0->n[2] * P0->s[1]) - (P0->n[1] * P0->s[2]);
+			P0->nnAL[1] = (P0->n[0] * P0->s[2]) - (P0->n[2] * P0->s[0]);
+			P0->nnAL[2] = (P0->n[1] * P0->s[0]) - (P0->n[0] * P0->s[1]);
+			P0->nnLK[0] = (P0->n[2] * P1->s[1]) - (P0->n[1] * P1->s[2]);
+			P0->nnLK[1] = (P0->n[0] * P1->s[2]) - (P0->n[2] * P1->s[0]);
+			P0->nnLK[2] = (P0->n[1] * P1->s[0]) - (P0->n[0] * P1->s[1]);
+			double nnAL_length = sqrt(P0->nnAL[0] * P0->nnAL[0] + P0->nnAL[1] * P0->nnAL[1] + P0->nnAL[2] * P0->nnAL[2]);
+			double nnLK_length = sqrt(P0->nnLK[0] * P0->nnLK[0] + P0->nnLK[1] * P0->nnLK[1] + P0->nnLK[2] * P0->nnLK[2]);
+			for (int i = 0; i < 6; ++i) {
+				P1->unit[i] = P1->length == 0 ? 0 : P1->s[i] / P1->length;
+				if (std::isnan(P1->unit[i]))
+					P1->unit[i] = 0;
+				if (nnAL_length > 0)
+					P0->nnAL[i] /= nnAL_length;
+				else
+					P0->nnAL[i] = 0;
+				if (nnLK_length > 0)
+					P0->nnLK[i] /= nnLK_length;
+				else
+					P0->nnLK[i] = 0;
+			}
+			*/
+			deviation(P0->nnAL, P0->s, P1->s); // XXX: check this
+			deviation(P0->nnLK, P1->s, P0->s);
+			P0->theta = acos(-P0->unit[0] * P1->unit[0] + -P0->unit[1] * P1->unit[1] + -P0->unit[2] * P1->unit[2]);
+			// The length of the first record has already been halved; the others are halved below.
+			double P0_length = P0 == start ? P0->length : P0->length / 2;
+			if (P0_length < 1e-10 || P1->length < 1e-10 || std::isnan(P0->theta))
+				P0->theta = 0;
 		}
-		*/
-		deviation(P0->nnAL, P0->s, P1->s); // XXX: check this
-		deviation(P0->nnLK, P1->s, P0->s);
-		P0->theta = acos(-P0->unit[0] * P1->unit[0] + -P0->unit[1] * P1->unit[1] + -P0->unit[2] * P1->unit[2]);
-		if (P0->length < 1e-10 || P1->length < 1e-10 || std::isnan(P0->theta))
-			P0->theta = 0;
+	});
+	for (auto P1 = start + 1; P1 != pending.end(); ++P1) {
+		pending_length += P1->length;
 		P1->length /= 2;
-	} // }}}
-	// Compute dynamic information about path, back tracking when needed. {{{
-	auto P0 = pending.begin();
-	auto P1 = ++pending.begin();
+	}
+	prepared = pending.end() - 1;
+} // }}}
+
+void Parser::plan_pending() { // {{{
+	// Compute dynamic information about path, back tracking when needed.
+	// Planning continues where the previous call stopped, so the result does not depend on how often this is called.
+	auto P0 = planned;
+	auto P1 = P0 + 1;
 	while (P1 != pending.end()) {
 		double s = -std::tan(P0->theta / 2);
 		P0->dev = std::min(max_dev, std::min(P0->length, P1->length) / (3 * -(s + 1 / s) * std::sin(P0->theta / 2)));
@@ -1229,11 +1650,15 @@ void Parser::flush_pending(bool finish) { // {{{
 		//debug("next");
 		++P0;
 		++P1;
-	} // }}}
-	// Turn Records into Run_Records and write them out.  Don't write last record. {{{
-	while (pending.size() > 1) {
-		P0 = pending.begin();
-		P1 = ++pending.begin();
+	}
+	planned = P0;
+} // }}}
+
+void Parser::write_pending(Ring::iterator stop) { // {{{
+	// Turn Records into Run_Records and write them out, until stop is the first record.
+	while (pending.begin() != stop) {
+		auto P0 = pending.begin();
+		auto P1 = P0 + 1;
 		if (P0->arc) {
 			debug("arcs are currently not supported");
 			abort();
@@ -1419,10 +1844,122 @@ void Parser::flush_pending(bool finish) { // {{{
 				}
 			}
 		}
+		pending_length -= 2 * P1->length;
 		pending.pop_front();
-	} // }}}
-	if (finish)
-		initialize_pending_front();
+	}
+} // }}}
+
+static double lowest_max_v(double x, double v_low, double v_high) { // {{{
+	// Return the minimum of compute_max_v(x, v) for v from v_low to v_high.
+	// It is not monotonic in v, so apart from the end points, check the minimum of both of its branches and the point where it switches between them.
+	// The minima follow from writing v and the result as a function of the ramp time (or total time, with max_a) and setting the derivative to 0.
+	double t_ramp_max = max_a / max_J;
+	double candidates[3];
+	// Switch between the branches.
+	candidates[0] = (x - max_a * t_ramp_max * t_ramp_max) / (2 * t_ramp_max);
+	// Minimum of the branch with constant acceleration.
+	double u = std::sqrt(x / (.45 * max_a));
+	candidates[1] = x / u - max_a * (u - t_ramp_max) / 2;
+	// Minimum of the branch without it.
+	double t = std::cbrt(x / (1.8 * max_J));
+	candidates[2] = (x - max_J * t * t * t) / (2 * t);
+	double ret = min(compute_max_v(x, v_low, max_J, max_a), compute_max_v(x, v_high, max_J, max_a));
+	for (auto v: candidates) {
+		if (v > v_low && v < v_high)
+			ret = min(ret, compute_max_v(x, v, max_J, max_a));
+	}
+	return ret;
+} // }}}
+
+void Parser::flush_window() { // {{{
+	// Write out records during a long sequence of moves, so memory use does not grow with the size of the job.
+	if (parse_window_records <= 0 && parse_window_distance <= 0)
+		return;
+	// The length of the path is only known for prepared records.  Otherwise, preparing and planning is postponed so it can be done in batches.
+	if (parse_window_distance > 0)
+		prepare_pending();
+	bool too_many = parse_window_records > 0 && int64_t(pending.size()) > parse_window_records;
+	bool too_long = parse_window_distance > 0 && pending_length > parse_window_distance;
+	if (!too_many && !too_long)
+		return;
+	prepare_pending();
+	plan_pending();
+	// Walk back from the end, computing the lowest speed that moves which are not parsed yet can force on each record.
+	// At worst, the next move makes the last record stop at the start of its segment; the corners before it can then get any speed between that and their current speed.
+	// The first record that cannot be slowed down by that is final, and so are all records before it.
+	// lowest_f[i] is the value for the i-th record from the end.
+	lowest_f.clear();
+	auto final_record = --pending.end();
+	double next_f = 0;
+	while (true) {
+		double f;
+		if (lowest_f.empty())
+			f = 0;	// The corner after the last record is not known, so it can take up the entire segment.
+		else
+			f = min(final_record->f, lowest_max_v(final_record->length + final_record->x0, min(final_record->v1, next_f), final_record->v1));
+		lowest_f.push_back(f);
+		if (!(f < final_record->f) || final_record == pending.begin())
+			break;
+		next_f = f;
+		--final_record;
+	}
+	// Keep at most half a window, so the next flush is not immediately needed again.
+	auto stop = --pending.end();
+	int64_t count = 1;
+	double length = 0;
+	while (stop != final_record) {
+		if (parse_window_records > 0 && count + 1 > parse_window_records / 2)
+			break;
+		if (parse_window_distance > 0 && length + 2 * stop->length > parse_window_distance / 2)
+			break;
+		count += 1;
+		length += 2 * stop->length;
+		--stop;
+	}
+	if (stop != final_record) {
+		// The window is too short to find a final record; plan the records before stop as if the job stops at the end of the window.
+		// Moves that are parsed later cannot slow these down further, so they are final after planning them again.
+		flushdebug("forcing %d records to be final", int(lowest_f.size() - count));
+		size_t i = lowest_f.size() - 1;
+		for (auto P = final_record; P != stop;) {
+			++P;
+			--i;
+			P->f = lowest_f[i];
+		}
+		planned = final_record;
+		plan_pending();
+	}
+	write_pending(stop);
+} // }}}
+
+void Parser::report_progress(int done) { // {{{
+	// Make the records that have been written so far available to a reader of the output.
+	// done is 1 when the file is complete and -1 when the parse was cancelled; see Run_Progress.
+	if (status)
+		status->records = num_records;
+	if (progress_fd < 0)
+		return;
+	if (done == 0)
+		outfile.flush();
+	Run_Progress progress;
+	progress.num_records = num_records - block.size();
+	progress.size = out_size;
+	progress.done = done;
+	progress.pid = getpid();
+	if (pwrite(progress_fd, &progress, sizeof(progress), 0) != sizeof(progress))
+		parse_error(errors, "unable to write progress file %s: %s", progress_name.c_str(), strerror(errno));
+} // }}}
+
+void Parser::write_block() { // {{{
+	// Encode the collected records and write them to the output.
+	if (block.empty())
+		return;
+	encoded.clear();
+	run_encode_block(block.data(), block.size(), encoded);
+	block_offsets.push_back(out_size);
+	outfile.write(encoded.data(), encoded.size());
+	out_size += encoded.size();
+	block.clear();
 } // }}}
 
 void Parser::add_record(int64_t gcode_line, RunType cmd, int tool, double x, double y, double z, double hx, double hy, double hz, double Jg, double tf, double v0, double e) { // {{{
@@ -1443,7 +1980,26 @@ void Parser::add_record(int64_t gcode_line, RunType cmd, int tool, double x, dou
 	r.time = last_time;
 	if (!std::isnan(tf))
 		last_time += tf;
-	outfile.write(reinterpret_cast <char *>(&r), sizeof(r));
+	if (block.empty()) {
+		// First record of a block.
+		Run_Seek seek;
+		seek.gcode_line = std::max(max_line, gcode_line);
+		seek.time = r.time;
+		seeks.push_back(seek);
+		if (block_offsets.size() % RUN_CHECKPOINT_BLOCKS == 0) {
+			checkpoint_offsets.push_back(checkpoints.size());
+			state.write(checkpoints);
+		}
+	}
+	max_line = std::max(max_line, gcode_line);
+	state.apply(r);
+	block.push_back(r);
+	num_records += 1;
+	// Report every block, so a job can start quickly.
+	if (block.size() >= RUN_BLOCK_RECORDS) {
+		write_block();
+		report_progress(0);
+	}
 } // }}}
 
 void Parser::add_move_record(int64_t gcode_line, RunType cmd, int tool, double X[6], bool have_abc, double h[6], double Jg, double tf, double v0, double factor, double e_start, double e_len) { // {{{
@@ -1453,9 +2009,9 @@ void Parser::add_move_record(int64_t gcode_line, RunType cmd, int tool, double X
 	add_record(gcode_line, cmd, tool, X[0], X[1], X[2], h[0], h[1], h[2], Jg, tf, v0, e_start + e_len * factor);
 } // }}}
 
-void parse_gcode(std::string const &infilename, std::string const &outfilename, void *errors) { // {{{
+bool parse_gcode(std::string const &infilename, std::string const &outfilename, void *errors, Parse_Status *status) { // {{{
 	// Create an instance of the class.  The constructor does all the work.
-	Parser p(infilename, outfilename, errors);
-	// No other actions needed.
+	Parser p(infilename, outfilename, errors, status);
+	return !p.cancelled;
 } // }}}
 // vim: set foldmethod=marker :
@@ -0,0 +1,698 @@
+/* runfile.cpp - Encoding and decoding run files for Franklin.
+ * Copyright 2018 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This file is used by both the Python module (which writes run files) and cdriver (which runs them).
+
+// Includes. {{{
+#include "module.h"
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+// }}}
+
+// Every record in a block is stored relative to the previous one; the first is relative to all zeros.
+// A record starts with a 16 bit mask of the fields that have changed, followed by those fields:
+// - type: 1 byte.
+// - tool and gcode_line: difference as a zigzag encoded varint.
+// - doubles: the bits are xored with the previous value.  One byte holds the number of leading
+//   (high nibble) and trailing (low nibble) zero bytes of the result, followed by the other bytes.
+// Consecutive moves usually share sign, exponent and the high bits of the mantissa, so this is
+// much smaller than the raw record, while still reproducing every value exactly.
+
+#define NUM_DOUBLES 11
+static size_t const double_offsets[NUM_DOUBLES] = {
+	offsetof(Run_Record, X[0]), offsetof(Run_Record, X[1]), offsetof(Run_Record, X[2]),
+	offsetof(Run_Record, h[0]), offsetof(Run_Record, h[1]), offsetof(Run_Record, h[2]),
+	offsetof(Run_Record, Jg), offsetof(Run_Record, tf), offsetof(Run_Record, v0),
+	offsetof(Run_Record, E), offsetof(Run_Record, time)
+};
+#define MASK_TYPE (1 << 0)
+#define MASK_TOOL (1 << 1)
+#define MASK_DOUBLE(i) (1 << (2 + (i)))
+#define MASK_LINE (1 << (2 + NUM_DOUBLES))
+
+static inline uint64_t get_bits(Run_Record const &r, int i) { // {{{
+	uint64_t ret;
+	memcpy(&ret, reinterpret_cast <char const *>(&r) + double_offsets[i], sizeof(ret));
+	return ret;
+} // }}}
+
+static inline void set_bits(Run_Record &r, int i, uint64_t value) { // {{{
+	memcpy(reinterpret_cast <char *>(&r) + double_offsets[i], &value, sizeof(value));
+} // }}}
+
+static inline uint8_t *put_varint(uint8_t *p, int64_t value) { // {{{
+	uint64_t v = (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+} // }}}
+
+static bool get_varint(uint8_t const *&p, uint8_t const *end, int64_t *value) { // {{{
+	uint64_t v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (p >= end)
+			return false;
+		uint8_t b = *p++;
+		v |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*value = int64_t(v >> 1) ^ -int64_t(v & 1);
+			return true;
+		}
+	}
+	return false;
+} // }}}
+
+// Largest possible encoding of a record: mask, type, two varints and all doubles.
+#define MAX_ENCODED_RECORD (2 + 1 + 2 * 10 + NUM_DOUBLES * 9)
+
+void run_encode_block(Run_Record const *records, int count, std::string &out) { // {{{
+	// Append a block, including its size and record count, to out.
+	size_t start = out.size();
+	uint32_t frame[2] = {0, uint32_t(count)};
+	out.resize(start + sizeof(frame) + count * MAX_ENCODED_RECORD);
+	uint8_t *base = reinterpret_cast <uint8_t *>(&out[start + sizeof(frame)]);
+	uint8_t *p = base;
+	Run_Record prev;
+	memset(&prev, 0, sizeof(prev));
+	for (int n = 0; n < count; ++n) {
+		Run_Record const &r = records[n];
+		uint16_t mask = 0;
+		if (r.type != prev.type)
+			mask |= MASK_TYPE;
+		if (r.tool != prev.tool)
+			mask |= MASK_TOOL;
+		uint64_t diff[NUM_DOUBLES];
+		for (int i = 0; i < NUM_DOUBLES; ++i) {
+			diff[i] = get_bits(r, i) ^ get_bits(prev, i);
+			if (diff[i] != 0)
+				mask |= MASK_DOUBLE(i);
+		}
+		if (r.gcode_line != prev.gcode_line)
+			mask |= MASK_LINE;
+		memcpy(p, &mask, sizeof(mask));
+		p += sizeof(mask);
+		if (mask & MASK_TYPE)
+			*p++ = r.type;
+		if (mask & MASK_TOOL)
+			p = put_varint(p, int64_t(r.tool) - prev.tool);
+		for (int i = 0; i < NUM_DOUBLES; ++i) {
+			if (!diff[i])
+				continue;
+			int lz = __builtin_clzll(diff[i]) / 8;
+			int tz = __builtin_ctzll(diff[i]) / 8;
+			*p++ = (lz << 4) | tz;
+			uint64_t bits = diff[i] >> (8 * tz);
+			for (int b = tz; b < 8 - lz; ++b) {
+				*p++ = bits;
+				bits >>= 8;
+			}
+		}
+		if (mask & MASK_LINE)
+			p = put_varint(p, r.gcode_line - prev.gcode_line);
+		prev = r;
+	}
+	frame[0] = p - base;
+	memcpy(&out[start], frame, sizeof(frame));
+	out.resize(start + sizeof(frame) + frame[0]);
+} // }}}
+
+static bool decode_block(uint8_t const *p, uint8_t const *end, int count, Run_Record *records) { // {{{
+	Run_Record prev;
+	memset(&prev, 0, sizeof(prev));
+	for (int n = 0; n < count; ++n) {
+		Run_Record &r = records[n];
+		r = prev;
+		uint16_t mask;
+		if (end - p < int(sizeof(mask)))
+			return false;
+		memcpy(&mask, p, sizeof(mask));
+		p += sizeof(mask);
+		if (mask & MASK_TYPE) {
+			if (p >= end)
+				return false;
+			r.type = *p++;
+		}
+		int64_t delta;
+		if (mask & MASK_TOOL) {
+			if (!get_varint(p, end, &delta))
+				return false;
+			r.tool = int32_t(prev.tool + delta);
+		}
+		for (int i = 0; i < NUM_DOUBLES; ++i) {
+			if (!(mask & MASK_DOUBLE(i)))
+				continue;
+			if (p >= end)
+				return false;
+			int lz = *p >> 4;
+			int tz = *p++ & 0xf;
+			if (lz + tz >= 8 || end - p < 8 - lz - tz)
+				return false;
+			uint64_t diff = 0;
+			for (int b = tz; b < 8 - lz; ++b)
+				diff |= uint64_t(*p++) << (8 * b);
+			set_bits(r, i, get_bits(prev, i) ^ diff);
+		}
+		if (mask & MASK_LINE) {
+			if (!get_varint(p, end, &delta))
+				return false;
+			r.gcode_line = prev.gcode_line + delta;
+		}
+		prev = r;
+	}
+	return p == end;
+} // }}}
+
+bool Run_Reader::open(char const *data, int64_t data_size) { // {{{
+	// Use a (new) mapping of a run file.  Returns false if it is not a valid run file.
+	map = NULL;
+	size = 0;
+	blocks.clear();
+	num_records = 0;
+	cached_block[0] = -1;
+	cached_block[1] = -1;
+	if (data_size < int64_t(sizeof(Run_Header)))
+		return false;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, RUN_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != RUN_FILE_VERSION || header.block_records == 0)
+		return false;
+	cache[0].resize(header.block_records);
+	cache[1].resize(header.block_records);
+	map = data;
+	size = data_size;
+	scan_pos = sizeof(Run_Header);
+	if (!complete())
+		return update(data, data_size);
+	// Use the index.
+	int64_t num_blocks = (header.num_records + header.block_records - 1) / header.block_records;
+	if (header.num_records < 0 || header.index_offset < 0 || header.index_offset + num_blocks * int64_t(sizeof(int64_t)) > size
+			|| header.seek_offset < 0 || header.seek_offset + num_blocks * int64_t(sizeof(Run_Seek)) > size
+			|| header.checkpoint_offset < 0 || header.checkpoint_offset + int64_t(header.num_checkpoints) * int64_t(sizeof(int64_t)) > size || header.checkpoint_blocks == 0
+			|| header.strings_offset < 0 || header.strings_offset + int64_t(header.num_strings) * int64_t(sizeof(uint32_t)) > size) {
+		map = NULL;
+		return false;
+	}
+	blocks.resize(num_blocks);
+	memcpy(blocks.data(), &map[header.index_offset], num_blocks * sizeof(int64_t));
+	num_records = header.num_records;
+	return true;
+} // }}}
+
+bool Run_Reader::update(char const *data, int64_t data_size) { // {{{
+	// The file has grown while it is being written; find the new blocks.
+	map = data;
+	size = data_size;
+	if (complete())
+		return true;
+	while (scan_pos + 2 * int64_t(sizeof(uint32_t)) <= size) {
+		uint32_t frame[2];
+		memcpy(frame, &map[scan_pos], sizeof(frame));
+		if (scan_pos + int64_t(sizeof(frame)) + frame[0] > size)
+			break;
+		blocks.push_back(scan_pos);
+		num_records += frame[1];
+		scan_pos += sizeof(frame) + frame[0];
+	}
+	return true;
+} // }}}
+
+Run_Record const *Run_Reader::get(int64_t index) { // {{{
+	// Returns NULL if the record does not exist or cannot be decoded.
+	if (!map || index < 0 || index >= num_records)
+		return NULL;
+	int64_t block = index / header.block_records;
+	int slot = cached_block[0] == block ? 0 : cached_block[1] == block ? 1 : -1;
+	if (slot < 0) {
+		slot = cache_old;
+		cached_block[slot] = -1;
+		if (block >= int64_t(blocks.size()) || blocks[block] + 2 * int64_t(sizeof(uint32_t)) > size)
+			return NULL;
+		uint32_t frame[2];
+		memcpy(frame, &map[blocks[block]], sizeof(frame));
+		uint8_t const *start = reinterpret_cast <uint8_t const *>(&map[blocks[block] + sizeof(frame)]);
+		if (frame[1] > header.block_records || blocks[block] + int64_t(sizeof(frame)) + frame[0] > size || !decode_block(start, start + frame[0], frame[1], cache[slot].data()))
+			return NULL;
+		cached_block[slot] = block;
+	}
+	cache_old = 1 - slot;
+	return &cache[slot][index % header.block_records];
+} // }}}
+
+bool Run_Reader::get_string(uint32_t index, char const **data, uint32_t *len) const { // {{{
+	if (!map || !complete() || index >= header.num_strings)
+		return false;
+	uint32_t const *lengths = reinterpret_cast <uint32_t const *>(&map[header.strings_offset]);
+	int64_t pos = header.strings_offset + int64_t(header.num_strings) * sizeof(uint32_t);
+	for (uint32_t i = 0; i < index; ++i)
+		pos += lengths[i];
+	if (pos + lengths[index] > size)
+		return false;
+	*data = &map[pos];
+	*len = lengths[index];
+	return true;
+} // }}}
+
+// Seeking. {{{
+// Every block has a Run_Seek entry for its first record, so a line or time can be found with a
+// binary search over the blocks, followed by a scan of one block.  The state of the machine is
+// found by replaying the records from the last checkpoint before the target.
+
+static Run_Seek get_seek(char const *map, Run_Header const &header, int64_t block) { // {{{
+	Run_Seek ret;
+	memcpy(&ret, &map[header.seek_offset + block * sizeof(Run_Seek)], sizeof(ret));
+	return ret;
+} // }}}
+
+int64_t Run_Reader::find_line(int64_t line) { // {{{
+	// Returns the first record for line or a later line, num_records if there is none, or -1 on error.
+	int64_t start = 0;
+	if (complete()) {
+		// Find the first block that starts at or after line; the record is before it.
+		int64_t lo = 0, hi = blocks.size();
+		while (lo < hi) {
+			int64_t mid = (lo + hi) / 2;
+			if (get_seek(map, header, mid).gcode_line < line)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == 0)
+			return 0;
+		start = (lo - 1) * header.block_records;
+	}
+	for (int64_t i = start; i < num_records; ++i) {
+		Run_Record const *r = get(i);
+		if (!r)
+			return -1;
+		if (r->gcode_line >= line)
+			return i;
+	}
+	return num_records;
+} // }}}
+
+int64_t Run_Reader::find_time(double time) { // {{{
+	// Returns the last record that starts at or before time, or -1 on error.
+	int64_t start = 0;
+	if (complete()) {
+		// Find the first block that starts after time; the record is before it.
+		int64_t lo = 0, hi = blocks.size();
+		while (lo < hi) {
+			int64_t mid = (lo + hi) / 2;
+			if (!(get_seek(map, header, mid).time > time))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == 0)
+			return 0;
+		start = (lo - 1) * header.block_records;
+	}
+	int64_t ret = start;
+	for (int64_t i = start; i < num_records; ++i) {
+		Run_Record const *r = get(i);
+		if (!r)
+			return -1;
+		if (r->time > time)
+			break;
+		ret = i;
+	}
+	return ret;
+} // }}}
+
+bool Run_Reader::state_at(int64_t record, Run_State *state) { // {{{
+	// Compute the state of the machine before record is run.
+	*state = Run_State();
+	if (record < 0 || record > num_records)
+		return false;
+	if (complete() && header.num_checkpoints > 0) {
+		int64_t c = std::min(record / (int64_t(header.checkpoint_blocks) * header.block_records), int64_t(header.num_checkpoints) - 1);
+		int64_t offset;
+		memcpy(&offset, &map[header.checkpoint_offset + c * sizeof(int64_t)], sizeof(offset));
+		if (offset < 0 || offset >= size || !state->read(&map[offset], size - offset))
+			return false;
+	}
+	for (int64_t i = state->record; i < record; ++i) {
+		Run_Record const *r = get(i);
+		if (!r)
+			return false;
+		state->apply(*r);
+	}
+	return true;
+} // }}}
+
+void Run_State::apply(Run_Record const &r) { // {{{
+	record += 1;
+	switch (r.type) {
+	case RUN_POLY3PLUS:
+	case RUN_POLY3MINUS:
+	case RUN_POLY2:
+	case RUN_ARC:
+	case RUN_GOTO:
+		tool = r.tool;
+		for (int i = 0; i < 3; ++i) {
+			if (!std::isnan(r.X[i]))
+				X[i] = r.X[i];
+		}
+		if (!std::isnan(r.E))
+			E = r.E;
+		break;
+	case RUN_SETPOS:
+		tool = r.tool;
+		E = r.E;
+		break;
+	case RUN_SETTEMP:
+		temps[r.tool] = r.X[0];
+		break;
+	case RUN_GPIO:
+		gpios[r.tool] = r.X[0];
+		break;
+	default:
+		break;
+	}
+} // }}}
+
+// Checkpoint format:
+// int64_t record, int32_t tool, double X[3], double E, uint32_t num_temps, uint32_t num_gpios,
+// followed by (int32_t channel, double value) for every temp and then for every gpio.
+template <typename T> static void put(std::string &out, T value) { // {{{
+	out.append(reinterpret_cast <char const *>(&value), sizeof(value));
+} // }}}
+
+template <typename T> static bool get(char const *&p, char const *end, T *value) { // {{{
+	if (end - p < int64_t(sizeof(T)))
+		return false;
+	memcpy(value, p, sizeof(T));
+	p += sizeof(T);
+	return true;
+} // }}}
+
+void Run_State::write(std::string &out) const { // {{{
+	put(out, record);
+	put(out, tool);
+	for (int i = 0; i < 3; ++i)
+		put(out, X[i]);
+	put(out, E);
+	put(out, uint32_t(temps.size()));
+	put(out, uint32_t(gpios.size()));
+	for (auto &t: temps) {
+		put(out, t.first);
+		put(out, t.second);
+	}
+	for (auto &g: gpios) {
+		put(out, g.first);
+		put(out, g.second);
+	}
+} // }}}
+
+bool Run_State::read(char const *data, int64_t size) { // {{{
+	char const *end = data + size;
+	uint32_t num_temps, num_gpios;
+	if (!get(data, end, &record) || !get(data, end, &tool) || !get(data, end, &X[0]) || !get(data, end, &X[1]) || !get(data, end, &X[2]) || !get(data, end, &E) || !get(data, end, &num_temps) || !get(data, end, &num_gpios))
+		return false;
+	temps.clear();
+	gpios.clear();
+	for (uint32_t i = 0; i < num_temps + num_gpios; ++i) {
+		int32_t which;
+		double value;
+		if (!get(data, end, &which) || !get(data, end, &value))
+			return false;
+		(i < num_temps ? temps : gpios)[which] = value;
+	}
+	return true;
+} // }}}
+// }}}
+
+// Spatial index. {{{
+// Every move is a line segment from the end of the previous move.  Like the scan that
+// this replaces, only RUN_POLY3PLUS and RUN_POLY3MINUS records are used, and the result
+// is exactly the same.  Coordinates that are NaN in a record keep their previous value.
+// Only the requested coordinates are used, and a move can only match if they have all
+// been set by an earlier move; this is what first_known is for.
+
+struct Spatial_File_Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	Run_Header run;	// Header of the run file that this index belongs to.
+	int64_t num_segments;
+	int64_t num_nodes;
+	int64_t first_known[8];
+} __attribute__((__packed__));
+
+static void segment_bbox(Run_Segment const *segments, int32_t count, double bbox[6], int64_t *min_record) { // {{{
+	*min_record = INT64_MAX;
+	for (int k = 0; k < 3; ++k) {
+		bbox[2 * k] = INFINITY;
+		bbox[2 * k + 1] = -INFINITY;
+	}
+	for (int32_t i = 0; i < count; ++i) {
+		*min_record = std::min(*min_record, segments[i].record);
+		for (int k = 0; k < 3; ++k) {
+			if (std::isnan(segments[i].start[k]) || std::isnan(segments[i].end[k])) {
+				// This segment is never used when coordinate k is requested, so coordinate k cannot limit the box.
+				bbox[2 * k] = -INFINITY;
+				bbox[2 * k + 1] = INFINITY;
+				continue;
+			}
+			bbox[2 * k] = std::min(bbox[2 * k], std::min(segments[i].start[k], segments[i].end[k]));
+			bbox[2 * k + 1] = std::max(bbox[2 * k + 1], std::max(segments[i].start[k], segments[i].end[k]));
+		}
+	}
+	// The computed closest point can be outside the segment by a rounding error; make sure the box is never closer than it.
+	for (int k = 0; k < 3; ++k) {
+		bbox[2 * k] -= 1e-9 * (1 + std::fabs(bbox[2 * k]));
+		bbox[2 * k + 1] += 1e-9 * (1 + std::fabs(bbox[2 * k + 1]));
+	}
+} // }}}
+
+static void build_node(std::vector <Run_Spatial_Node> &nodes, Run_Segment *segments, int32_t first, int32_t count) { // {{{
+	int32_t n = nodes.size();
+	nodes.push_back(Run_Spatial_Node());
+	segment_bbox(&segments[first], count, nodes[n].bbox, &nodes[n].min_record);
+	if (count <= RUN_SPATIAL_LEAF) {
+		nodes[n].first = first;
+		nodes[n].count = count;
+		return;
+	}
+	// Split at the median of the segment centers, along the longest side of the box.
+	int axis = 0;
+	for (int k = 1; k < 3; ++k) {
+		if (nodes[n].bbox[2 * k + 1] - nodes[n].bbox[2 * k] > nodes[n].bbox[2 * axis + 1] - nodes[n].bbox[2 * axis])
+			axis = k;
+	}
+	int32_t half = count / 2;
+	std::nth_element(&segments[first], &segments[first + half], &segments[first + count], [axis](Run_Segment const &a, Run_Segment const &b) {
+		return a.start[axis] + a.end[axis] < b.start[axis] + b.end[axis];
+	});
+	build_node(nodes, segments, first, half);
+	int32_t second = nodes.size();
+	build_node(nodes, segments, first + half, count - half);
+	nodes[n].first = second;
+	nodes[n].count = 0;
+} // }}}
+
+void Run_Spatial_Index::clear() { // {{{
+	segments.clear();
+	nodes.clear();
+	for (int m = 0; m < 8; ++m)
+		first_known[m] = INT64_MAX;
+} // }}}
+
+bool Run_Spatial_Index::build(Run_Reader &reader, int64_t num_records) { // {{{
+	// Returns false if the run file could not be read.
+	clear();
+	double current[3] = {NAN, NAN, NAN};
+	for (int64_t i = 0; i < num_records; ++i) {
+		Run_Record const *r = reader.get(i);
+		if (!r)
+			return false;
+		if (r->type != RUN_POLY3PLUS && r->type != RUN_POLY3MINUS)
+			continue;
+		int have = 0;
+		for (int k = 0; k < 3; ++k) {
+			if (!std::isnan(r->X[k]))
+				have |= 1 << k;
+		}
+		for (int m = 1; m < 8; ++m) {
+			if ((have & m) == m && first_known[m] == INT64_MAX)
+				first_known[m] = i;
+		}
+		Run_Segment s;
+		for (int k = 0; k < 3; ++k) {
+			s.start[k] = current[k];
+			if (!std::isnan(r->X[k]))
+				current[k] = r->X[k];
+			s.end[k] = current[k];
+		}
+		s.record = i;
+		// A move without length never matches.
+		if (s.start[0] != s.end[0] || s.start[1] != s.end[1] || s.start[2] != s.end[2])
+			segments.push_back(s);
+	}
+	if (segments.size() >= 0x7fffffff) {
+		clear();
+		return false;
+	}
+	if (!segments.empty())
+		build_node(nodes, segments.data(), 0, segments.size());
+	return true;
+} // }}}
+
+bool Run_Spatial_Index::load(std::string const &filename, Run_Header const &header) { // {{{
+	clear();
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	Spatial_File_Header h;
+	bool ok = read(fd, &h, sizeof(h)) == sizeof(h) && memcmp(h.magic, RUN_SPATIAL_MAGIC, sizeof(h.magic)) == 0 && h.version == RUN_SPATIAL_VERSION && memcmp(&h.run, &header, sizeof(header)) == 0 && h.num_segments >= 0 && h.num_segments < 0x7fffffff && h.num_nodes >= 0 && h.num_nodes < 0x7fffffff;
+	if (ok) {
+		memcpy(first_known, h.first_known, sizeof(first_known));
+		segments.resize(h.num_segments);
+		nodes.resize(h.num_nodes);
+		ssize_t ssize = h.num_segments * sizeof(Run_Segment);
+		ssize_t nsize = h.num_nodes * sizeof(Run_Spatial_Node);
+		ok = read(fd, segments.data(), ssize) == ssize && read(fd, nodes.data(), nsize) == nsize;
+	}
+	close(fd);
+	// Check the tree, so a damaged file cannot make find() read out of bounds.
+	for (size_t n = 0; ok && n < nodes.size(); ++n) {
+		if (nodes[n].count == 0)
+			ok = n + 1 < nodes.size() && nodes[n].first > int32_t(n) && size_t(nodes[n].first) < nodes.size();
+		else
+			ok = nodes[n].count > 0 && nodes[n].first >= 0 && size_t(nodes[n].first) + nodes[n].count <= segments.size();
+	}
+	if (!ok)
+		clear();
+	return ok;
+} // }}}
+
+void Run_Spatial_Index::save(std::string const &filename, Run_Header const &header) const { // {{{
+	// Failure is not a problem: the index is built again next time.
+	std::string tmpname = filename + ".tmp";
+	int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return;
+	Spatial_File_Header h;
+	memcpy(h.magic, RUN_SPATIAL_MAGIC, sizeof(h.magic));
+	h.version = RUN_SPATIAL_VERSION;
+	h.reserved = 0;
+	h.run = header;
+	h.num_segments = segments.size();
+	h.num_nodes = nodes.size();
+	memcpy(h.first_known, first_known, sizeof(first_known));
+	ssize_t ssize = segments.size() * sizeof(Run_Segment);
+	ssize_t nsize = nodes.size() * sizeof(Run_Spatial_Node);
+	bool ok = write(fd, &h, sizeof(h)) == sizeof(h) && write(fd, segments.data(), ssize) == ssize && write(fd, nodes.data(), nsize) == nsize;
+	close(fd);
+	if (!ok || rename(tmpname.c_str(), filename.c_str()) < 0)
+		unlink(tmpname.c_str());
+} // }}}
+
+static double box_distance(double const bbox[6], double const pos[3]) { // {{{
+	// Square of the distance from pos to the box; a lower bound for everything in it.
+	double ret = 0;
+	for (int k = 0; k < 3; ++k) {
+		if (std::isnan(pos[k]))
+			continue;
+		double d = std::max(std::max(bbox[2 * k] - pos[k], pos[k] - bbox[2 * k + 1]), 0.);
+		ret += d * d;
+	}
+	return ret;
+} // }}}
+
+double Run_Spatial_Index::find(double const pos[3]) const { // {{{
+	// Find position in toolpath that is closest to requested position; NaN coordinates are ignored.
+	int mask = 0;
+	for (int k = 0; k < 3; ++k) {
+		if (!std::isnan(pos[k]))
+			mask |= 1 << k;
+	}
+	if (nodes.empty() || mask == 0 || first_known[mask] == INT64_MAX)
+		return NAN;
+	// Moves up to and including the one that first sets all requested coordinates have no valid start.
+	int64_t first = first_known[mask] + 1;
+	double dist = INFINITY;
+	int64_t record = -1;
+	double record_fraction = NAN;
+	int32_t stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		int32_t n = stack[--sp];
+		Run_Spatial_Node const &node = nodes[n];
+		// Equally close moves only matter if they are earlier.
+		double bound = box_distance(node.bbox, pos);
+		if (bound > dist || (bound == dist && node.min_record > record))
+			continue;
+		if (node.count == 0) {
+			if (sp + 2 > 64) {
+				// Cannot happen for a balanced tree; refuse to overflow on a damaged one.
+				break;
+			}
+			// Visit the closest child first, so the other one can often be skipped.
+			if (box_distance(nodes[n + 1].bbox, pos) <= box_distance(nodes[node.first].bbox, pos)) {
+				stack[sp++] = node.first;
+				stack[sp++] = n + 1;
+			}
+			else {
+				stack[sp++] = n + 1;
+				stack[sp++] = node.first;
+			}
+			continue;
+		}
+		for (int32_t i = node.first; i < node.first + node.count; ++i) {
+			// This is the same computation as the scan in run_find_pos(), so the result is identical.
+			Run_Segment const &s = segments[i];
+			if (s.record < first)
+				continue;
+			double pt = 0, tt = 0;
+			for (int k = 0; k < 3; ++k) {
+				if (std::isnan(pos[k]))
+					continue;
+				pt += (pos[k] - s.start[k]) * (s.end[k] - s.start[k]);
+				tt += (s.end[k] - s.start[k]) * (s.end[k] - s.start[k]);
+			}
+			double fraction = pt / tt;
+			if (fraction < 0)
+				fraction = 0;
+			if (fraction > 1)
+				fraction = 1;
+			double d = 0;
+			for (int k = 0; k < 3; ++k) {
+				if (std::isnan(pos[k]))
+					continue;
+				double dd = pos[k] - ((s.end[k] - s.start[k]) * fraction + s.start[k]);
+				d += dd * dd;
+			}
+			// The scan returns the first of equally close moves.
+			if (d < dist || (d == dist && s.record < record)) {
+				dist = d;
+				record = s.record;
+				record_fraction = fraction;
+			}
+		}
+	}
+	return record < 0 ? NAN : record + record_fraction;
+} // }}}
+// }}}
+// vim: set foldmethod=marker :
@@ -19,6 +19,8 @@ cdrivermodule = Extension('cdriver',
 		sources = [
 			'module.cpp',
 			'parse.cpp',
+			'cache.cpp',
+			'runfile.cpp',
 		],
 		depends = [
 			'setup.py',
@@ -26,7 +28,8 @@ cdrivermodule = Extension('cdriver',
 		],
 		define_macros = macros,
 		language = 'c++',
-		extra_compile_args = ['-std=c++11'],
+		extra_compile_args = ['-std=c++11', '-pthread'],
+		extra_link_args = ['-pthread'],
 	)
 
 setup(name = 'cdriver',
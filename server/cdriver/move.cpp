@@ -19,9 +19,13 @@
  * }}} */
 
 #include "cdriver.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 
 //#define mdebug(...) debug(__VA_ARGS__)
 //#define debug_abort() abort()
+//#define CHECK_MOTOR_LIMITS	// Check motor limits for every sample, not only per move.
 
 #ifndef mdebug
 #define mdebug(...) do {} while (0)
@@ -33,12 +37,19 @@
 
 #define warning debug
 
+static void motion_notify();
+
+static bool fragment_sending() { // {{{
+	// The motion thread only queues fragments; the main thread sends them, so only it has to wait for that.
+	return sending_fragment && !motion_thread_self();
+} // }}}
+
 static void send_fragment() { // {{{
 	if (host_block) {
 		current_fragment_pos = 0;
 		return;
 	}
-	if (current_fragment_pos <= 0 || stopping || sending_fragment) {
+	if (current_fragment_pos <= 0 || stopping || fragment_sending()) {
 		//debug("no send fragment %d %d %d", current_fragment_pos, stopping, sending_fragment);
 		return;
 	}
@@ -63,18 +74,78 @@ static void send_fragment() { // {{{
 		if (!aborting && (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER >= MIN_BUFFER_FILL && !stopping) {
 			arch_start_move(0);
 		}
+		motion_notify();
 	}
 	else {
 		// Reset current_fragment_pos anyway, otherwise store_settings will complain.
 		current_fragment_pos = 0;
 	}
-	while (sending_fragment) {
+	while (fragment_sending()) {
 		//debug("waiting for sending fragment to be 0 from %d", sending_fragment);
 		serial_wait();
 	}
 	store_settings();
 } // }}}
 
+static double plan_move();
+static bool run_replan();
+static void plan_run(bool start);
+static void plan_next();
+static double run_limits(double limit);
+static int sample_period();
+static void plan_stream();
+
+static void move_setup(MoveCommand const &mc) { // {{{
+	// Set up the polynomial of mc, which starts at the source of the axes in space 0.
+	settings.end_time = mc.tf * 1e6;
+	settings.run_time = mc.time;
+	settings.Jh = 0;
+	double leng = 0;
+	for (int i = 0; i < 3; ++i) {
+		if (i >= spaces[0].num_axes) {
+			settings.unitg[i] = 0;
+			settings.unith[i] = 0;
+			continue;
+		}
+		settings.unitg[i] = mc.target[i] - spaces[0].axis[i]->settings.source;
+		settings.unith[i] = mc.unith[i];
+		leng += settings.unitg[i] * settings.unitg[i];
+	}
+	settings.Jh = mc.Jh;
+	leng = std::sqrt(leng);
+	for (int i = 0; i < 3; ++i) {
+		settings.unitg[i] /= leng;
+	}
+	double t = settings.end_time / 1e6;
+	double t2 = t * t;
+	double t3 = t2 * t;
+	if (mc.reverse) {
+		//debug("set reverse from J %f v %f", mc.Jg, mc.v0);
+		settings.x0h = mc.Jh / 6 * t3;
+		settings.v0h = -mc.Jh / 2 * t2;
+		settings.a0h = mc.Jh * t;
+		settings.Jh = -mc.Jh;
+		settings.x0g = leng - (mc.Jg / 6 * t3 + mc.v0 * t);
+		settings.v0g = mc.v0 + mc.Jg / 2 * t2;
+		settings.a0g = -mc.Jg * t;
+		settings.Jg = mc.Jg;
+	}
+	else {
+		settings.Jg = mc.Jg;
+		settings.a0g = mc.a0;
+		settings.v0g = mc.v0;
+		settings.x0g = 0;
+		settings.a0h = 0;
+		settings.v0h = 0;
+		settings.x0h = 0;
+	}
+} // }}}
+
+static bool move_at_rest() { // {{{
+	// Check if the move that was set up starts from a standstill.
+	return std::fabs(settings.v0g) + std::fabs(settings.v0h) < 1e-6;
+} // }}}
+
 // For documentation about variables used here, see struct History in cdriver.h
 void next_move(int32_t start_time) { // {{{
 	if (stopping) {
@@ -84,6 +155,8 @@ void next_move(int32_t start_time) { // {{{
 	//debug("next move, computing=%d, start time=%d, current time=%d, queue %d -> %d", computing_move, start_time, settings.hwtime, settings.queue_start, settings.queue_end);
 	probing = false;
 	factor = 0;
+	if (settings.queue_start == settings.queue_end && !resume_pending)
+		plan_stream();
 	if (settings.queue_start == settings.queue_end) {
 		if (resume_pending) {
 			memcpy(&settings, &resume.settings, sizeof(History));
@@ -115,7 +188,7 @@ void next_move(int32_t start_time) { // {{{
 	// Clean up state before starting the move (but not if there is no next move; in that case finish the current tick before sending).
 	if (current_fragment_pos > 0) {
 		//debug("sending because new move is started");
-		while (sending_fragment)
+		while (fragment_sending())
 			serial_wait();
 		if (host_block || stopping || discard_pending || stop_pending) {
 			//debug("not moving yet");
@@ -209,49 +282,7 @@ void next_move(int32_t start_time) { // {{{
 		}
 	} // }}}
 
-	// TODO: use feedrate.
-	settings.end_time = queue[q].tf * 1e6;
-	settings.run_time = queue[q].time;
-	settings.Jh = 0;
-	double leng = 0;
-	for (int i = 0; i < 3; ++i) {
-		if (i >= sp0.num_axes) {
-			settings.unitg[i] = 0;
-			settings.unith[i] = 0;
-			continue;
-		}
-		settings.unitg[i] = queue[q].target[i] - spaces[0].axis[i]->settings.source;
-		settings.unith[i] = queue[q].unith[i];
-		leng += settings.unitg[i] * settings.unitg[i];
-	}
-	settings.Jh = queue[q].Jh;
-	leng = std::sqrt(leng);
-	for (int i = 0; i < 3; ++i) {
-		settings.unitg[i] /= leng;
-	}
-	double t = settings.end_time / 1e6;
-	double t2 = t * t;
-	double t3 = t2 * t;
-	if (queue[q].reverse) {
-		//debug("set reverse from J %f v %f", queue[q].Jg, queue[q].v0);
-		settings.x0h = queue[q].Jh / 6 * t3;
-		settings.v0h = -queue[q].Jh / 2 * t2;
-		settings.a0h = queue[q].Jh * t;
-		settings.Jh = -queue[q].Jh;
-		settings.x0g = leng - (queue[q].Jg / 6 * t3 + queue[q].v0 * t);
-		settings.v0g = queue[q].v0 + queue[q].Jg / 2 * t2;
-		settings.a0g = -queue[q].Jg * t;
-		settings.Jg = queue[q].Jg;
-	}
-	else {
-		settings.Jg = queue[q].Jg;
-		settings.a0g = queue[q].a0;
-		settings.v0g = queue[q].v0;
-		settings.x0g = 0;
-		settings.a0h = 0;
-		settings.v0h = 0;
-		settings.x0h = 0;
-	}
+	move_setup(queue[q]);
 
 	// Info for 3-D robot
 	if (spaces[0].num_axes >= 3)
@@ -298,23 +329,48 @@ void next_move(int32_t start_time) { // {{{
 		spaces[2].axis[~queue[q].tool]->settings.endpos = queue[q].e;
 		mdebug("move follower to %f, current=%f source=%f current_pos=%f", queue[q].e, spaces[2].axis[~queue[q].tool]->current, spaces[2].axis[~queue[q].tool]->settings.source, spaces[2].motor[~queue[q].tool]->settings.current_pos);
 	}
-	auto last_hwtime_step = settings.hwtime_step;
+	auto last_base_hwtime_step = base_hwtime_step;
 	if (queue[q].pattern_size > 0) {
 		memcpy(settings.pattern, queue[q].pattern, queue[q].pattern_size);
-		settings.hwtime_step = settings.end_time / (queue[q].pattern_size * 8);
-		if (settings.hwtime_step < min_hwtime_step)
-			settings.hwtime_step = min_hwtime_step;
+		base_hwtime_step = settings.end_time / (queue[q].pattern_size * 8);
+		if (base_hwtime_step < min_hwtime_step)
+			base_hwtime_step = min_hwtime_step;
 	}
 	settings.pattern_size = queue[q].pattern_size;
 	for (int a = 0; a < min(6, spaces[0].num_axes); ++a) {
 		mdebug("setting endpos %d %d to target %f", 0, a, queue[q].target[a]);
 		spaces[0].axis[a]->settings.endpos = queue[q].target[a];
 	}
+	bool at_rest = move_at_rest();
+	if (!at_rest)
+		settings.run_move += 1;
+	if (at_rest || run_replan()) {
+		// This starts a new run of connected moves, or it must be planned again.
+		settings.run_index += 1;
+		settings.run_move = 0;
+		plan_run(at_rest);
+	}
+	else
+		plan_next();
+	// Patterns are timed by the firmware setup; other moves are checked against the motor limits and get a sample period that fits their speed.
+	double limit = INFINITY;
+	if (settings.pattern_size > 0)
+		settings.hwtime_step = base_hwtime_step;
+	else {
+		limit = plan_move();
+		settings.hwtime_step = sample_period();
+	}
+	double start_limit = run_limits(limit);
+	if (at_rest) {
+		// The time warp can change instantly, because nothing moves; within the run it only changes gradually.
+		settings.feed = min(feedrate, start_limit);
+		settings.feed_rate = 0;
+	}
 	store_settings();
-	if (settings.hwtime_step != last_hwtime_step)
+	if (base_hwtime_step != last_base_hwtime_step)
 		arch_globals_change();
 	settings.queue_start += 1;
-	first_fragment = current_fragment;	// Do this every time, because otherwise the queue must be regenerated.	TODO: send partial fragment to make sure this hack actually works, or fix it properly.
+	__atomic_store_n(&first_fragment, current_fragment, __ATOMIC_RELAXED);	// Do this every time, because otherwise the queue must be regenerated.	TODO: send partial fragment to make sure this hack actually works, or fix it properly.
 	for (int i = 0; i < 6; ++i) {
 		if (i >= spaces[0].num_axes)
 			break;
@@ -330,6 +386,7 @@ void next_move(int32_t start_time) { // {{{
 	computing_move = true;
 } // }}}
 
+#ifdef CHECK_MOTOR_LIMITS
 static void check_distance(int sp, int mt, Motor *mtr, Motor *limit_mtr, double distance, double dt, double &factor) { // {{{
 	// Check motor limits for motor (sp,mt), which is mtr. For followers, limit_mtr is set to its leader unless settings.single is true.
 	// distance is the distance to travel; dt is the time, factor is lowered if needed.
@@ -394,10 +451,13 @@ static void check_distance(int sp, int mt, Motor *mtr, Motor *limit_mtr, double
 	mtr->last_v = target_v;
 } // }}}
 
-static double move_axes(Space *s) { // {{{
-	s->xyz2motors();
+#endif
+
+static double check_motors(Space *s) { // {{{
+	// Check the motor targets against the limits; return the largest acceptable factor.
+	// Moves are checked as a whole by plan_move(), so this only reports violations for debugging.
 	double factor = 1;
-	//*
+#ifdef CHECK_MOTOR_LIMITS
 	for (int m = 0; m < s->num_motors; ++m) {
 		//if (s->id == 0 && m == 0)
 		//	debug("check move %d %d time %f target %f current %f", s->id, m, settings.hwtime / 1e6, s->motor[m]->settings.target_pos, s->motor[m]->settings.current_pos);
@@ -414,10 +474,17 @@ static double move_axes(Space *s) { // {{{
 		}
 		check_distance(s->id, m, s->motor[m], limit_mtr, distance, settings.hwtime_step / 1e6, factor);
 	}
-	// */
+#else
+	(void)&s;
+#endif
 	return factor;
 } // }}}
 
+static double move_axes(Space *s) { // {{{
+	s->xyz2motors();
+	return check_motors(s);
+} // }}}
+
 static void do_steps(double old_factor) { // {{{
 	// Do the steps to arrive at the correct position. Update axis and motor current positions.
 	// Set new current position.
@@ -524,19 +591,866 @@ static void do_steps(double old_factor) { // {{{
 	}
 } // }}}
 
+// Feed rate override. {{{
+// The speed of all moves can be changed with feedrate at any time, without planning them
+// again.  Instead, time is warped: every sample advances settings.hwtime by settings.feed
+// times the sample period.  settings.feed follows feedrate with a limited rate of change,
+// which itself changes at a limited rate.  At max_v this adds at most half of max_a and
+// max_J to the planned movement.  It does not exceed the limits of the current move, and
+// it slows down in time for the next one; see run_limits().  Patterns are timed by the
+// firmware, so they are not warped.
+static int32_t warped_step() { // {{{
+	// How much settings.hwtime advances per sample with the current feed.  It must not
+	// become 0, or time stops.
+	if (settings.pattern_size > 0)
+		return settings.hwtime_step;
+	return max(int32_t(1), int32_t(std::lround(settings.hwtime_step * settings.feed)));
+} // }}}
+
+static double warp_ramp_time(double diff, double rate) { // {{{
+	// Time that the time warp needs to lower the feed by diff and stop there, if it now changes at rate.
+	double max_rate = max_a / max_v / 2;
+	double max_rate_change = max_J / max_v / 2;
+	double t = 0;
+	if (rate > 0) {
+		t = rate / max_rate_change;
+		diff += rate * rate / (2 * max_rate_change);
+	}
+	if (diff <= 0)
+		return t;
+	if (diff <= max_rate * max_rate / max_rate_change)
+		return t + 2 * std::sqrt(diff / max_rate_change);
+	return t + diff / max_rate + max_rate / max_rate_change;
+} // }}}
+
+static double warp_ramp_size(double t) { // {{{
+	// How much the time warp can lower the feed in time t, starting and ending at a constant feed.
+	// This uses half the rates of warp_step(), because that only changes once per sample.
+	double max_rate = max_a / max_v / 4;
+	double max_rate_change = max_J / max_v / 4;
+	if (t <= 2 * max_rate / max_rate_change)
+		return max_rate_change * t * t / 4;
+	return max_rate * (t - max_rate / max_rate_change);
+} // }}}
+
+static int32_t warp_step() { // {{{
+	// Update settings.feed for the next sample; return how much settings.hwtime advances.
+	if (settings.pattern_size > 0)
+		return settings.hwtime_step;
+	double dt = settings.hwtime_step / 1e6;
+	double max_rate = max_a / max_v / 2;
+	double max_rate_change = max_J / max_v / 2;
+	double step = max_rate_change * dt;
+	double target = min(feedrate, settings.feed_limit);
+	if (settings.feed_next < target) {
+		// Slow down for the next move if there would not be enough time left after speeding up for one more sample.
+		double left = (settings.end_time - settings.hwtime) / 1e6 / settings.feed;
+		double rate = min(max_rate, settings.feed_rate + step);
+		if (left <= warp_ramp_time(settings.feed + rate * dt - settings.feed_next, rate) + 2 * dt)
+			target = settings.feed_next;
+	}
+	double diff = target - settings.feed;
+	if (diff != 0 || settings.feed_rate != 0) {
+		// Change at the highest rate that still allows stopping at the target.
+		double want = min(max_rate, max(0., std::sqrt(2 * max_rate_change * std::fabs(diff) + step * step / 4) - step / 2));
+		if (diff < 0)
+			want = -want;
+		double change = want - settings.feed_rate;
+		if (change > step)
+			change = step;
+		else if (change < -step)
+			change = -step;
+		settings.feed_rate += change;
+		settings.feed += settings.feed_rate * dt;
+		if (!std::isfinite(settings.feed) || (target - settings.feed) * diff <= 0) {
+			settings.feed = target;
+			settings.feed_rate = 0;
+		}
+	}
+	return warped_step();
+} // }}}
+// }}}
+
+static double time_factor(int32_t hwtime) { // {{{
+	// Factor of current move that should be completed at this time.
+	if (hwtime >= settings.end_time)
+		return 1;
+	if (hwtime <= 0)
+		return 0;
+	double target_factor = (hwtime / 1e6) / (settings.end_time / 1e6);
+	if (target_factor > 1)
+		target_factor = 1;
+	if (target_factor < 0)
+		target_factor = 0;
+	return target_factor;
+} // }}}
+
+static void move_position(double factor, double &xg, double &xh) { // {{{
+	// Distance along the g and h vectors of the current move, at a factor of it.
+	double t = factor * settings.end_time / 1e6;
+	double t2 = t * t;
+	double t3 = t2 * t;
+	xg = settings.Jg * t3 / 6 + settings.a0g * t2 / 2 + settings.v0g * t + settings.x0g;
+	xh = settings.Jh * t3 / 6 + settings.a0h * t2 / 2 + settings.v0h * t + settings.x0h;
+} // }}}
+
+static double axis_target(Space &sp, int a, double factor, double xg, double xh) { // {{{
+	// Positional axes follow the move; all other axes use linear interpolation.
+	if (sp.id == 0 && a < 3)
+		return sp.axis[a]->settings.source + xg * settings.unitg[a] + xh * settings.unith[a];
+	return sp.axis[a]->settings.source + factor * (sp.axis[a]->settings.endpos - sp.axis[a]->settings.source);
+} // }}}
+
+// Motor positions along the current move. {{{
+// When a move starts, the motor positions of every space are evaluated at a few points
+// along it.  They are used to choose the sample period, and to fit a cubic polynomial
+// in the move factor for every motor.  For types where motors are linear combinations
+// of axes (cartesian, h_bot, extruder, follower) the fit is exact; for others it is
+// used if it is within motor_fit_tolerance steps of the exact path at every point that
+// was not used for the fit, and at the points halfway between them.  batch_fill() then
+// evaluates the polynomial instead of calling the type module.  If motor_fit_check is
+// set, it also computes the exact path for every fitted sample and records the largest
+// difference in fit_max_error.
+static int const move_points = 9;
+static int const fit_nodes[4] = {0, 3, 5, 8};	// Points that the cubic goes through.
+struct Move_Samples {
+	std::vector <double> axes, motors;	// axes[a * move_points + i] is the target of axis a at factor i / (move_points - 1).
+	std::vector <double const *> axis_ptr;
+	std::vector <double *> motor_ptr;
+	std::vector <double> jacobian, motor_v;	// jacobian[(m * num_axes + a) * move_points + i]; motor_v[m * move_points + i] in units/s.
+	std::vector <double *> jacobian_ptr;
+	std::vector <double> mid_axes, mid_motors;	// Positions halfway between the points, for checking the fit.
+	std::vector <double const *> mid_axis_ptr;
+	std::vector <double *> mid_motor_ptr;
+	// Fit of the motor positions, and the move that it was computed for.
+	bool fit_done, fit_valid;
+	std::vector <double> coef;	// Position of motor m is sum(coef[m * 4 + k] * f ** k).
+	double move[19];
+	std::vector <double> source, endpos;
+	Move_Samples() : fit_done(false), fit_valid(false) {}
+};
+static Move_Samples move_samples[NUM_SPACES];
+
+static void move_key(double *key) { // {{{
+	// Parameters of the current move that a fit depends on, apart from axis sources and end positions.
+	double const values[19] = {settings.Jg, settings.Jh, settings.a0g, settings.a0h, settings.v0g, settings.v0h, settings.x0g, settings.x0h, double(settings.end_time), settings.unitg[0], settings.unitg[1], settings.unitg[2], settings.unith[0], settings.unith[1], settings.unith[2], double(spaces[0].num_axes), double(single), settings.adjust, double(settings.pattern_size)};
+	for (int i = 0; i < 19; ++i)
+		key[i] = values[i];
+} // }}}
+
+static bool move_evaluate(Space &sp) { // {{{
+	// Compute axis targets and motor positions at move_points points along the current move.
+	Move_Samples &ms = move_samples[sp.id];
+	if (sp.num_motors == 0)
+		return false;
+	ms.axes.resize(sp.num_axes * move_points);
+	ms.motors.resize(sp.num_motors * move_points);
+	ms.axis_ptr.resize(sp.num_axes);
+	ms.motor_ptr.resize(sp.num_motors);
+	for (int a = 0; a < sp.num_axes; ++a)
+		ms.axis_ptr[a] = &ms.axes[a * move_points];
+	for (int m = 0; m < sp.num_motors; ++m)
+		ms.motor_ptr[m] = &ms.motors[m * move_points];
+	for (int i = 0; i < move_points; ++i) {
+		double f = i / (move_points - 1.);
+		double xg = 0, xh = 0;
+		if (sp.id == 0)
+			move_position(f, xg, xh);
+		for (int a = 0; a < sp.num_axes; ++a)
+			ms.axes[a * move_points + i] = axis_target(sp, a, f, xg, xh);
+	}
+	if (!sp.xyz2motors_batch(move_points, ms.axis_ptr.data(), ms.motor_ptr.data())) {
+		// Without batch support, assume motors follow their axes.
+		for (int m = 0; m < sp.num_motors; ++m) {
+			for (int i = 0; i < move_points; ++i)
+				ms.motors[m * move_points + i] = m < sp.num_axes ? ms.axes[m * move_points + i] : NAN;
+		}
+		return false;
+	}
+	return true;
+} // }}}
+
+static bool move_fit_compute(Space &sp) { // {{{
+	// Fit a cubic through the evaluated motor positions; see above.
+	Move_Samples &ms = move_samples[sp.id];
+	// Motors that are not computed from axes keep their current target, which may change during the move.
+	if (motor_fit_tolerance <= 0 || sp.num_motors > sp.num_axes || settings.adjust > 0)
+		return false;
+	// Inverse of the Vandermonde matrix for the fit nodes; computed once.
+	static double inverse[4][4];
+	static bool have_inverse = false;
+	if (!have_inverse) {
+		double m[4][8];
+		for (int r = 0; r < 4; ++r) {
+			double f = fit_nodes[r] / (move_points - 1.);
+			for (int c = 0; c < 4; ++c) {
+				m[r][c] = std::pow(f, c);
+				m[r][4 + c] = r == c ? 1 : 0;
+			}
+		}
+		for (int c = 0; c < 4; ++c) {
+			int p = c;
+			for (int r = c + 1; r < 4; ++r) {
+				if (std::fabs(m[r][c]) > std::fabs(m[p][c]))
+					p = r;
+			}
+			for (int k = 0; k < 8; ++k)
+				std::swap(m[c][k], m[p][k]);
+			double d = m[c][c];
+			for (int k = 0; k < 8; ++k)
+				m[c][k] /= d;
+			for (int r = 0; r < 4; ++r) {
+				if (r == c)
+					continue;
+				double factor = m[r][c];
+				for (int k = 0; k < 8; ++k)
+					m[r][k] -= factor * m[c][k];
+			}
+		}
+		for (int k = 0; k < 4; ++k) {
+			for (int r = 0; r < 4; ++r)
+				inverse[k][r] = m[k][4 + r];
+		}
+		have_inverse = true;
+	}
+	ms.coef.resize(sp.num_motors * 4);
+	for (int m = 0; m < sp.num_motors; ++m) {
+		double *coef = &ms.coef[m * 4];
+		double const *pos = &ms.motors[m * move_points];
+		for (int k = 0; k < 4; ++k) {
+			coef[k] = 0;
+			for (int r = 0; r < 4; ++r)
+				coef[k] += inverse[k][r] * pos[fit_nodes[r]];
+		}
+		// The start of the move must be exact.
+		coef[0] = pos[0];
+		double spu = std::fabs(sp.motor[m]->steps_per_unit);
+		for (int i = 0; i < move_points; ++i) {
+			double f = i / (move_points - 1.);
+			double error = std::fabs(((coef[3] * f + coef[2]) * f + coef[1]) * f + coef[0] - pos[i]) * spu;
+			if (!(error <= motor_fit_tolerance))
+				return false;
+		}
+	}
+	// A cubic through 4 points can also match the other points of a path that is not a cubic; check halfway between them too.
+	int const mid_points = move_points - 1;
+	ms.mid_axes.resize(sp.num_axes * mid_points);
+	ms.mid_motors.resize(sp.num_motors * mid_points);
+	ms.mid_axis_ptr.resize(sp.num_axes);
+	ms.mid_motor_ptr.resize(sp.num_motors);
+	for (int a = 0; a < sp.num_axes; ++a)
+		ms.mid_axis_ptr[a] = &ms.mid_axes[a * mid_points];
+	for (int m = 0; m < sp.num_motors; ++m)
+		ms.mid_motor_ptr[m] = &ms.mid_motors[m * mid_points];
+	for (int i = 0; i < mid_points; ++i) {
+		double f = (i + .5) / (move_points - 1.);
+		double xg = 0, xh = 0;
+		if (sp.id == 0)
+			move_position(f, xg, xh);
+		for (int a = 0; a < sp.num_axes; ++a)
+			ms.mid_axes[a * mid_points + i] = axis_target(sp, a, f, xg, xh);
+	}
+	if (!sp.xyz2motors_batch(mid_points, ms.mid_axis_ptr.data(), ms.mid_motor_ptr.data()))
+		return false;
+	for (int m = 0; m < sp.num_motors; ++m) {
+		double const *coef = &ms.coef[m * 4];
+		double spu = std::fabs(sp.motor[m]->steps_per_unit);
+		for (int i = 0; i < mid_points; ++i) {
+			double f = (i + .5) / (move_points - 1.);
+			double error = std::fabs(((coef[3] * f + coef[2]) * f + coef[1]) * f + coef[0] - ms.mid_motors[m * mid_points + i]) * spu;
+			if (!(error <= motor_fit_tolerance))
+				return false;
+		}
+	}
+	return true;
+} // }}}
+
+static void move_fit(Space &sp, bool exact) { // {{{
+	// Compute the fit and record which move it is for, also if the move cannot be fitted.
+	// exact is false if the motor positions were not computed by the type module.
+	Move_Samples &ms = move_samples[sp.id];
+	ms.fit_valid = exact && move_fit_compute(sp);
+	move_key(ms.move);
+	ms.source.resize(sp.num_axes);
+	ms.endpos.resize(sp.num_axes);
+	for (int a = 0; a < sp.num_axes; ++a) {
+		ms.source[a] = sp.axis[a]->settings.source;
+		ms.endpos[a] = sp.axis[a]->settings.endpos;
+	}
+	ms.fit_done = true;
+} // }}}
+
+static bool fit_current(Space &sp) { // {{{
+	// Check that the fit for this space was computed for the current move; refit if it was not (for example after a rewind).
+	Move_Samples &ms = move_samples[sp.id];
+	if (motor_fit_tolerance <= 0 || settings.adjust > 0)
+		return false;
+	double key[19];
+	move_key(key);
+	bool same = ms.fit_done && int(ms.source.size()) == sp.num_axes;
+	for (int i = 0; same && i < 19; ++i)
+		same = key[i] == ms.move[i];
+	for (int a = 0; same && a < sp.num_axes; ++a)
+		same = ms.source[a] == sp.axis[a]->settings.source && ms.endpos[a] == sp.axis[a]->settings.endpos;
+	if (!same)
+		move_fit(sp, move_evaluate(sp));
+	return ms.fit_valid;
+} // }}}
+
+void motor_fit_reset() { // {{{
+	// Space settings have changed; fits must be recomputed.
+	for (int s = 0; s < NUM_SPACES; ++s)
+		move_samples[s].fit_done = false;
+} // }}}
+
+static void move_velocities(Space &sp) { // {{{
+	// Compute motor velocities at the evaluated points of the current move.
+	// With a Jacobian from the type module they follow from the axis velocities; otherwise they are estimated from the positions.
+	Move_Samples &ms = move_samples[sp.id];
+	double T = settings.end_time / 1e6;
+	double dt = T / (move_points - 1);
+	ms.motor_v.assign(sp.num_motors * move_points, 0);
+	ms.jacobian.resize(sp.num_motors * sp.num_axes * move_points);
+	ms.jacobian_ptr.resize(sp.num_motors * sp.num_axes);
+	for (int j = 0; j < sp.num_motors * sp.num_axes; ++j)
+		ms.jacobian_ptr[j] = &ms.jacobian[j * move_points];
+	if (sp.jacobian(move_points, ms.axis_ptr.data(), ms.jacobian_ptr.data())) {
+		for (int i = 0; i < move_points; ++i) {
+			double t = T * i / (move_points - 1);
+			double vg = settings.v0g + settings.a0g * t + settings.Jg * t * t / 2;
+			double vh = settings.v0h + settings.a0h * t + settings.Jh * t * t / 2;
+			for (int a = 0; a < sp.num_axes; ++a) {
+				double v;
+				if (sp.id == 0 && a < 3)
+					v = vg * settings.unitg[a] + vh * settings.unith[a];
+				else
+					v = (sp.axis[a]->settings.endpos - sp.axis[a]->settings.source) / T;
+				for (int m = 0; m < sp.num_motors; ++m)
+					ms.motor_v[m * move_points + i] += ms.jacobian[(m * sp.num_axes + a) * move_points + i] * v;
+			}
+		}
+		return;
+	}
+	for (int m = 0; m < sp.num_motors; ++m) {
+		double const *pos = &ms.motors[m * move_points];
+		double *v = &ms.motor_v[m * move_points];
+		// Second order differences; one sided at the ends.
+		v[0] = (-3 * pos[0] + 4 * pos[1] - pos[2]) / (2 * dt);
+		for (int i = 1; i < move_points - 1; ++i)
+			v[i] = (pos[i + 1] - pos[i - 1]) / (2 * dt);
+		v[move_points - 1] = (3 * pos[move_points - 1] - 4 * pos[move_points - 2] + pos[move_points - 3]) / (2 * dt);
+	}
+} // }}}
+
+static double move_feed_limit(bool *exact) { // {{{
+	// Evaluate the current move and return the largest feed factor at which no motor
+	// exceeds its limits and the path stays within max_v, max_a and max_J.  Motor
+	// velocities scale with the feed factor and their accelerations with its square.
+	// exact[s] is set if the motor positions of space s were computed by the type module.
+	double limit = INFINITY;
+	double dt = settings.end_time / 1e6 / (move_points - 1);
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		Move_Samples &ms = move_samples[s];
+		exact[s] = false;
+		if ((s == 2 && !single) || sp.num_motors == 0)
+			continue;
+		exact[s] = move_evaluate(sp);
+		if (settings.end_time <= 0)
+			continue;
+		move_velocities(sp);
+		for (int m = 0; m < sp.num_motors; ++m) {
+			Motor *limit_mtr = sp.motor[m];
+			if (!single && s == 2) {
+				FollowerMotorData *data = reinterpret_cast <FollowerMotorData *>(sp.motor[m]->type_data);
+				if (data->space >= 0 && data->space <= 1 && data->motor >= 0 && data->motor < spaces[data->space].num_motors)
+					limit_mtr = spaces[data->space].motor[data->motor];
+			}
+			double const *v = &ms.motor_v[m * move_points];
+			for (int i = 0; i < move_points; ++i) {
+				double f = limit_mtr->limit_v / std::fabs(v[i]);
+				if (f < limit)
+					limit = f;
+				if (i > 0) {
+					f = std::sqrt(limit_mtr->limit_a * dt / std::fabs(v[i] - v[i - 1]));
+					if (f < limit)
+						limit = f;
+				}
+			}
+		}
+	}
+	// Do not slow down moves that are at the limit, but for rounding errors.
+	if (limit < 1 && limit > 1 - 1e-5)
+		limit = 1;
+	// The move was planned within max_v, max_a and max_J, so those only limit a feed
+	// rate override above 1.  Speed scales with the feed factor, acceleration with its
+	// square and jerk with its cube.
+	double T = settings.end_time / 1e6;
+	double J = 0;
+	for (int a = 0; a < min(3, spaces[0].num_axes); ++a) {
+		double j = settings.Jg * settings.unitg[a] + settings.Jh * settings.unith[a];
+		J += j * j;
+	}
+	double path = std::cbrt(max_J / std::sqrt(J));
+	for (int i = 0; i < move_points; ++i) {
+		double t = T * i / (move_points - 1);
+		double vg = settings.v0g + settings.a0g * t + settings.Jg * t * t / 2;
+		double vh = settings.v0h + settings.a0h * t + settings.Jh * t * t / 2;
+		double ag = settings.a0g + settings.Jg * t;
+		double ah = settings.a0h + settings.Jh * t;
+		double v = 0, acc = 0;
+		for (int a = 0; a < min(3, spaces[0].num_axes); ++a) {
+			double va = vg * settings.unitg[a] + vh * settings.unith[a];
+			double aa = ag * settings.unitg[a] + ah * settings.unith[a];
+			v += va * va;
+			acc += aa * aa;
+		}
+		double f = max_v / std::sqrt(v);
+		if (f < path)
+			path = f;
+		f = std::sqrt(max_a / std::sqrt(acc));
+		if (f < path)
+			path = f;
+	}
+	if (path < 1)
+		path = 1;
+	if (path < limit)
+		limit = path;
+	return limit;
+} // }}}
+
+static double plan_move() { // {{{
+	// Evaluate the current move before any sample is computed and return the largest
+	// feed factor that it allows; see run_limits() for how it is used.  Then fit the
+	// motor paths.
+	bool exact[NUM_SPACES];
+	for (int s = 0; s < NUM_SPACES; ++s)
+		move_samples[s].fit_done = false;
+	double limit = move_feed_limit(exact);
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		if ((s == 2 && !single) || spaces[s].num_motors == 0)
+			continue;
+		move_fit(spaces[s], exact[s]);
+	}
+	return limit;
+} // }}}
+
+// Run planning. {{{
+// The feed factor must stay within the limit of every move (see move_feed_limit()), and
+// it must not jump while the machine moves.  So the limits of the moves in a run of
+// connected moves are computed ahead of time, and going back from the last planned move,
+// the largest feed at the start of every move is found that still allows the time warp to
+// slow down in time for the moves after it.  Beyond the plan, the feed is at most 1.
+// When a run starts, it is planned far enough ahead to slow down from the highest feed, but
+// for at most run_plan_time; every move that starts adds run_plan_moves more, up to
+// run_lookahead moves ahead.  Moves that are not in the plan are still limited by
+// plan_move().
+static int const run_lookahead = 1000;
+static int const run_plan_moves = 4;
+static int const run_plan_time = 2000;	// μs.
+static std::vector <double> run_caps;	// Largest feed factor of move run_caps_base + k of the run.
+static std::vector <double> run_start_caps;	// Largest feed factor at the start of move run_caps_base + k; one longer than run_caps.
+static std::vector <double> run_duration;	// Duration of move run_caps_base + k at a feed factor of 1, in seconds.
+static int run_caps_base;	// Number of the move in the run that run_caps[0] is for.
+static int run_caps_index;	// The settings.run_index that run_caps was computed for.
+static bool run_caps_stop;	// run_caps ends at a standstill.
+static bool run_limited;	// The run can be limited at all; if not, it is not planned.
+static double run_feedrate;	// The feed rate that run_start_caps was computed for.
+static bool run_warned;	// The user has been warned about moves in this run that exceed the motor limits.
+// The state at the end of the last planned move, from which the next one is set up.
+static History run_plan_settings;
+static bool run_plan_single;
+static std::vector <double> run_plan_pos;	// Source and endpos of every axis.
+static Run_Lookahead run_plan_file;	// Where the plan continues in the run file; record is -1 while it is in the queue.
+
+static bool run_is_limited() { // {{{
+	// Without motor limits, only a feed rate override above 1 can be limited.
+	if (feedrate > 1)
+		return true;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		for (int m = 0; m < spaces[s].num_motors; ++m) {
+			if (std::isfinite(spaces[s].motor[m]->limit_v) || std::isfinite(spaces[s].motor[m]->limit_a))
+				return true;
+		}
+	}
+	return false;
+} // }}}
+
+static void run_swap_state() { // {{{
+	// Exchange the move state with that of the plan.
+	std::swap(settings, run_plan_settings);
+	std::swap(single, run_plan_single);
+	int i = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		for (int a = 0; a < spaces[s].num_axes; ++a) {
+			std::swap(spaces[s].axis[a]->settings.source, run_plan_pos[i++]);
+			std::swap(spaces[s].axis[a]->settings.endpos, run_plan_pos[i++]);
+		}
+	}
+} // }}}
+
+static void run_add() { // {{{
+	// Add the limits of the move that is set up to the plan.
+	bool exact[NUM_SPACES];
+	// Patterns are not warped, so the feed cannot change during them.
+	double cap = INFINITY, duration = 0;
+	if (settings.pattern_size == 0) {
+		cap = move_feed_limit(exact);
+		duration = settings.end_time / 1e6;
+	}
+	run_caps.push_back(cap);
+	run_duration.push_back(duration);
+	double T = settings.end_time / 1e6;
+	run_caps_stop = std::fabs(settings.v0g + settings.a0g * T + settings.Jg * T * T / 2) + std::fabs(settings.v0h + settings.a0h * T + settings.Jh * T * T / 2) < 1e-6;
+	if (cap < 1 && !run_warned) {
+		warning("line %" LONGFMT ": moves exceed motor limits; slowing them down to a feed factor of %f", settings.gcode_line, cap);
+		run_warned = true;
+	}
+} // }}}
+
+static void run_start_limits(int old_size) { // {{{
+	// Compute run_start_caps, going back from the end of the plan.  The first old_size
+	// moves were planned before; once one of them keeps its value, so do the ones before it.
+	int n = run_caps.size();
+	bool same_feed = run_feedrate == feedrate;
+	run_feedrate = feedrate;
+	run_start_caps.resize(n + 1);
+	run_start_caps[n] = run_caps_stop ? INFINITY : 1;
+	for (int k = n - 1; k >= 0; --k) {
+		// Ramps take the least time at the highest feed.
+		double feed = min(run_caps[k], max(feedrate, 1.));
+		double cap = min(run_caps[k], run_start_caps[k + 1] + warp_ramp_size(run_duration[k] / feed));
+		if (same_feed && k < old_size && cap == run_start_caps[k])
+			break;
+		run_start_caps[k] = cap;
+	}
+} // }}}
+
+static void plan_extend(int num, bool start) { // {{{
+	// Add up to num moves to the plan.  If start is true, stop when the plan is long enough
+	// to slow down from the highest feed, or when run_plan_time has passed.
+	int old_size = run_caps.size();
+	// The current move is queue[settings.queue_start]; the queue continues from there, and then the run file.
+	int q = settings.queue_start + run_caps_base + old_size - settings.run_move;
+	int queue_end = settings.queue_end;
+	Run_Lookahead file_start;
+	bool file_ok = run_plan_file.record < 0 && run_file_lookahead_start(&file_start);
+	double top = max(feedrate, 1.);
+	double ahead = 0, needed = warp_ramp_time(top, 0);
+	struct timespec begin, now;
+	if (start)
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+	run_swap_state();
+	for (int k = 0; k < num && !run_caps_stop; ++k) {
+		if (start && k > 0) {
+			if (ahead >= needed)
+				break;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - begin.tv_sec) * 1000000 + (now.tv_nsec - begin.tv_nsec) / 1000 >= run_plan_time)
+				break;
+		}
+		MoveCommand mc;
+		if (run_plan_file.record < 0 && q < queue_end)
+			mc = queue[q++];
+		else {
+			if (run_plan_file.record < 0) {
+				if (!file_ok)
+					break;
+				run_plan_file = file_start;
+			}
+			if (run_file_lookahead(&run_plan_file, &mc, 1) < 1)
+				break;
+		}
+		// The next move starts where this one ends.
+		for (int s = 0; s < NUM_SPACES; ++s) {
+			for (int a = 0; a < spaces[s].num_axes; ++a)
+				spaces[s].axis[a]->settings.source = spaces[s].axis[a]->settings.endpos;
+		}
+		for (int a = 0; a < min(6, spaces[0].num_axes); ++a) {
+			if (std::isnan(mc.target[a]))
+				mc.target[a] = spaces[0].axis[a]->settings.source;
+		}
+		single = mc.single;
+		move_setup(mc);
+		if (move_at_rest()) {
+			run_caps_stop = true;
+			break;
+		}
+		settings.gcode_line = mc.gcode_line;
+		for (int a = 0; a < min(6, spaces[0].num_axes); ++a)
+			spaces[0].axis[a]->settings.endpos = mc.target[a];
+		if (mc.tool >= 0 && mc.tool < spaces[1].num_axes && !std::isnan(mc.e))
+			spaces[1].axis[mc.tool]->settings.endpos = mc.e;
+		else if (mc.single && mc.tool < 0 && ~mc.tool < spaces[2].num_axes && !std::isnan(mc.e))
+			spaces[2].axis[~mc.tool]->settings.endpos = mc.e;
+		settings.pattern_size = mc.pattern_size;
+		run_add();
+		ahead += settings.end_time / 1e6 / top;
+	}
+	run_swap_state();
+	run_start_limits(old_size);
+} // }}}
+
+static void plan_run(bool start) { // {{{
+	// Start a new plan with the current move, which is set up; start is true if the run
+	// starts with it.
+	run_caps_index = settings.run_index;
+	run_caps_base = 0;
+	run_caps_stop = false;
+	run_caps.clear();
+	run_duration.clear();
+	run_start_caps.assign(1, 1);
+	if (start)
+		run_warned = false;
+	run_limited = run_is_limited();
+	if (!run_limited)
+		return;
+	run_plan_settings = settings;
+	run_plan_single = single;
+	run_plan_pos.clear();
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		for (int a = 0; a < spaces[s].num_axes; ++a) {
+			run_plan_pos.push_back(spaces[s].axis[a]->settings.source);
+			run_plan_pos.push_back(spaces[s].axis[a]->settings.endpos);
+		}
+	}
+	run_plan_file.record = -1;
+	run_add();
+	plan_extend(run_lookahead, true);
+} // }}}
+
+static void plan_next() { // {{{
+	// Keep the plan ahead of the current move, and forget the moves that cannot be rewound to anymore.
+	if (!run_limited)
+		return;
+	int behind = settings.run_move - run_caps_base - 256;
+	if (behind > run_lookahead) {
+		run_caps.erase(run_caps.begin(), run_caps.begin() + behind);
+		run_duration.erase(run_duration.begin(), run_duration.begin() + behind);
+		run_start_caps.erase(run_start_caps.begin(), run_start_caps.begin() + behind);
+		run_caps_base += behind;
+	}
+	if (run_caps_base + int(run_caps.size()) - settings.run_move < run_lookahead)
+		plan_extend(run_plan_moves, false);
+	else if (run_feedrate != feedrate)
+		run_start_limits(run_caps.size());
+} // }}}
+
+static bool run_replan() { // {{{
+	// Check if the current run must be planned again: after a rewind into an earlier run,
+	// when the feed rate override makes a run limited that was not, and when the current
+	// move is beyond the plan.
+	if (run_caps_index != settings.run_index)
+		return true;
+	if (!run_limited)
+		return run_is_limited();
+	return !run_caps_stop && settings.run_move >= run_caps_base + int(run_caps.size());
+} // }}}
+
+static double run_limits(double limit) { // {{{
+	// Set the feed limits for the current move, which is move settings.run_move of the
+	// plan and allows limit, and return the largest feed at its start.  If the plan does
+	// not have the move, because nothing is limited, a feed factor above 1 is not allowed.
+	int k = settings.run_move - run_caps_base;
+	double start_limit;
+	if (run_caps_index == settings.run_index && k >= 0 && k < int(run_caps.size())) {
+		settings.feed_limit = min(run_caps[k], limit);
+		settings.feed_next = run_start_caps[k + 1];
+		start_limit = min(run_start_caps[k], limit);
+	}
+	else {
+		settings.feed_limit = min(1., limit);
+		settings.feed_next = settings.feed_limit;
+		start_limit = settings.feed_limit;
+	}
+	if (settings.feed_limit < 1)
+		shmem->stretched_moves += 1;
+	return start_limit;
+} // }}}
+// }}}
+
+static int sample_period() { // {{{
+	// Choose the sample period for the current move, which plan_move() has evaluated: as
+	// long as possible, but keep the number of steps per sample well below what a sample
+	// can hold (0x1ff).  The peak step rate is estimated from the motor positions at the
+	// evaluated points.
+	double const max_steps = 0x80;
+	if (settings.end_time <= 0)
+		return arch_sample_period(base_hwtime_step);
+	double dt = settings.end_time / (move_points - 1.);
+	double max_rate = 0;	// Steps per μs.
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		Move_Samples &ms = move_samples[s];
+		if ((s == 2 && !single) || sp.num_motors == 0)
+			continue;
+		for (int m = 0; m < sp.num_motors; ++m) {
+			double spu = sp.motor[m]->steps_per_unit;
+			if (!(spu > 0))
+				continue;
+			for (int i = 1; i < move_points; ++i) {
+				double rate = std::fabs(ms.motors[m * move_points + i] - ms.motors[m * move_points + i - 1]) * spu / dt;
+				if (rate > max_rate)
+					max_rate = rate;
+			}
+		}
+	}
+	// The feed rate override makes the steps faster.
+	max_rate *= max(settings.feed, feedrate);
+	// Do not make samples much longer than the default, because the host reacts to events per sample.
+	double period = 4. * base_hwtime_step;
+	if (max_rate * period > max_steps)
+		period = max_steps / max_rate;
+	return arch_sample_period(period);
+} // }}}
+// }}}
+
+// Batched kinematics. {{{
+// Calling the type module for every sample and every space is expensive.  When a module
+// supports it, the motor positions for the rest of the fragment are computed in one call
+// instead.  A result is only used if the axis targets and the motor positions that it was
+// computed from are still exactly what they are when the sample is generated; otherwise
+// the sample is computed with xyz2motors(), so the output is always the same.
+struct Kinematics_Batch {
+	int n, pos;	// Number of samples in the batch, and the next one to use.
+	int size;	// Number of samples that the buffers have room for.
+	std::vector <double> axes, motors;	// Axis targets and motor positions; axes[a * size + i].
+	std::vector <double> factor;	// Move factor of every sample.
+	std::vector <double const *> axis_ptr;
+	std::vector <double *> motor_ptr;
+	std::vector <double> start_pos, start_target;	// Motor current and target positions before the first sample.
+	Kinematics_Batch() : n(0), pos(0), size(0) {}
+};
+static Kinematics_Batch batch[NUM_SPACES];
+
+static void batch_reset() { // {{{
+	// Discard all batches; this is required whenever space settings may have changed.
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		batch[s].n = 0;
+		batch[s].pos = 0;
+	}
+} // }}}
+
+static void batch_fill(Space &sp, double factor) { // {{{
+	// Compute motor positions for the current sample (at factor) and the rest of the fragment.
+	Kinematics_Batch &b = batch[sp.id];
+	b.n = 0;
+	b.pos = 0;
+	if (!space_types[sp.type].xyz2motors_batch || settings.adjust > 0)
+		return;
+	int n = SAMPLES_PER_FRAGMENT - current_fragment_pos;
+	if (n < 2)
+		return;
+	b.size = SAMPLES_PER_FRAGMENT;
+	b.axes.resize(sp.num_axes * b.size);
+	b.motors.resize(sp.num_motors * b.size);
+	b.factor.resize(b.size);
+	b.axis_ptr.resize(sp.num_axes);
+	b.motor_ptr.resize(sp.num_motors);
+	for (int a = 0; a < sp.num_axes; ++a)
+		b.axis_ptr[a] = &b.axes[a * b.size];
+	for (int m = 0; m < sp.num_motors; ++m)
+		b.motor_ptr[m] = &b.motors[m * b.size];
+	// Use the same times that apply_tick() will use if the feed rate override does not change; stop at the end of the move.
+	// A fitted path is not used for the final sample, so the move ends exactly at its target.
+	bool fitted = fit_current(sp);
+	int32_t step = warped_step();
+	int i;
+	for (i = 0; i < n; ++i) {
+		int32_t hwtime = settings.hwtime + i * step;
+		if (i > 0 && hwtime >= settings.end_time)
+			break;
+		double f = i == 0 ? factor : time_factor(hwtime);
+		if (fitted && f >= 1)
+			break;
+		b.factor[i] = f;
+		double xg = 0, xh = 0;
+		if (sp.id == 0)
+			move_position(f, xg, xh);
+		for (int a = 0; a < sp.num_axes; ++a) {
+			double target = axis_target(sp, a, f, xg, xh);
+			if (std::isnan(target))
+				return;
+			b.axes[a * b.size + i] = target;
+		}
+	}
+	if (i < 2)
+		return;
+	b.start_pos.resize(sp.num_motors);
+	b.start_target.resize(sp.num_motors);
+	for (int m = 0; m < sp.num_motors; ++m) {
+		b.start_pos[m] = sp.motor[m]->settings.current_pos;
+		b.start_target[m] = sp.motor[m]->target_pos;
+	}
+	if (fitted) {
+		Move_Samples &ms = move_samples[sp.id];
+		for (int m = 0; m < sp.num_motors; ++m) {
+			double const *coef = &ms.coef[m * 4];
+			for (int j = 0; j < i; ++j) {
+				double f = b.factor[j];
+				b.motors[m * b.size + j] = ((coef[3] * f + coef[2]) * f + coef[1]) * f + coef[0];
+			}
+		}
+		shmem->fit_samples += i;
+		if (motor_fit_check) {
+			std::vector <double> exact(sp.num_motors * b.size);
+			std::vector <double *> exact_ptr(sp.num_motors);
+			for (int m = 0; m < sp.num_motors; ++m)
+				exact_ptr[m] = &exact[m * b.size];
+			sp.xyz2motors_batch(i, b.axis_ptr.data(), exact_ptr.data());
+			for (int m = 0; m < sp.num_motors; ++m) {
+				for (int j = 0; j < i; ++j) {
+					double error = std::fabs(exact[m * b.size + j] - b.motors[m * b.size + j]) * std::fabs(sp.motor[m]->steps_per_unit);
+					if (error > shmem->fit_max_error)
+						shmem->fit_max_error = error;
+					if (error > motor_fit_tolerance)
+						warning("fitted position of motor %d %d is %f steps off at factor %f", sp.id, m, error, b.factor[j]);
+				}
+			}
+		}
+	}
+	else
+		sp.xyz2motors_batch(i, b.axis_ptr.data(), b.motor_ptr.data());
+	b.n = i;
+} // }}}
+
+static bool batch_motors(Space &sp) { // {{{
+	// Set motor targets from the batch; return false if it cannot be used.
+	Kinematics_Batch &b = batch[sp.id];
+	if (b.pos >= b.n)
+		return false;
+	bool valid = settings.adjust <= 0;
+	for (int a = 0; valid && a < sp.num_axes; ++a)
+		valid = sp.axis[a]->target == b.axes[a * b.size + b.pos];
+	for (int m = 0; valid && m < sp.num_motors; ++m) {
+		// The previous sample must have been applied exactly as computed.
+		double pos = b.pos == 0 ? b.start_pos[m] : b.motors[m * b.size + b.pos - 1];
+		valid = sp.motor[m]->settings.current_pos == pos;
+		if (valid && m >= sp.num_axes)
+			valid = sp.motor[m]->target_pos == (b.pos == 0 ? b.start_target[m] : pos);
+	}
+	if (!valid) {
+		b.n = 0;
+		b.pos = 0;
+		return false;
+	}
+	for (int m = 0; m < sp.num_motors; ++m)
+		sp.motor[m]->target_pos = b.motors[m * b.size + b.pos];
+	b.pos += 1;
+	return true;
+} // }}}
+// }}}
+
 static double set_targets(double factor) { // {{{
 	// Set motor targets for the requested factor. If limits are exceeded, return largest acceptable factor.
 	if (spaces[0].num_axes > 0) {
 		// Only handle positional move if there are positional axes.
-		double t = factor * settings.end_time / 1e6;
-		double t2 = t * t;
-		double t3 = t2 * t;
-		double xg = settings.Jg * t3 / 6 + settings.a0g * t2 / 2 + settings.v0g * t + settings.x0g;
-		double xh = settings.Jh * t3 / 6 + settings.a0h * t2 / 2 + settings.v0h * t + settings.x0h;
+		double xg, xh;
+		move_position(factor, xg, xh);
 		for (int i = 0; i < 3; ++i) {
 			if (i >= spaces[0].num_axes)
 				continue;
-			spaces[0].axis[i]->target = spaces[0].axis[i]->settings.source + xg * settings.unitg[i] + xh * settings.unith[i];
+			spaces[0].axis[i]->target = axis_target(spaces[0], i, factor, xg, xh);
 		}
 		mdebug("targets %f,%f,%f -> %f,%f,%f src %f,%f,%f current %f,%f,%f adjust %f: %f,%f,%f time %f", spaces[0].axis[0]->target, spaces[0].axis[1]->target, spaces[0].axis[2]->target, spaces[0].motor[0]->settings.current_pos, spaces[0].motor[1]->settings.current_pos, spaces[0].motor[2]->settings.current_pos, spaces[0].axis[0]->settings.source, spaces[0].axis[1]->settings.source, spaces[0].axis[2]->settings.source, spaces[0].axis[0]->current, spaces[0].axis[1]->current, spaces[0].axis[2]->current, settings.adjust, spaces[0].axis[0]->settings.adjust, spaces[0].axis[1]->settings.adjust, spaces[0].axis[2]->settings.adjust, settings.adjust_time / 1e6);
 	}
@@ -552,11 +1466,13 @@ static double set_targets(double factor) { // {{{
 				ax->settings.source = 0;
 				mdebug("setting axis %d %d source from nan to 0", s, a);
 			}
-			ax->target = ax->settings.source + factor * (ax->settings.endpos - ax->settings.source);
+			ax->target = axis_target(sp, a, factor, 0, 0);
 			//if (s == 1)
 			//	debug("setting target for %d %d to %f (%f -> %f) adjust %f", s, a, ax->target, ax->settings.source, ax->settings.endpos, ax->settings.adjust);
 		}
-		double f = move_axes(&sp);
+		if (batch[s].pos >= batch[s].n)
+			batch_fill(sp, factor);
+		double f = batch_motors(sp) ? check_motors(&sp) : move_axes(&sp);
 		if (max_f > f)
 			max_f = f;
 	}
@@ -577,7 +1493,9 @@ static void apply_tick() { // {{{
 		debug("apply tick called, but not moving");
 		return;
 	}
-	settings.hwtime += settings.hwtime_step;
+	double old_feed = settings.feed, old_feed_rate = settings.feed_rate;
+	int32_t step = warp_step();
+	settings.hwtime += step;
 	if (settings.adjust > 0) {
 		settings.adjust = 1 - ((settings.hwtime - settings.adjust_start_time) * 1. / settings.adjust_time);
 	}
@@ -586,23 +1504,13 @@ static void apply_tick() { // {{{
 		int empty_fragments = (running_fragment - 1 - current_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
 		if (stopping || discarding || discard_pending || empty_fragments <= (FRAGMENTS_PER_BUFFER > 4 ? 4 : FRAGMENTS_PER_BUFFER - 2)) {
 			// Abort attempt to fill buffer. Adjust time so next call it will retry current time.
-			settings.hwtime -= settings.hwtime_step;
+			settings.hwtime -= step;
+			settings.feed = old_feed;
+			settings.feed_rate = old_feed_rate;
 			break;
 		}
 		//debug("tick time %d step %d frag %d pos %d", settings.hwtime, settings.hwtime_step, current_fragment, current_fragment_pos);
-		double t = settings.hwtime / 1e6;
-		double target_factor;	// Factor of current move that should be completed at this time.
-		if (settings.hwtime >= settings.end_time)
-			target_factor = 1;
-		else if (settings.hwtime <= 0)
-			target_factor = 0;
-		else {
-			target_factor = t / (settings.end_time / 1e6);
-			if (target_factor > 1)
-				target_factor = 1;
-			if (target_factor < 0)
-				target_factor = 0;
-		}
+		double target_factor = time_factor(settings.hwtime);	// Factor of current move that should be completed at this time.
 		//debug("target factor: %f (t=%f end=%f)", target_factor, t, settings.end_time / 1e6);
 		// Go straight to the next move if the distance was 0 (so target_factor is NaN).
 		double old_factor = factor;
@@ -624,7 +1532,7 @@ static void apply_tick() { // {{{
 					// target move = 100
 					// so (1-0.9)*100=10 of target move must be removed
 					// that is (1-0.9)/0.6 of new part.
-					double newpart = settings.hwtime * 1. / settings.hwtime_step;
+					double newpart = settings.hwtime * 1. / step;
 					//debug("update f from %f", f);
 					f = 1 - (1 - f) / newpart;
 					target_factor = f * target_factor;
@@ -664,7 +1572,7 @@ static void apply_tick() { // {{{
 			// There is no next move.
 			continue_event = true;
 			do_steps(old_factor);
-			if (current_fragment_pos > 0 && !sending_fragment) {
+			if (current_fragment_pos > 0 && !fragment_sending()) {
 				mdebug("sending final fragment");
 				send_fragment();
 			}
@@ -677,6 +1585,42 @@ static void apply_tick() { // {{{
 		//debug("move z %d %d %f %f %f", current_fragment, current_fragment_pos, spaces[0].axis[2]->current, spaces[0].motor[0]->settings.current_pos, spaces[0].motor[0]->settings.current_pos + avr_pos_offset[0]);
 } // }}}
 
+// History of the move state, for rewinding. {{{
+static void history_copy(int fragment) { // {{{
+	// Copy the state to the history of fragment; all motors are inactive at the start of it.
+	history.settings[fragment] = settings;
+	Motor_History *motor = &history.motor[fragment * history.num_motors];
+	Axis_History *axis = &history.axis[fragment * history.num_axes];
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		for (int m = 0; m < sp.num_motors; ++m) {
+			sp.motor[m]->active = false;
+			*motor++ = sp.motor[m]->settings;
+		}
+		for (int a = 0; a < sp.num_axes; ++a)
+			*axis++ = sp.axis[a]->settings;
+	}
+} // }}}
+
+void history_reset() { // {{{
+	// Allocate the history and fill it with the current state. This must be called when the buffer size or the number of motors or axes changes.
+	delete[] history.settings;
+	delete[] history.motor;
+	delete[] history.axis;
+	history.num_motors = 0;
+	history.num_axes = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		history.num_motors += spaces[s].num_motors;
+		history.num_axes += spaces[s].num_axes;
+	}
+	history.settings = new History[FRAGMENTS_PER_BUFFER];
+	history.motor = new Motor_History[FRAGMENTS_PER_BUFFER * history.num_motors];
+	history.axis = new Axis_History[FRAGMENTS_PER_BUFFER * history.num_axes];
+	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+		history_copy(f);
+} // }}}
+// }}}
+
 void store_settings() { // {{{
 	if (current_fragment_pos != 0) {
 		warning("store settings called with non-empty send buffer");
@@ -685,49 +1629,20 @@ void store_settings() { // {{{
 	num_active_motors = 0;
 	if (FRAGMENTS_PER_BUFFER == 0)
 		return;
-	for (int i = 0; i < 3; ++i) {
-		history[current_fragment].unitg[i] = settings.unitg[i];
-		history[current_fragment].unith[i] = settings.unith[i];
-	}
-	history[current_fragment].Jg = settings.Jg;
-	history[current_fragment].Jh = settings.Jh;
-	history[current_fragment].a0g = settings.a0g;
-	history[current_fragment].a0h = settings.a0h;
-	history[current_fragment].v0g = settings.v0g;
-	history[current_fragment].v0h = settings.v0h;
-	history[current_fragment].x0g = settings.x0g;
-	history[current_fragment].x0h = settings.x0h;
-	history[current_fragment].hwtime = settings.hwtime;
-	history[current_fragment].hwtime_step = settings.hwtime_step;
-	history[current_fragment].end_time = settings.end_time;
-	history[current_fragment].adjust_start_time = settings.adjust_start_time;
-	history[current_fragment].adjust_time = settings.adjust_time;
-	history[current_fragment].run_time = settings.run_time;
-	history[current_fragment].pattern_size = settings.pattern_size;
-	history[current_fragment].gcode_line = settings.gcode_line;
-	history[current_fragment].adjust = settings.adjust;
-	history[current_fragment].run_file_current = settings.run_file_current;
-	history[current_fragment].queue_start = settings.queue_start;
-	history[current_fragment].queue_end = settings.queue_end;
-	for (int i = 0; i < PATTERN_MAX; ++i)
-		history[current_fragment].pattern[i] = settings.pattern[i];
-	for (int s = 0; s < NUM_SPACES; ++s) {
-		Space &sp = spaces[s];
-		for (int m = 0; m < sp.num_motors; ++m) {
-			sp.motor[m]->active = false;
-			sp.motor[m]->history[current_fragment].current_pos = sp.motor[m]->settings.current_pos;
-			sp.motor[m]->history[current_fragment].hw_pos = sp.motor[m]->settings.hw_pos;
-			cpdebug(s, m, "store");
-		}
-		for (int a = 0; a < sp.num_axes; ++a) {
-			mdebug("setting history %d of source for %d %d to %f; current is %f", current_fragment, s, a, sp.axis[a]->settings.source, sp.axis[a]->current);
-			sp.axis[a]->history[current_fragment].source = sp.axis[a]->settings.source;
-			sp.axis[a]->history[current_fragment].endpos = sp.axis[a]->settings.endpos;
-			sp.axis[a]->history[current_fragment].adjust = sp.axis[a]->settings.adjust;
-		}
-	}
-	pattern.active = false;
+	// Time some of the calls, for the statistics.
+	bool timed = shmem->history_stores++ % 64 == 0;
+	struct timespec start;
+	if (timed)
+		clock_gettime(CLOCK_MONOTONIC, &start);
 	DATA_CLEAR();
+	pattern.active = false;
+	history_copy(current_fragment);
+	if (timed) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		shmem->history_samples += 1;
+		shmem->history_store_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+	}
 } // }}}
 
 void restore_settings() { // {{{
@@ -735,56 +1650,43 @@ void restore_settings() { // {{{
 	num_active_motors = 0;
 	if (FRAGMENTS_PER_BUFFER == 0)
 		return;
-	for (int i = 0; i < 3; ++i) {
-		settings.unitg[i] = history[current_fragment].unitg[i];
-		settings.unith[i] = history[current_fragment].unith[i];
-	}
-	settings.Jg = history[current_fragment].Jg;
-	//debug("restored Jg to %f from history %d", settings.Jg, current_fragment);
-	settings.Jh = history[current_fragment].Jh;
-	settings.a0g = history[current_fragment].a0g;
-	settings.a0h = history[current_fragment].a0h;
-	settings.v0g = history[current_fragment].v0g;
-	settings.v0h = history[current_fragment].v0h;
-	settings.x0g = history[current_fragment].x0g;
-	settings.x0h = history[current_fragment].x0h;
-	settings.hwtime = history[current_fragment].hwtime;
-	settings.hwtime_step = history[current_fragment].hwtime_step;
-	settings.adjust_start_time = history[current_fragment].adjust_start_time;
-	settings.adjust_time = history[current_fragment].adjust_time;
-	settings.end_time = history[current_fragment].end_time;
-	settings.run_time = history[current_fragment].run_time;
-	settings.pattern_size = history[current_fragment].pattern_size;
-	settings.gcode_line = history[current_fragment].gcode_line;
-	settings.adjust = history[current_fragment].adjust;
-	settings.run_file_current = history[current_fragment].run_file_current;
-	settings.queue_start = history[current_fragment].queue_start;
-	settings.queue_end = history[current_fragment].queue_end;
-	for (int i = 0; i < PATTERN_MAX; ++i)
-		settings.pattern[i] = history[current_fragment].pattern[i];
+	DATA_CLEAR();
+	pattern.active = false;
+	settings = history.settings[current_fragment];
+	Motor_History const *motor = &history.motor[current_fragment * history.num_motors];
+	Axis_History const *axis = &history.axis[current_fragment * history.num_axes];
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		Space &sp = spaces[s];
 		for (int m = 0; m < sp.num_motors; ++m) {
 			sp.motor[m]->active = false;
-			sp.motor[m]->settings.current_pos = sp.motor[m]->history[current_fragment].current_pos;
-			sp.motor[m]->settings.hw_pos = sp.motor[m]->history[current_fragment].hw_pos;
-			cpdebug(s, m, "restore");
-		}
-		for (int a = 0; a < sp.num_axes; ++a) {
-			mdebug("setting source for %d %d to history %d of %f", s, a, current_fragment, sp.axis[a]->history[current_fragment].source);
-			sp.axis[a]->settings.source = sp.axis[a]->history[current_fragment].source;
-			sp.axis[a]->settings.endpos = sp.axis[a]->history[current_fragment].endpos;
-			sp.axis[a]->settings.adjust = sp.axis[a]->history[current_fragment].adjust;
+			sp.motor[m]->settings = *motor++;
 		}
+		for (int a = 0; a < sp.num_axes; ++a)
+			sp.axis[a]->settings = *axis++;
 	}
-	pattern.active = false;
-	DATA_CLEAR();
+} // }}}
+
+static void motion_kick();
+static void motion_yield();
+
+static bool buffer_room() { // {{{
+	// Keep one free fragment, because we want to be able to rewind and use the buffer before the one currently active.
+	// The main thread moves running_fragment while the motion thread computes.
+	int running = __atomic_load_n(&running_fragment, __ATOMIC_ACQUIRE);
+	return (running - 1 - current_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > (FRAGMENTS_PER_BUFFER > 4 ? 4 : FRAGMENTS_PER_BUFFER - 2);
 } // }}}
 
 void buffer_refill() { // {{{
 	// Try to fill the buffer. This is called at any time that the buffer may be refillable.
 	//mdebug("refill");
-	if (aborting || preparing || FRAGMENTS_PER_BUFFER == 0) {
+	if (motion_threaded && !motion_thread_self()) {
+		// The motion thread does the work; only wake it up if there is something to do.
+		if (FRAGMENTS_PER_BUFFER > 0 && (computing_move || settings.adjust > 0) && !stopping && discarding == 0 && !discard_pending && buffer_room())
+			motion_kick();
+		return;
+	}
+	// The motion thread does not use the packet buffer, so it can fill the buffer while a packet is prepared.
+	if (aborting || (preparing && !motion_thread_self()) || FRAGMENTS_PER_BUFFER == 0) {
 		mdebug("no refill because prepare or no buffer yet");
 		return;
 	}
@@ -793,14 +1695,14 @@ void buffer_refill() { // {{{
 		return;
 	}
 	refilling = true;
+	batch_reset();
 	// send_fragment in the previous refill may have failed; try it again.
 	/*if (current_fragment_pos > 0) {
 		debug("sending because data pending frag=%d pos=%d", current_fragment, current_fragment_pos);
 		send_fragment();
 	}*/
 	mdebug("refill start %d %d %d", running_fragment, current_fragment, sending_fragment);
-	// Keep one free fragment, because we want to be able to rewind and use the buffer before the one currently active.
-	while ((computing_move || settings.adjust > 0) && !aborting && !stopping && discarding == 0 && !discard_pending && (running_fragment - 1 - current_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > (FRAGMENTS_PER_BUFFER > 4 ? 4 : FRAGMENTS_PER_BUFFER - 2) && !sending_fragment) {
+	while ((computing_move || settings.adjust > 0) && !aborting && !stopping && discarding == 0 && !discard_pending && buffer_room() && !fragment_sending()) {
 		mdebug("refill %d %d %f", current_fragment, current_fragment_pos, spaces[0].motor[0]->settings.current_pos);
 		// fill fragment until full.
 		apply_tick();
@@ -809,6 +1711,8 @@ void buffer_refill() { // {{{
 			debug("sending because fragment full (weird) %d %d %d", computing_move, current_fragment_pos, BYTES_PER_FRAGMENT);
 			send_fragment();
 		}
+		if (current_fragment_pos == 0)
+			motion_yield();
 	}
 	if (aborting || stopping || discarding != 0 || discard_pending) {
 		mdebug("aborting refill for stopping");
@@ -823,7 +1727,372 @@ void buffer_refill() { // {{{
 	arch_start_move(0);
 } // }}}
 
+// Motion thread. {{{
+// Fragments are computed on their own thread, so requests and waiting for the firmware or the server do not delay them.
+// While it runs, the motion thread owns the planner state.  The main thread hands it queued moves through motion_inbox
+// and reads positions and the queue length from a copy that the motion thread publishes after every fragment.
+// For anything else that uses the planner state, the main thread calls motion_hold(), which makes the motion thread
+// wait at the end of its fragment.
+// Computed fragments are handed over in the arch's fragment queue; the main thread sends them with arch_send_queued().
+static pthread_mutex_t motion_lock = PTHREAD_MUTEX_INITIALIZER;	// Only for waking up and waiting; it is not held while computing.
+static pthread_cond_t motion_cond = PTHREAD_COND_INITIALIZER;	// Signalled when there is work, or when a hold is released.
+static pthread_cond_t motion_parked = PTHREAD_COND_INITIALIZER;	// Signalled when the motion thread starts waiting.
+static pthread_t motion_thread;
+static thread_local bool motion_self;
+static bool motion_work;	// A refill was requested.
+static bool motion_busy;	// The motion thread is not waiting.
+static bool motion_hold_request;	// The main thread is holding the motion thread; checked between fragments.
+static int motion_holds;	// Nesting depth of motion_hold(); only used by the main thread.
+static bool motion_signalled;	// The wake fd has been written and not drained yet.
+static bool motion_abort_pending;	// The motion thread waits for the main thread to call abort_move(motion_abort_pos).
+static int motion_abort_pos;
+
+// Queued moves, from the main thread to the motion thread.
+#define MOTION_INBOX_SIZE 64
+struct Motion_Move {
+	bool relative;
+	MoveCommand move;
+};
+static Motion_Move motion_inbox[MOTION_INBOX_SIZE];
+static uint32_t motion_inbox_head;	// Written by the main thread.
+static uint32_t motion_inbox_tail;	// Written by the thread that owns the planner state, after queueing the move.
+static bool motion_taking;	// The motion thread is queueing moves from the inbox; it may wait for an abort in the middle.
+
+// State for requests, published by the thread that owns the planner state.  It is written between two changes of
+// motion_status_seq, which is odd while it is written.
+static uint32_t motion_status_seq;
+static std::vector <double> motion_status_pos;	// Position and motor position of every axis; only resized while the motion thread waits.
+static int motion_status_queued;	// stream_length().
+static uint32_t motion_status_taken;	// motion_inbox_tail.
+static int32_t motion_status_hwtime;
+
+bool motion_thread_self() { // {{{
+	return motion_self;
+} // }}}
+
+static void motion_notify() { // {{{
+	// Wake up the main thread, so it sends the new fragments and handles events.
+	if (!motion_self || __atomic_exchange_n(&motion_signalled, true, __ATOMIC_SEQ_CST))
+		return;
+	uint64_t one = 1;
+	if (write(pollfds[4].fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+		debug("failed to wake main thread: %s", strerror(errno));
+} // }}}
+
+static void motion_kick() { // {{{
+	// Ask the motion thread to refill the buffer.
+	pthread_mutex_lock(&motion_lock);
+	motion_work = true;
+	pthread_cond_signal(&motion_cond);
+	pthread_mutex_unlock(&motion_lock);
+} // }}}
+
+static void motion_take_moves() { // {{{
+	// Queue the moves that the main thread handed over.
+	uint32_t head = __atomic_load_n(&motion_inbox_head, __ATOMIC_ACQUIRE);
+	if (motion_inbox_tail == head || motion_taking)
+		return;
+	motion_taking = motion_self;
+	while (motion_inbox_tail != head) {
+		Motion_Move &m = motion_inbox[motion_inbox_tail % MOTION_INBOX_SIZE];
+		queue_move(m.relative, &m.move);
+		if (!computing_move) {
+			cb_pending = true;
+			motion_notify();
+		}
+		__atomic_store_n(&motion_inbox_tail, motion_inbox_tail + 1, __ATOMIC_RELEASE);
+	}
+	motion_taking = false;
+	batch_reset();
+} // }}}
+
+static void motion_publish() { // {{{
+	// Copy the state that requests read without holding the motion thread.
+	size_t num = 0;
+	for (int s = 0; s < NUM_SPACES; ++s)
+		num += 2 * spaces[s].num_axes;
+	if (motion_status_pos.size() != num) {
+		// The spaces were changed while the motion thread waited; the main thread publishes the new state.
+		if (motion_self)
+			return;
+		motion_status_pos.resize(num);
+	}
+	uint32_t seq = motion_status_seq;
+	__atomic_store_n(&motion_status_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	size_t i = 0;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		for (int a = 0; a < sp.num_axes; ++a) {
+			double motor = a < sp.num_motors ? sp.motor[a]->settings.current_pos : NAN;
+			__atomic_store(&motion_status_pos[i++], &sp.axis[a]->current, __ATOMIC_RELAXED);
+			__atomic_store(&motion_status_pos[i++], &motor, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_store_n(&motion_status_queued, stream_length(), __ATOMIC_RELAXED);
+	__atomic_store_n(&motion_status_taken, motion_inbox_tail, __ATOMIC_RELAXED);
+	__atomic_store_n(&motion_status_hwtime, settings.hwtime, __ATOMIC_RELAXED);
+	__atomic_store_n(&motion_status_seq, seq + 2, __ATOMIC_RELEASE);
+} // }}}
+
+static void motion_status(size_t index, double *pos, int *queued, uint32_t *taken, int32_t *hwtime) { // {{{
+	// Read the published state; pos is NULL, or it gets the positions at index in motion_status_pos.
+	while (true) {
+		uint32_t seq = __atomic_load_n(&motion_status_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		if (pos) {
+			__atomic_load(&motion_status_pos[index], &pos[0], __ATOMIC_RELAXED);
+			__atomic_load(&motion_status_pos[index + 1], &pos[1], __ATOMIC_RELAXED);
+		}
+		*queued = __atomic_load_n(&motion_status_queued, __ATOMIC_RELAXED);
+		*taken = __atomic_load_n(&motion_status_taken, __ATOMIC_RELAXED);
+		*hwtime = __atomic_load_n(&motion_status_hwtime, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&motion_status_seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+} // }}}
+
+bool motion_getpos(int s, int a, double *axis, double *motor) { // {{{
+	// Get the position of an axis without holding the motion thread.
+	// If this returns false, the caller must hold it and use the planner state.
+	if (!motion_threaded || motion_holds > 0)
+		return false;
+	size_t index = 0;
+	for (int t = 0; t < s; ++t)
+		index += 2 * spaces[t].num_axes;
+	index += 2 * a;
+	if (index + 1 >= motion_status_pos.size())
+		return false;
+	double pos[2];
+	int queued;
+	uint32_t taken;
+	int32_t hwtime;
+	motion_status(index, pos, &queued, &taken, &hwtime);
+	if (std::isnan(pos[0]))
+		return false;
+	*axis = pos[0];
+	*motor = pos[1];
+	return true;
+} // }}}
+
+int motion_queued() { // {{{
+	// Number of segments and lines that have not been started, including the moves that were not taken from the inbox yet.
+	if (!motion_threaded || motion_holds > 0)
+		return stream_length();
+	int queued;
+	uint32_t taken;
+	int32_t hwtime;
+	motion_status(0, NULL, &queued, &taken, &hwtime);
+	return int(motion_inbox_head - taken) + queued;
+} // }}}
+
+int32_t motion_hwtime() { // {{{
+	// Time in the move that is being computed.
+	if (!motion_threaded || motion_holds > 0)
+		return settings.hwtime;
+	int queued;
+	uint32_t taken;
+	int32_t hwtime;
+	motion_status(0, NULL, &queued, &taken, &hwtime);
+	return hwtime;
+} // }}}
+
+bool motion_idle() { // {{{
+	// The motion thread has no moves to take or compute, so it will not queue fragments without a new request.
+	if (!motion_threaded || motion_holds > 0)
+		return true;
+	return !computing_move && __atomic_load_n(&motion_inbox_tail, __ATOMIC_ACQUIRE) == motion_inbox_head;
+} // }}}
+
+void motion_queue_move(bool relative, MoveCommand const *move) { // {{{
+	// Add a line to the stream; if there is a motion thread, it does this, so the request does not wait for it.
+	if (motion_threaded && motion_holds == 0 && motion_inbox_head - __atomic_load_n(&motion_inbox_tail, __ATOMIC_ACQUIRE) < MOTION_INBOX_SIZE) {
+		Motion_Move &m = motion_inbox[motion_inbox_head % MOTION_INBOX_SIZE];
+		m.relative = relative;
+		m.move = *move;
+		__atomic_store_n(&motion_inbox_head, motion_inbox_head + 1, __ATOMIC_RELEASE);
+		motion_kick();
+		return;
+	}
+	// The inbox is full, or the main thread owns the planner state already.
+	motion_hold();
+	queue_move(relative, move);
+	if (!computing_move)
+		cb_pending = true;
+	motion_unhold();
+} // }}}
+
+static void motion_park() { // {{{
+	// Let the main thread use the planner state; called by the motion thread with motion_lock held.
+	motion_busy = false;
+	pthread_cond_broadcast(&motion_parked);
+	while (motion_hold_request || motion_abort_pending)
+		pthread_cond_wait(&motion_cond, &motion_lock);
+	motion_busy = true;
+} // }}}
+
+static void motion_yield() { // {{{
+	// Called between fragments: let the main thread in if it is holding this thread, and make the new state visible.
+	if (!motion_self)
+		return;
+	if (__atomic_load_n(&motion_hold_request, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&motion_lock);
+		motion_park();
+		pthread_mutex_unlock(&motion_lock);
+		// Settings may have changed.
+		batch_reset();
+	}
+	motion_take_moves();
+	motion_publish();
+} // }}}
+
+void motion_hold() { // {{{
+	// Make the motion thread wait at the end of its fragment, so the main thread can use the planner state.
+	if (!motion_threaded || motion_self)
+		return;
+	if (motion_holds++ > 0)
+		return;
+	pthread_mutex_lock(&motion_lock);
+	__atomic_store_n(&motion_hold_request, true, __ATOMIC_SEQ_CST);
+	while (motion_busy)
+		pthread_cond_wait(&motion_parked, &motion_lock);
+	pthread_mutex_unlock(&motion_lock);
+	// Moves that were handed over before this must be queued before anything else changes.
+	motion_take_moves();
+} // }}}
+
+void motion_unhold() { // {{{
+	if (!motion_threaded || motion_self)
+		return;
+	if (--motion_holds > 0)
+		return;
+	motion_publish();
+	pthread_mutex_lock(&motion_lock);
+	__atomic_store_n(&motion_hold_request, false, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&motion_cond);
+	pthread_mutex_unlock(&motion_lock);
+} // }}}
+
+bool motion_holding() { // {{{
+	return motion_holds > 0;
+} // }}}
+
+static void motion_abort(int pos) { // {{{
+	// Called by the motion thread instead of abort_move(): the main thread may be sending the fragments that are rewound, so it does the abort while this thread waits.
+	pthread_mutex_lock(&motion_lock);
+	motion_abort_pos = pos;
+	__atomic_store_n(&motion_abort_pending, true, __ATOMIC_SEQ_CST);
+	motion_notify();
+	motion_park();
+	pthread_mutex_unlock(&motion_lock);
+	batch_reset();
+} // }}}
+
+void motion_drain() { // {{{
+	// Called by the main thread when the wake fd is readable.
+	uint64_t value;
+	if (read(pollfds[4].fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		debug("failed to read motion wake fd: %s", strerror(errno));
+	__atomic_store_n(&motion_signalled, false, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&motion_abort_pending, __ATOMIC_SEQ_CST))
+		return;
+	motion_hold();
+	abort_move(motion_abort_pos);
+	__atomic_store_n(&motion_abort_pending, false, __ATOMIC_SEQ_CST);
+	motion_unhold();
+} // }}}
+
+void motion_wait() { // {{{
+	// Let the motion thread finish the requested refill. This is for archs that run fragments on the main thread.
+	if (!motion_threaded || motion_self)
+		return;
+	if (motion_holds > 0) {
+		debug("motion_wait called while holding the motion thread");
+		abort();
+	}
+	pthread_mutex_lock(&motion_lock);
+	while (motion_work || motion_busy)
+		pthread_cond_wait(&motion_parked, &motion_lock);
+	pthread_mutex_unlock(&motion_lock);
+} // }}}
+
+static void *motion_run(void *) { // {{{
+	motion_self = true;
+	pthread_mutex_lock(&motion_lock);
+	while (true) {
+		while (!motion_work || motion_hold_request)
+			pthread_cond_wait(&motion_cond, &motion_lock);
+		motion_work = false;
+		motion_busy = true;
+		pthread_mutex_unlock(&motion_lock);
+		motion_take_moves();
+		buffer_refill();
+		motion_publish();
+		pthread_mutex_lock(&motion_lock);
+		motion_busy = false;
+		pthread_cond_broadcast(&motion_parked);
+	}
+	return NULL;
+} // }}}
+
+static void motion_pin() { // {{{
+	// Give the motion thread a core of its own: the last allowed one, which the main thread stops using.
+	cpu_set_t cpus;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+		debug("unable to get cpu affinity: %s; not pinning the motion thread", strerror(errno));
+		return;
+	}
+	if (CPU_COUNT(&cpus) < 2) {
+		debug("only one cpu is available; not pinning the motion thread");
+		return;
+	}
+	int cpu = CPU_SETSIZE - 1;
+	while (!CPU_ISSET(cpu, &cpus))
+		--cpu;
+	cpu_set_t motion_cpu;
+	CPU_ZERO(&motion_cpu);
+	CPU_SET(cpu, &motion_cpu);
+	int ret = pthread_setaffinity_np(motion_thread, sizeof(motion_cpu), &motion_cpu);
+	if (ret != 0) {
+		debug("unable to pin the motion thread to cpu %d: %s", cpu, strerror(ret));
+		return;
+	}
+	CPU_CLR(cpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+		debug("unable to keep the main thread off cpu %d: %s", cpu, strerror(errno));
+	debug("motion thread pinned to cpu %d", cpu);
+} // }}}
+
+void motion_start() { // {{{
+	// Start the motion thread; from now on, the main thread must hold it to use the planner state.
+	pollfds[4].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pollfds[4].events = POLLIN;
+	pollfds[4].revents = 0;
+	if (pollfds[4].fd < 0) {
+		debug("unable to create motion wake fd: %s; computing moves on the main thread", strerror(errno));
+		return;
+	}
+	motion_publish();
+	motion_threaded = true;
+	int ret = pthread_create(&motion_thread, NULL, motion_run, NULL);
+	if (ret != 0) {
+		debug("unable to start motion thread: %s; computing moves on the main thread", strerror(ret));
+		motion_threaded = false;
+		return;
+	}
+	motion_pin();
+} // }}}
+// }}}
+
 void abort_move(int pos) { // {{{
+	if (motion_self) {
+		motion_abort(pos);
+		return;
+	}
 	aborting = true;
 	//debug("abort pos %d", pos);
 	//debug("abort; cf %d rf %d first %d computing_move %d fragments, regenerating %d ticks", current_fragment, running_fragment, first_fragment, computing_move, pos);
@@ -843,6 +2112,8 @@ void abort_move(int pos) { // {{{
 		}
 	}
 	restore_settings();
+	// Fragments that were computed, but not sent, are gone.
+	arch_rewind();
 	for (int i = 0; i < 6; ++i) {
 		final_x[i] = NAN;
 		final_v[i] = 0;
@@ -851,6 +2122,7 @@ void abort_move(int pos) { // {{{
 	//debug("free abort reset");
 	current_fragment_pos = 0;
 	computing_move = true;
+	batch_reset();
 	while (computing_move && current_fragment_pos < unsigned(pos)) {
 		mdebug("abort reconstruct %d %d", current_fragment_pos, pos);
 		apply_tick();
@@ -861,6 +2133,7 @@ void abort_move(int pos) { // {{{
 	// Flush queue.
 	settings.queue_start = 0;
 	settings.queue_end = 0;
+	stream_clear();
 	// Copy settings back to previous fragment.
 	current_fragment_pos = 0;
 	settings.adjust = 0;
@@ -917,7 +2190,23 @@ static double s_dv(double v1, double v2) { // {{{
 	}
 } // }}}
 
+void Move_Queue::make_room(int q) { // {{{
+	int used = q - settings.queue_start;
+	int size = data.size();
+	if (used < size)
+		return;
+	while (size <= used)
+		size *= 2;
+	// Move the queued segments to their place in the larger ring.
+	std::vector <MoveCommand> old(size);
+	old.swap(data);
+	for (int i = settings.queue_start; i < q; ++i)
+		data[i & (size - 1)] = old[i & (old.size() - 1)];
+	mdebug("move queue grown to %d", size);
+} // }}}
+
 static int add_to_queue(int q, int64_t gcode_line, int time, int tool, double pos[6], double tf, double v0, double a0, double e, double target[6], double Jg, double *h = NULL, double Jh = 0, bool reverse = false) { // {{{
+	queue.make_room(q);
 	queue[q].probe = false;
 	queue[q].single = false;
 	queue[q].reverse = reverse;
@@ -1049,6 +2338,7 @@ bool compute_current_pos(double x[6], double v[6], double a[6], bool store) { //
 	mdebug("flush queue for discard at compute current");
 	settings.queue_start = 0;
 	settings.queue_end = 0;
+	stream_clear();
 	double t = settings.hwtime / 1e6;
 	double t2 = t * t;
 	double t3 = t2 * t;
@@ -1072,8 +2362,9 @@ bool compute_current_pos(double x[6], double v[6], double a[6], bool store) { //
 	}
 	for (int i = 0; i < 6; ++i) {
 		x[i] = (i < spaces[0].num_axes ? spaces[0].axis[i]->settings.source : 0) + xg * settings.unitg[i] + xh * settings.unith[i];
-		v[i] = vg * settings.unitg[i] + vh * settings.unith[i];
-		a[i] = ag * settings.unitg[i] + ah * settings.unith[i];
+		// The feed rate override warps time, so the real speed differs from the planned speed.
+		v[i] = (vg * settings.unitg[i] + vh * settings.unith[i]) * settings.feed;
+		a[i] = (ag * settings.unitg[i] + ah * settings.unith[i]) * settings.feed * settings.feed;
 		// Update "final" settings.
 		if (i < spaces[0].num_axes) {
 			final_x[i] = x[i];
@@ -1212,6 +2503,7 @@ int go_to(bool relative, MoveCommand const *move, bool queue_only) { // {{{
 	mdebug("goto (%.2f,%.2f,%.2f) %s at speed %.2f, e %.2f", move->target[0], move->target[1], move->target[2], relative ? "rel" : "abs", move->v0, move->e);
 	mdebug("new queue for goto");
 	settings.queue_start = 0;
+	stream_clear();
 	int q = 0;
 	double x[6];
 	for (int a = 0; a < 6; ++a) {
@@ -1480,6 +2772,221 @@ int go_to(bool relative, MoveCommand const *move, bool queue_only) { // {{{
 	return 0;
 } // }}}
 
+// Queued immediate moves. {{{
+// A move from the host that is queued does not replace the current movement like go_to()
+// does, but is added to a list of lines.  When the segment queue runs empty, the first
+// line is turned into segments.  Like Parser::flush_pending() does for files, its end speed
+// is planned with all lines that are known at that time: consecutive lines in (almost)
+// the same direction are joined at speed, and the tool can always stop at the end of the
+// last line.  Lines that meet at a corner are joined at (nearly) zero speed, because these
+// moves are not rounded like parsed G-code is.
+struct Stream_Line {
+	double target[6];
+	double e, v;
+	int tool;
+	int64_t gcode_line;
+	double time;
+};
+static std::vector <Stream_Line> stream;	// Lines that have not been started.
+static int stream_first;	// Index of the first line in stream that has not been started.
+static double stream_v;	// Speed at the end of the segments that were queued for the last started line.
+static double const max_junction_dv = .05;	// Speed change that is allowed where lines join; below the check in next_move().
+
+void stream_clear() { // {{{
+	stream.clear();
+	stream_first = 0;
+	stream_v = 0;
+} // }}}
+
+int stream_length() { // {{{
+	// Number of segments and lines that have not been started.
+	return settings.queue_end - settings.queue_start + int(stream.size()) - stream_first;
+} // }}}
+
+void queue_move(bool relative, MoveCommand const *move) { // {{{
+	// Add a line to the stream and start it if the machine is not moving.
+	Stream_Line line;
+	int na = min(6, spaces[0].num_axes);
+	for (int a = 0; a < 6; ++a) {
+		// The line starts where the previous line ends.
+		double prev;
+		if (a >= na)
+			prev = 0;
+		else if (int(stream.size()) > stream_first)
+			prev = stream.back().target[a];
+		else if (computing_move)
+			prev = spaces[0].axis[a]->last_target;
+		else
+			prev = spaces[0].axis[a]->current;
+		if (std::isnan(prev) && a < na)
+			prev = spaces[0].axis[a]->current;
+		if (std::isnan(move->target[a]))
+			line.target[a] = prev;
+		else
+			line.target[a] = (relative ? prev : 0) + move->target[a];
+		if (a < na)
+			spaces[0].axis[a]->last_target = line.target[a];
+	}
+	line.e = move->e;
+	line.v = min(move->v0, max_v);
+	line.tool = move->tool;
+	line.gcode_line = move->gcode_line;
+	line.time = move->time;
+	mdebug("queue line to (%.2f,%.2f,%.2f) at speed %.2f", line.target[0], line.target[1], line.target[2], line.v);
+	stream.push_back(line);
+	if (!computing_move)
+		next_move(settings.hwtime);
+} // }}}
+
+static double stream_s_dv(double v1, double v2) { // {{{
+	// Length of a speed change as queue_speed_change() queues it; it ignores tiny changes.
+	if (std::fabs(v2 - v1) < 1e-5)
+		return 0;
+	return s_dv(v1, v2);
+} // }}}
+
+static double stream_reachable_v(double v, double dist, double limit) { // {{{
+	// Highest speed up to limit that can be reached from v (or that can be slowed down to v) within dist.
+	if (limit <= v || s_dv(v, limit) <= dist)
+		return limit;
+	double low = v, high = limit;
+	for (int i = 0; i < 40; ++i) {
+		double mid = (low + high) / 2;
+		if (s_dv(v, mid) <= dist)
+			low = mid;
+		else
+			high = mid;
+	}
+	return low;
+} // }}}
+
+static double stream_top_v(double v_in, double v_out, double dist, double limit) { // {{{
+	// Highest speed up to limit that can be reached between v_in and v_out within dist.
+	double low = max(v_in, v_out);
+	if (limit <= low || s_dv(v_in, limit) + s_dv(limit, v_out) <= dist)
+		return max(low, limit);
+	double high = limit;
+	for (int i = 0; i < 40; ++i) {
+		double mid = (low + high) / 2;
+		if (s_dv(v_in, mid) + s_dv(mid, v_out) <= dist)
+			low = mid;
+		else
+			high = mid;
+	}
+	return low;
+} // }}}
+
+static void plan_stream() { // {{{
+	// Turn the first line of the stream into segments.
+	int n = stream.size() - stream_first;
+	if (n <= 0 || stopping)
+		return;
+	// The line starts where the previous segment ends.
+	double x[6], e0 = NAN;
+	for (int a = 0; a < 6; ++a) {
+		if (a < spaces[0].num_axes)
+			x[a] = computing_move ? spaces[0].axis[a]->settings.source : spaces[0].axis[a]->current;
+		else
+			x[a] = 0;
+	}
+	Stream_Line const &first = stream[stream_first];
+	if (first.tool >= 0 && first.tool < spaces[1].num_axes)
+		e0 = computing_move ? spaces[1].axis[first.tool]->settings.source : spaces[1].axis[first.tool]->current;
+	// Compute lengths, directions and maximum speeds where the lines join.
+	std::vector <double> len(n), unit(n * 6), v_join(n);
+	double const *start = x;
+	for (int i = 0; i < n; ++i) {
+		Stream_Line const &line = stream[stream_first + i];
+		double l = 0;
+		for (int a = 0; a < 6; ++a) {
+			unit[i * 6 + a] = line.target[a] - start[a];
+			l += unit[i * 6 + a] * unit[i * 6 + a];
+		}
+		len[i] = std::sqrt(l);
+		for (int a = 0; a < 6; ++a)
+			unit[i * 6 + a] = len[i] < 1e-10 ? 0 : unit[i * 6 + a] / len[i];
+		start = line.target;
+	}
+	for (int i = 0; i < n; ++i) {
+		if (i == n - 1) {
+			v_join[i] = 0;
+			continue;
+		}
+		double diff = 0;
+		for (int a = 0; a < 6; ++a) {
+			double d = unit[i * 6 + a] - unit[(i + 1) * 6 + a];
+			diff += d * d;
+		}
+		diff = std::sqrt(diff);
+		v_join[i] = min(stream[stream_first + i].v, stream[stream_first + i + 1].v);
+		if (diff > 0)
+			v_join[i] = min(v_join[i], max_junction_dv / diff);
+	}
+	// Work backwards, so every line can slow down to what the next line allows.
+	for (int i = n - 2; i >= 0; --i)
+		v_join[i] = stream_reachable_v(v_join[i + 1], len[i + 1], v_join[i]);
+	// A line of zero length is only useful for moving the extruder; it is not joined at speed.
+	double v_in = stream_v;
+	double const *u = &unit[0];
+	if (len[0] < 1e-10) {
+		v_in = 0;
+		v_join[0] = 0;
+	}
+	double v_out = stream_reachable_v(v_in, len[0], v_join[0]);
+	double v_top = stream_top_v(v_in, v_out, len[0], first.v);
+	mdebug("stream line: length %f, v %f -> %f -> %f", len[0], v_in, v_top, v_out);
+	// Queue the segments.
+	settings.queue_start = 0;
+	int q = 0;
+	double pos[6], dir[6];
+	for (int a = 0; a < 6; ++a) {
+		pos[a] = x[a];
+		dir[a] = u[a];
+	}
+	if (len[0] >= 1e-10) {
+		q = queue_speed_change(q, first.tool, pos, dir, v_in, v_top);
+		double dist = len[0] - stream_s_dv(v_in, v_top) - stream_s_dv(v_top, v_out);
+		if (dist > 1e-10) {
+			double target[6];
+			for (int a = 0; a < 6; ++a)
+				target[a] = pos[a] + dir[a] * dist;
+			q = add_to_queue(q, -1, 0, first.tool, pos, dist / v_top, v_top, 0, NAN, target, 0);
+		}
+		q = queue_speed_change(q, first.tool, pos, dir, v_top, v_out);
+	}
+	else if (!std::isnan(first.e) && !std::isnan(e0)) {
+		// Only the extruder moves.
+		double vmax = min(first.v, spaces[1].motor[first.tool]->limit_v);
+		double dist = std::fabs(first.e - e0);
+		double t = dist / vmax + std::sqrt(dist / max_a);
+		double target[6];
+		for (int a = 0; a < 6; ++a)
+			target[a] = first.target[a];
+		q = add_to_queue(q, -1, 0, first.tool, pos, t, 0, 0, NAN, target, 0);
+	}
+	// Set the extruder position and line information for all segments, like go_to() does.
+	for (int i = 0; i < q; ++i) {
+		queue[i].gcode_line = first.gcode_line;
+		queue[i].time = first.time;
+		if (std::isnan(first.e) || std::isnan(e0))
+			continue;
+		double s = 0;
+		for (int a = 0; a < 6; ++a)
+			s += (queue[i].target[a] - x[a]) * u[a];
+		queue[i].e = len[0] < 1e-10 ? first.e : e0 + (first.e - e0) * s / len[0];
+	}
+	settings.queue_end = q;
+	stream_v = v_out;
+	stream_first += 1;
+	if (stream_first == int(stream.size()))
+		stream_clear();	// The last line always ends at zero speed.
+	else if (stream_first > 100 && stream_first * 2 > int(stream.size())) {
+		stream.erase(stream.begin(), stream.begin() + stream_first);
+		stream_first = 0;
+	}
+} // }}}
+// }}}
+
 void discard_finals() { // {{{
 	for (int i = 0; i < 6; ++i) {
 		final_x[i] = NAN;
@@ -1490,14 +2997,15 @@ void discard_finals() { // {{{
 
 void discard() { // {{{
 	// Discard much of the buffer, so the upcoming change will be used almost immediately.
-	if (!avr_running || stopping || avr_homing || !computing_move || discarding != 0)
+	if (!arch_running() || stopping || !computing_move || discarding != 0)
 		return;
 	//debug("discard start current = %d, running = %d, sending = %d", current_fragment, running_fragment, sending_fragment);
 	discard_pending = true;
 	// Clear final target of current move.
 	discard_finals();
 	// Compute fragments in buffer; if there are enough, discard some.
-	int fragments = (current_fragment + (transmitting_fragment ? 1 : 0) - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
+	// A fragment that is being transmitted was counted in current_fragment when it was queued.
+	int fragments = (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
 	if (fragments <= 3) {
 		discard_pending = false;
 		return;
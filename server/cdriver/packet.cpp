@@ -24,6 +24,66 @@ static void get_cb(bool value) {
 	delayed_reply();
 }
 
+static bool do_move(bool relative, bool queue, MoveCommand *move, int *ret) { // {{{
+	// Returns false if the move is ignored.
+	// Ignore move while stopping.
+	if (stopping)
+		return false;
+	// Ignore move while running.
+	if (run_file_map != NULL && !pausing && !parkwaiting)
+		return false;
+	//debug("moving to (%f,%f,%f), tool %d e %f v %f", move->target[0], move->target[1], move->target[2], move->tool, move->e, move->v0);
+	last_active = millis();
+	initialized = true;
+	move->target[2] += zoffset;
+	if (queue) {
+		// Queued move; add it after the others.
+		motion_queue_move(relative, move);
+		*ret = 0;
+		return true;
+	}
+	motion_hold();
+	*ret = go_to(relative, move);
+	if (!computing_move)
+		cb_pending = true;
+	motion_unhold();
+	return true;
+} // }}}
+
+static void get_pos(int s, int a, volatile double *ret) { // {{{
+	if (s >= NUM_SPACES || a >= spaces[s].num_axes) {
+		debug("Getting position of invalid axis %d %d", s, a);
+		abort();
+	}
+	if (!motors_busy) {
+		ret[0] = NAN;
+		ret[1] = NAN;
+		return;
+	}
+	double axis, motor;
+	if (!motion_getpos(s, a, &axis, &motor)) {
+		// The position must be computed from the planner state.
+		motion_hold();
+		if (std::isnan(spaces[s].axis[a]->current)) {
+			reset_pos(&spaces[s]);
+			for (int i = 0; i < spaces[s].num_axes; ++i) {
+				//debug("setting %d %d source to %f for non-NaN.", s, i, spaces[s].axis[i]->current);
+				spaces[s].axis[i]->settings.source = spaces[s].axis[i]->current;
+			}
+		}
+		axis = spaces[s].axis[a]->current;
+		motor = spaces[s].motor[a]->settings.current_pos;
+		motion_unhold();
+	}
+	ret[0] = axis;
+	ret[1] = motor;
+	//debug("getpos %d %d %f", s, a, ret[0]);
+	if (s == 0) {
+		if (a == 2)
+			ret[0] -= zoffset;
+	}
+} // }}}
+
 #if 0
 #define CASE(x) case x: debug("request " # x " current fragment pos = %d", current_fragment_pos);
 #define CASE2(x) case x: debug("request " # x);
@@ -32,7 +92,37 @@ static void get_cb(bool value) {
 #define CASE2(x) case x:
 #endif
 
-void request(int req) {
+static bool request_holds(int req) { // {{{
+	// Most requests use the planner state, so the motion thread must wait while they are handled.
+	// These don't: they read a copy of the state, hand a move to the motion thread, or hold it themselves if needed.
+	switch (req) {
+	case CMD_SET_UUID:
+	case CMD_MOVE:
+	case CMD_SETTEMP:
+	case CMD_WAITTEMP:
+	case CMD_TEMP_VALUE:
+	case CMD_POWER_VALUE:
+	case CMD_GETPOS:
+	case CMD_READ_GLOBALS:
+	case CMD_READ_SPACE_INFO:
+	case CMD_READ_SPACE_AXIS:
+	case CMD_READ_TEMP:
+	case CMD_WRITE_TEMP:
+	case CMD_READ_GPIO:
+	case CMD_WRITE_GPIO:
+	case CMD_QUEUED:
+	case CMD_PIN_VALUE:
+	case CMD_GET_TIME:
+	case CMD_SPI:
+	case CMD_TP_GETPOS:
+	case CMD_MOTORS2XYZ:
+		return false;
+	default:
+		return true;
+	}
+} // }}}
+
+static void do_request(int req) {
 	switch (req) {
 	CASE(CMD_SET_UUID)
 		arch_set_uuid();
@@ -58,22 +148,15 @@ void request(int req) {
 		arch_reconnect(const_cast<const char *>(shmem->strs[0]));
 		break;
 	CASE(CMD_MOVE)
-		// Ignore move while stopping.
-		if (stopping)
-			break;
-		// Ignore move while running.
-		if (run_file_map != NULL && !pausing && !parkwaiting)
+	{
+		int ret;
+		if (!do_move(shmem->ints[0], shmem->ints[2], const_cast <MoveCommand *>(&shmem->move), &ret))
 			break;
-		//debug("moving to (%f,%f,%f), tool %d e %f v %f", shmem->move.target[0], shmem->move.target[1], shmem->move.target[2], shmem->move.tool, shmem->move.e, shmem->move.v0);
-		last_active = millis();
-		initialized = true;
-		shmem->move.target[2] += zoffset;
-		shmem->ints[1] = go_to(shmem->ints[0], const_cast <MoveCommand const *>(&shmem->move));
-		if (!computing_move)
-			cb_pending = true;
+		shmem->ints[1] = ret;
 		delayed_reply();
 		buffer_refill();
 		return;
+	}
 	CASE(CMD_RUN)
 		last_active = millis();
 		if (!run_file(const_cast<const char *>(shmem->strs[0]), const_cast<const char *>(shmem->strs[1]), shmem->ints[0], shmem->floats[0], shmem->floats[1]))
@@ -180,29 +263,7 @@ void request(int req) {
 		setpos(shmem->ints[0], shmem->ints[1], shmem->floats[0], true);
 		break;
 	CASE2(CMD_GETPOS)
-		if (shmem->ints[0] >= NUM_SPACES || shmem->ints[1] >= spaces[shmem->ints[0]].num_axes) {
-			debug("Getting position of invalid axis %d %d", shmem->ints[0], shmem->ints[1]);
-			abort();
-			return;
-		}
-		if (!motors_busy) {
-			shmem->floats[0] = NAN;
-			break;
-		}
-		if (std::isnan(spaces[shmem->ints[0]].axis[shmem->ints[1]]->current)) {
-			reset_pos(&spaces[shmem->ints[0]]);
-			for (int a = 0; a < spaces[shmem->ints[0]].num_axes; ++a) {
-				//debug("setting %d %d source to %f for non-NaN.", shmem->ints[0], a, spaces[shmem->ints[0]].axis[a]->current);
-				spaces[shmem->ints[0]].axis[a]->settings.source = spaces[shmem->ints[0]].axis[a]->current;
-			}
-		}
-		shmem->floats[0] = spaces[shmem->ints[0]].axis[shmem->ints[1]]->current;
-		shmem->floats[1] = spaces[shmem->ints[0]].motor[shmem->ints[1]]->settings.current_pos;
-		//debug("getpos %d %d %f", shmem->ints[0], shmem->ints[1], shmem->floats[0]);
-		if (shmem->ints[0] == 0) {
-			if (shmem->ints[1] == 2)
-				shmem->floats[0] -= zoffset;
-		}
+		get_pos(shmem->ints[0], shmem->ints[1], shmem->floats);
 		break;
 	CASE(CMD_READ_GLOBALS)
 		globals_save();
@@ -296,7 +357,7 @@ void request(int req) {
 		break;
 	CASE(CMD_QUEUED)
 		last_active = millis();
-		shmem->ints[1] = settings.queue_end - settings.queue_start;
+		shmem->ints[1] = motion_queued();
 		break;
 	CASE(CMD_HOME)
 		arch_home();
@@ -357,8 +418,16 @@ void request(int req) {
 		pausing = false;
 		break;
 	CASE2(CMD_GET_TIME)
-		shmem->floats[0] = history[running_fragment].run_time / feedrate + settings.hwtime / 1e6;
+	{
+		// The history of a fragment is not changed while it runs; if nothing runs, the motion thread may be writing it.
+		bool hold = !arch_running();
+		if (hold)
+			motion_hold();
+		shmem->floats[0] = history.settings[running_fragment].run_time / feedrate + motion_hwtime() / 1e6;
+		if (hold)
+			motion_unhold();
 		break;
+	}
 	CASE(CMD_SPI)
 		arch_send_spi(shmem->ints[0], reinterpret_cast<const uint8_t *>(const_cast<const char *>(shmem->strs[0])));
 		break;
@@ -366,15 +435,22 @@ void request(int req) {
 		run_adjust_probe(shmem->floats[0], shmem->floats[1], shmem->floats[2]);
 		break;
 	CASE2(CMD_TP_GETPOS)
-		shmem->floats[0] = history[running_fragment].run_file_current + (history[running_fragment].hwtime / 1e6) / (history[running_fragment].end_time / 1e6);
+	{
+		bool hold = !arch_running();
+		if (hold)
+			motion_hold();
+		shmem->floats[0] = history.settings[running_fragment].run_file_current + (history.settings[running_fragment].hwtime / 1e6) / (history.settings[running_fragment].end_time / 1e6);
+		if (hold)
+			motion_unhold();
 		break;
+	}
 	CASE(CMD_TP_SETPOS)
 	{
 		int ipos = int(shmem->floats[0]);
 		discard();
 		settings.run_file_current = ipos;
 		// Hack to force TP_GETPOS to return the same value; this is only called when paused, so it does no harm.
-		history[running_fragment].run_file_current = ipos;
+		history.settings[running_fragment].run_file_current = ipos;
 		for (int s = 0; s < NUM_SPACES; ++s) {
 			Space &sp = spaces[s];
 			for (int a = 0; a < sp.num_axes; ++a)
@@ -396,6 +472,64 @@ void request(int req) {
 	delayed_reply();
 }
 
+void request(int req) {
+	bool hold = request_holds(req);
+	if (hold)
+		motion_hold();
+	do_request(req);
+	if (hold)
+		motion_unhold();
+}
+
+// Handle all requests in the command ring.
+void ring_request() {
+	// This can be called recursively while waiting for an interrupt reply; the outer call handles the new requests as well.
+	static bool busy = false;
+	if (busy)
+		return;
+	uint32_t handled = shmem->ring_handled;
+	if (handled == __atomic_load_n(&shmem->ring_head, __ATOMIC_ACQUIRE))
+		return;
+	busy = true;
+	bool moved = false;
+	for (; handled != __atomic_load_n(&shmem->ring_head, __ATOMIC_ACQUIRE); ++handled) {
+		volatile RingEntry &entry = shmem->ring[handled % RING_SIZE];
+		switch (entry.cmd) {
+		CASE2(CMD_GETPOS)
+			get_pos(entry.ints[0], entry.ints[1], entry.floats);
+			break;
+		CASE(CMD_MOVE)
+		{
+			MoveCommand move = MoveCommand();
+			move.tool = entry.ints[3];
+			move.single = entry.ints[4] & 1;
+			move.probe = (entry.ints[4] >> 1) & 1;
+			for (int i = 0; i < 6; ++i)
+				move.target[i] = entry.floats[i];
+			move.e = entry.floats[6];
+			move.v0 = entry.floats[7];
+			int ret = 0;
+			if (do_move(entry.ints[0], entry.ints[2], &move, &ret))
+				moved = true;
+			entry.ints[1] = ret;
+			break;
+		}
+		default:
+			debug("unknown request in command ring: %x", entry.cmd);
+		}
+		// Results must be visible before the entry is marked as handled.
+		__atomic_store_n(&shmem->ring_handled, handled + 1, __ATOMIC_RELEASE);
+	}
+	busy = false;
+	uint64_t one = 1;
+	if (write(ring_done, &one, sizeof(one)) != sizeof(one)) {
+		debug("failed to signal command ring results");
+		abort();
+	}
+	if (moved)
+		buffer_refill();
+}
+
 void delayed_reply() {
 	char cmd = 0;
 	if (write(toserver, &cmd, 1) != 1) {
@@ -20,6 +20,7 @@
 #include "cdriver.h"
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <signal.h>
 
 #if 0
 #define rundebug debug
@@ -27,20 +28,18 @@
 #define rundebug(...) do {} while(0)
 #endif
 
-static int read_num(off_t offset) {
-	int ret = 0;
-	uint8_t const *map = reinterpret_cast<uint8_t const *>(run_file_map);
-	for (int i = 0; i < 4; ++i)
-		ret |= (map[offset + i]) << (8 * i);
-	return ret;
-}
+// Decodes the records of the run file.
+static Run_Reader reader;
 
-struct String {
-	int len;
-	off_t start;
-};
+// Finds the closest move for run_find_pos(); loaded or built on the first request.
+static Run_Spatial_Index spatial;
+static bool spatial_checked, spatial_usable;
 
-static String *strings;
+// While the run file is still being written, these are kept open to follow it.
+static int stream_fd = -1;
+static int progress_fd = -1;
+static int32_t stream_last_change;	// Time when the parser last wrote records, from millis().
+static std::string stream_error;	// Why the parser did not complete the run file; empty if it did.
 
 static double probe_adjust;
 
@@ -48,9 +47,103 @@ static int pattern_size;
 static uint8_t current_pattern[PATTERN_MAX];
 static double pending_abc[3], pending_abc_h[3];
 
+static void close_stream() {
+	if (stream_fd >= 0)
+		close(stream_fd);
+	if (progress_fd >= 0)
+		close(progress_fd);
+	stream_fd = -1;
+	progress_fd = -1;
+}
+
+static void fail_stream(char const *reason) {
+	// The parser will not write more records, so the job cannot be completed.
+	// Stop at the current record; when the machine has stopped, the job is reported as failed instead of done.
+	debug("Parsing of run file '%s' %s", run_file_name.c_str(), reason);
+	close_stream();
+	if (run_file_num_records > settings.run_file_current)
+		run_file_num_records = settings.run_file_current;
+	stream_error = std::string("parsing ") + reason;
+}
+
+static bool refresh_stream() {
+	// Check if the parser has written more records; map them if so.
+	// Returns true if the mapping has changed.
+	if (progress_fd < 0)
+		return false;
+	Run_Progress progress;
+	if (pread(progress_fd, &progress, sizeof(progress), 0) != sizeof(progress)) {
+		// The parser has only just created it.
+		progress.size = 0;
+		progress.done = 0;
+		progress.pid = 0;
+	}
+	if (progress.done < 0) {
+		fail_stream("was cancelled");
+		return false;
+	}
+	if (!progress.done && progress.size <= run_file_size) {
+		// Nothing new; make sure the parser is still working on it.
+		if (progress.pid > 0 && kill(pid_t(progress.pid), 0) < 0 && errno == ESRCH)
+			fail_stream("did not complete: the parser is gone");
+		else if (millis() - stream_last_change > RUN_STREAM_TIMEOUT)
+			fail_stream("has stalled");
+		return false;
+	}
+	stream_last_change = millis();
+	off_t size;
+	if (progress.done) {
+		struct stat stat;
+		if (fstat(stream_fd, &stat) < 0) {
+			debug("Failed to stat run file '%s': %s", run_file_name.c_str(), strerror(errno));
+			return false;
+		}
+		size = stat.st_size;
+	}
+	else
+		size = progress.size;
+	char const *map = reinterpret_cast<char const *>(mmap(NULL, size, PROT_READ, MAP_SHARED, stream_fd, 0));
+	if (map == MAP_FAILED) {
+		debug("Failed to map run file '%s': %s", run_file_name.c_str(), strerror(errno));
+		return false;
+	}
+	munmap(const_cast<char *>(run_file_map), run_file_size);
+	run_file_map = map;
+	run_file_size = size;
+	// The header is read again when the file is complete, because only then does it contain the index.
+	bool ok = progress.done || !reader.map ? reader.open(map, size) : reader.update(map, size);
+	if (progress.done)
+		close_stream();
+	if (!ok) {
+		debug("Run file '%s' is invalid", run_file_name.c_str());
+		close_stream();
+		run_file_num_records = settings.run_file_current;
+		stream_error = "the run file is invalid";
+		return false;
+	}
+	run_file_num_records = reader.num_records;
+	rundebug("run file now has %" LONGFMT " records%s", run_file_num_records, stream_fd < 0 ? " (complete)" : "");
+	return true;
+}
+
+static bool have_record() {
+	if (settings.run_file_current < run_file_num_records)
+		return true;
+	return refresh_stream() && settings.run_file_current < run_file_num_records;
+}
+
+static void wait_for_stream() {
+	// Check again later; the timer is handled like RUN_WAIT.
+	run_file_timer.it_value.tv_sec = 0;
+	run_file_timer.it_value.tv_nsec = 50000000;
+	run_file_wait += 1;
+	timerfd_settime(pollfds[0].fd, 0, &run_file_timer, NULL);
+}
+
 bool run_file(char const *name, char const *probename, bool start, double sina, double cosa) {
 	rundebug("run file %d %f %f", start, sina, cosa);
 	abort_run_file();
+	stream_error.clear();
 	if (name[0] == '\0')
 		return false;
 	run_file_name = name;
@@ -77,57 +170,68 @@ bool run_file(char const *name, char const *probename, bool start, double sina,
 			return false;
 		}
 	}
+	// If the parser is still writing the file, follow it instead of requiring it to be complete.
+	// The progress file must be opened first, so the parser cannot finish in between.
+	progress_fd = open((run_file_name + RUN_PROGRESS_SUFFIX).c_str(), O_RDONLY);
 	int fd = open(run_file_name.c_str(), O_RDONLY);
 	if (fd < 0) {
 		debug("Failed to open run file '%s': %s", run_file_name.c_str(), strerror(errno));
 		if (probename[0] != '\0')
 			close(probe_fd);
+		close_stream();
 		return false;
 	}
 	struct stat stat;
 	if (fstat(fd, &stat) < 0) {
 		debug("Failed to stat run file '%s': %s", run_file_name.c_str(), strerror(errno));
 		close(fd);
+		if (probename[0] != '\0')
+			close(probe_fd);
+		close_stream();
+		return false;
+	}
+	if (progress_fd >= 0) {
+		// Map a single page for now; refresh_stream() maps the records when they are available.
+		stream_fd = fd;
+		stream_last_change = millis();
+		run_file_size = 1;
+	}
+	else
+		run_file_size = stat.st_size;
+	run_file_map = reinterpret_cast<char const *>(mmap(NULL, run_file_size, PROT_READ, MAP_SHARED, fd, 0));
+	if (progress_fd < 0)
+		close(fd);
+	reader.map = NULL;
+	if (progress_fd < 0 && !reader.open(run_file_map, run_file_size)) {
+		debug("Run file '%s' is invalid or has an unsupported format", run_file_name.c_str());
+		munmap(const_cast<char *>(run_file_map), run_file_size);
+		run_file_map = NULL;
 		if (probename[0] != '\0')
 			close(probe_fd);
 		return false;
 	}
-	run_file_size = stat.st_size;
-	run_file_map = reinterpret_cast<Run_Record *>(mmap(NULL, run_file_size, PROT_READ, MAP_SHARED, fd, 0));
-	close(fd);
 	if (probename[0] != '\0') {
 		probe_file_map = reinterpret_cast<ProbeFile *>(mmap(NULL, probe_file_size, PROT_READ, MAP_SHARED, probe_fd, 0));
 		close(probe_fd);
 		if (((probe_file_map->nx + 1) * (probe_file_map->ny + 1)) * sizeof(double) + sizeof(ProbeFile) != unsigned(probe_file_size)) {
 			debug("Invalid probe file size %ld != %ld", probe_file_size, ((probe_file_map->nx + 1) * (probe_file_map->ny + 1)) * sizeof(double) + sizeof(ProbeFile));
 			munmap(probe_file_map, probe_file_size);
-			munmap(run_file_map, run_file_size);
+			munmap(const_cast<char *>(run_file_map), run_file_size);
 			probe_file_map = NULL;
 			run_file_map = NULL;
+			close_stream();
 			return false;
 		}
 	}
 	else
 		probe_file_map = NULL;
 	delayed_reply();
-	// File format:
-	// records
-	// strings
-	// int32_t stringlengths[]
-	// int32_t numstrings
-	// double bbox[6]
-	// double time
-	run_file_num_strings = read_num(run_file_size - sizeof(double) * 7 - sizeof(int32_t));
-	strings = new String[run_file_num_strings];
-	off_t pos = run_file_size - sizeof(double) * 7 - sizeof(int32_t) - sizeof(int32_t) * run_file_num_strings;
-	off_t current = 0;
-	for (int i = 0; i < run_file_num_strings; ++i) {
-		strings[i].start = current;
-		strings[i].len = read_num(pos + sizeof(int32_t) * i);
-		current += strings[i].len;
+	if (stream_fd >= 0) {
+		run_file_num_records = 0;
+		refresh_stream();
 	}
-	run_file_first_string = pos - current;
-	run_file_num_records = run_file_first_string / sizeof(Run_Record);
+	else
+		run_file_num_records = reader.num_records;
 	run_file_wait = start ? 0 : 1;
 	run_file_timer.it_interval.tv_sec = 0;
 	run_file_timer.it_interval.tv_nsec = 0;
@@ -147,14 +251,16 @@ bool run_file(char const *name, char const *probename, bool start, double sina,
 void abort_run_file() {
 	if (!run_file_map)
 		return;
-	munmap(run_file_map, run_file_size);
+	munmap(const_cast<char *>(run_file_map), run_file_size);
 	run_file_map = NULL;
+	reader.map = NULL;
+	spatial.clear();
+	spatial_checked = false;
 	if (probe_file_map) {
 		munmap(probe_file_map, probe_file_size);
 		probe_file_map = NULL;
 	}
-	delete[] strings;
-	strings = NULL;
+	close_stream();
 }
 
 static double handle_probe(double ox, double oy, double z) {
@@ -205,6 +311,58 @@ static double handle_probe(double ox, double oy, double z) {
 	return z + l * (1 - fx) + r * fx + probe_adjust;
 }
 
+static void decode_poly(Run_Record const &r, MoveCommand &move, double *lastpos, double *abc, double *abc_h, int &pending_size, uint8_t const *pattern) {
+	// Convert a polynomial move record into a queue entry.  Pending ABC and pattern records are used up.
+	move.reverse = r.type == RUN_POLY3MINUS;
+	move.single = false;
+	move.probe = false;
+	move.a0 = (r.type == RUN_POLY2 ? r.Jg : 0);
+	move.v0 = r.v0;
+	double x = r.X[0] * run_file_cosa - r.X[1] * run_file_sina + run_file_refx;
+	double y = r.X[1] * run_file_cosa + r.X[0] * run_file_sina + run_file_refy;
+	double z = r.X[2] + zoffset;
+	//debug("line %d: %f %f %f", settings.run_file_current, x, y, z);
+	move.target[0] = x;
+	move.target[1] = y;
+	move.target[2] = handle_probe(x, y, z);
+	double distg = 0, disth = 0;
+	for (int i = 0; i < 3; ++i) {
+		double d = move.target[i] - lastpos[i];
+		if (!std::isnan(d))
+			distg += d * d;
+		d = abc[i] - lastpos[3 + i];
+		if (!std::isnan(d))
+			distg += d * d;
+		if (!std::isnan(r.h[i]))
+			disth += r.h[i] * r.h[i];
+		if (!std::isnan(abc_h[i]))
+			disth += abc_h[i] * abc_h[i];
+		move.target[3 + i] = abc[i];
+		abc[i] = NAN;
+		abc_h[i] = NAN;
+	}
+	distg = std::sqrt(distg);
+	disth = std::sqrt(disth);
+	for (int i = 0; i < 6; ++i) {
+		move.unitg[i] = distg < 1e-10 ? 0 : (move.target[i] - lastpos[i]) / distg;
+		move.unith[i] = disth < 1e-10 ? 0 : (i < 3 ? r.h[i]: abc_h[i - 3]) / disth;
+	}
+	move.Jg = (r.type == RUN_POLY2 ? 0 : r.Jg);
+	move.Jh = disth;
+	move.tf = r.tf;
+	move.e = r.E;
+	move.tool = r.tool;
+	move.time = r.time;
+	move.cb = false;
+	move.pattern_size = pending_size;
+	move.gcode_line = r.gcode_line;
+	if (pending_size > 0)
+		memcpy(move.pattern, pattern, pending_size);
+	pending_size = 0;
+	for (int i = 0; i < 6; ++i)
+		lastpos[i] = move.target[i];
+}
+
 void run_file_next_command(int32_t start_time) {
 	static bool lock = false;
 	if (pausing || parkwaiting || lock || resume_pending) {
@@ -218,18 +376,36 @@ void run_file_next_command(int32_t start_time) {
 	while (!pausing	&& !parkwaiting // We are running.
 			&& run_file_map	// There is a file to run.
 			&& settings.queue_end == settings.queue_start	// The queue is empty
-			&& settings.run_file_current < run_file_num_records	// There are records to send.
-			&& !run_file_wait) {	// We are not waiting for something else (delay, temperature or confirm).
-		Run_Record &r = run_file_map[settings.run_file_current];
+			&& !run_file_wait	// We are not waiting for something else (delay, temperature or confirm).
+			&& have_record()) {	// There are records to send.
+		Run_Record const *record = reader.get(settings.run_file_current);
+		if (!record) {
+			debug("Unable to read record %" LONGFMT " of %s", settings.run_file_current, run_file_name.c_str());
+			run_file_num_records = settings.run_file_current;
+			break;
+		}
+		// Copy it, because the decoded block may be replaced while the record is handled.
+		Run_Record r = *record;
 		int t = r.type;
+		if ((t == RUN_SYSTEM || t == RUN_CONFIRM) && stream_fd >= 0) {
+			// Strings are only available when the parser is done.
+			wait_for_stream();
+			break;
+		}
 		if (!(t == RUN_POLY3PLUS || t == RUN_POLY3MINUS || t == RUN_POLY2 || t == RUN_ARC || t == RUN_ABC || t == RUN_PATTERN) && (arch_running() || computing_move || settings.queue_end != settings.queue_start || moving || sending_fragment || transmitting_fragment))
 			break;
 		rundebug("running %" LONGFMT ": %d %d running %d moving %d", settings.run_file_current, r.type, r.tool, arch_running(), moving);
 		switch (r.type) {
 			case RUN_SYSTEM:
 			{
-				char const *cmd = strndupa(&reinterpret_cast<char const *>(run_file_map)[run_file_first_string + strings[r.tool].start], strings[r.tool].len);
-				debug("Running system command: %ld %d %s", strings[r.tool].start, strings[r.tool].len, cmd);
+				char const *str;
+				uint32_t len;
+				if (!reader.get_string(r.tool, &str, &len)) {
+					debug("Invalid string %d in %s", r.tool, run_file_name.c_str());
+					break;
+				}
+				char const *cmd = strndupa(str, len);
+				debug("Running system command: %d %s", len, cmd);
 				int ret = system(cmd);
 				debug("Done running system command, return = %d", ret);
 				break;
@@ -248,54 +424,8 @@ void run_file_next_command(int32_t start_time) {
 			{
 				settings.queue_start = 0;
 				settings.queue_end = 0;
-				queue[settings.queue_end].reverse = r.type == RUN_POLY3MINUS;
-				queue[settings.queue_end].single = false;
-				queue[settings.queue_end].probe = false;
-				queue[settings.queue_end].a0 = (r.type == RUN_POLY2 ? r.Jg : 0);
-				queue[settings.queue_end].v0 = r.v0;
-				double x = r.X[0] * run_file_cosa - r.X[1] * run_file_sina + run_file_refx;
-				double y = r.X[1] * run_file_cosa + r.X[0] * run_file_sina + run_file_refy;
-				double z = r.X[2] + zoffset;
-				//debug("line %d: %f %f %f", settings.run_file_current, x, y, z);
-				queue[settings.queue_end].target[0] = x;
-				queue[settings.queue_end].target[1] = y;
-				queue[settings.queue_end].target[2] = handle_probe(x, y, z);
-				double distg = 0, disth = 0;
-				for (int i = 0; i < 3; ++i) {
-					double d = queue[settings.queue_end].target[i] - lastpos[i];
-					if (!std::isnan(d))
-						distg += d * d;
-					d = pending_abc[i] - lastpos[3 + i];
-					if (!std::isnan(d))
-						distg += d * d;
-					if (!std::isnan(r.h[i]))
-						disth += r.h[i] * r.h[i];
-					if (!std::isnan(pending_abc_h[i]))
-						disth += pending_abc_h[i] * pending_abc_h[i];
-					queue[settings.queue_end].target[3 + i] = pending_abc[i];
-					pending_abc[i] = NAN;
-					pending_abc_h[i] = NAN;
-				}
-				distg = std::sqrt(distg);
-				disth = std::sqrt(disth);
-				for (int i = 0; i < 6; ++i) {
-					queue[settings.queue_end].unitg[i] = distg < 1e-10 ? 0 : (queue[settings.queue_end].target[i] - lastpos[i]) / distg;
-					queue[settings.queue_end].unith[i] = disth < 1e-10 ? 0 : (i < 3 ? r.h[i]: pending_abc_h[i - 3]) / disth;
-				}
-				queue[settings.queue_end].Jg = (r.type == RUN_POLY2 ? 0 : r.Jg);
-				queue[settings.queue_end].Jh = disth;
-				queue[settings.queue_end].tf = r.tf;
-				queue[settings.queue_end].e = r.E;
-				queue[settings.queue_end].tool = r.tool;
-				queue[settings.queue_end].time = r.time;
-				queue[settings.queue_end].cb = false;
-				queue[settings.queue_end].pattern_size = pattern_size;
-				queue[settings.queue_end].gcode_line = r.gcode_line;
-				if (pattern_size > 0)
-					memcpy(queue[settings.queue_end].pattern, current_pattern, pattern_size);
-				pattern_size = 0;
-				for (int i = 0; i < 6; ++i)
-					lastpos[i] = queue[settings.queue_end].target[i];
+				queue.make_room(settings.queue_end);
+				decode_poly(r, queue[settings.queue_end], lastpos, pending_abc, pending_abc_h, pattern_size, current_pattern);
 				settings.queue_end += 1;
 				moving = true;
 				break;
@@ -367,10 +497,7 @@ void run_file_next_command(int32_t start_time) {
 					gpios[tool].state = 0;
 					RESET(gpios[tool].pin);
 				}
-				prepare_interrupt();
-				shmem->interrupt_ints[0] = tool;
-				shmem->interrupt_ints[1] = gpios[tool].state;
-				send_to_parent(CMD_UPDATE_PIN);
+				send_event(CMD_UPDATE_PIN, tool, gpios[tool].state);
 				break;
 			}
 			case RUN_SETTEMP:
@@ -380,10 +507,7 @@ void run_file_next_command(int32_t start_time) {
 					tool = bed_id != 255 ? bed_id : -1;
 				rundebug("settemp %d %f", tool, r.X[0]);
 				settemp(tool, r.X[0]);
-				prepare_interrupt();
-				shmem->interrupt_ints[0] = tool;
-				shmem->interrupt_floats[0] = r.X[0];
-				send_to_parent(CMD_UPDATE_TEMP);
+				send_event(CMD_UPDATE_TEMP, tool, 0, r.X[0]);
 				break;
 			}
 			case RUN_WAITTEMP:
@@ -436,8 +560,12 @@ void run_file_next_command(int32_t start_time) {
 				break;
 			case RUN_CONFIRM:
 			{
-				int len = min(strings[r.tool].len, PATH_MAX);
-				memcpy(const_cast<char *>(shmem->interrupt_str), &reinterpret_cast<char const *>(run_file_map)[run_file_first_string + strings[r.tool].start], len);
+				char const *str = "";
+				uint32_t str_len;
+				if (!reader.get_string(r.tool, &str, &str_len))
+					str_len = 0;
+				int len = min(int(str_len), PATH_MAX);
+				memcpy(const_cast<char *>(shmem->interrupt_str), str, len);
 				run_file_wait += 1;
 				prepare_interrupt();
 				shmem->interrupt_ints[0] = r.X[0] ? 1 : 0;
@@ -460,18 +588,81 @@ void run_file_next_command(int32_t start_time) {
 		settings.run_file_current += 1;
 	}
 	rundebug("run queue done");
-	if (run_file_map && settings.run_file_current >= run_file_num_records && !run_file_wait && settings.queue_start == settings.queue_end) {
+	if (run_file_map && stream_fd >= 0 && settings.run_file_current >= run_file_num_records && !run_file_wait && !pausing && !parkwaiting) {
+		// The parser has not caught up yet; check again later.
+		wait_for_stream();
+	}
+	if (run_file_map && stream_fd < 0 && settings.run_file_current >= run_file_num_records && !run_file_wait && settings.queue_start == settings.queue_end) {
 		// Done.
 		//debug("done running file");
 		if (!computing_move && !sending_fragment && !transmitting_fragment && !arch_running()) {
 			abort_run_file();
-			num_file_done_events += 1;
+			if (stream_error.empty())
+				num_file_done_events += 1;
+			else {
+				// The rest of the job was never parsed; don't let it look like it completed.
+				prepare_interrupt();
+				int len = min(int(stream_error.size()), PATH_MAX - 1);
+				memcpy(const_cast<char *>(shmem->interrupt_str), stream_error.c_str(), len);
+				shmem->interrupt_str[len] = '\0';
+				stream_error.clear();
+				send_to_parent(CMD_FILE_ERROR);
+			}
 		}
 	}
 	next_move(start_time);
 	lock = false;
 }
 
+bool run_file_lookahead_start(Run_Lookahead *look) {
+	// Point look at the record after the moves that have been queued, so the moves from there can be decoded ahead.
+	if (!run_file_map || run_file_wait || pausing || parkwaiting)
+		return false;
+	look->record = settings.run_file_current;
+	for (int i = 0; i < 3; ++i) {
+		look->abc[i] = pending_abc[i];
+		look->abc_h[i] = pending_abc_h[i];
+	}
+	look->pattern_size = pattern_size;
+	memcpy(look->pattern, current_pattern, pattern_size);
+	return true;
+}
+
+int run_file_lookahead(Run_Lookahead *look, MoveCommand *moves, int num) {
+	// Decode the moves at look without running them, so they can be planned ahead, and move look past them.
+	// Decoding stops at the first record that waits until the machine has stopped, and at the end of what has been parsed.
+	if (!run_file_map || run_file_wait || pausing || parkwaiting)
+		return 0;
+	double lastpos[6] = {0, 0, 0, 0, 0, 0};
+	int n = 0;
+	for (; n < num && look->record < run_file_num_records; ++look->record) {
+		Run_Record const *record = reader.get(look->record);
+		if (!record)
+			break;
+		Run_Record r = *record;
+		switch (r.type) {
+			case RUN_ABC:
+				for (int a = 0; a < 3; ++a) {
+					look->abc[a] = r.X[a];
+					look->abc_h[a] = r.h[a];
+				}
+				break;
+			case RUN_PATTERN:
+				look->pattern_size = max(0, min(r.tool, PATTERN_MAX));
+				memcpy(look->pattern, &r.X[0], look->pattern_size);
+				break;
+			case RUN_POLY3PLUS:
+			case RUN_POLY3MINUS:
+			case RUN_POLY2:
+				decode_poly(r, moves[n++], lastpos, look->abc, look->abc_h, look->pattern_size, look->pattern);
+				break;
+			default:
+				return n;
+		}
+	}
+	return n;
+}
+
 void run_adjust_probe(double x, double y, double z) {
 	probe_adjust = 0;
 	double probe_z = handle_probe(x, y, 0);
@@ -482,6 +673,23 @@ double run_find_pos(const double pos[3]) {
 	// Find position in toolpath that is closest to requested position.
 	if (!run_file_map)
 		return NAN;
+	// Use the index if the file is complete; the scan below is only needed while it is still being written.
+	if (reader.complete() && run_file_num_records == reader.num_records) {
+		if (!spatial_checked) {
+			spatial_checked = true;
+			std::string name = run_file_name + RUN_SPATIAL_SUFFIX;
+			spatial_usable = spatial.load(name, reader.header);
+			if (!spatial_usable) {
+				spatial_usable = spatial.build(reader, run_file_num_records);
+				if (spatial_usable)
+					spatial.save(name, reader.header);
+				else
+					debug("Not using spatial index for run file '%s'", run_file_name.c_str());
+			}
+		}
+		if (spatial_usable)
+			return spatial.find(pos);
+	}
 	double dist = INFINITY;
 	double current[3] = {NAN, NAN, NAN};
 	double center[3];
@@ -491,7 +699,10 @@ double run_find_pos(const double pos[3]) {
 	(void)&center;
 	(void)&normal;
 	for (int i = 0; i < run_file_num_records; ++i) {
-		switch (run_file_map[i].type) {
+		Run_Record const *r = reader.get(i);
+		if (!r)
+			break;
+		switch (r->type) {
 			case RUN_SYSTEM:
 			case RUN_GPIO:
 			case RUN_SETTEMP:
@@ -503,7 +714,7 @@ double run_find_pos(const double pos[3]) {
 				continue;
 			case RUN_POLY3PLUS:
 			case RUN_POLY3MINUS:
-				double target[3] = {run_file_map[i].X[0], run_file_map[i].X[1], run_file_map[i].X[2]};
+				double target[3] = {r->X[0], r->X[1], r->X[2]};
 				int k;
 				double pt = 0, tt = 0;
 				for (k = 0; k < 3; ++k) {
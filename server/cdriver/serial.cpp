@@ -19,6 +19,7 @@
  * }}} */
 
 #include "cdriver.h"
+#include "checksum.h"
 
 // Nothing in this file is useful if there serial ports are not used for communicating.
 #ifdef SERIAL
@@ -40,21 +41,22 @@
 // Codes (low nybble is data): 80 (e1 d2) b3 b4 (d5 e6) 87 (f8) 99 aa (cb cc) ad 9e (ff)
 // Codes which have duplicates in machine id codes are not used.
 // These are defined in cdriver.h.
+
+// If the firmware accepts a window in CMD_BEGIN, packets to it have no flipflop.
+// Instead, they end with a 7 bit sequence number and up to out_window of them can be sent before waiting for an ack.
+// The firmware follows its acks, nacks and stalls with the sequence number they are about, with odd parity in bit 7.
+// The low 2 bits of that number are also in the code, like the flipflop.
+// An ack is for all packets up to and including that number; a nack is a request to resend everything from that number.
+// Packets from the firmware always use the flipflop.
 // }}}
 
 // Globals. {{{
 static bool had_data = false;
 static bool doing_debug = false;
 static uint8_t need_id = 0;
-// }}}
-
-// Parity masks for decoding. {{{
-static const uint8_t MASK[5][4] = {
-	{0xc0, 0xc3, 0xff, 0x09},
-	{0x38, 0x3a, 0x7e, 0x13},
-	{0x26, 0xb5, 0xb9, 0x23},
-	{0x95, 0x6c, 0xd5, 0x43},
-	{0x4b, 0xdc, 0xe2, 0x83}};
+static uint8_t id_packet[1 + ID_SIZE + UUID_SIZE + (1 + ID_SIZE + UUID_SIZE + 2) / 3];
+static int seq_code = 0;	// 1, -1 or 2 if the next byte is the sequence number of an ack, nack or stall.
+static int seq_which;	// Low bits of that sequence number, from the code.
 // }}}
 
 // Constants. {{{
@@ -75,31 +77,121 @@ static void command_cancel() { // {{{
 	}
 } // }}}
 
+static void resync() { // {{{
+	// After a bad packet, the following bytes cannot be framed, and trying every offset can accept noise as a packet.
+	// Drop everything until the line is quiet, then request a resend; that starts at a packet boundary.
+	command_end = 0;
+	int32_t start = utime();
+	do {
+		while (serialdev->available())
+			serialdev->read();
+	} while (int32_t(utime() - start) < 50000 && poll(&pollfds[BASE_FDS], 1, 3) > 0);
+	write_nack();
+} // }}}
+
+static inline int seq_mask() { // {{{
+	return windowed ? SEQ_MASK : 3;
+} // }}}
+
 static void resend(int amount) { // {{{
 	// Unless the last packet was already received; in that case ignore the NACK.
 	//debug("nack%d ff %d busy %d", which, ff_out, out_busy);
 	if (out_busy >= amount) {
-		ff_out = (ff_out - amount) & 3;
+		shmem->packets_resent += amount;
+		ff_out = (ff_out - amount) & seq_mask();
 		out_busy -= amount;
 		while (amount--) {
-			ff_out = (ff_out + 1) & 3;
+			ff_out = (ff_out + 1) & seq_mask();
 			send_packet();
 		}
 	}
 } // }}}
 
+static void handle_acks(int amount) { // {{{
+	// Remove acked packets from the queue, oldest first.
+	while (amount-- > 0 && out_busy > 0) {
+		out_busy -= 1;
+		void (*cb)() = serial_cb[0];
+		for (int i = 0; i < out_busy; ++i)
+			serial_cb[i] = serial_cb[i + 1];
+		serial_cb[out_busy] = NULL;
+		if (cb)
+			cb();
+	}
+} // }}}
+
+static void handle_seq(uint8_t code) { // {{{
+	// Handle the sequence number that follows an ack, nack or stall if there is a window.
+	uint8_t parity = code ^ (code >> 4);
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	if (!(parity & 1)) {
+		// The timeout will recover from this.
+		debug("invalid parity for sequence number %02x", code);
+		return;
+	}
+	if ((code & 3) != seq_which) {
+		// A lost sequence number makes the next byte look like one; the code tells its low bits.
+		debug("sequence number %02x does not match its code", code);
+		return;
+	}
+	// Number of packets before the one that is referenced.
+	int amount = (code - (ff_out - out_busy)) & SEQ_MASK;
+	if (seq_code > 1) {
+		// A sequence number whose ack code was lost can look like a stall, so only believe one about a packet in flight.
+		if (amount >= out_busy) {
+			debug("ignoring stall with sequence number %02x", code);
+			return;
+		}
+		debug("received stall!");
+		out_busy = 0;
+		serialdev->write(CMD_STALLACK);
+		abort();
+	}
+	if (seq_code > 0) {
+		// Ack: all packets up to this one have been handled.
+		if (amount < out_busy)
+			handle_acks(amount + 1);
+	}
+	else {
+		// Nack: the packets before this one have been handled, this one and the rest are resent.
+		shmem->link_nacks += 1;
+		if (amount <= out_busy) {
+			handle_acks(amount);
+			resend(out_busy);
+		}
+	}
+} // }}}
+
+void serial_window(int window) { // {{{
+	// Switch between the flipflop protocol (window 0) and a window.  This must not be done while packets are in flight.
+	windowed = window > 0;
+	out_window = windowed ? window : 3;
+	ff_out = windowed ? 0 : ff_out & 3;
+	seq_code = 0;
+} // }}}
+
 static void try_pending() {
-	if (out_busy < 3 && change_pending)
+	// Changing motors, stopping and discarding use the planner state, so the motion thread must wait meanwhile.
+	if (out_busy < out_window && change_pending) {
+		motion_hold();
 		arch_motors_change();
-	if (out_busy < 3 && start_pending) {
+		motion_unhold();
+	}
+	if (out_busy < out_window && start_pending) {
 		arch_start_move(0);
 	}
-	if (out_busy < 3 && stop_pending) {
+	if (out_busy < out_window && stop_pending) {
 		//debug("do pending stop");
+		motion_hold();
 		arch_stop();
+		motion_unhold();
 	}
-	if (out_busy < 3 && discard_pending)
+	if (out_busy < out_window && discard_pending) {
+		motion_hold();
 		arch_discard();
+		motion_unhold();
+	}
 	if (!sending_fragment && !stopping && arch_running()) {
 		buffer_refill();
 	}
@@ -123,6 +215,8 @@ bool serial(bool allow_pending) { // {{{
 			}
 			else {
 				debug("Too much silence; request packet to be sure");
+				if (out_busy > 0)
+					shmem->link_timeouts += 1;
 				write_nack();
 				resend(out_busy);
 				last_micros = utm;
@@ -146,6 +240,15 @@ bool serial(bool allow_pending) { // {{{
 			debug("received: %x", command[0]);
 #endif
 			had_data = true;
+			if (seq_code != 0) {
+				handle_seq(command[0]);
+				seq_code = 0;
+				if (allow_pending)
+					try_pending();
+				if (!preparing)
+					arch_had_ack();
+				continue;
+			}
 			if (doing_debug) {
 				if (command[0] == 0) {
 					END_DEBUG();
@@ -156,13 +259,29 @@ bool serial(bool allow_pending) { // {{{
 				continue;
 			}
 			if (need_id) {
+				id_packet[sizeof(id_packet) - need_id] = command[0];
 				need_id -= 1;
 				if (!need_id) {
+					// A damaged byte or a lost ack code before a sequence number can look like the start of an id, so check it.
+					int len = 1 + ID_SIZE + UUID_SIZE;
+					bool good = true;
+					for (int t = 0; t < (len + 2) / 3; ++t)
+						good = good && id_packet[len + t] == checksum(t, &id_packet[3 * t]);
+					if (!good) {
+						debug("ignoring invalid id");
+						resync();
+						continue;
+					}
 					// Firmware has reset.
 					//arch_reset();
-					// avr_* should not be used outside arch_avr.h, but this is just for debugging...
-					if (avr_pong == 255)
+					// Ids are expected while connecting, so only report them after that.
+					if (protocol_version != 0)
 						debug("firmware sent id");
+					// The firmware no longer uses a window after sending its id.
+					if (windowed) {
+						debug("firmware sent id; dropping window");
+						serial_window(0);
+					}
 				}
 				continue;
 			}
@@ -184,6 +303,12 @@ bool serial(bool allow_pending) { // {{{
 				which += 1;
 				// Fall through.
 			case CMD_STALL0:
+				if (windowed) {
+					// The sequence number follows.
+					seq_code = 2;
+					seq_which = which;
+					continue;
+				}
 				debug("received stall!");
 				ff_out = which;
 				out_busy = 0;
@@ -203,16 +328,15 @@ bool serial(bool allow_pending) { // {{{
 			case CMD_ACK0:
 				//debug("ack%d ff %d busy %d alllow pending %d discard pending %d", which, ff_out, out_busy, allow_pending, discard_pending);
 				which &= 3;
-				// Ack: flip the flipflop.
-				if (out_busy > 0 && ((ff_out - out_busy) & 3) == which) { // Only if we expected it and it is the right type.
-					out_busy -= 1;
-					void (*cb)() = serial_cb[0];
-					for (int i = 0; i < out_busy; ++i)
-						serial_cb[i] = serial_cb[i + 1];
-					serial_cb[out_busy] = NULL;
-					if (cb)
-						cb();
+				if (windowed) {
+					// The sequence number follows.
+					seq_code = 1;
+					seq_which = which;
+					continue;
 				}
+				// Ack: flip the flipflop.
+				if (out_busy > 0 && ((ff_out - out_busy) & 3) == which) // Only if we expected it and it is the right type.
+					handle_acks(1);
 				if (allow_pending) {
 					try_pending();
 				}
@@ -232,8 +356,19 @@ bool serial(bool allow_pending) { // {{{
 			{
 				// Nack: the host didn't properly receive the packet: resend.
 				//debug("nack received");
-				int amount = ((ff_out - which - 1) & 3) + 1;
-				resend(amount);
+				if (windowed) {
+					// The sequence number follows.
+					seq_code = -1;
+					seq_which = which;
+					continue;
+				}
+				shmem->link_nacks += 1;
+				// The nack is for the packet the firmware expects, so the ones before it have been received, even if their acks were lost.
+				int amount = (ff_out - which) & 3;
+				if (amount <= out_busy) {
+					handle_acks(out_busy - amount);
+					resend(amount);
+				}
 				continue;
 			}
 			case CMD_ID:
@@ -242,7 +377,8 @@ bool serial(bool allow_pending) { // {{{
 				// connects to the machine.  This may be a reconnect,
 				// and can happen at any time.
 				// Response to host is to send the machine id; from machine this is handled after receiving the id.
-				need_id = ID_SIZE + UUID_SIZE + (1 + ID_SIZE + UUID_SIZE + 2) / 3;
+				id_packet[0] = command[0];
+				need_id = sizeof(id_packet) - 1;
 				continue;
 			default:
 				if (!expected_replies)
@@ -253,7 +389,7 @@ bool serial(bool allow_pending) { // {{{
 				// These lengths are not allowed; this cannot be a good packet.
 				debug("invalid firmware command code %02x", command[0]);
 				//abort();
-				write_nack();
+				resync();
 				continue;
 			}
 			command_end = 1;
@@ -334,36 +470,19 @@ bool serial(bool allow_pending) { // {{{
 			{
 				debug("incorrect extra bit, size = %d t = %d", len, t);
 				//abort();
-				command_cancel();
-				if (command_end == 0)
-					write_nack();
-				else
-					continue;
+				resync();
 				return true;
 			}
-			for (uint8_t bit = 0; bit < 5; ++bit)
+			if (sum != checksum(t, &command[3 * t]))
 			{
-				uint8_t check = sum & MASK[bit][3];
-				for (uint8_t p = 0; p < 3; ++p)
-					check ^= command[3 * t + p] & MASK[bit][p];
-				check ^= check >> 4;
-				check ^= check >> 2;
-				check ^= check >> 1;
-				if (check & 1)
-				{
-					debug("incorrect checksum byte %d bit %d", t, bit);
-					//abort();
-		//fprintf(stderr, "err (%d %d):", len, t);
-		//for (uint8_t i = 0; i < len + (len + 2) / 3; ++i)
-		//	fprintf(stderr, " %02x", command[i]);
-		//fprintf(stderr, "\n");
-					command_cancel();
-					if (command_end == 0)
-						write_nack();
-					else
-						continue;
-					return true;
-				}
+				debug("incorrect checksum byte %d: %02x != %02x", t, sum, checksum(t, &command[3 * t]));
+				//abort();
+	//fprintf(stderr, "err (%d %d):", len, t);
+	//for (uint8_t i = 0; i < len + (len + 2) / 3; ++i)
+	//	fprintf(stderr, " %02x", command[i]);
+	//fprintf(stderr, "\n");
+				resync();
+				return true;
 			}
 		}
 		// Packet is good.
@@ -394,7 +513,10 @@ bool serial(bool allow_pending) { // {{{
 			for (int i = 0; i < expected_replies; ++i)
 				wait_for_reply[i] = wait_for_reply[i + 1];
 			wait_for_reply[expected_replies] = NULL;
+			// Replies may change the motion state.
+			motion_hold();
 			cb();
+			motion_unhold();
 			break;
 		}
 	}
@@ -403,6 +525,15 @@ bool serial(bool allow_pending) { // {{{
 
 // This is run in a loop until some event happened.
 void serial_wait(int timeout) { // {{{
+	if (motion_thread_self()) {
+		// The motion thread only queues fragments; it must never wait for the firmware.
+		debug("serial_wait called from the motion thread");
+		abort();
+	}
+	serialdev->flush();
+	// Wake up for the silence timeout in serial(), or lost acks would never be recovered.
+	if (out_busy > 0 && (timeout < 0 || timeout > 100))
+		timeout = 100;
 	poll(&pollfds[BASE_FDS], 1, timeout);
 	serial(false);
 } // }}}
@@ -422,9 +553,9 @@ void serial_wait(int timeout) { // {{{
 // Set checksum bytes.
 bool prepare_packet(char *the_packet, int size) { // {{{
 	//debug("prepare %d %d %d", size, ff_out, out_busy);
-	if (size >= COMMAND_SIZE)
+	if (size + windowed >= COMMAND_SIZE)
 	{
-		debug("packet is too large: %d > %d", size, COMMAND_SIZE);
+		debug("packet is too large: %d > %d", size + windowed, COMMAND_SIZE);
 		return false;
 	}
 	if (preparing) {
@@ -433,14 +564,21 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 	}
 	// Wait for room in the queue.  This is required to avoid a stall being received in between prepare and send.
 	preparing = true;
-	while (out_busy >= 3)
+	while (out_busy >= out_window)
 		serial_wait();
 	preparing = false;	// Not yet, but there are no further interruptions.
 	if (stopping)
 		return false;
-	// Set flipflop bit.
 	the_packet[0] &= 0x1f;
-	the_packet[0] |= ff_out << 5;
+	if (windowed) {
+		// Append sequence number.
+		the_packet[size] = ff_out;
+		size += 1;
+	}
+	else {
+		// Set flipflop bit.
+		the_packet[0] |= ff_out << 5;
+	}
 #ifdef DEBUG_FF
 	debug("use ff_out: %d", ff_out);
 #endif
@@ -458,44 +596,28 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 	else if (size == 4)
 		the_packet[5] = 0;
 	for (uint8_t t = 0; t < (size + 2) / 3; ++t)
-	{
-		uint8_t sum = t & 7;
-		for (uint8_t bit = 0; bit < 5; ++bit)
-		{
-			uint8_t check = 0;
-			for (uint8_t p = 0; p < 3; ++p) {
-				//debug("c %d %d %x %x %x", t, p, the_packet[3 * t + p], MASK[bit][p], the_packet[3 * t + p] & MASK[bit][p]);
-				check ^= the_packet[3 * t + p] & MASK[bit][p];
-			}
-			check ^= sum & MASK[bit][3];
-			check ^= check >> 4;
-			check ^= check >> 2;
-			check ^= check >> 1;
-			if (check & 1)
-				sum ^= 1 << (bit + 3);
-		}
-		the_packet[size + t] = sum;
-	}
-	pending_len[ff_out] = size + (size + 2) / 3;
+		the_packet[size + t] = checksum(t, reinterpret_cast <uint8_t *>(&the_packet[3 * t]));
+	int which = ff_out & (MAX_WINDOW - 1);
+	pending_len[which] = size + (size + 2) / 3;
 #ifdef DEBUG_SERIAL
 	fprintf(stderr, "prepare %p:", the_packet);
 #endif
-	for (uint8_t i = 0; i < pending_len[ff_out]; ++i) {
-		pending_packet[ff_out][i] = the_packet[i];
+	for (uint8_t i = 0; i < pending_len[which]; ++i) {
+		pending_packet[which][i] = the_packet[i];
 #ifdef DEBUG_SERIAL
-		fprintf(stderr, " %02x", int(uint8_t(pending_packet[ff_out][i])));
+		fprintf(stderr, " %02x", int(uint8_t(pending_packet[which][i])));
 #endif
 	}
 #ifdef DEBUG_SERIAL
 	fprintf(stderr, "\n");
 #endif
-	ff_out = (ff_out + 1) & 3;
+	ff_out = (ff_out + 1) & seq_mask();
 	return true;
 } // }}}
 
 // Send packet to firmware.
 void send_packet() { // {{{
-	int which = (ff_out - 1) & 3;
+	int which = (ff_out - 1) & seq_mask() & (MAX_WINDOW - 1);
 #ifdef DEBUG_DATA
 	char const *sendname[0x20] = {"begin", "ping", "set-uuid", "setup", "control", "msetup", "asetup", "home", "start-move", "start-probe", "move", "move-single", "pattern", "start", "stop", "abort", "discard", "getpin", "spi", "pinname", "14", "15", "16", "17", "18", "19", "1a", "1b", "1c", "1d", "1e", "1f"};
 	fprintf(stderr, "send (%d): %s ", which, sendname[pending_packet[which][0] & 0x1f]);
@@ -508,8 +630,11 @@ void send_packet() { // {{{
 #endif
 	for (uint8_t t = 0; t < pending_len[which]; ++t)
 		serialdev->write(pending_packet[which][t]);
+	// Send the packet, and any acks before it, with one write.
+	serialdev->flush();
 	out_busy += 1;
 	out_time = utime();
+	shmem->packets_sent += 1;
 } // }}}
 
 void write_ack() { // {{{
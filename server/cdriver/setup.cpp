@@ -78,6 +78,8 @@ void setup()
 		*(void **)(&space_types[type_id].free_axis) = load_sym(handle, "free_axis", *(void **)&space_types[0].free_axis);
 		*(void **)(&space_types[type_id].free_motor) = load_sym(handle, "free_motor", *(void **)&space_types[0].free_motor);
 		*(void **)(&space_types[type_id].probe_speed) = load_sym(handle, "probe_speed", *(void **)&space_types[0].probe_speed);
+		*(void **)(&space_types[type_id].xyz2motors_batch) = load_sym(handle, "xyz2motors_batch", NULL);
+		*(void **)(&space_types[type_id].jacobian) = load_sym(handle, "jacobian", NULL);
 		dlerror();
 		*(void **)(&space_types[type_id].xyz2motors) = dlsym(handle, "xyz2motors");
 		*(void **)(&space_types[type_id].motors2xyz) = dlsym(handle, "motors2xyz");
@@ -101,12 +103,14 @@ void setup()
 	motors_busy = false;
 	current_extruder = 0;
 	ping = 0;
-	for (int i = 0; i < 4; ++i) {
+	for (int i = 0; i < MAX_WINDOW; ++i) {
 		pending_len[i] = 0;
 		wait_for_reply[i] = NULL;
 		serial_cb[i] = NULL;
 	}
 	out_busy = 0;
+	out_window = 3;
+	windowed = false;
 	num_file_done_events = 0;
 	continue_event = false;
 	led_pin.init();
@@ -121,11 +125,19 @@ void setup()
 	current_fragment = running_fragment;
 	settings.queue_start = 0;
 	settings.queue_end = 0;
+	settings.feed = 1;
+	settings.feed_rate = 0;
+	settings.feed_limit = INFINITY;
+	settings.feed_next = INFINITY;
+	settings.run_index = 0;
+	settings.run_move = 0;
+	queue.data.resize(16);
 	//debug("current_fragment = running_fragment; %d %p", current_fragment, &current_fragment);
 	current_fragment_pos = 0;
 	num_active_motors = 0;
 	default_hwtime_step = 25000;
 	min_hwtime_step = 10000;
+	base_hwtime_step = default_hwtime_step;
 	settings.hwtime_step = default_hwtime_step;
 	feedrate = 1;
 	max_deviation = 0;
@@ -133,6 +145,8 @@ void setup()
 	max_a = 10000;
 	max_J = 10000;
 	adjust_speed = 1;
+	motor_fit_tolerance = 0.01;
+	motor_fit_check = false;
 	targetx = 0;
 	targety = 0;
 	zoffset = 0;
@@ -170,9 +184,11 @@ void setup()
 }
 
 void check_protocol() {
-	if (protocol_version < PROTOCOL_VERSION) {
-		debug("Machine has older Franklin version %d than host which has %d; please flash newer firmware.", protocol_version, PROTOCOL_VERSION);
-		disconnect(true, "Machine has older Franklin version %d than host which has %d; please flash newer firmware.", protocol_version, PROTOCOL_VERSION);
+	if (protocol_version < OLDEST_PROTOCOL_VERSION) {
+		// Version 8 added the sample period to START_MOVE and version 9 run length encoded the fragment data.
+		// The host only sends those formats, so older firmware cannot run moves and must be flashed again.
+		debug("Machine firmware has protocol version %d, but this host needs at least version %d; please flash the firmware from this host.", protocol_version, OLDEST_PROTOCOL_VERSION);
+		disconnect(true, "Machine firmware has protocol version %d, but this host needs at least version %d; please flash the firmware from this host.", protocol_version, OLDEST_PROTOCOL_VERSION);
 	}
 	else if (protocol_version > PROTOCOL_VERSION) {
 		debug("Machine has newer Franklin version %d than host which has %d; please upgrade your host software.", protocol_version, PROTOCOL_VERSION);
@@ -182,25 +198,8 @@ void check_protocol() {
 
 void connect_end() {
 	// Set things up that need information from the firmware.
-	num_subfragments_bits = int(std::log2(settings.hwtime_step / TIME_PER_ISR));
-	delete[] history;
-	history = new History[FRAGMENTS_PER_BUFFER];
-	for (int i = 0; i < 2; ++i) {
-		int f = (current_fragment - i + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
-		history[f].hwtime = 0;
-		history[f].run_time = 0;
-	}
-	for (int s = 0; s < NUM_SPACES; ++s) {
-		Space &sp = spaces[s];
-		for (int a = 0; a < sp.num_axes; ++a) {
-			delete[] sp.axis[a]->history;
-			sp.axis[a]->history = setup_axis_history();
-		}
-		for (int m = 0; m < sp.num_motors; ++m) {
-			delete[] sp.motor[m]->history;
-			sp.motor[m]->history = setup_motor_history();
-		}
-	}
+	num_subfragments_bits = int(std::log2(base_hwtime_step / TIME_PER_ISR));
+	history_reset();
 	// Restore all temps to their current values.
 	for (int t = 0; t < num_temps; ++t) {
 		settemp(t, temps[t].target[0]);
@@ -223,21 +222,3 @@ void connect_end() {
 		send_to_parent(CMD_CONNECTED);
 	}
 }
-
-Axis_History *setup_axis_history() {
-	Axis_History *ret = new Axis_History[FRAGMENTS_PER_BUFFER];
-	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f) {
-		ret[f].source = NAN;
-		ret[f].endpos = NAN;
-	}
-	return ret;
-}
-
-Motor_History *setup_motor_history() {
-	Motor_History *ret = new Motor_History[FRAGMENTS_PER_BUFFER];
-	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f) {
-		ret[f].current_pos = 0;
-		ret[f].hw_pos = 0;
-	}
-	return ret;
-}
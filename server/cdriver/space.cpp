@@ -51,11 +51,9 @@ void Space::setup_nums(int na, int nm) { // {{{
 			new_axes[a]->current = NAN;
 			new_axes[a]->settings.source = NAN;
 			new_axes[a]->settings.endpos = NAN;
-			new_axes[a]->history = setup_axis_history();
 		}
 		for (int a = na; a < old_na; ++a) {
 			space_types[type].free_axis(this, a);
-			delete[] axis[a]->history;
 			delete axis[a];
 		}
 		delete[] axis;
@@ -87,14 +85,12 @@ void Space::setup_nums(int na, int nm) { // {{{
 			new_motors[m]->target_pos = NAN;
 			new_motors[m]->settings.current_pos = 0;
 			new_motors[m]->settings.hw_pos = 0;
-			new_motors[m]->history = setup_motor_history();
 			new_motors[m]->type_data = NULL;
 			ARCH_NEW_MOTOR(id, m, new_motors);
 		}
 		for (int m = nm; m < old_nm; ++m) {
 			DATA_DELETE(id, m);
 			space_types[type].free_motor(this, m);
-			delete[] motor[m]->history;
 			delete motor[m];
 		}
 		delete[] motor;
@@ -103,6 +99,7 @@ void Space::setup_nums(int na, int nm) { // {{{
 			space_types[type].init_motor(this, m);
 		arch_motors_change();
 	}
+	history_reset();
 } // }}}
 
 void Space::xyz2motors() { // {{{
@@ -127,6 +124,38 @@ void Space::xyz2motors() { // {{{
 	}
 } // }}}
 
+bool Space::xyz2motors_batch(int n, double const *const *axes, double *const *motors) { // {{{
+	// Compute motor positions for n samples in one call.  axes[a][i] is the target of axis a for sample i.
+	// Returns false if the type does not support this; xyz2motors() must be used for every sample in that case.
+	if (!space_types[type].xyz2motors_batch)
+		return false;
+	// Set default values, like xyz2motors() does.
+	for (int m = 0; m < num_motors; ++m) {
+		for (int i = 0; i < n; ++i)
+			motors[m][i] = m < num_axes ? axes[m][i] : motor[m]->target_pos;
+	}
+	// Override with type computations.
+	space_types[type].xyz2motors_batch(this, n, axes, motors);
+	return true;
+} // }}}
+
+bool Space::jacobian(int n, double const *const *axes, double *const *jacobian) { // {{{
+	// Compute the derivatives of the motor positions to the axis positions at n points.
+	// Returns false if the type does not support this.
+	if (!space_types[type].jacobian)
+		return false;
+	// Set default values: motors follow their axis, extra motors don't move.
+	for (int m = 0; m < num_motors; ++m) {
+		for (int a = 0; a < num_axes; ++a) {
+			for (int i = 0; i < n; ++i)
+				jacobian[m * num_axes + a][i] = m == a ? 1 : 0;
+		}
+	}
+	// Override with type computations.
+	space_types[type].jacobian(this, n, axes, jacobian);
+	return true;
+} // }}}
+
 void Space::motors2xyz(const double *motors, double *xyz) { // {{{
 	// Set default values.
 	for (int a = 0; a < num_axes; ++a)
@@ -137,6 +166,7 @@ void Space::motors2xyz(const double *motors, double *xyz) { // {{{
 
 void Space::load_info() { // {{{
 	loaddebug("loading space %d", id);
+	motor_fit_reset();
 	int t = type;
 	if (t < 0 || t >= num_space_types || (t != id && id != 0)) {
 		debug("invalid current type?! using default type instead");
@@ -233,6 +263,7 @@ void reset_pos(Space *s) { // {{{
 
 void Space::load_axis(int a) { // {{{
 	loaddebug("loading axis %d", a);
+	motor_fit_reset();
 	axis[a]->park_order = shmem->ints[2];
 	axis[a]->park = shmem->floats[0];
 	axis[a]->min_pos = shmem->floats[1];
@@ -248,6 +279,7 @@ void Space::load_axis(int a) { // {{{
 
 void Space::load_motor(int m) { // {{{
 	loaddebug("loading motor %d", m);
+	motor_fit_reset();
 	uint16_t enable = motor[m]->enable_pin.write();
 	double old_home_pos = motor[m]->home_pos;
 	double old_steps_per_unit = motor[m]->steps_per_unit;
@@ -379,7 +411,6 @@ void Space::init(int space_id) { // {{{
 	num_motors = 0;
 	motor = NULL;
 	axis = NULL;
-	history = NULL;
 	settings.adjust = 0;
 	space_types[type].init_space(this);
 } // }}}
@@ -224,6 +224,7 @@ void handle_temp(int id, int temp) { // {{{
 		temps[id].max_alarm = NAN;
 		temps[id].adcmin_alarm = -1;
 		temps[id].adcmax_alarm = MAXINT;
+		motion_hold();
 		if (run_file_wait) {
 			run_file_wait -= 1;
 			if (run_file_wait == 0)
@@ -231,10 +232,9 @@ void handle_temp(int id, int temp) { // {{{
 			buffer_refill();
 		}
 		else {
-			prepare_interrupt();
-			shmem->interrupt_ints[0] = id;
-			send_to_parent(CMD_TEMPCB);
+			send_event(CMD_TEMPCB, id);
 		}
+		motion_unhold();
 	}
 	// Update PID (only if hold_time == 0).
 	if (temps[id].hold_time == 0 && now >= temps[id].last_PID + 200) {
@@ -45,7 +45,6 @@ import traceback
 import signal
 import atexit
 import protocol
-import mmap
 import random
 import errno
 import shutil
@@ -56,13 +55,16 @@ import cdriver
 C0 = 273.15	# Conversion between K and °C
 WAIT = object()	# Sentinel for blocking functions.
 NUM_SPACES = 3	# Position, extruders, followers
-record_format = '=Bi' + 'd' * 11 + 'q' # type, tool, X[3], h[3], Jg, tf, v0, E, time, line
 # Space types
 type_names = []
 # }}}
 
 fhs.option('allow-system', 'Regular expression of allowed system commands', default = '')
 fhs.option('uuid', 'Machine uuid')
+fhs.option('parse-cache', 'Maximum size of the cache for parsed G-Code in MiB; 0 to disable', default = 1024)
+fhs.option('parse-window', 'Maximum number of moves that the G-Code parser plans ahead; 0 for no limit', default = 20000)
+fhs.option('parse-window-distance', 'Maximum distance in mm that the G-Code parser plans ahead; 0 for no limit', default = 0)
+fhs.option('parse-threads', 'Number of threads for parsing G-Code; 0 for one per processor', default = 0)
 config = fhs.init(packagename = 'franklin')
 
 # Load space type modules {{{
@@ -195,6 +197,10 @@ for m in open(modulepath):
 # }}}
 
 cdriver.init(fhs.read_data('franklin-cdriver', opened = False).encode('utf-8'), (moduledir + os.sep).encode('utf-8'))
+cdriver.parse_window(int(config['parse-window']), float(config['parse-window-distance']))
+cdriver.parse_threads(int(config['parse-threads']))
+if int(config['parse-cache']) > 0:
+	cdriver.parse_cache(fhs.write_cache('parse', dir = True, opened = False).encode('utf-8'), int(config['parse-cache']) << 20)
 
 # Enable code trace. {{{
 if False:
@@ -321,13 +327,16 @@ class Machine: # {{{
 			for filename in os.listdir(gcode):
 				name, ext = os.path.splitext(filename)
 				if ext != os.extsep + 'bin':
-					log('skipping %s' % filename)
+					if ext not in ('.part', '.spatial'):
+						log('skipping %s' % filename)
+					continue
+				if os.path.exists(os.path.join(gcode, filename + '.part')):
+					# Still being parsed; it has no footer yet.
 					continue
 				try:
 					#log('opening %s' % filename)
-					with open(os.path.join(gcode, filename), 'rb') as f:
-						f.seek(-8 * 7, os.SEEK_END)
-						self.jobqueue[name] = struct.unpack('=' + 'd' * 7, f.read())
+					done, num_records, strings, bbox, time = cdriver.run_file_info(os.path.join(gcode, filename).encode('utf-8'))
+					self.jobqueue[name] = bbox + (time,)
 				except:
 					traceback.print_exc()
 					log('failed to open gcode file %s' % os.path.join(gcode, filename))
@@ -363,6 +372,7 @@ class Machine: # {{{
 		self.probemap = None
 		self.job_current = None
 		self.job_id = None
+		self.job_motion_stats = None
 		self.confirm_id = 0
 		self.confirm_message = None
 		self.confirm_axes = None
@@ -378,7 +388,8 @@ class Machine: # {{{
 		self.probe_cb = None
 		self.probe_speed = 3.
 		self.gcode_file = False
-		self.gcode_map = None
+		self.gcode_filename = None
+		self.gcode_streaming = False
 		self.gcode_id = None
 		self.gcode_waiting = 0
 		self.audio_id = None
@@ -455,6 +466,7 @@ class Machine: # {{{
 		self.max_a = 10000
 		self.max_J = 10000
 		self.adjust_speed = 1
+		self.motor_fit_tolerance = 0.01
 		self.current_extruder = 0
 		self.targetx = 0.
 		self.targety = 0.
@@ -464,6 +476,7 @@ class Machine: # {{{
 		# Fill job queue.
 		self.jobqueue = {}
 		self.audioqueue = {}
+		self.parse_jobs = {}	# Background parses; key is their fd, value is (reply id, name, temporary input file or None).
 		self._refresh_queue()
 		try:
 			self.user_load(update = False)
@@ -547,7 +560,15 @@ class Machine: # {{{
 		self.moving = False
 	# }}}
 	def _machine_input(self, reply = False): # {{{
-		cmd = cdriver.get_interrupt()
+		# Events that were queued before the interrupt are included, in order.
+		for cmd in cdriver.get_interrupt():
+			self._handle_interrupt(cmd)
+	# }}}
+	def _event_input(self): # {{{
+		for cmd in cdriver.get_events():
+			self._handle_interrupt(cmd)
+	# }}}
+	def _handle_interrupt(self, cmd): # {{{
 		#log('received interrupt: %s' % repr(cmd))
 		if cmd['type'] == 'move-cb':
 			self._trigger_movewaits()
@@ -612,6 +633,9 @@ class Machine: # {{{
 			call_queue.append((self.user_park(cb = cdriver.resume)[1], (None,)))
 		elif cmd['type'] == 'file-done':
 			call_queue.append((self._job_done, (True, 'completed')))
+		elif cmd['type'] == 'file-error':
+			self._broadcast(None, 'message', 'Job stopped before it was complete: ' + cmd['reason'])
+			call_queue.append((self._job_done, (False, cmd['reason'])))
 		elif cmd['type'] == 'pinname':
 			if cmd['pin'] >= len(self.pin_names):
 				self.pin_names.extend([[0xf, '(Pin %d)' % i] for i in range(len(self.pin_names), cmd['pin'] + 1)])
@@ -673,7 +697,7 @@ class Machine: # {{{
 		dt = nt - len(self.temps)
 		dg = ng - len(self.gpios)
 		data = {'num_temps': nt, 'num_gpios': ng}
-		data.update({x:getattr(self, x) for x in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin', 'timeout', 'bed_id', 'fan_id', 'spindle_id', 'feedrate', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed', 'current_extruder', 'targetx', 'targety', 'targetangle', 'zoffset', 'store_adc')})
+		data.update({x:getattr(self, x) for x in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin', 'timeout', 'bed_id', 'fan_id', 'spindle_id', 'feedrate', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed', 'motor_fit_tolerance', 'current_extruder', 'targetx', 'targety', 'targetangle', 'zoffset', 'store_adc')})
 		#log('writing globals: %s' % repr(data))
 		cdriver.write_globals(data)
 		self._read_globals(update = True)
@@ -704,7 +728,7 @@ class Machine: # {{{
 	def _globals_update(self, target = None): # {{{
 		if not self.initialized:
 			return
-		attrnames = ('name', 'profile', 'user_interface', 'pin_names', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin', 'probe_dist', 'probe_offset', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed', 'targetx', 'targety', 'targetangle', 'zoffset', 'store_adc', 'park_after_job', 'sleep_after_job', 'cool_after_job', 'temp_scale_min', 'temp_scale_max', 'probemap', 'connected')
+		attrnames = ('name', 'profile', 'user_interface', 'pin_names', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin', 'probe_dist', 'probe_offset', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed', 'motor_fit_tolerance', 'targetx', 'targety', 'targetangle', 'zoffset', 'store_adc', 'park_after_job', 'sleep_after_job', 'cool_after_job', 'temp_scale_min', 'temp_scale_max', 'probemap', 'connected')
 		attrs = {n: getattr(self, n) for n in attrnames}
 		attrs['num_temps'] = len(self.temps)
 		attrs['num_gpios'] = len(self.gpios)
@@ -739,17 +763,27 @@ class Machine: # {{{
 	# }}}
 	def _gcode_close(self): # {{{
 		self.gcode_strings = []
-		self.gcode_map.close()
-		os.close(self.gcode_fd)
-		self.gcode_map = None
 		self.gcode_file = False
-		self.gcode_fd = -1
+		self.gcode_streaming = False
+		self.gcode_filename = None
+	# }}}
+	def _gcode_load(self): # {{{
+		'''Read information about the run file of the current job.
+		If it is still being parsed, only the records that have been written are available.
+		'''
+		done, self.gcode_num_records, self.gcode_strings, bbox, self.total_time = cdriver.run_file_info(self.gcode_filename.encode('utf-8'))
+		# done is negative if the parse was cancelled; the file will never be complete then.
+		self.gcode_streaming = done == 0
 	# }}}
 	def _job_done(self, complete, reason): # {{{
 		cdriver.run_file()
 		if self.gcode_file:
 			log('job done: ' + reason)
 			self._gcode_close()
+		if self.job_motion_stats is not None:
+			stats = cdriver.motion_stats()
+			log('job had %d buffer underruns; waited %d times for host (%.3f s); %d events overflowed the event ring' % (stats['underruns'] - self.job_motion_stats['underruns'], stats['host_waits'] - self.job_motion_stats['host_waits'], stats['host_wait_time'] - self.job_motion_stats['host_wait_time'], stats['event_overflows'] - self.job_motion_stats['event_overflows']))
+			self.job_motion_stats = None
 		#traceback.print_stack()
 		if self.gcode_id is not None:
 			log('Job done (%d): %s' % (complete, reason))
@@ -802,11 +836,15 @@ class Machine: # {{{
 		cdriver.unpause()
 		self._globals_update()
 	# }}}
-	def _queue_add(self, filename, name): # {{{
+	def _queue_add(self, id, filename, name, tmp = None): # {{{
+		'''Start parsing a file in the background.
+		The reply is sent from _parse_done.  tmp is closed when the parse is done.
+		'''
 		name = os.path.splitext(os.path.split(name)[1])[0]
 		origname = name
 		i = 0
-		while name == '' or name in self.jobqueue:
+		parsing = [job[1] for job in self.parse_jobs.values()]
+		while name == '' or name in self.jobqueue or name in parsing:
 			name = '%s-%d' % (origname, i)
 			i += 1
 		infilename = filename.encode('utf-8', 'replace')
@@ -815,10 +853,30 @@ class Machine: # {{{
 			os.makedirs(outfiledir)
 		outfilename = os.path.join(outfiledir, name + os.path.extsep + 'bin').encode('utf-8', 'replace')
 		self._broadcast(None, 'blocked', 'Parsing g-code')
-		errors = cdriver.parse_gcode(infilename, outfilename)
+		fd = cdriver.parse_gcode_start(infilename, outfilename)
+		self.parse_jobs[fd] = (id, name, tmp)
+	# }}}
+	def _parse_done(self, fd): # {{{
+		'''Handle the end of a background parse.'''
+		id, name, tmp = self.parse_jobs.pop(fd)
+		errors = cdriver.parse_gcode_finish(fd)
+		if tmp is not None:
+			tmp.close()
+		if self.gcode_streaming and self.job_current == name:
+			if errors is None:
+				# cdriver stops the job when it reaches the end of what was parsed.
+				self.gcode_streaming = False
+			else:
+				# The running job is now complete; read its footer.
+				self._gcode_load()
+		if errors is None:
+			log('parsing %s was cancelled' % name)
+			errors = ['Parsing was cancelled']
 		self._refresh_queue()
-		self._broadcast(None, 'blocked', None)
-		return name + '\n' + json.dumps(errors)
+		if len(self.parse_jobs) == 0:
+			self._broadcast(None, 'blocked', None)
+		if id is not None:
+			self._send(id, 'return', name + '\n' + json.dumps(errors))
 	# }}}
 	def _audio_add(self, f, name): # {{{
 		name = os.path.splitext(os.path.split(name)[1])[0]
@@ -1331,28 +1389,16 @@ class Machine: # {{{
 			for e in range(len(self.spaces[1].axis)):
 				self.user_set_axis_pos(1, e, 0)
 		filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', src + os.extsep + 'bin'), text = False, opened = False)
-		self.total_time = self.jobqueue[src][-1]
-		self.gcode_fd = os.open(filename, os.O_RDONLY)
-		self.gcode_map = mmap.mmap(self.gcode_fd, 0, prot = mmap.PROT_READ)
-		filesize = os.fstat(self.gcode_fd).st_size
-		bboxsize = 7 * struct.calcsize('=d')
-		def unpack(format, pos):
-			return struct.unpack(format, self.gcode_map[pos:pos + struct.calcsize(format)])
-		num_strings = unpack('=I', filesize - bboxsize - struct.calcsize('=I'))[0]
-		self.gcode_strings = []
-		sizes = [unpack('=I', filesize - bboxsize - struct.calcsize('=I') * (num_strings + 1 - x))[0] for x in range(num_strings)]
-		first_string = filesize - bboxsize - struct.calcsize('=I') * (num_strings + 1) - sum(sizes)
-		pos = 0
-		for x in range(num_strings):
-			self.gcode_strings.append(self.gcode_map[first_string + pos:first_string + pos + sizes[x]].decode('utf-8', 'replace'))
-			pos += sizes[x]
-		self.gcode_num_records = first_string / struct.calcsize(record_format)
+		# The file may still be being parsed; cdriver runs the records as they become available.
+		self.gcode_filename = filename
+		self._gcode_load()
 		if self.probemap is None:
 			encoded_probemap_filename = b''
 		else:
 			encoded_probemap_filename = fhs.read_spool(os.path.join(self.uuid, 'probe' + os.extsep + 'bin'), text = False, opened = False).encode('utf-8')
 		self.gcode_file = True
 		log('running %s %f %f' % (filename, self.gcode_angle[0], self.gcode_angle[1]))
+		self.job_motion_stats = cdriver.motion_stats()
 		cdriver.run_file(filename.encode('utf-8'), encoded_probemap_filename, 1 if not paused and self.confirmer is None else 0, self.gcode_angle[0], self.gcode_angle[1])
 		self.paused = paused
 		self._globals_update()
@@ -1542,6 +1588,12 @@ class Machine: # {{{
 			if not self.machine.connected:
 				return float('nan')
 			return cdriver.getpos(self.id, axis)
+		def get_all_pos(self, num):
+			# Request all positions before waiting for the first, so they don't each need a round trip.
+			if not self.machine.connected:
+				return [(float('nan'), float('nan'))] * num
+			ids = [cdriver.getpos_start(self.id, i) for i in range(num)]
+			return [cdriver.ring_result(i) for i in ids]
 		def motor_name(self, i):
 			if i < len(typeinfo[self.type]['name']):
 				name = typeinfo[self.type]['name'][i][0]
@@ -1747,8 +1799,12 @@ class Machine: # {{{
 		self._do_probe(id, 0, 0, self.get_axis_pos(0, 2))
 	# }}}
 	@delayed
-	def user_line(self, id, moves = (), e = None, tool = None, v = None, relative = False, probe = False, single = False, force = False): # {{{
+	def user_line(self, id, moves = (), e = None, tool = None, v = None, relative = False, probe = False, single = False, force = False, queue = False): # {{{
 		'''Move the tool in a straight line; return when done.
+		If queue is True, the line is added after the lines that are
+		already queued instead of replacing the current movement, and
+		this returns immediately.  Queued lines that continue in the
+		same direction are joined without stopping.
 		'''
 		if not force and self.home_phase is not None:
 			log('ignoring line during home')
@@ -1779,9 +1835,13 @@ class Machine: # {{{
 			v = self.max_v
 		self.moving = True
 		#log('move to ' + repr(moves))
-		cdriver.move(*([self.current_extruder] + moves + [e, v]), single = single, probe = probe, relative = relative)
+		# The result is not used, so don't wait for cdriver to handle it.
+		cdriver.move_start(*([self.current_extruder] + moves + [e, v]), single = single, probe = probe, relative = relative, queue = queue, reply = False)
 		if id is not None:
-			self.wait_for_cb()[1](id)
+			if queue:
+				self._send(id, 'return', None)
+			else:
+				self.wait_for_cb()[1](id)
 	# }}}
 	def user_move_target(self, dx, dy): # {{{
 		'''Move the target position.
@@ -2099,7 +2159,7 @@ class Machine: # {{{
 		message += 'spi_setup = %s\r\n' % self._mangle_spi()
 		message += ''.join(['%s = %s\r\n' % (x, write_pin(getattr(self, x))) for x in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin')])
 		message += ''.join(['%s = %d\r\n' % (x, getattr(self, x)) for x in ('bed_id', 'fan_id', 'spindle_id', 'park_after_job', 'sleep_after_job', 'cool_after_job', 'timeout')])
-		message += ''.join(['%s = %f\r\n' % (x, getattr(self, x)) for x in ('probe_dist', 'probe_offset', 'probe_safe_dist', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed')])
+		message += ''.join(['%s = %f\r\n' % (x, getattr(self, x)) for x in ('probe_dist', 'probe_offset', 'probe_safe_dist', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed', 'motor_fit_tolerance')])
 		message += 'user_interface = %s\r\n' % self.user_interface
 		for i, s in enumerate(self.spaces):
 			message += s.export_settings()
@@ -2132,7 +2192,7 @@ class Machine: # {{{
 		globals_changed = True
 		changed = {'space': set(), 'temp': set(), 'gpio': set(), 'axis': set(), 'motor': set(), 'extruder': set(), 'follower': set()}
 		keys = {
-				'general': {'num_temps', 'num_gpios', 'user_interface', 'pin_names', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin', 'probe_dist', 'probe_offset', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'temp_scale_min', 'temp_scale_max', 'park_after_job', 'sleep_after_job', 'cool_after_job', 'spi_setup', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed'},
+				'general': {'num_temps', 'num_gpios', 'user_interface', 'pin_names', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin', 'probe_dist', 'probe_offset', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'temp_scale_min', 'temp_scale_max', 'park_after_job', 'sleep_after_job', 'cool_after_job', 'spi_setup', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed', 'motor_fit_tolerance'},
 				'space': {'type', 'num_axes'},
 				'temp': {'name', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'heater_pin', 'fan_pin', 'thermistor_pin', 'fan_temp', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time', 'P', 'I', 'D'},
 				'gpio': {'name', 'pin', 'state', 'reset', 'duty', 'leader', 'ticks'},
@@ -2377,19 +2437,27 @@ class Machine: # {{{
 						cdriver.resume()
 		return True
 	# }}}
-	def queue_add(self, data, name): # {{{
+	@delayed
+	def queue_add(self, id, data, name): # {{{
 		'''Add code to the queue as a string.
 		'''
-		with fhs.write_temp() as f:
-			f.write(data)
-			f.seek(0)
-			return self._queue_add(f.filename, name)
+		# The temporary file must exist until the parser is done with it.
+		f = fhs.write_temp()
+		f.write(data)
+		f.flush()
+		self._queue_add(id, f.filename, name, f)
 	# }}}
-	def queue_add_POST(self, filename, name): # {{{
+	@delayed
+	def queue_add_POST(self, id, filename, name): # {{{
 		'''Add g-code to queue using a POST request.
 		Note that this function can only be called using POST; not with the regular websockets system.
 		'''
-		return self._queue_add(filename, name)
+		self._queue_add(id, filename, name)
+	# }}}
+	def queue_parse_progress(self): # {{{
+		'''Get progress of files that are being parsed.
+		@return dict of name: (bytes handled, total bytes, records written).'''
+		return {job[1]: cdriver.parse_gcode_progress(fd) for fd, job in self.parse_jobs.items()}
 	# }}}
 	def probe_add_POST(self, filename, name): # {{{
 		'''Set probe map using a POST request.
@@ -2409,6 +2477,11 @@ class Machine: # {{{
 			filename = fhs.read_spool(os.path.join(self.uuid, 'audio', name + os.extsep + 'bin'), opened = False)
 			del self.audioqueue[name]
 		else:
+			for fd, job in self.parse_jobs.items():
+				if job[1] == name:
+					# Still being parsed; the parser removes its output when it stops.
+					cdriver.parse_gcode_cancel(fd)
+					return
 			assert name in self.jobqueue
 			filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', name + os.extsep + 'bin'), opened = False)
 			del self.jobqueue[name]
@@ -2416,6 +2489,8 @@ class Machine: # {{{
 			os.unlink(filename)
 		except:
 			log('unable to unlink %s' % filename)
+		if os.path.exists(filename + '.spatial'):
+			os.unlink(filename + '.spatial')
 		self._refresh_queue()
 	# }}}
 	def queue_list(self): # {{{
@@ -2453,6 +2528,27 @@ class Machine: # {{{
 		elif id is not None:
 			self._send(id, 'return', None)
 	# }}}
+	def get_motion_stats(self): # {{{
+		'''Get buffer underrun statistics since cdriver was started.
+		@return dict with underruns (times the firmware ran out of
+		fragments during a move), host_waits (times cdriver stopped
+		computing the move to wait for the host), host_wait_time
+		(total time of those waits, in seconds), history_stores
+		(fragment states stored for rewinding), history_store_time
+		(average time per store, in seconds, measured on a sample),
+		fit_samples (samples computed from a fitted motor path),
+		fit_max_error (largest error of those, in steps; only measured
+		by the fit check of the sim cdriver, so 0 here),
+		stretched_moves (moves that were slowed down to stay within
+		the motor limits),
+		event_overflows (events that were sent as interrupts because
+		the event ring was full), packets_sent (packets sent to the
+		firmware, including resends), packets_resent (those that were
+		resent after a nack or a timeout), link_nacks (nacks received
+		from the firmware) and link_timeouts (times the firmware was
+		silent while packets were in flight).'''
+		return cdriver.motion_stats()
+	# }}}
 	def get_machine_state(self): # {{{
 		'''Return current machine state.
 		Return value is a tuple of a human readable string describing
@@ -2501,6 +2597,8 @@ class Machine: # {{{
 		@return position, total toolpath length.'''
 		if not self.gcode_file:
 			return 0, 0
+		if self.gcode_streaming:
+			self._gcode_load()
 		return cdriver.tp_getpos(), self.gcode_num_records
 	# }}}
 	def user_tp_set_position(self, position): # {{{
@@ -2513,6 +2611,45 @@ class Machine: # {{{
 		assert self.paused
 		cdriver.tp_setpos(position)
 	# }}}
+	def user_tp_seek(self, line = None, time = None): # {{{
+		'''Continue the toolpath from a G-Code line or a time.
+		The toolpath position is set to the first record for the line, or the
+		last record that starts at or before the time.  Temperatures, gpios,
+		current tool and extruder position are restored to what they would be
+		when the job had run up to that point.
+		It is an error to call this function while not paused.
+		@param line: G-Code line number to continue from.
+		@param time: Estimated job time to continue from, if line is None.
+		@return toolpath position, target position of the move before it.'''
+		assert self.gcode_file
+		assert self.paused
+		assert line is not None or time is not None
+		if self.gcode_streaming:
+			self._gcode_load()
+		position, tool, pos, e, temps, gpios = cdriver.run_file_seek(self.gcode_filename.encode('utf-8'), -1 if line is None else int(line), float('nan') if time is None else float(time))
+		position = min(position, self.gcode_num_records - 1)
+		for channel, value in temps.items():
+			if channel == -1:
+				channel = self.bed_id
+			if not 0 <= channel < len(self.temps):
+				continue
+			self.user_settemp(channel, value - C0 if not math.isnan(self.temps[channel].beta) else value)
+		for gpio, value in gpios.items():
+			if gpio == -2:
+				gpio = self.fan_id
+			elif gpio == -3:
+				gpio = self.spindle_id
+			if not 0 <= gpio < len(self.gpios):
+				continue
+			if value:
+				self.expert_set_gpio(gpio, state = 1, duty = value)
+			else:
+				self.expert_set_gpio(gpio, state = 0)
+		if not math.isnan(e) and tool < len(self.spaces[1].axis):
+			self.user_set_axis_pos(1, tool, e)
+		cdriver.tp_setpos(position)
+		return position, pos
+	# }}}
 	def tp_get_context(self, num = None, position = None): # {{{
 		'''Get context around a position.
 		@param num: number of lines context on each side.
@@ -2525,13 +2662,14 @@ class Machine: # {{{
 		if position is None:
 			position = self.tp_get_position()[0]
 		position = int(position)
-		def parse_record(num):
-			s = struct.calcsize(record_format)
-			type, tool, X, Y, Z, hx, hy, hz, Jg, tf, v0, E, time, line = struct.unpack(record_format, self.gcode_map[num * s:(num + 1) * s])
+		def parse_record(record):
+			type, tool, X, Y, Z, hx, hy, hz, Jg, tf, v0, E, time, line = record
 			#log('get context type %d' % type)
 
 			return {'type': tuple(x for x in protocol.parsed if protocol.parsed[x] == type)[0], 'X': (X, Y, Z), 'h': (hx, hy, hz), 'Jg': Jg, 'tf': tf, 'v0': v0, 'E': E, 'time': time, 'line': line}
-		return max(0, position - num), [parse_record(x) for x in range(position - num, position + num + 1) if 0 <= x < self.gcode_num_records]
+		first = max(0, position - num)
+		records = cdriver.run_file_records(self.gcode_filename.encode('utf-8'), first, min(position + num + 1, self.gcode_num_records) - first)
+		return first, [parse_record(x) for x in records]
 	# }}}
 	def tp_get_string(self, num): # {{{
 		'''Get string from toolpath.
@@ -2555,7 +2693,7 @@ class Machine: # {{{
 	def get_globals(self): # {{{
 		#log('getting globals')
 		ret = {'num_temps': len(self.temps), 'num_gpios': len(self.gpios)}
-		for key in ('name', 'user_interface', 'pin_names', 'uuid', 'queue_length', 'num_pins', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin', 'probe_dist', 'probe_offset', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'targetx', 'targety', 'targetangle', 'zoffset', 'store_adc', 'temp_scale_min', 'temp_scale_max', 'probemap', 'paused', 'park_after_job', 'sleep_after_job', 'cool_after_job', 'spi_setup', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed'):
+		for key in ('name', 'user_interface', 'pin_names', 'uuid', 'queue_length', 'num_pins', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin', 'probe_dist', 'probe_offset', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'targetx', 'targety', 'targetangle', 'zoffset', 'store_adc', 'temp_scale_min', 'temp_scale_max', 'probemap', 'paused', 'park_after_job', 'sleep_after_job', 'cool_after_job', 'spi_setup', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed', 'motor_fit_tolerance'):
 			ret[key] = getattr(self, key)
 		return ret
 	# }}}
@@ -2583,7 +2721,7 @@ class Machine: # {{{
 		for key in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'pattern_step_pin', 'pattern_dir_pin', 'bed_id', 'fan_id', 'spindle_id', 'park_after_job', 'sleep_after_job', 'cool_after_job', 'timeout'):
 			if key in ka:
 				setattr(self, key, int(ka.pop(key)))
-		for key in ('probe_dist', 'probe_offset', 'probe_safe_dist', 'feedrate', 'targetx', 'targety', 'targetangle', 'zoffset', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed'):
+		for key in ('probe_dist', 'probe_offset', 'probe_safe_dist', 'feedrate', 'targetx', 'targety', 'targetangle', 'zoffset', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v', 'max_a', 'max_J', 'adjust_speed', 'motor_fit_tolerance'):
 			if key in ka:
 				setattr(self, key, float(ka.pop(key)))
 		self._write_globals(nt, ng, update = update)
@@ -2605,7 +2743,7 @@ class Machine: # {{{
 			log('request for invalid axis position %d %d' % (space, axis))
 			return float('nan')
 		if axis is None:
-			return [self.spaces[space].get_current_pos(a)[0] for a in range(len(self.spaces[space].axis))]
+			return [p[0] for p in self.spaces[space].get_all_pos(len(self.spaces[space].axis))]
 		else:
 			return self.spaces[space].get_current_pos(axis)[0]
 	# }}}
@@ -2614,7 +2752,7 @@ class Machine: # {{{
 			log('request for invalid motor position %d %d' % (space, motor))
 			return float('nan')
 		if motor is None:
-			return [self.spaces[space].get_current_pos(m)[1] for m in range(len(self.spaces[space].motor))]
+			return [p[1] for p in self.spaces[space].get_all_pos(len(self.spaces[space].motor))]
 		else:
 			return self.spaces[space].get_current_pos(motor)[1]
 	# }}}
@@ -2826,13 +2964,14 @@ class Machine: # {{{
 call_queue = []
 machine = Machine(config['allow-system'])
 fd = cdriver.fileno()
+event_fd = cdriver.event_fileno()
 
 while True: # {{{
 	while len(call_queue) > 0:
 		f, a = call_queue.pop(0)
 		#log('calling %s' % repr((f, a)))
 		f(*a)
-	fds = [sys.stdin, fd]
+	fds = [sys.stdin, fd, event_fd] + list(machine.parse_jobs)
 	found = select.select(fds, [], fds, None)
 	if sys.stdin in found[0] or sys.stdin in found[2]:
 		#log('command')
@@ -2840,4 +2979,9 @@ while True: # {{{
 	if fd in found[0] or fd in found[2]:
 		#log('machine')
 		machine._machine_input()
+	if event_fd in found[0] or event_fd in found[2]:
+		machine._event_input()
+	for parse_fd in list(machine.parse_jobs):
+		if parse_fd in found[0] or parse_fd in found[2]:
+			machine._parse_done(parse_fd)
 # }}}
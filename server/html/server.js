@@ -146,6 +146,7 @@ function _setup_updater() {
 					max_a: 0,
 					max_J: 0,
 					adjust_speed: 1,
+					motor_fit_tolerance: 0.01,
 					targetx: 0,
 					targety: 0,
 					targetangle: 0,
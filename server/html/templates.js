@@ -769,6 +769,9 @@ function setup_globals(desc, pos, top) { // {{{
 	e.Add(Float(ui, [null, 'adjust_speed'], 2, 1));
 	e.AddText(' ').Add(add_name(ui, 'unit', 0, 0));
 	e.AddText('/s');
+	e = ret.AddElement('div').AddText('Motor Fit Tolerance');
+	e.Add(Float(ui, [null, 'motor_fit_tolerance'], 2, 1));
+	e.AddText(' steps');
 	var pins = ret.Add(make_table(ui));
 	// Add dummy first child instead of a title row.
 	pins.Add(document.createComment(''));
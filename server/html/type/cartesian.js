@@ -0,0 +1 @@
+../../type/cartesian/cartesian.js
\ No newline at end of file
@@ -0,0 +1 @@
+../../type/delta/delta.js
\ No newline at end of file
@@ -0,0 +1 @@
+../../type/drawbot/drawbot.js
\ No newline at end of file
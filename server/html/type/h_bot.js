@@ -0,0 +1 @@
+../../type/h_bot/h_bot.js
\ No newline at end of file
@@ -0,0 +1 @@
+../../type/polar/polar.js
\ No newline at end of file
@@ -24,6 +24,22 @@ void xyz2motors(Space *s) { // {{{
 	(void)&s;
 } // }}}
 
+void xyz2motors_batch(Space *s, int n, double const *const *axes, double *const *motors) { // {{{
+	// The default values are correct; defining this allows cdriver to use batches.
+	(void)&s;
+	(void)&n;
+	(void)&axes;
+	(void)&motors;
+} // }}}
+
+void jacobian(Space *s, int n, double const *const *axes, double *const *jacobian) { // {{{
+	// The default values are correct; defining this allows cdriver to check moves as a whole.
+	(void)&s;
+	(void)&n;
+	(void)&axes;
+	(void)&jacobian;
+} // }}}
+
 void motors2xyz(Space *s, const double *motors, double *xyz) { // {{{
 	(void)&s;
 	(void)&motors;
@@ -123,6 +123,41 @@ void xyz2motors(Space *s) {
 		s->motor[m]->target_pos = delta_to_axis(s, m);
 }
 
+void xyz2motors_batch(Space *s, int n, double const *const *axes, double *const *motors) {
+	// Same computation as delta_to_axis(), for all samples at once.
+	for (uint8_t m = 0; m < 3; ++m) {
+		double mx = myMotor(s, m).x, my = myMotor(s, m).y, mz = myMotor(s, m).z;
+		double l2 = myMotor(s, m).rodlength * myMotor(s, m).rodlength;
+		double const *x = axes[0], *y = axes[1], *z = axes[2];
+		double *target = motors[m];
+		for (int i = 0; i < n; ++i) {
+			double dx = x[i] - mx;
+			double dy = y[i] - my;
+			double dz = z[i] - mz;
+			double r2 = dx * dx + dy * dy;
+			target[i] = sqrt(l2 - r2) + dz;
+		}
+	}
+}
+
+void jacobian(Space *s, int n, double const *const *axes, double *const *jacobian) {
+	// Derivatives of the computation in xyz2motors_batch().
+	int na = s->num_axes;
+	for (uint8_t m = 0; m < 3; ++m) {
+		double mx = myMotor(s, m).x, my = myMotor(s, m).y;
+		double l2 = myMotor(s, m).rodlength * myMotor(s, m).rodlength;
+		double const *x = axes[0], *y = axes[1];
+		for (int i = 0; i < n; ++i) {
+			double dx = x[i] - mx;
+			double dy = y[i] - my;
+			double h = sqrt(l2 - dx * dx - dy * dy);
+			jacobian[m * na + 0][i] = -dx / h;
+			jacobian[m * na + 1][i] = -dy / h;
+			jacobian[m * na + 2][i] = 1;
+		}
+	}
+}
+
 void check_position(Space *s, double *data) {
 	if (std::isnan(data[0]) || std::isnan(data[1])) {
 		if (!std::isnan(data[0]))
@@ -42,6 +42,34 @@ void xyz2motors(Space *s) {
 	}
 }
 
+void xyz2motors_batch(Space *s, int n, double const *const *axes, double *const *motors) {
+	for (int m = 0; m < 2; ++m) {
+		double mx = myMotor(s, m).x, my = myMotor(s, m).y;
+		double const *x = axes[0], *y = axes[1];
+		double *target = motors[m];
+		for (int i = 0; i < n; ++i) {
+			double dx = x[i] - mx;
+			double dy = y[i] - my;
+			target[i] = sqrt(dx * dx + dy * dy);
+		}
+	}
+}
+
+void jacobian(Space *s, int n, double const *const *axes, double *const *jacobian) {
+	int na = s->num_axes;
+	for (int m = 0; m < 2; ++m) {
+		double mx = myMotor(s, m).x, my = myMotor(s, m).y;
+		double const *x = axes[0], *y = axes[1];
+		for (int i = 0; i < n; ++i) {
+			double dx = x[i] - mx;
+			double dy = y[i] - my;
+			double l = sqrt(dx * dx + dy * dy);
+			jacobian[m * na + 0][i] = dx / l;
+			jacobian[m * na + 1][i] = dy / l;
+		}
+	}
+}
+
 void motors2xyz(Space *s, const double motors[3], double xyz[3]) {
 	double uv[2];
 	uv[0] = myMotor(s, 1).x - myMotor(s, 0).x;
@@ -33,6 +33,20 @@ void xyz2motors(Space *s) {
 	(void)&s;
 }
 
+void xyz2motors_batch(Space *s, int n, double const *const *axes, double *const *motors) {
+	(void)&s;
+	(void)&n;
+	(void)&axes;
+	(void)&motors;
+}
+
+void jacobian(Space *s, int n, double const *const *axes, double *const *jacobian) {
+	(void)&s;
+	(void)&n;
+	(void)&axes;
+	(void)&jacobian;
+}
+
 void motors2xyz(Space *s, const double motors[3], double xyz[3]) {
 	(void)&s;
 	(void)&motors;
@@ -29,6 +29,26 @@ void xyz2motors(Space *s) {
 	s->motor[1]->target_pos = s->axis[0]->target - s->axis[1]->target;
 }
 
+void xyz2motors_batch(Space *s, int n, double const *const *axes, double *const *motors) {
+	(void)&s;
+	double const *x = axes[0], *y = axes[1];
+	double *u = motors[0], *v = motors[1];
+	for (int i = 0; i < n; ++i) {
+		u[i] = x[i] + y[i];
+		v[i] = x[i] - y[i];
+	}
+}
+
+void jacobian(Space *s, int n, double const *const *axes, double *const *jacobian) {
+	(void)&axes;
+	int na = s->num_axes;
+	for (int i = 0; i < n; ++i) {
+		jacobian[0 * na + 1][i] = 1;
+		jacobian[1 * na + 0][i] = 1;
+		jacobian[1 * na + 1][i] = -1;
+	}
+}
+
 void motors2xyz(Space *s, const double *motors, double *xyz) {
 	(void)(&s);
 	xyz[0] = (motors[0] + motors[1]) / 2;
@@ -46,6 +46,43 @@ void xyz2motors(Space *s) {
 	s->motor[2]->target_pos = z;
 }
 
+void xyz2motors_batch(Space *s, int n, double const *const *axes, double *const *motors) {
+	double const *x = axes[0], *y = axes[1], *z = axes[2];
+	double *r = motors[0], *theta = motors[1], *mz = motors[2];
+	for (int i = 0; i < n; ++i) {
+		r[i] = sqrt(x[i] * x[i] + y[i] * y[i]);
+		mz[i] = z[i];
+	}
+	// The angle is kept close to the previous one, so this part depends on the previous sample.
+	double current = s->motor[1]->settings.current_pos;
+	for (int i = 0; i < n; ++i) {
+		double t = atan2(y[i], x[i]);
+		while (t - current > 2 * M_PI)
+			t -= 2 * M_PI;
+		while (t - current < -2 * M_PI)
+			t += 2 * M_PI;
+		theta[i] = t;
+		current = t;
+	}
+}
+
+void jacobian(Space *s, int n, double const *const *axes, double *const *jacobian) {
+	int na = s->num_axes;
+	double const *x = axes[0], *y = axes[1];
+	for (int i = 0; i < n; ++i) {
+		double r2 = x[i] * x[i] + y[i] * y[i];
+		if (r2 == 0) {
+			// The angle is undefined at the origin; leave the defaults.
+			continue;
+		}
+		double r = sqrt(r2);
+		jacobian[0 * na + 0][i] = x[i] / r;
+		jacobian[0 * na + 1][i] = y[i] / r;
+		jacobian[1 * na + 0][i] = -y[i] / r2;
+		jacobian[1 * na + 1][i] = x[i] / r2;
+	}
+}
+
 void motors2xyz(Space *s, const double motors[3], double xyz[3]) {
 	(void)&s;
 	xyz[0] = motors[0] * cos(motors[1]);
@@ -0,0 +1,117 @@
+/* checksum-test.cpp - Compare the checksums of host and firmware for Franklin {{{
+ * vim: set foldmethod=marker :
+ * Copyright 2018 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+// The checksum bytes are looked up in tables: per byte on the host and per nybble in the firmware.
+// This checks both against the bit by bit computation that defines them, for all 3 byte inputs at all 8 indices,
+// and reports how fast each of them is.
+// Run it from server/cdriver with "make checksumtest".
+
+#include <stdint.h>
+#include <cstdio>
+#include <ctime>
+
+namespace host {
+#include "../server/cdriver/checksum.h"
+}
+
+namespace firmware {
+#define PROGMEM
+#define pgm_read_byte(p) (*(p))
+#include "../firmware/checksum.h"
+
+static inline uint8_t checksum(uint8_t t, uint8_t const *data) {
+	return (t & 7) | (check_index(t) ^ check_byte(data[0], 0) ^ check_byte(data[1], 1) ^ check_byte(data[2], 2));
+}
+}
+
+// The computation from before the tables, one parity mask at a time. {{{
+static uint8_t reference(uint8_t t, uint8_t const *data) {
+	uint8_t sum = t & 7;
+	for (uint8_t bit = 0; bit < 5; ++bit) {
+		uint8_t check = 0;
+		for (uint8_t p = 0; p < 3; ++p)
+			check ^= data[p] & host::MASK[bit][p];
+		check ^= sum & host::MASK[bit][3];
+		check ^= check >> 4;
+		check ^= check >> 2;
+		check ^= check >> 1;
+		if (check & 1)
+			sum ^= 1 << (bit + 3);
+	}
+	return sum;
+}
+// }}}
+
+// Compute the checksums of a buffer, like a packet, and report the speed. {{{
+static uint8_t buffer[3 << 20];
+
+template <uint8_t (*F)(uint8_t, uint8_t const *)> static uint8_t bench(char const *name) {
+	uint8_t result = 0;
+	int const rounds = 20;
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int r = 0; r < rounds; ++r) {
+		for (unsigned i = 0; i < sizeof(buffer) / 3; ++i)
+			result ^= F(i, &buffer[3 * i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-10s %7.1f MB/s\n", name, rounds * sizeof(buffer) / t / 1e6);
+	return result;
+}
+// }}}
+
+int main() {
+	// The masks must be the same, or the tables are not for the same protocol.
+	for (int bit = 0; bit < 5; ++bit) {
+		for (int p = 0; p < 4; ++p) {
+			if (host::MASK[bit][p] != firmware::MASK[bit][p]) {
+				printf("mask %d %d differs: %02x != %02x\n", bit, p, host::MASK[bit][p], firmware::MASK[bit][p]);
+				return 1;
+			}
+		}
+	}
+	unsigned errors = 0;
+	for (uint32_t v = 0; v < 1 << 24; ++v) {
+		uint8_t data[3] = {uint8_t(v), uint8_t(v >> 8), uint8_t(v >> 16)};
+		for (uint8_t t = 0; t < 8; ++t) {
+			uint8_t ref = reference(t, data);
+			uint8_t h = host::checksum(t, data);
+			uint8_t f = firmware::checksum(t, data);
+			if (h == ref && f == ref)
+				continue;
+			if (errors++ < 10)
+				printf("index %d data %02x %02x %02x: reference %02x host %02x firmware %02x\n", t, data[0], data[1], data[2], ref, h, f);
+		}
+	}
+	if (errors > 0) {
+		printf("%u of %u checksums differ\n", errors, 8u << 24);
+		return 1;
+	}
+	printf("all %u checksums agree\n", 8u << 24);
+	uint32_t x = 1;
+	for (unsigned i = 0; i < sizeof(buffer); ++i) {
+		x = x * 1103515245 + 12345;
+		buffer[i] = x >> 16;
+	}
+	uint8_t r = bench <reference>("bits");
+	uint8_t h = bench <host::checksum>("host");
+	uint8_t f = bench <firmware::checksum>("firmware");
+	return r == h && h == f ? 0 : 1;
+}